@@ -0,0 +1,153 @@
+#ifndef CAPTURE_EMULATION_H
+#define CAPTURE_EMULATION_H
+
+#include "constants.h"
+#include "latency_profile.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <utility>
+#include <vector>
+
+// The capture side of the event loop as the benchmarks emulate it: an ALSA ring
+// of the profile's periods and a V4L2 queue of its buffers fill on the capture
+// timeline, and the loop wakes for whichever is due next. A period the loop is
+// too late for overruns the ring, which starts over empty as after
+// snd_pcm_recover(); a frame arriving at a full queue is dropped; with
+// drain-to-newest only the newest queued frame is dequeued.
+//
+//   captureEmulation capture(profile, durationUs, stalls);
+//   while (capture.nextWake()) {
+//       while (capture.nextPeriod(capturedUs)) ...
+//       while (capture.nextFrame(arrivedUs)) ...
+//   }
+
+inline int64_t clockUs(clockid_t clock = CLOCK_MONOTONIC) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+inline void sleepUntilUs(int64_t dueUs) {
+    struct timespec due;
+    due.tv_sec = dueUs / 1000000;
+    due.tv_nsec = (dueUs % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+    }
+}
+
+// Start times and lengths, relative to the run start, of the times the loop is descheduled
+typedef std::vector<std::pair<int64_t, int64_t> > stallList;
+
+// Stalls of up to maxMs, perSecond of them on average. Seeded, so every run gets the same.
+inline stallList makeStalls(int64_t durationUs, double perSecond, double maxMs) {
+    stallList stalls;
+    if (perSecond <= 0 || maxMs <= 0) return stalls;
+    uint32_t x = 1;
+    int64_t meanGapUs = (int64_t)(1000000 / perSecond);
+    for (int64_t at = 0;;) {
+        x = x * 1664525 + 1013904223;
+        at += 1 + (int64_t)(2.0 * meanGapUs * (x / 4294967296.0));
+        if (at >= durationUs) break;
+        x = x * 1664525 + 1013904223;
+        stalls.push_back(std::make_pair(at, 1 + (int64_t)(maxMs * 1000 * (x / 4294967296.0))));
+    }
+    return stalls;
+}
+
+class captureEmulation {
+public:
+    captureEmulation(const latencyProfile& profile, int64_t durationUs, const stallList& stalls = stallList())
+        : fProfile(profile),
+          fStalls(stalls),
+          fNextStall(0),
+          fPeriodUs(profile.audioPeriodMs * 1000LL),
+          fFrameUs(1000000LL * FRAME_RATE_NUMERATOR / FRAME_RATE_DENOMINATOR),
+          fStartUs(clockUs()),
+          fEndUs(fStartUs + durationUs),
+          fDueUs(fStartUs),
+          fNowUs(fStartUs),
+          fAudioReadUs(fStartUs),
+          fNextArrivalUs(fStartUs + fFrameUs),
+          fOverruns(0),
+          fDroppedFrames(0),
+          fSkippedFrames(0) {
+    }
+
+    // Sleeps until the next period is captured or frame arrives, and on through a
+    // stall that begins by then. False once the run is over.
+    bool nextWake() {
+        int64_t nextPeriodUs = fStartUs + ((fNowUs - fStartUs) / fPeriodUs + 1) * fPeriodUs;
+        fDueUs = std::min(nextPeriodUs, fNextArrivalUs);
+        if (fDueUs >= fEndUs) return false;
+        sleepUntilUs(fDueUs);
+        if (fNextStall < fStalls.size() && fStartUs + fStalls[fNextStall].first <= fDueUs) {
+            sleepUntilUs(clockUs() + fStalls[fNextStall].second);
+            ++fNextStall;
+        }
+        fNowUs = clockUs();
+
+        if (fNowUs - fAudioReadUs > fPeriodUs * fProfile.audioBufferPeriods) {
+            ++fOverruns;
+            fAudioReadUs = fNowUs - (fNowUs - fStartUs) % fPeriodUs;
+        }
+        for (; fNextArrivalUs <= fNowUs; fNextArrivalUs += fFrameUs) {
+            if (fQueued.size() >= fProfile.videoBufferCount) {
+                ++fDroppedFrames;
+            } else {
+                fQueued.push_back(fNextArrivalUs);
+            }
+        }
+        if (fProfile.videoDrainToNewest && fQueued.size() > 1) {
+            fSkippedFrames += fQueued.size() - 1;
+            fQueued.erase(fQueued.begin(), fQueued.end() - 1);
+        }
+        return true;
+    }
+
+    // The next period in the ring, by the capture time of its first sample
+    bool nextPeriod(int64_t& capturedUs) {
+        if (fAudioReadUs + fPeriodUs > fNowUs) return false;
+        capturedUs = fAudioReadUs;
+        fAudioReadUs += fPeriodUs;
+        return true;
+    }
+
+    // The next frame to dequeue, by the time it arrived (its capture ended)
+    bool nextFrame(int64_t& arrivedUs) {
+        if (fQueued.empty()) return false;
+        arrivedUs = fQueued.front();
+        fQueued.pop_front();
+        return true;
+    }
+
+    int64_t startUs() const { return fStartUs; }
+    int64_t dueUs() const { return fDueUs; }
+    int64_t nowUs() const { return fNowUs; }
+    int64_t periodUs() const { return fPeriodUs; }
+    int64_t frameUs() const { return fFrameUs; }
+    unsigned overruns() const { return fOverruns; }
+    unsigned droppedFrames() const { return fDroppedFrames; }
+    unsigned skippedFrames() const { return fSkippedFrames; }
+
+private:
+    const latencyProfile& fProfile;
+    stallList fStalls;
+    size_t fNextStall;
+    int64_t fPeriodUs;
+    int64_t fFrameUs;
+    int64_t fStartUs;
+    int64_t fEndUs;
+    int64_t fDueUs;
+    int64_t fNowUs;
+    int64_t fAudioReadUs;     // Capture time up to which the ring has been read
+    int64_t fNextArrivalUs;
+    std::deque<int64_t> fQueued;  // Arrival times of frames waiting in V4L2 buffers
+    unsigned fOverruns;
+    unsigned fDroppedFrames;
+    unsigned fSkippedFrames;
+};
+
+#endif // CAPTURE_EMULATION_H
@@ -0,0 +1,205 @@
+// CPU benchmark for the ULPFEC encoder (ulpfec_encoder.h). Feeds it the RTP
+// packets of IDR and P frames, fragmented as the video sink sends them, at the
+// configured group sizes, and reports packets, overhead and the encoder's cost
+// per frame and as a share of one CPU at the capture frame rate. The IDR frame
+// is preceded by its parameter sets, which the encoder protects like the keyframe.
+//
+//   fec_bench [--frames=10000] [--idr-bytes=<bytes>] [--p-bytes=<bytes>]
+//             [--group-size=8] [--keyframe-group-size=4] [--video-codec=h264]
+//
+// By default a P frame is the average frame at VIDEO_BITRATE and an IDR frame
+// SIZER_KEYFRAME_FRAMES of them, as the frame sizer first expects.
+
+#include "constants.h"
+#include "nal_unit.h"
+#include "ulpfec_encoder.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const unsigned MEDIA_PAYLOAD_TYPE = 96;
+
+typedef std::vector<std::vector<unsigned char> > packetList;
+
+struct fecResult {
+    double mediaPackets;  // Per frame
+    double fecPackets;
+    double overheadPercent;  // FEC bytes against media bytes
+    double usPerFrame;
+};
+
+static void appendPacket(packetList& packets, uint16_t& seq, uint32_t timestamp, bool marker,
+                         const std::vector<unsigned char>& payload) {
+    std::vector<unsigned char> packet(12);
+    packet[0] = 0x80;
+    packet[1] = (marker ? 0x80 : 0) | MEDIA_PAYLOAD_TYPE;
+    packet[2] = seq >> 8;
+    packet[3] = seq & 0xFF;
+    for (int i = 0; i < 4; ++i) {
+        packet[4 + i] = (timestamp >> (24 - 8 * i)) & 0xFF;
+        packet[8 + i] = 0x5A;
+    }
+    packet.insert(packet.end(), payload.begin(), payload.end());
+    packets.push_back(packet);
+    ++seq;
+}
+
+// One NAL unit of nalSize bytes, in a single packet or as FU-A / FU fragments
+static void packetizeNal(packetList& packets, VideoCodec codec, unsigned nalType, unsigned nalSize, uint16_t& seq,
+                         uint32_t timestamp, bool lastNal) {
+    const unsigned maxPayload = RTP_MAX_PACKET_SIZE - 12;
+    std::vector<unsigned char> nal(nalSize, 0xA5);
+    if (codec == VIDEO_CODEC_HEVC) {
+        nal[0] = nalType << 1;
+        nal[1] = 1;
+    } else {
+        nal[0] = 0x60 | nalType;
+    }
+    if (nalSize <= maxPayload) {
+        appendPacket(packets, seq, timestamp, lastNal, nal);
+        return;
+    }
+
+    unsigned headerSize = codec == VIDEO_CODEC_HEVC ? 2 : 1;
+    unsigned fuHeaderSize = headerSize + 1;
+    unsigned offset = headerSize;
+    while (offset < nalSize) {
+        unsigned chunk = std::min(maxPayload - fuHeaderSize, nalSize - offset);
+        bool first = offset == headerSize;
+        bool last = offset + chunk == nalSize;
+        std::vector<unsigned char> payload;
+        if (codec == VIDEO_CODEC_HEVC) {
+            payload.push_back(49 << 1);
+            payload.push_back(1);
+        } else {
+            payload.push_back(0x60 | 28);
+        }
+        payload.push_back((first ? 0x80 : 0) | (last ? 0x40 : 0) | nalType);
+        payload.insert(payload.end(), nal.begin() + offset, nal.begin() + offset + chunk);
+        appendPacket(packets, seq, timestamp, last && lastNal, payload);
+        offset += chunk;
+    }
+}
+
+static packetList packetizeFrame(VideoCodec codec, bool idr, unsigned frameBytes, uint16_t& seq, uint32_t timestamp) {
+    packetList packets;
+    if (idr) {
+        // VPS, SPS, PPS or SPS, PPS, each in a packet of its own
+        if (codec == VIDEO_CODEC_HEVC) {
+            packetizeNal(packets, codec, 32, 24, seq, timestamp, false);
+            packetizeNal(packets, codec, 33, 40, seq, timestamp, false);
+            packetizeNal(packets, codec, 34, 8, seq, timestamp, false);
+        } else {
+            packetizeNal(packets, codec, 7, 16, seq, timestamp, false);
+            packetizeNal(packets, codec, 8, 4, seq, timestamp, false);
+        }
+    }
+    unsigned sliceType = codec == VIDEO_CODEC_HEVC ? (idr ? 19 : 1) : (idr ? 5 : 1);
+    packetizeNal(packets, codec, sliceType, frameBytes, seq, timestamp, true);
+    return packets;
+}
+
+static fecResult runFrames(VideoCodec codec, bool idr, unsigned frameBytes, unsigned frames, unsigned groupSize,
+                           unsigned keyFrameGroupSize) {
+    ulpfecEncoder encoder(codec, groupSize, keyFrameGroupSize);
+    const uint32_t ticksPerFrame = 90000 * FRAME_RATE_NUMERATOR / FRAME_RATE_DENOMINATOR;
+
+    // Packetized once; only the sequence numbers and timestamp change per frame
+    uint16_t seq = 0;
+    packetList packets = packetizeFrame(codec, idr, frameBytes, seq, 0);
+
+    fecResult result = {0, 0, 0, 0};
+    double mediaBytes = 0;
+    double fecBytes = 0;
+    double elapsedUs = 0;
+    uint32_t timestamp = 0;
+    for (unsigned frame = 0; frame < frames; ++frame) {
+        for (size_t i = 0; i < packets.size(); ++i) {
+            unsigned char* packet = &packets[i][0];
+            packet[2] = seq >> 8;
+            packet[3] = seq & 0xFF;
+            packet[4] = timestamp >> 24;
+            packet[5] = (timestamp >> 16) & 0xFF;
+            packet[6] = (timestamp >> 8) & 0xFF;
+            packet[7] = timestamp & 0xFF;
+            ++seq;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < packets.size(); ++i) {
+            unsigned fecSize;
+            if (encoder.addPacket(&packets[i][0], packets[i].size(), fecSize) != nullptr) {
+                result.fecPackets += 1;
+                fecBytes += fecSize;
+            }
+        }
+        elapsedUs += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+        for (size_t i = 0; i < packets.size(); ++i) {
+            mediaBytes += packets[i].size();
+        }
+        result.mediaPackets += packets.size();
+        timestamp += ticksPerFrame;
+    }
+
+    result.mediaPackets /= frames;
+    result.fecPackets /= frames;
+    result.overheadPercent = 100.0 * fecBytes / mediaBytes;
+    result.usPerFrame = elapsedUs / frames;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    const double frameRate = (double)FRAME_RATE_DENOMINATOR / FRAME_RATE_NUMERATOR;
+    const unsigned averageFrame = (unsigned)(VIDEO_BITRATE / 8 / frameRate);
+    unsigned frames = 10000;
+    unsigned idrBytes = averageFrame * SIZER_KEYFRAME_FRAMES;
+    unsigned pBytes = averageFrame;
+    unsigned groupSize = FEC_GROUP_SIZE;
+    unsigned keyFrameGroupSize = FEC_KEYFRAME_GROUP_SIZE;
+    std::string codecName = VIDEO_CODEC;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--frames=", 9) == 0) {
+            frames = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--idr-bytes=", 12) == 0) {
+            idrBytes = atoi(argv[i] + 12);
+        } else if (strncmp(argv[i], "--p-bytes=", 10) == 0) {
+            pBytes = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--group-size=", 13) == 0) {
+            groupSize = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--keyframe-group-size=", 22) == 0) {
+            keyFrameGroupSize = atoi(argv[i] + 22);
+        } else if (strncmp(argv[i], "--video-codec=", 14) == 0) {
+            codecName = argv[i] + 14;
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [--frames=10000] [--idr-bytes=<bytes>] [--p-bytes=<bytes>] [--group-size=8] "
+                    "[--keyframe-group-size=4] [--video-codec=h264|hevc]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (frames < 1 || idrBytes < 16 || pBytes < 16 || (codecName != "h264" && codecName != "hevc")) {
+        fprintf(stderr, "Bad frame count, frame size or codec\n");
+        return 2;
+    }
+    VideoCodec codec = codecName == "hevc" ? VIDEO_CODEC_HEVC : VIDEO_CODEC_H264;
+
+    printf("%s, group size %u, keyframe group size %u, %u frames each, %.0f fps\n", codecName.c_str(), groupSize,
+           keyFrameGroupSize, frames, frameRate);
+    printf("%-5s %8s %10s %10s %10s %12s %10s\n", "frame", "bytes", "media pkt", "fec pkt", "overhead", "us/frame",
+           "cpu %");
+    const char* names[] = {"IDR", "P"};
+    const unsigned sizes[] = {idrBytes, pBytes};
+    for (int kind = 0; kind < 2; ++kind) {
+        fecResult result = runFrames(codec, kind == 0, sizes[kind], frames, groupSize, keyFrameGroupSize);
+        // As if every frame were this kind
+        printf("%-5s %8u %10.1f %10.1f %9.1f%% %12.2f %10.3f\n", names[kind], sizes[kind], result.mediaPackets,
+               result.fecPackets, result.overheadPercent, result.usPerFrame, result.usPerFrame * frameRate / 1e4);
+    }
+    return 0;
+}
@@ -0,0 +1,237 @@
+// Latency, CPU and overrun tradeoff of the bundled latency profiles
+// (latency_profile.h). An emulated event loop (capture_emulation.h) reads audio
+// periods and video frames on the capture timeline and sends them as RTP-sized
+// datagrams to a loopback socket nobody reads. Every profile sees the same
+// sequence of stalls, where the loop is descheduled as it would be on a busy SoC.
+// For each profile it reports:
+// - capture-to-send latency of audio and video, mean and max;
+// - the loop's CPU use, which follows the packet rate;
+// - ALSA ring overruns, V4L2 frames dropped on a full queue, and frames skipped
+//   by drain-to-newest.
+//
+//   latency_profile_bench [--seconds=10] [--stalls-per-s=2] [--stall-ms=60]
+//                         [--profiles=ultra-low-latency,balanced,lossy-network]
+//                         [--video-device=<file>] [--video-codec=h264]
+//
+// With --video-device the data comes through the server's own capture path, set
+// up for each profile: the file replayed by v4l2Capture and the synthetic ALSA
+// device, whose audio latency and overruns are then the capture's own.
+
+#include "capture_emulation.h"
+#include "alsa_capture.h"
+#include "constants.h"
+#include "latency_profile.h"
+#include "metrics.h"
+#include "v4l2_capture.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const size_t RTP_PAYLOAD_BYTES = 1400;
+
+struct latencyStats {
+    double sumUs;
+    double maxUs;
+    unsigned count;
+
+    void add(double us) {
+        sumUs += us;
+        maxUs = std::max(maxUs, us);
+        ++count;
+    }
+    double meanMs() const { return count > 0 ? sumUs / count / 1000 : 0; }
+    double maxMs() const { return maxUs / 1000; }
+};
+
+struct profileResult {
+    const latencyProfile* profile;
+    latencyStats audio;
+    latencyStats video;
+    double cpuPercent;
+    unsigned overruns;         // ALSA ring overflowed before the loop read it
+    unsigned droppedFrames;    // V4L2 queue was full when a frame arrived
+    unsigned skippedFrames;    // Stale frames drained to the newest
+    uint64_t packets;
+};
+
+// Splits into RTP-sized datagrams, as the framers do
+static unsigned sendPacketized(int sock, const struct sockaddr_in& to, const char* data, size_t length) {
+    unsigned packets = 0;
+    for (size_t offset = 0; offset < length; offset += RTP_PAYLOAD_BYTES) {
+        size_t size = std::min(RTP_PAYLOAD_BYTES, length - offset);
+        sendto(sock, data + offset, size, 0, reinterpret_cast<const struct sockaddr*>(&to), sizeof(to));
+        ++packets;
+    }
+    return packets;
+}
+
+// Without a video device, frames and periods are filler of the configured sizes
+static bool runProfile(const latencyProfile& profile, int64_t durationUs, const stallList& stalls, int sock,
+                       const struct sockaddr_in& to, const char* videoDevice, VideoCodec codec,
+                       profileResult& result) {
+    const int64_t periodUs = profile.audioPeriodMs * 1000LL;
+    const int64_t frameUs = 1000000LL * FRAME_RATE_NUMERATOR / FRAME_RATE_DENOMINATOR;
+    std::vector<char> frame(VIDEO_BITRATE / 8 * frameUs / 1000000, 1);
+    std::vector<char> period(AUDIO_SAMPLE_RATE * AUDIO_CHANNELS * AUDIO_BIT_DEPTH / 8 * periodUs / 1000000, 1);
+
+    v4l2Capture* video = nullptr;
+    alsa_rtsp::alsaCapture* audio = nullptr;
+    if (videoDevice != nullptr) {
+        video = new v4l2Capture(videoDevice, codec);
+        video->setBufferCount(profile.videoBufferCount);
+        video->setDrainToNewest(profile.videoDrainToNewest);
+        audio = new alsa_rtsp::alsaCapture(AUDIO_SYNTHETIC_DEVICE, AUDIO_SAMPLE_RATE, AUDIO_CHANNELS, AUDIO_BIT_DEPTH,
+                                           AUDIO_SAMPLE_RATE * profile.audioPeriodMs / 1000,
+                                           profile.audioBufferPeriods);
+        if (!video->isReplay() || !video->initialize() || !video->startCapture() || !audio->initialize() ||
+            !audio->startCapture()) {
+            fprintf(stderr, "Cannot replay %s\n", videoDevice);
+            delete video;
+            delete audio;
+            return false;
+        }
+    }
+    double overrunsBefore = getMetric("audio.overruns");
+
+    memset(&result, 0, sizeof(result));
+    result.profile = &profile;
+    captureEmulation capture(profile, durationUs, stalls);
+    int64_t cpuStart = clockUs(CLOCK_THREAD_CPUTIME_ID);
+    int64_t capturedUs;
+    int64_t arrivedUs;
+    while (capture.nextWake()) {
+        int64_t now = capture.nowUs();
+        if (audio != nullptr) {
+            while (audio->waitForData(0)) {
+                audio->readFrames(period.data(), audio->getFramesPerPeriod());
+                result.audio.add(now - audio->getPeriodTimestampUs());
+                result.packets += sendPacketized(sock, to, period.data(), period.size());
+            }
+        } else {
+            while (capture.nextPeriod(capturedUs)) {
+                // The first sample of the period waited a whole period to be captured
+                result.audio.add(now - capturedUs);
+                result.packets += sendPacketized(sock, to, period.data(), period.size());
+            }
+        }
+
+        while (capture.nextFrame(arrivedUs)) {
+            result.video.add(now - arrivedUs + frameUs);
+            if (video != nullptr) {
+                size_t length = 0;
+                unsigned char* data = video->getFrame(length);
+                result.packets += sendPacketized(sock, to, reinterpret_cast<char*>(data), length);
+                video->releaseFrame();
+            } else {
+                result.packets += sendPacketized(sock, to, frame.data(), frame.size());
+            }
+        }
+    }
+
+    int64_t wallUs = clockUs() - capture.startUs();
+    result.cpuPercent = 100.0 * (clockUs(CLOCK_THREAD_CPUTIME_ID) - cpuStart) / std::max<int64_t>(wallUs, 1);
+    result.overruns = audio != nullptr ? unsigned(getMetric("audio.overruns") - overrunsBefore) : capture.overruns();
+    result.droppedFrames = capture.droppedFrames();
+    result.skippedFrames = capture.skippedFrames();
+    delete video;
+    delete audio;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    double seconds = 10;
+    double stallsPerSecond = 2;
+    double stallMs = 60;
+    std::string profiles = "ultra-low-latency,balanced,lossy-network";
+    const char* videoDevice = nullptr;
+    const char* videoCodec = "h264";
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--seconds=", 10) == 0) {
+            seconds = atof(argv[i] + 10);
+        } else if (strncmp(argv[i], "--stalls-per-s=", 15) == 0) {
+            stallsPerSecond = atof(argv[i] + 15);
+        } else if (strncmp(argv[i], "--stall-ms=", 11) == 0) {
+            stallMs = atof(argv[i] + 11);
+        } else if (strncmp(argv[i], "--profiles=", 11) == 0) {
+            profiles = argv[i] + 11;
+        } else if (strncmp(argv[i], "--video-device=", 15) == 0) {
+            videoDevice = argv[i] + 15;
+        } else if (strncmp(argv[i], "--video-codec=", 14) == 0) {
+            videoCodec = argv[i] + 14;
+        } else {
+            fprintf(stderr, "Usage: %s [--seconds=10] [--stalls-per-s=2] [--stall-ms=60] [--profiles=<list>] "
+                            "[--video-device=<file>] [--video-codec=<h264|hevc>]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (seconds <= 0) {
+        fprintf(stderr, "Bad duration\n");
+        return 2;
+    }
+    if (strcmp(videoCodec, "h264") != 0 && strcmp(videoCodec, "hevc") != 0) {
+        fprintf(stderr, "Unknown video codec \"%s\"\n", videoCodec);
+        return 2;
+    }
+    VideoCodec codec = strcmp(videoCodec, "hevc") == 0 ? VIDEO_CODEC_HEVC : VIDEO_CODEC_H264;
+
+    // A bound socket nobody reads: sends cost what they would, the kernel drops the data
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(to);
+    if (sink < 0 || sock < 0 || bind(sink, reinterpret_cast<struct sockaddr*>(&to), sizeof(to)) != 0 ||
+        getsockname(sink, reinterpret_cast<struct sockaddr*>(&to), &length) != 0) {
+        fprintf(stderr, "Cannot open loopback sockets: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // The captures log as they are set up, so the table comes after all runs
+    int64_t durationUs = (int64_t)(seconds * 1000000);
+    stallList stalls = makeStalls(durationUs, stallsPerSecond, stallMs);
+    std::vector<profileResult> results;
+    for (size_t begin = 0; begin < profiles.size();) {
+        size_t end = profiles.find(',', begin);
+        if (end == std::string::npos) end = profiles.size();
+        std::string name = profiles.substr(begin, end - begin);
+        begin = end + 1;
+
+        const latencyProfile* profile = findLatencyProfile(name.c_str());
+        if (profile == nullptr) {
+            fprintf(stderr, "Unknown latency profile \"%s\"\n", name.c_str());
+            return 2;
+        }
+        profileResult result;
+        if (!runProfile(*profile, durationUs, stalls, sock, to, videoDevice, codec, result)) {
+            return 1;
+        }
+        results.push_back(result);
+    }
+    close(sock);
+    close(sink);
+
+    printf("%.0f s per profile, %zu stalls of up to %.0f ms, %s\n", seconds, stalls.size(), stallMs,
+           videoDevice != nullptr ? "replayed video and synthetic audio capture" : "emulated capture");
+    printf("%-18s %14s %14s %7s %9s %8s %8s %9s\n", "profile", "audio mean/max", "video mean/max", "CPU %",
+           "overruns", "dropped", "skipped", "packets/s");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const profileResult& r = results[i];
+        char audio[32];
+        char video[32];
+        snprintf(audio, sizeof(audio), "%.1f/%.1f ms", r.audio.meanMs(), r.audio.maxMs());
+        snprintf(video, sizeof(video), "%.1f/%.1f ms", r.video.meanMs(), r.video.maxMs());
+        printf("%-18s %14s %14s %7.2f %9u %8u %8u %9.0f\n", r.profile->name, audio, video, r.cpuPercent, r.overruns,
+               r.droppedFrames, r.skippedFrames, r.packets / seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+// Quality and CPU benchmark for the in-process resampler (audio_resampler.h).
+// For each device rate it converts to AUDIO_SAMPLE_RATE and reports what the
+// startup log only estimates: the filter's ripple and alias rejection, the SNR
+// of a resampled tone, the level of a tone above the output Nyquist that would
+// alias, the cost of one NUM_OF_FRAMES_PER_PERIOD period, and how close the
+// clock lock gets with a drifting, jittery device clock.
+//
+//   resampler_bench [--rates=48000,44100,32000,16000,8000] [--tone=1000] [--drift-ppm=150]
+
+#include "audio_resampler.h"
+#include "constants.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using alsa_rtsp::polyphaseResampler;
+
+static const double PI = 3.14159265358979323846;
+static const unsigned SETTLE_PERIODS = 10;     // Filter transient and history fill, not measured
+static const unsigned MEASURE_PERIODS = 500;   // 10 s at 20 ms periods
+static const double JITTER_US = 1000;          // Timestamp noise, as from snd_pcm_delay
+
+struct toneResult {
+    double snrDb;       // Tone power against everything else in the output
+    double levelDb;     // Tone power relative to a full-scale input tone
+};
+
+// Resamples a sine at frequency Hz and fits a sine at the same frequency to the
+// output: the fit is the signal, the residual the noise and distortion
+static toneResult resampleTone(unsigned inRate, double frequency) {
+    polyphaseResampler resampler(inRate, AUDIO_SAMPLE_RATE, 1);
+    std::vector<float> in;
+    std::vector<float> out(NUM_OF_FRAMES_PER_PERIOD);
+    std::vector<double> measured;
+    uint64_t inFrames = 0;
+    for (unsigned period = 0; period < SETTLE_PERIODS + MEASURE_PERIODS; ++period) {
+        in.resize(resampler.inputFramesNeeded(NUM_OF_FRAMES_PER_PERIOD));
+        for (size_t i = 0; i < in.size(); ++i, ++inFrames) {
+            in[i] = 0.5f * (float)std::sin(2 * PI * frequency * inFrames / inRate);
+        }
+        const float* inPlane = in.data();
+        float* outPlane = out.data();
+        resampler.push(&inPlane, in.size());
+        resampler.pull(&outPlane, out.size());
+        if (period >= SETTLE_PERIODS) {
+            measured.insert(measured.end(), out.begin(), out.end());
+        }
+    }
+
+    // Least squares against sin and cos; the two are near orthogonal over many cycles
+    double sinSum = 0, cosSum = 0;
+    for (size_t i = 0; i < measured.size(); ++i) {
+        double phase = 2 * PI * frequency * i / AUDIO_SAMPLE_RATE;
+        sinSum += measured[i] * std::sin(phase);
+        cosSum += measured[i] * std::cos(phase);
+    }
+    double a = 2 * sinSum / measured.size();
+    double b = 2 * cosSum / measured.size();
+    double signal = 0, noise = 0;
+    for (size_t i = 0; i < measured.size(); ++i) {
+        double phase = 2 * PI * frequency * i / AUDIO_SAMPLE_RATE;
+        double fit = a * std::sin(phase) + b * std::cos(phase);
+        signal += fit * fit;
+        noise += (measured[i] - fit) * (measured[i] - fit);
+    }
+    toneResult result;
+    result.snrDb = 10 * std::log10(signal / std::max(noise, 1e-30));
+    result.levelDb = 10 * std::log10(std::max(signal / measured.size(), 1e-30) / (0.5 * 0.5 / 2));
+    return result;
+}
+
+// Microseconds per output period of one plane; the server resamples each input
+// channel as a plane of its own
+static double periodCostUs(unsigned inRate) {
+    polyphaseResampler resampler(inRate, AUDIO_SAMPLE_RATE, 1);
+    std::vector<float> in(resampler.inputFramesNeeded(NUM_OF_FRAMES_PER_PERIOD) + 16);
+    std::vector<float> out(NUM_OF_FRAMES_PER_PERIOD);
+    for (size_t i = 0; i < in.size(); ++i) {
+        in[i] = (float)std::sin(0.1 * i);
+    }
+    const float* inPlane = in.data();
+    float* outPlane = out.data();
+    const unsigned periods = 20000;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned period = 0; period < periods; ++period) {
+        resampler.push(&inPlane, resampler.inputFramesNeeded(NUM_OF_FRAMES_PER_PERIOD));
+        resampler.pull(&outPlane, out.size());
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    return us / periods;
+}
+
+struct lockResult {
+    double adjustPpm;     // Trim applied at the end; ideally the drift
+    double maxErrorMs;    // Over the last half, once locked
+};
+
+// A device clock drifting by driftPpm, stamped with jittery capture times, the
+// way alsaCapture calls trackClock() once per period
+static lockResult lockToDrift(unsigned inRate, double driftPpm) {
+    polyphaseResampler resampler(inRate, AUDIO_SAMPLE_RATE, 1);
+    const double deviceRate = inRate * (1 + driftPpm * 1e-6);
+    std::vector<float> in;
+    std::vector<float> out(NUM_OF_FRAMES_PER_PERIOD);
+    uint64_t pushed = 0;
+    uint32_t noise = 12345;
+    lockResult result;
+    result.maxErrorMs = 0;
+    const unsigned periods = 30000;   // 10 minutes at 20 ms
+    for (unsigned period = 0; period < periods; ++period) {
+        in.assign(resampler.inputFramesNeeded(NUM_OF_FRAMES_PER_PERIOD), 0.0f);
+        const float* inPlane = in.data();
+        float* outPlane = out.data();
+        resampler.push(&inPlane, in.size());
+        pushed += in.size();
+        noise = noise * 1664525 + 1013904223;
+        double jitterUs = (noise / 4294967296.0 - 0.5) * 2 * JITTER_US;
+        resampler.trackClock((int64_t)(pushed * 1e6 / deviceRate + jitterUs));
+        resampler.pull(&outPlane, out.size());
+        if (period >= periods / 2) {
+            result.maxErrorMs = std::max(result.maxErrorMs, std::fabs(resampler.getClockErrorMs()));
+        }
+    }
+    result.adjustPpm = resampler.getAdjustPpm();
+    return result;
+}
+
+int main(int argc, char** argv) {
+    std::string rates = "48000,44100,32000,16000,8000";
+    double tone = AUDIO_SYNTHETIC_TONE_HZ;
+    double driftPpm = 150;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--rates=", 8) == 0) {
+            rates = argv[i] + 8;
+        } else if (strncmp(argv[i], "--tone=", 7) == 0) {
+            tone = atof(argv[i] + 7);
+        } else if (strncmp(argv[i], "--drift-ppm=", 12) == 0) {
+            driftPpm = atof(argv[i] + 12);
+        } else {
+            fprintf(stderr, "Usage: %s [--rates=<list>] [--tone=<Hz>] [--drift-ppm=<ppm>]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (tone <= 0 || tone >= AUDIO_SAMPLE_RATE / 2.0) {
+        fprintf(stderr, "The tone must be below %d Hz\n", AUDIO_SAMPLE_RATE / 2);
+        return 2;
+    }
+
+    printf("To %d Hz, %u-frame periods, %.0f Hz tone, %.0f ppm drift with %.0f us jitter\n", AUDIO_SAMPLE_RATE,
+           NUM_OF_FRAMES_PER_PERIOD, tone, driftPpm, JITTER_US);
+    printf("%8s %5s %10s %12s %8s %10s %10s %10s %12s\n", "from Hz", "taps", "ripple dB", "rejection dB", "SNR dB",
+           "alias dB", "us/period", "lock ppm", "lock err ms");
+    for (const char* p = rates.c_str(); *p != '\0';) {
+        char* end;
+        unsigned inRate = strtoul(p, &end, 10);
+        if (end == p || inRate == 0) {
+            fprintf(stderr, "Bad rate list \"%s\"\n", rates.c_str());
+            return 2;
+        }
+        p = *end == ',' ? end + 1 : end;
+
+        polyphaseResampler resampler(inRate, AUDIO_SAMPLE_RATE, 1);
+        toneResult inBand = resampleTone(inRate, tone);
+        // Folds to the tone's own frequency if the filter lets it through
+        char alias[16] = "-";
+        double aliasFrequency = AUDIO_SAMPLE_RATE - tone;
+        if (aliasFrequency < inRate / 2.0) {
+            snprintf(alias, sizeof(alias), "%.1f", resampleTone(inRate, aliasFrequency).levelDb);
+        }
+        lockResult lock = lockToDrift(inRate, driftPpm);
+        printf("%8u %5u %10.4f %12.1f %8.1f %10s %10.1f %10.1f %12.2f\n", inRate, resampler.getTaps(),
+               resampler.passbandRippleDb(), resampler.stopbandAttenuationDb(), inBand.snrDb, alias,
+               periodCostUs(inRate), lock.adjustPpm, lock.maxErrorMs);
+    }
+    return 0;
+}
@@ -0,0 +1,207 @@
+// Event loop cost with many idle clients: the epoll scheduler against live555's
+// select() one (SCHEDULER_USE_EPOLL). Each connection is a UDP socket on
+// loopback registered for reading, as a client's RTCP socket is. A task runs
+// every audio period, as packetization does, and --active of the sockets get a
+// datagram each time. CPU time is the process's own, so the sender counts too;
+// it costs the same for both schedulers.
+//
+//   scheduler_bench [--seconds=10] [--connections=1000] [--active=1] [--tick-ms=20]
+//
+// select() can't watch socket numbers at or above FD_SETSIZE (1024), so keep the
+// connections below that for the comparison; the epoll run alone can go higher.
+
+#include "constants.h"
+#include "epoll_task_scheduler.h"
+#include <BasicUsageEnvironment.hh>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+struct benchState;
+
+// One handler registration, as live555 has one per socket
+struct connection {
+    benchState* state;
+    int sock;
+};
+
+struct benchState {
+    TaskScheduler* scheduler;
+    std::vector<connection> connections;
+    std::vector<int> sockets;
+    std::vector<struct sockaddr_in> addresses;
+    int sender;
+    unsigned active;
+    unsigned next;          // Round-robin over the sockets, so every one gets used
+    int64_t tickUs;
+    uint64_t ticks;
+    uint64_t received;
+    char volatile done;
+};
+
+static double cpuSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double wallSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void readHandler(void* clientData, int /*mask*/) {
+    connection* conn = static_cast<connection*>(clientData);
+    char packet[64];
+    if (recv(conn->sock, packet, sizeof(packet), MSG_DONTWAIT) > 0) {
+        ++conn->state->received;
+    }
+}
+
+static void tickTask(void* clientData) {
+    benchState* state = static_cast<benchState*>(clientData);
+    ++state->ticks;
+    char packet[32];
+    memset(packet, 0, sizeof(packet));
+    for (unsigned i = 0; i < state->active; ++i) {
+        const struct sockaddr_in& to = state->addresses[state->next];
+        state->next = (state->next + 1) % state->sockets.size();
+        sendto(state->sender, packet, sizeof(packet), 0, reinterpret_cast<const struct sockaddr*>(&to), sizeof(to));
+    }
+    state->scheduler->scheduleDelayedTask(state->tickUs, tickTask, state);
+}
+
+static void stopTask(void* clientData) {
+    static_cast<benchState*>(clientData)->done = 1;
+}
+
+static int openReceiver(struct sockaddr_in& address) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return -1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(sock, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0 ||
+        getsockname(sock, reinterpret_cast<struct sockaddr*>(&address), &length) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// False if the sockets can't be opened
+static bool runScheduler(const char* name, TaskScheduler* scheduler, unsigned connections, unsigned active,
+                         int64_t tickUs, double seconds, bool selectLimited) {
+    benchState state;
+    state.scheduler = scheduler;
+    state.sender = socket(AF_INET, SOCK_DGRAM, 0);
+    state.active = active;
+    state.next = 0;
+    state.tickUs = tickUs;
+    state.ticks = 0;
+    state.received = 0;
+    state.done = 0;
+    for (unsigned i = 0; i < connections; ++i) {
+        struct sockaddr_in address;
+        int sock = openReceiver(address);
+        if (sock < 0) {
+            fprintf(stderr, "Cannot open connection %u: %s\n", i, strerror(errno));
+            break;
+        }
+        if (selectLimited && sock >= FD_SETSIZE) {
+            fprintf(stderr, "Socket %d is beyond select()'s FD_SETSIZE; use fewer connections\n", sock);
+            close(sock);
+            break;
+        }
+        state.sockets.push_back(sock);
+        state.addresses.push_back(address);
+    }
+    bool opened = state.sender >= 0 && state.sockets.size() == connections;
+    if (opened) {
+        for (size_t i = 0; i < state.sockets.size(); ++i) {
+            connection conn = {&state, state.sockets[i]};
+            state.connections.push_back(conn);
+        }
+        for (size_t i = 0; i < state.connections.size(); ++i) {
+            scheduler->turnOnBackgroundReadHandling(state.sockets[i], readHandler, &state.connections[i]);
+        }
+        scheduler->scheduleDelayedTask(tickUs, tickTask, &state);
+        scheduler->scheduleDelayedTask((int64_t)(seconds * 1000000), stopTask, &state);
+
+        double wallStart = wallSeconds();
+        double cpuStart = cpuSeconds();
+        scheduler->doEventLoop(&state.done);
+        double cpu = cpuSeconds() - cpuStart;
+        double wall = wallSeconds() - wallStart;
+
+        printf("%-8s %11zu %10.2f %14.1f %12.1f %10llu\n", name, state.sockets.size(), 100 * cpu / wall,
+               1e6 * cpu / wall, 1e6 * cpu / std::max<uint64_t>(state.ticks, 1),
+               (unsigned long long)state.received);
+        for (size_t i = 0; i < state.sockets.size(); ++i) {
+            scheduler->disableBackgroundHandling(state.sockets[i]);
+        }
+    }
+    for (size_t i = 0; i < state.sockets.size(); ++i) {
+        close(state.sockets[i]);
+    }
+    if (state.sender >= 0) close(state.sender);
+    return opened;
+}
+
+int main(int argc, char** argv) {
+    double seconds = 10;
+    unsigned connections = 1000;
+    unsigned active = 1;
+    unsigned tickMs = 20;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--seconds=", 10) == 0) {
+            seconds = atof(argv[i] + 10);
+        } else if (strncmp(argv[i], "--connections=", 14) == 0) {
+            connections = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--active=", 9) == 0) {
+            active = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--tick-ms=", 10) == 0) {
+            tickMs = atoi(argv[i] + 10);
+        } else {
+            fprintf(stderr, "Usage: %s [--seconds=10] [--connections=1000] [--active=1] [--tick-ms=20]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (seconds <= 0 || connections == 0 || tickMs == 0) {
+        fprintf(stderr, "Bad duration, connection count or tick\n");
+        return 2;
+    }
+
+    // As main() does for the epoll scheduler
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    printf("%u connections, %u active per %u ms tick, %.0f s per scheduler\n", connections, active, tickMs, seconds);
+    printf("%-8s %11s %10s %14s %12s %10s\n", "loop", "connections", "CPU %", "CPU us/s", "CPU us/tick",
+           "datagrams");
+
+    epollTaskScheduler* epoll = epollTaskScheduler::createNew(SCHEDULER_MAX_EVENTS);
+    if (epoll == nullptr) return 1;
+    bool ok = runScheduler("epoll", epoll, connections, active, tickMs * 1000LL, seconds, false);
+    delete epoll;
+
+    BasicTaskScheduler* selectScheduler = BasicTaskScheduler::createNew();
+    ok = runScheduler("select", selectScheduler, connections, active, tickMs * 1000LL, seconds, true) && ok;
+    delete selectScheduler;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,232 @@
+// Time from launching the server to the first DESCRIBE it answers, with the
+// SPS/PPS cache (sps_pps_cache.h) cold and warm. Each run starts
+// avs_rtsp_server, connects to its RTSP port and sends DESCRIBE until a 200
+// with an SDP comes back, then stops the server with SIGTERM. Cold runs delete
+// the device's cache file first; warm runs use the one the run before left.
+// Run it on the target device: a replayed file never uses the cache.
+//
+//   startup_bench [--server=<avs_rtsp_server>] [--video-device=/dev/video0]
+//                 [--video-codec=h264] [--runs=5] [--timeout-s=20]
+
+#include "constants.h"
+#include "sps_pps_cache.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#ifndef AVS_RTSP_SERVER_PATH
+#define AVS_RTSP_SERVER_PATH "./avs_rtsp_server"  // CMake passes the built one
+#endif
+
+static const char* STREAM_NAME = "avs_stream";  // As unified_rtsp_server_manager.cpp names it
+
+struct startupStats {
+    std::vector<double> ms;
+    unsigned failed;
+};
+
+static int64_t clockUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleepUs(int64_t us) {
+    struct timespec delay;
+    delay.tv_sec = us / 1000000;
+    delay.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR) {
+    }
+}
+
+// One DESCRIBE on a fresh connection; true once the whole 200 response and its SDP are in
+static bool describe(int64_t deadlineUs) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return false;
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(DEFAULT_RTSP_PORT);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, reinterpret_cast<struct sockaddr*>(&server), sizeof(server)) != 0) {
+        close(sock);
+        return false;
+    }
+
+    char request[256];
+    int length = snprintf(request, sizeof(request),
+                          "DESCRIBE rtsp://127.0.0.1:%d/%s RTSP/1.0\r\nCSeq: 1\r\nAccept: application/sdp\r\n\r\n",
+                          DEFAULT_RTSP_PORT, STREAM_NAME);
+    if (send(sock, request, length, MSG_NOSIGNAL) != length) {
+        close(sock);
+        return false;
+    }
+
+    std::string response;
+    size_t headerEnd = std::string::npos;
+    size_t contentLength = 0;
+    for (;;) {
+        if (headerEnd != std::string::npos && response.size() >= headerEnd + 4 + contentLength) break;
+        int64_t leftUs = deadlineUs - clockUs();
+        struct pollfd readable = {sock, POLLIN, 0};
+        if (leftUs <= 0 || poll(&readable, 1, (int)(leftUs / 1000) + 1) <= 0) {
+            close(sock);
+            return false;
+        }
+        char buffer[4096];
+        ssize_t received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            close(sock);
+            return false;
+        }
+        response.append(buffer, received);
+        if (headerEnd == std::string::npos) {
+            headerEnd = response.find("\r\n\r\n");
+            size_t field = response.find("Content-Length:");
+            if (headerEnd != std::string::npos && field != std::string::npos && field < headerEnd) {
+                contentLength = strtoul(response.c_str() + field + 15, NULL, 10);
+            }
+        }
+    }
+    close(sock);
+    return response.compare(0, 12, "RTSP/1.0 200") == 0 && contentLength > 0;
+}
+
+// Milliseconds from exec to the first answered DESCRIBE, or a negative value
+static double runOnce(const std::vector<std::string>& args, int64_t timeoutUs) {
+    std::vector<char*> argv;
+    for (size_t i = 0; i < args.size(); ++i) {
+        argv.push_back(const_cast<char*>(args[i].c_str()));
+    }
+    argv.push_back(NULL);
+
+    fflush(stdout);  // Or the child repeats what is buffered
+    int64_t start = clockUs();
+    pid_t server = fork();
+    if (server < 0) return -1;
+    if (server == 0) {
+        // The server's log would drown the table
+        freopen("/dev/null", "w", stdout);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    double ms = -1;
+    int64_t deadlineUs = start + timeoutUs;
+    while (clockUs() < deadlineUs) {
+        int status;
+        if (waitpid(server, &status, WNOHANG) == server) {
+            fprintf(stderr, "Server exited before answering DESCRIBE\n");
+            return -1;
+        }
+        if (describe(deadlineUs)) {
+            ms = (clockUs() - start) / 1000.0;
+            break;
+        }
+        sleepUs(1000);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return ms;
+}
+
+static void printRow(const char* name, const startupStats& stats) {
+    if (stats.ms.empty()) {
+        printf("%-6s %5u %5u %10s %10s %10s\n", name, 0u, stats.failed, "-", "-", "-");
+        return;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < stats.ms.size(); ++i) {
+        sum += stats.ms[i];
+    }
+    printf("%-6s %5zu %5u %10.1f %10.1f %10.1f\n", name, stats.ms.size(), stats.failed, sum / stats.ms.size(),
+           *std::min_element(stats.ms.begin(), stats.ms.end()), *std::max_element(stats.ms.begin(), stats.ms.end()));
+}
+
+int main(int argc, char** argv) {
+    std::string server = AVS_RTSP_SERVER_PATH;
+    std::string device = VIDEO_DEVICE;
+    std::string codec = VIDEO_CODEC;
+    int runs = 5;
+    double timeoutSeconds = 20;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--server=", 9) == 0) {
+            server = argv[i] + 9;
+        } else if (strncmp(argv[i], "--video-device=", 15) == 0) {
+            device = argv[i] + 15;
+        } else if (strncmp(argv[i], "--video-codec=", 14) == 0) {
+            codec = argv[i] + 14;
+        } else if (strncmp(argv[i], "--runs=", 7) == 0) {
+            runs = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--timeout-s=", 12) == 0) {
+            timeoutSeconds = atof(argv[i] + 12);
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [--server=<path>] [--video-device=<path>] [--video-codec=h264|hevc] [--runs=5] "
+                    "[--timeout-s=20]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (runs < 1 || timeoutSeconds <= 0) {
+        fprintf(stderr, "Bad run count or timeout\n");
+        return 2;
+    }
+
+    // The key the server looks its parameter sets up by, before the encoder is opened
+    std::string cacheFile = spsPpsCachePath(spsPpsCacheKey(device, codec == "hevc" ? VIDEO_CODEC_HEVC : VIDEO_CODEC_H264,
+                                                           VIDEO_WIDTH, VIDEO_HEIGHT, FRAME_RATE_NUMERATOR,
+                                                           FRAME_RATE_DENOMINATOR));
+    std::vector<std::string> args;
+    args.push_back(server);
+    args.push_back("--video-device=" + device);
+    args.push_back("--video-codec=" + codec);
+    int64_t timeoutUs = (int64_t)(timeoutSeconds * 1000000);
+
+    printf("%s on %s, %d runs per cache state\n", codec.c_str(), device.c_str(), runs);
+    printf("cache file %s\n", cacheFile.c_str());
+    startupStats cold = {std::vector<double>(), 0};
+    startupStats warm = {std::vector<double>(), 0};
+    for (int run = 0; run < runs; ++run) {
+        // Cold, then warm from what the cold run saved
+        if (unlink(cacheFile.c_str()) != 0 && errno != ENOENT) {
+            fprintf(stderr, "Cannot delete %s: %s\n", cacheFile.c_str(), strerror(errno));
+            return 1;
+        }
+        double ms = runOnce(args, timeoutUs);
+        if (ms < 0) {
+            ++cold.failed;
+        } else {
+            cold.ms.push_back(ms);
+        }
+
+        if (access(cacheFile.c_str(), R_OK) != 0) {
+            fprintf(stderr, "The server left no cache file; warm runs would be cold too\n");
+            return 1;
+        }
+        ms = runOnce(args, timeoutUs);
+        if (ms < 0) {
+            ++warm.failed;
+        } else {
+            warm.ms.push_back(ms);
+        }
+    }
+
+    printf("%-6s %5s %5s %10s %10s %10s\n", "cache", "runs", "fail", "mean ms", "min ms", "max ms");
+    printRow("cold", cold);
+    printRow("warm", warm);
+    return 0;
+}
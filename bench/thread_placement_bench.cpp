@@ -0,0 +1,173 @@
+// Jitter benchmark for thread placement (thread_placement.h). An emulated event
+// loop (capture_emulation.h) reads audio periods and video frames on the capture
+// timeline while busy threads compete for every CPU. It runs once as started and
+// once placed, and reports what the server's audio.overruns and
+// video.dequeue_interval_* metrics would show for each.
+//
+//   thread_placement_bench [--seconds=10] [--load=<threads>] [--cpus=<list>]
+//                          [--fifo=<priority>] [--latency-profile=<name>]
+//
+// The defaults are one load thread per CPU, the last CPU, SCHED_FIFO 50 and the
+// ultra-low-latency profile, whose 40 ms ALSA ring overruns first. SCHED_FIFO
+// needs CAP_SYS_NICE or an RLIMIT_RTPRIO allowance; without it the placed run is
+// only pinned, as the log says.
+
+#include "capture_emulation.h"
+#include "constants.h"
+#include "latency_profile.h"
+#include "thread_placement.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct jitterResult {
+    unsigned overruns;         // ALSA ring overflowed before the loop read it
+    unsigned droppedFrames;    // V4L2 queue was full when a frame arrived
+    unsigned skippedFrames;    // Stale frames drained to the newest
+    double intervalStddevUs;   // Between video dequeues
+    double intervalMaxUs;
+    double latenessMaxUs;      // Wake-up behind schedule
+};
+
+// Reads everything ready at each wake and copies it as packetization would
+static jitterResult runLoop(const latencyProfile& profile, int64_t durationUs) {
+    const int64_t periodUs = profile.audioPeriodMs * 1000LL;
+    const int64_t frameUs = 1000000LL * FRAME_RATE_NUMERATOR / FRAME_RATE_DENOMINATOR;
+    std::vector<char> frame(VIDEO_BITRATE / 8 * frameUs / 1000000, 1);
+    std::vector<char> period(AUDIO_SAMPLE_RATE * AUDIO_CHANNELS * AUDIO_BIT_DEPTH / 8 * periodUs / 1000000, 1);
+    std::vector<char> packet(std::max(frame.size(), period.size()));
+
+    jitterResult result;
+    memset(&result, 0, sizeof(result));
+    captureEmulation capture(profile, durationUs);
+    int64_t capturedUs;
+    int64_t arrivedUs;
+    int64_t lastDequeueUs = 0;
+    unsigned intervals = 0;
+    double sum = 0;
+    double sumSquares = 0;
+
+    while (capture.nextWake()) {
+        int64_t now = capture.nowUs();
+        result.latenessMaxUs = std::max(result.latenessMaxUs, double(now - capture.dueUs()));
+
+        while (capture.nextPeriod(capturedUs)) {
+            memcpy(packet.data(), period.data(), period.size());
+        }
+        while (capture.nextFrame(arrivedUs)) {
+            memcpy(packet.data(), frame.data(), frame.size());
+            if (lastDequeueUs != 0) {
+                double interval = now - lastDequeueUs;
+                sum += interval;
+                sumSquares += interval * interval;
+                result.intervalMaxUs = std::max(result.intervalMaxUs, interval);
+                ++intervals;
+            }
+            lastDequeueUs = now;
+        }
+    }
+
+    result.overruns = capture.overruns();
+    result.droppedFrames = capture.droppedFrames();
+    result.skippedFrames = capture.skippedFrames();
+    if (intervals > 0) {
+        double mean = sum / intervals;
+        result.intervalStddevUs = std::sqrt(std::max(0.0, sumSquares / intervals - mean * mean));
+    }
+    return result;
+}
+
+// Analytics stand-in: computes over a working set bigger than the caches
+static void busyLoad(const std::atomic<bool>* stop) {
+    std::vector<uint32_t> data(1 << 20);
+    uint32_t x = 1;
+    while (!stop->load(std::memory_order_relaxed)) {
+        for (size_t i = 0; i < data.size(); i += 16) {
+            x = x * 1664525 + 1013904223;
+            data[i] += x;
+        }
+    }
+}
+
+static jitterResult runPhase(const latencyProfile& profile, int64_t durationUs, bool placed, const std::string& cpus,
+                             int fifoPriority) {
+    jitterResult result;
+    std::thread loop([&]() {
+        if (placed && !applyThreadPlacement("bench-loop", cpus.c_str(), fifoPriority)) {
+            fprintf(stderr, "Placement incomplete; the placed run is partly unplaced\n");
+        }
+        result = runLoop(profile, durationUs);
+    });
+    loop.join();
+    return result;
+}
+
+static void printResult(const char* name, const jitterResult& r) {
+    printf("%-10s %9u %12u %12u %18.0f %16.0f %16.0f\n", name, r.overruns, r.droppedFrames, r.skippedFrames,
+           r.intervalStddevUs, r.intervalMaxUs, r.latenessMaxUs);
+}
+
+int main(int argc, char** argv) {
+    double seconds = 10;
+    unsigned load = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    std::string cpus = std::to_string(load - 1);
+    int fifoPriority = 50;
+    const char* profileName = "ultra-low-latency";
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--seconds=", 10) == 0) {
+            seconds = atof(argv[i] + 10);
+        } else if (strncmp(argv[i], "--load=", 7) == 0) {
+            load = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--cpus=", 7) == 0) {
+            cpus = argv[i] + 7;
+        } else if (strncmp(argv[i], "--fifo=", 7) == 0) {
+            fifoPriority = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--latency-profile=", 18) == 0) {
+            profileName = argv[i] + 18;
+        } else {
+            fprintf(stderr, "Usage: %s [--seconds=10] [--load=<threads>] [--cpus=<list>] [--fifo=<priority>] "
+                            "[--latency-profile=<name>]\n", argv[0]);
+            return 2;
+        }
+    }
+    const latencyProfile* profile = findLatencyProfile(profileName);
+    if (profile == nullptr || seconds <= 0) {
+        fprintf(stderr, "Unknown latency profile or bad duration\n");
+        return 2;
+    }
+
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> loadThreads;
+    for (unsigned i = 0; i < load; ++i) {
+        loadThreads.push_back(std::thread(busyLoad, &stop));
+    }
+
+    int64_t durationUs = (int64_t)(seconds * 1000000);
+    printf("%u load threads, %.0f s per run, profile %s (%u ms ALSA ring, %u V4L2 buffers), placed on CPUs %s",
+           load, seconds, profile->name, profile->audioPeriodMs * profile->audioBufferPeriods,
+           profile->videoBufferCount, cpus.c_str());
+    if (fifoPriority > 0) {
+        printf(" at SCHED_FIFO %d", fifoPriority);
+    }
+    printf("\n");
+    jitterResult unplaced = runPhase(*profile, durationUs, false, cpus, fifoPriority);
+    jitterResult placed = runPhase(*profile, durationUs, true, cpus, fifoPriority);
+
+    stop.store(true);
+    for (size_t i = 0; i < loadThreads.size(); ++i) {
+        loadThreads[i].join();
+    }
+
+    printf("%-10s %9s %12s %12s %18s %16s %16s\n", "placement", "overruns", "frame drops", "frame skips",
+           "interval stddev us", "interval max us", "lateness max us");
+    printResult("unplaced", unplaced);
+    printResult("placed", placed);
+    return 0;
+}
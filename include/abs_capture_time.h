@@ -0,0 +1,27 @@
+#ifndef ABS_CAPTURE_TIME_H
+#define ABS_CAPTURE_TIME_H
+
+#include <cstdint>
+
+// abs-capture-time RTP header extension: the NTP wall-clock time the first
+// sample of a frame was captured, so receivers can measure glass-to-glass
+// latency and line up several cameras. Carried as an RFC 8285 one-byte-header
+// element; negotiated with an a=extmap line.
+#define ABS_CAPTURE_TIME_URI "http://www.webrtc.org/experiments/rtp-hdrext/abs-capture-time"
+
+// Bytes the extension adds to a packet: 0xBEDE header plus the padded element
+#define ABS_CAPTURE_TIME_EXTENSION_SIZE 16
+
+// CLOCK_MONOTONIC microseconds (V4L2 buffer and ALSA period timestamps) to a
+// 64-bit NTP timestamp (32.32 fixed point) on the current wall clock
+uint64_t monotonicToNtp(int64_t monotonicMicros);
+
+// Writes packet to out with the extension added. Returns the new size, or 0 if
+// it doesn't fit in outSize or the packet already has a header extension.
+unsigned addAbsCaptureTime(const unsigned char* packet, unsigned size, unsigned char extensionId, uint64_t ntpTime,
+                           unsigned char* out, unsigned outSize);
+
+// Adds the a=extmap line to an SDP media section. Returns a new[] string.
+char* addAbsCaptureTimeToSdpLines(char const* sdpLines, unsigned char extensionId);
+
+#endif // ABS_CAPTURE_TIME_H
@@ -0,0 +1,54 @@
+#ifndef ADMISSION_RTSP_SERVER_H
+#define ADMISSION_RTSP_SERVER_H
+
+#include <liveMedia.hh>
+#include "bandwidth_budget.h"
+
+// RTSP server that admits clients against the egress budget: a session's first
+// SETUP is answered with "453 Not Enough Bandwidth" when one more stream would
+// not fit, so the viewers already connected keep their quality.
+// A session's SET_PARAMETER with a "video_format: <width>x<height>@<fps>" line
+// switches the video format (VIDEO_RECONFIGURE_VIA_RTSP); any other
+// SET_PARAMETER, a keep-alive usually, is answered as before.
+class admissionRTSPServer : public RTSPServer {
+public:
+    static admissionRTSPServer* createNew(UsageEnvironment& env, Port ourPort, bandwidthBudget* budget,
+                                          UserAuthenticationDatabase* authDatabase = NULL,
+                                          unsigned reclamationSeconds = 65);
+
+    // Applies a video_format value; false if it is malformed or can't be applied
+    typedef bool (videoFormatHandler)(void* clientData, char const* format);
+    void setVideoFormatHandler(videoFormatHandler* handler, void* clientData);
+
+protected:
+    admissionRTSPServer(UsageEnvironment& env, int ourSocketIPv4, int ourSocketIPv6, Port ourPort,
+                        bandwidthBudget* budget, UserAuthenticationDatabase* authDatabase,
+                        unsigned reclamationSeconds);
+    virtual ~admissionRTSPServer();
+
+    virtual ClientSession* createNewClientSession(u_int32_t sessionId);
+
+    class admissionClientSession : public RTSPClientSession {
+    public:
+        admissionClientSession(admissionRTSPServer& ourServer, u_int32_t sessionId);
+        virtual ~admissionClientSession();
+
+    protected:
+        virtual void handleCmd_SETUP(RTSPClientConnection* ourClientConnection, char const* urlPreSuffix,
+                                     char const* urlSuffix, char const* fullRequestStr);
+        virtual void handleCmd_SET_PARAMETER(RTSPClientConnection* ourClientConnection,
+                                             ServerMediaSubsession* subsession, char const* fullRequestStr);
+
+    private:
+        admissionRTSPServer& fServer;
+        bandwidthBudget* fBudget;
+        bool fAdmitted;  // Holds one stream of the budget until the session goes away
+    };
+
+private:
+    bandwidthBudget* fBudget;
+    videoFormatHandler* fVideoFormatHandler;
+    void* fVideoFormatClientData;
+};
+
+#endif // ADMISSION_RTSP_SERVER_H
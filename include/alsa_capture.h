@@ -1,41 +1,114 @@
 #pragma once // Preventing multiple inclusions of header files
 
 #include <alsa/asoundlib.h>
+#include <mutex>
+#include <string>
 #include <vector>
+#include <poll.h>
 #include "constants.h"
+#include "audio_mix.h"
+#include "audio_resampler.h"
+#include "shm_frame_publisher.h"
 
 namespace alsa_rtsp {
 
+// One ALSA device feeding the capture, in whatever format and rate it offers
+struct alsaInput {
+    std::string device;
+    snd_pcm_t* pcm_handle;
+    sampleFormat format;
+    unsigned int channels;
+    unsigned int rate;
+    snd_pcm_uframes_t period_frames;   // One output period's worth at the device rate
+    float gain;
+    deinterleaveFunc deinterleave;
+    std::vector<char> buffer;          // Frames as read from the device
+    polyphaseResampler* resampler;     // Null when ALSA delivers the stream rate itself
+    std::vector<std::vector<float>> native_planes;
+    std::vector<float*> native_plane_ptrs;
+    std::string metric_prefix;
+};
+
+// One input channel (numbered across all inputs) summed into one output channel
+struct mixRoute {
+    unsigned int input_plane;
+    unsigned int output_channel;
+    float gain;
+};
+
 class alsaCapture {
 public:
-    // Parameterized constructor for flexibility
+    // Parameterized constructor for flexibility. The device may be a comma-separated
+    // list; those devices are captured in step and mixed down to `channels` channels
+    // following AUDIO_CHANNEL_MAP. AUDIO_SYNTHETIC_DEVICE generates a test tone
+    // on the media clock instead, for simulation runs.
     alsaCapture(const char* device, unsigned int sampleRate, 
-                unsigned int channels, unsigned int bitDepth);
+                unsigned int channels, unsigned int bitDepth,
+                unsigned int framesPerPeriod = NUM_OF_FRAMES_PER_PERIOD,
+                unsigned int periodsInBuffer = NUM_OF_PERIODS_IN_BUFFER);
     ~alsaCapture();
 
     bool initialize();
     bool startCapture();
     bool stopCapture();
     bool reset();
+    bool recover();
+    bool waitForData(int timeoutMs);
     int readFrames(char* outbuffer, int outFrames);
+    // Also publish every captured period to a shared-memory ring for local readers
+    bool enableFrameExport(const char* name, unsigned slots);
+    bool isExportingFrames() const { return frame_publisher != nullptr; }
+    // Framed sources register while they read periods, so nothing else takes them
+    void addStreamReader() { ++stream_readers; }
+    void removeStreamReader() { --stream_readers; }
+    bool hasStreamReader() const { return stream_readers > 0; }
 
     // Getters for audio parameters
     unsigned int getSampleRate() const { return AUDIO_SAMPLE_RATE; }
     unsigned int getChannels() const { return AUDIO_CHANNELS; }
     unsigned int getBitDepth() const { return AUDIO_BIT_DEPTH; }
     size_t getBufferSize() const { return buffer_size; }
+    unsigned int getFramesPerPeriod() const { return frames; }
+    unsigned int getPeriodDurationUs() const { return frames * 1000000ULL / sample_rate; }
+    // CLOCK_MONOTONIC time of the first sample of the period readFrames() returned last
+    int64_t getPeriodTimestampUs() const { return period_timestamp_us; }
+    bool isSynthetic() const { return synthetic; }
 
 private:
-    const char* pcm_device;
+    // The watchdog recovers on its own thread; the event loop's calls wait for it
+    std::recursive_mutex device_mutex;
+    std::string device_list;
     unsigned int sample_rate;
     unsigned int num_channels;
     unsigned int bit_depth;
-    snd_pcm_t* pcm_handle;
-    snd_pcm_hw_params_t* params;
     snd_pcm_uframes_t frames;
     snd_pcm_uframes_t periods;
-    std::vector<char> buffer;
     size_t buffer_size;
+    std::vector<alsaInput> inputs;
+    std::vector<mixRoute> routes;
+    std::vector<std::vector<float>> input_planes;
+    std::vector<std::vector<float>> output_planes;
+    std::vector<float*> input_plane_ptrs;
+    std::vector<float*> output_plane_ptrs;
+    bool needs_alignment;
+    std::vector<struct pollfd> poll_fds;
+    shmFramePublisher* frame_publisher;
+    unsigned stream_readers;
+    uint32_t periods_read;
+    int64_t period_timestamp_us;
+    bool synthetic;
+    int64_t synthetic_start_us;  // Media clock time of the first synthetic sample
+
+    bool openInput(alsaInput& input);
+    void closeInputs();
+    bool buildRoutes();
+    void startPreparedInputs();
+    void alignInputs(snd_pcm_sframes_t tolerance);
+    void setMixerControls(snd_pcm_t* handle);
+    snd_pcm_uframes_t framesToRead(const alsaInput& input) const;
+    int readInput(alsaInput& input, snd_pcm_uframes_t count);
+    bool resampleInput(alsaInput& input, int frames_read, float* const* planes);
+    int readSyntheticFrames(char* outbuffer, int outFrames);
 };
 
 } // namespace alsa_rtsp
\ No newline at end of file
@@ -2,27 +2,45 @@
 
 #include <liveMedia.hh>
 #include "alsa_capture.h"
+#include "audio_level.h"
+#include "capture_watchdog.h"
+#include "stream_sizer.h"
 
 namespace alsa_rtsp {
 
 class alsaPcmFramedSource : public FramedSource {
 public:
-    static alsaPcmFramedSource* createNew(UsageEnvironment& env, alsaCapture* capture);
+    // sizer may be null
+    static alsaPcmFramedSource* createNew(UsageEnvironment& env, alsaCapture* capture, streamSizer* sizer);
 
 protected:
-    alsaPcmFramedSource(UsageEnvironment& env, alsaCapture* capture);
+    alsaPcmFramedSource(UsageEnvironment& env, alsaCapture* capture, streamSizer* sizer);
     ~alsaPcmFramedSource();
 
 private:
     void doGetNextFrame() override;
+    static void retryGetNextFrame(void* clientData);
+    static void deliverSilence(void* clientData);
+    void bridgeStall(unsigned retryDelayUs);
+    void deliverPeriods(int frames, unsigned periods);
+    bool deferToCaptureTime();
 
     alsaCapture* fCapture;
+    streamSizer* fSizer;
     char* fBuffer;
     struct timeval fInitialTime;
     unsigned long long fCurTimestamp;
-
-    // RTP timing constants
-    static const unsigned int TIMESTAMP_INCREMENT = 1800;  // (90000/16000)*320 or 90000/50
+    int64_t fClockStartUs;  // Media clock time of timestamp 0
+    captureWatchdog fWatchdog;
+    silenceDetector fSilenceDetector;
+    int64_t fLastPeriodUs;        // Media clock time the last period came from the capture
+    unsigned fBridgedPeriods;     // Periods of silence sent since then
+    int64_t fCoveredUntilUs;      // Capture time the periods sent so far reach, or 0 before the first
+
+    // RTP timing, derived from the capture's period size
+    unsigned int fPeriodDurationUs;
+    unsigned int fTimestampIncrement;  // 90 kHz ticks per period
+    int fPollTimeoutMs;                // Two periods
 };
 
 } // namespace alsa_rtsp
\ No newline at end of file
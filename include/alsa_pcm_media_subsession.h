@@ -2,6 +2,9 @@
 
 #include <liveMedia.hh>
 #include "alsa_capture.h"
+#include "rtcp_feedback_groupsock.h"
+#include "rtx_groupsock.h"
+#include "stream_sizer.h"
 
 namespace alsa_rtsp {
 
@@ -17,8 +20,21 @@ protected:
     RTPSink* createNewRTPSink(Groupsock* rtpGroupsock, unsigned char rtpPayloadTypeIfDynamic, FramedSource* inputSource) override;
     char const* getAuxSDPLine(RTPSink* rtpSink, FramedSource* inputSource) override;
     void deleteStream(unsigned clientSessionId, void*& streamToken) override;
+    char const* sdpLines(int addressFamily) override;
+    Groupsock* createGroupsock(struct sockaddr_storage const& addr, Port port) override;
 private:
+    static void onRtcpFeedback(void* clientData, rtcpFeedbackGroupsock::FeedbackType type, u_int32_t mediaSsrc,
+                               u_int16_t lostSeq, unsigned sessionId);
+    static int64_t captureTimeUs(void* clientData);
+
     alsaCapture* fCapture;
+    streamSizer fSizer;
+    rtxGroupsock* fRtpGroupsock;     // Live stream's, or NULL once its stream is deleted
+    rtxGroupsock* fNewRtpGroupsock;  // Created, waiting for its RTCP groupsock to open
+    bool fSdpHasSsrcGroup;           // fSDPLines groups the live stream's SSRC with its RTX's...
+    u_int32_t fSdpMediaSsrc;         // ...this one
+    unsigned char fSrtpMasterKey[SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH];
+    bool fSrtpEnabled;
 };
 
 } // namespace alsa_rtsp
\ No newline at end of file
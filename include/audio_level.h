@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+
+namespace alsa_rtsp {
+
+// Level of one period of audio, in dB relative to full scale
+struct audioLevel {
+    float rmsDbfs;
+    float peakDbfs;
+};
+
+// Measure RMS and peak level of big-endian signed 16-bit samples (the L16 wire format).
+// Uses NEON or SSE2 when available, with a scalar fallback.
+audioLevel measureAudioLevel(const char* samples, size_t numSamples);
+
+// Decides which periods to transmit. Periods stay "active" while the RMS level is
+// above the threshold, plus a hangover of a few periods so word endings aren't clipped.
+class silenceDetector {
+public:
+    silenceDetector(float thresholdDbfs, unsigned hangoverPeriods);
+
+    // Returns true if the period should be sent, false if it can be suppressed
+    bool update(const audioLevel& level);
+    bool isSilent() const { return silent; }
+
+private:
+    float threshold_dbfs;
+    unsigned hangover_periods;
+    unsigned quiet_periods;
+    bool silent;
+};
+
+} // namespace alsa_rtsp
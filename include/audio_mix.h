@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+
+namespace alsa_rtsp {
+
+// Capture formats we accept from a device: native-endian, interleaved.
+// S24 is 24-bit audio in the low bytes of a 32-bit container, as ALSA stores it.
+enum sampleFormat {
+    SAMPLE_FORMAT_S16,
+    SAMPLE_FORMAT_S24,
+    SAMPLE_FORMAT_S32
+};
+
+const unsigned MAX_DEVICE_CHANNELS = 8;
+
+size_t sampleFormatBytes(sampleFormat format);
+const char* sampleFormatName(sampleFormat format);
+
+// Splits one interleaved period into per-channel float planes in [-1, 1).
+// Every format/channel-count pair is its own specialization; nullptr if unsupported.
+typedef void (*deinterleaveFunc)(const void* in, size_t frames, float* const* planes);
+deinterleaveFunc getDeinterleaver(sampleFormat format, unsigned channels);
+
+// acc[i] += in[i] * gain. Uses NEON or SSE when available, with a scalar fallback.
+void mixWithGain(float* acc, const float* in, float gain, size_t count);
+
+// Interleaves float planes into saturated big-endian signed 16-bit samples (the L16 wire format)
+void interleaveToS16BE(const float* const* planes, unsigned channels, size_t frames, char* out);
+
+} // namespace alsa_rtsp
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace alsa_rtsp {
+
+// Windowed-sinc polyphase resampler over float planes. The conversion ratio can be
+// trimmed continuously, so a device whose crystal drifts can be locked to
+// CLOCK_MONOTONIC (the clock V4L2 stamps video frames with).
+class polyphaseResampler {
+public:
+    polyphaseResampler(unsigned int inRate, unsigned int outRate, unsigned int channels);
+
+    // Input frames that still have to be pushed before pull() can produce outFrames
+    size_t inputFramesNeeded(size_t outFrames) const;
+    void push(const float* const* planes, size_t frames);
+    // Produces exactly outFrames, or nothing if not enough input has been pushed
+    bool pull(float* const* planes, size_t outFrames);
+
+    // Steers the ratio so output sample time keeps pace with the monotonic clock.
+    // Call after push() with the capture time of the newest frame pushed.
+    void trackClock(int64_t newestInputUs);
+    // After a gap in the input (overrun, restart): re-anchor, keeping the learned drift
+    void restartClock() { clock_started = false; }
+    double getAdjustPpm() const { return adjust_ppm; }
+    double getClockErrorMs() const { return clock_error_ms; }
+    // Input frames pushed that no output has stepped past yet
+    double pendingInputFrames() const { return buffered - position / 4294967296.0; }
+
+    unsigned int getTaps() const { return taps; }
+    // Measured response of the filter, for the startup log
+    float passbandRippleDb() const;
+    float stopbandAttenuationDb() const;
+
+private:
+    unsigned int in_rate;
+    unsigned int out_rate;
+    unsigned int num_channels;
+    unsigned int taps;
+    unsigned int phases;
+    float cutoff;                    // Cycles per input sample
+    std::vector<float> coefficients; // phases + 1 rows of taps, for interpolating between phases
+    std::vector<std::vector<float>> history;
+    size_t buffered;
+    uint64_t position;               // Input position of the next output, 32.32 fixed point
+    double nominal_step;             // Input frames per output frame
+    uint64_t step;
+
+    bool clock_started;
+    double clock_origin_us;
+    uint64_t pushed_frames;
+    uint64_t dropped_frames;         // Consumed and discarded from the front of history
+    uint64_t produced_frames;
+    double clock_integral;
+    double adjust_ppm;
+    double clock_error_ms;
+
+    float responseDb(float frequency) const;
+};
+
+} // namespace alsa_rtsp
@@ -0,0 +1,29 @@
+#ifndef AV_SYNC_MARKER_H
+#define AV_SYNC_MARKER_H
+
+#include "nal_unit.h"
+#include <cstddef>
+#include <cstdint>
+
+// Sync markers for the A/V self-check (see avSyncMonitor). Marker instants fall
+// every AV_SYNC_MARKER_INTERVAL_MS of capture time on the media clock. At each
+// one, the synthetic audio starts a beep. The video gets a marker SEI, its
+// "flash frame", in front of the first picture captured at or after that instant.
+
+void enableAvSyncMarkers();
+bool avSyncMarkersEnabled();
+
+// Index of the last marker instant at or before captureMicros, and its time
+int64_t avSyncMarkerIndex(int64_t captureMicros);
+int64_t avSyncMarkerTimeUs(int64_t index);
+
+// True while the beep that starts at a marker instant sounds
+bool avSyncBeepActive(int64_t captureMicros);
+
+// A user_data_unregistered SEI NAL unit carrying the marker index and how long
+// after the marker instant the picture was captured. Returns its size, or 0 if
+// maxSize is too small.
+size_t buildAvSyncMarkerNal(VideoCodec codec, int64_t index, uint32_t latenessUs, uint8_t* out, size_t maxSize);
+bool parseAvSyncMarkerNal(VideoCodec codec, const uint8_t* nal, size_t size, int64_t& index, uint32_t& latenessUs);
+
+#endif // AV_SYNC_MARKER_H
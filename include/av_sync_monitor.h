@@ -0,0 +1,63 @@
+#ifndef AV_SYNC_MONITOR_H
+#define AV_SYNC_MONITOR_H
+
+#include <liveMedia.hh>
+#include "nal_unit.h"
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Receives the loopback stream of a simulation run and measures A/V sync the way
+// a player would see it. The sync markers (av_sync_marker.h) are found in the
+// received RTP: the audio beep onsets and the video marker SEIs. Their RTP
+// timestamps are mapped back to presentation times through the sending sink,
+// in place of RTCP sender reports, because live555 times those on the real
+// clock. Each video marker is paired with the nearest beep. The offset is
+// audio minus video, so a positive value means the audio plays late.
+// Everything a track receives also goes into a digest, so that two runs can be
+// compared packet for packet.
+class avSyncMonitor {
+public:
+    explicit avSyncMonitor(UsageEnvironment& env);
+    ~avSyncMonitor();
+
+    // Listens on 127.0.0.1:port for the RTP of the track sink sends. Call before
+    // the stream starts.
+    bool addTrack(unsigned short port, RTPSink* sink);
+
+    // Logs the offset distribution, every offset and each track's digest; false
+    // if the offsets are outside the thresholds or nothing was measured
+    bool report();
+
+private:
+    struct track {
+        avSyncMonitor* monitor;
+        int socket;
+        RTPSink* sink;
+        bool video;
+        VideoCodec codec;
+        unsigned channels;
+        uint32_t frame_timestamp;      // Audio: RTP timestamp of the frame being received
+        size_t frame_bytes;            // Audio: payload received for it so far
+        bool have_frame;
+        bool in_beep;
+        unsigned quiet_samples;
+        unsigned packets;              // Everything received, RTX and FEC too
+        uint64_t digest;               // FNV-1a over those packets, in order
+    };
+
+    static void incomingHandler(void* clientData, int mask);
+    void readPackets(track& t);
+    void handleAudio(track& t, uint32_t timestamp, const uint8_t* payload, size_t size);
+    void handleVideo(track& t, uint32_t timestamp, const uint8_t* payload, size_t size);
+    int64_t presentationTimeUs(const track& t, uint32_t timestamp) const;
+    void matchMarkers();
+
+    UsageEnvironment& env;
+    std::vector<track*> tracks;
+    std::deque<int64_t> audio_onsets;   // Presentation times, in microseconds
+    std::deque<int64_t> video_markers;  // Presentation times of the marker instants
+    std::vector<double> offsets_ms;     // In marker order
+};
+
+#endif // AV_SYNC_MONITOR_H
@@ -0,0 +1,65 @@
+#ifndef BANDWIDTH_BUDGET_H
+#define BANDWIDTH_BUDGET_H
+
+#include <UsageEnvironment.hh>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+
+// Keeps the server's egress within the uplink budget. Every client receives the
+// same RTP stream (reuseFirstSource), so egress is the stream's measured bitrate
+// (the "rtp.sent_bytes" counter) times the number of admitted clients. A new
+// client is only admitted while one more stream still fits; beyond that each
+// client's allowance shrinks to an equal share of the budget, never above the
+// per-client cap.
+// Runs on the event loop thread only.
+class bandwidthBudget {
+public:
+    bandwidthBudget(UsageEnvironment& env, unsigned budgetBitsPerSecond, unsigned clientCapBitsPerSecond,
+                    unsigned videoBitsPerSecond, unsigned audioBitsPerSecond);
+    ~bandwidthBudget();
+
+    // A new client asks for the stream; false means it doesn't fit
+    bool admitClient();
+    void releaseClient();
+
+    // What one client may receive right now, and the part of it left for video
+    unsigned clientAllowance() const { return allowance; }
+    unsigned videoAllowance() const { return allowance > audio_bitrate ? allowance - audio_bitrate : 0; }
+
+    // Called whenever the allowance changes
+    void setAllowanceListener(std::function<void(unsigned)> listener) { allowance_listener = listener; }
+
+private:
+    static void sampleTask(void* clientData);
+    void sample();
+    void updateAllowance();
+
+    UsageEnvironment& env;
+    unsigned budget;
+    unsigned client_cap;
+    unsigned nominal_bitrate;   // Until there is a stream to measure
+    unsigned audio_bitrate;
+    unsigned clients;
+    unsigned allowance;
+    double stream_bitrate;      // Measured, smoothed
+    double last_sent_bytes;
+    std::chrono::steady_clock::time_point last_sample;
+    TaskToken sample_task;
+    std::function<void(unsigned)> allowance_listener;
+};
+
+// Token bucket for one stream: refills at the allowed rate and holds at most
+// burstMs worth of bytes. A forced consume (keyframes) may leave it in debt.
+class tokenBucket {
+public:
+    tokenBucket();
+
+    bool consume(size_t bytes, unsigned bitsPerSecond, unsigned burstMs, bool force);
+
+private:
+    double tokens;  // Bytes
+    std::chrono::steady_clock::time_point last_refill;
+};
+
+#endif // BANDWIDTH_BUDGET_H
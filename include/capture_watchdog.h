@@ -0,0 +1,43 @@
+#ifndef CAPTURE_WATCHDOG_H
+#define CAPTURE_WATCHDOG_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+
+// Detects capture stalls and recovers the device on a background thread, so the
+// event loop can keep connected clients alive (holding video, sending silence)
+// while the device is being reopened. Recovery times are exported as metrics.
+class captureWatchdog {
+public:
+    captureWatchdog(const std::string& name, unsigned stallTimeoutMs, std::function<bool()> recoverFn);
+    ~captureWatchdog();
+
+    // Called by the framed source for every good frame / every missed one
+    void reportFrame();
+    void reportStall();
+
+    // While true the device belongs to the recovery thread and must not be touched
+    bool isRecovering() const { return recovering.load(); }
+    bool isStalled() const { return stalled; }
+
+private:
+    void startRecovery();
+    void runRecovery();
+
+    std::string watchdog_name;
+    std::chrono::milliseconds stall_timeout;
+    std::function<bool()> recover_fn;
+    std::thread recovery_thread;
+    std::atomic<bool> recovering;
+
+    bool stalled;
+    std::chrono::steady_clock::time_point last_frame_time;
+    std::chrono::steady_clock::time_point stall_start_time;
+    unsigned recovery_count;
+    double total_recovery_ms;
+};
+
+#endif // CAPTURE_WATCHDOG_H
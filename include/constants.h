@@ -2,7 +2,8 @@
 #define CONSTANTS_H
 
 // Video settings (V4L2)
-#define VIDEO_DEVICE "/dev/video0"
+#define VIDEO_DEVICE "/dev/video0"     // A regular file of Annex B NAL units is replayed instead
+#define VIDEO_CODEC "h264"              // "h264" or "hevc"; falls back to h264 if the encoder lacks HEVC; --video-codec=<name> overrides
 #define VIDEO_BUFFER_COUNT 4
 #define VIDEO_WIDTH 640
 #define VIDEO_HEIGHT 480
@@ -11,16 +12,146 @@
 #define FRAME_RATE_NUMERATOR 1
 #define FRAME_RATE_DENOMINATOR 30  // 30 fps
 #define ROTATION_DEGREES 180
+#define VIDEO_RECONFIGURE_VIA_RTSP 1  // SET_PARAMETER "video_format: <W>x<H>@<fps>" switches the format; any session may
+#define VIDEO_POLL_TIMEOUT_MS 10   // Longest the event loop blocks in one wait for a frame
+#define VIDEO_GAP_TIMEOUT_MS 100   // Three frame intervals; a frame this late is a gap in the video
+#define VIDEO_STALL_TIMEOUT_MS 200 // No frames for this long triggers device recovery
+// Drop non-reference frames, and then skip to the next IDR, once the send path is this far
+// behind; for a single client, once its receiver reports are this far behind what it was sent
+#define VIDEO_DROP_LAG_MS 100
+#define VIDEO_SKIP_LAG_MS 300
+// Content-adaptive GOP and bitrate, steered by the sizes of the encoded frames
+#define VIDEO_ADAPTIVE_RATE_ENABLED 1
+#define VIDEO_MAX_GOP_SIZE 120          // Longest GOP static scenes get; bounds how long a new viewer waits for an IDR
+#define VIDEO_MIN_BITRATE 500000        // Static scenes
+#define VIDEO_MAX_BITRATE 2000000       // Busy scenes
+#define ADAPTIVE_STATIC_ACTIVITY 0.05   // Average P-frame size relative to a keyframe that counts as static...
+#define ADAPTIVE_BUSY_ACTIVITY 0.25     // ...and as busy
+#define ADAPTIVE_RELAX_INTERVAL_MS 5000 // Minimum time between steps towards a longer GOP or lower bitrate
+#define KEYFRAME_MIN_INTERVAL_MS 500  // At most one forced keyframe per interval, whatever the number of PLI/FIR senders
+#define SPS_PPS_CACHE_DIR "/var/tmp/avs_rtsp_server"
 
 // Audio settings (ALSA)
-#define AUDIO_DEVICE "plughw:2,0"
+#define AUDIO_DEVICE "plughw:2,0"        // Comma-separated list captures several devices as one stream
+#define AUDIO_SYNTHETIC_DEVICE "synthetic"  // As the device: a test tone instead of a capture device
+#define AUDIO_SYNTHETIC_TONE_HZ 1000
+#define AUDIO_DEVICE_CHANNELS 1           // Channels opened on each device (1-8, S16/S24/S32)
+#define AUDIO_DEVICE_GAIN_DB ""           // Per-device gain, comma-separated, e.g. "0,-3"
+#define AUDIO_CHANNEL_MAP ""              // Sources per output channel, e.g. "0.0,1.0" or "0.0+1.0"; "" = automatic
 #define AUDIO_SAMPLE_RATE 16000
-#define AUDIO_CHANNELS 1
+#define AUDIO_RESAMPLER_ENABLED 1         // Convert from the device's own rate in-process and lock it to the video clock
+#define AUDIO_RESAMPLER_TAPS 32           // Filter taps per phase at 1:1; scaled up when downsampling
+#define AUDIO_RESAMPLER_CUTOFF 0.9        // Passband edge relative to the lower Nyquist frequency
+#define AUDIO_CHANNELS 1                  // Output channels; several sources on one channel are averaged
 #define AUDIO_BIT_DEPTH 16
 #define NUM_OF_PERIODS_IN_BUFFER 64
 #define NUM_OF_FRAMES_PER_PERIOD 320
+#define AUDIO_GAP_TIMEOUT_MS 100   // Five periods; no period for this long is a gap, bridged with silence
+#define AUDIO_STALL_TIMEOUT_MS 200 // No periods for this long triggers device recovery
+
+// Silence suppression (discontinuous transmission) for the PCM stream
+#define AUDIO_DTX_ENABLED 1
+#define AUDIO_SILENCE_THRESHOLD_DBFS -55.0f
+#define AUDIO_SILENCE_HANGOVER_MS 300
 
 // RTSP server settings
 #define DEFAULT_RTSP_PORT 8554
+#define LATENCY_PROFILE "balanced"  // "ultra-low-latency", "balanced" or "lossy-network"; --latency-profile=<name> overrides
+// RTP retransmission (RFC 4588)
+#define RTX_PAYLOAD_TYPE_OFFSET 16      // RTX payload type = media payload type + offset
+#define RTX_VIDEO_HISTORY_PACKETS 1024
+#define RTX_AUDIO_HISTORY_PACKETS 128   // 2.5 s of 20 ms periods
+#define RTX_TIME_MS 1000                // Advertised rtx-time
+#define RTX_MAX_PACKETS_PER_RTCP 32     // Retransmissions one incoming RTCP packet can ask for
+
+// Pacing: each video frame's packets are spread over part of the frame interval
+// instead of leaving back-to-back. Audio is never paced, so it goes out ahead of
+// queued video.
+#define VIDEO_PACING_ENABLED 1
+#define PACING_FRAME_FRACTION 0.5       // Of the frame interval
+#define PACING_MIN_GAP_US 250           // Packets closer than this leave together
+#define PACING_MAX_GAP_US 1000          // Small frames don't need the whole window
+#define PACING_QUEUE_PACKETS 512
+
+// abs-capture-time RTP header extension (capture wall-clock time) on both streams
+#define ABS_CAPTURE_TIME_ENABLED 1
+#define RTP_EXT_ABS_CAPTURE_TIME_ID 1   // extmap ID, 1-14
+#define RTP_MAX_PACKET_SIZE 1456        // live555's default; room for the extension comes off this
+#define RTP_PACKET_OVERHEAD 40          // IPv4 + UDP + RTP headers
+
+// Buffer sizing from observed frame sizes and bitrate (see stream_sizer.h)
+#define SIZER_WINDOW_MS 2000
+#define SIZER_SHRINK_WINDOWS 30         // A minute of smaller frames before buffers shrink
+#define SIZER_HYSTERESIS 0.25           // Relative change needed to move an estimate
+#define SIZER_HEADROOM 1.5
+#define SIZER_KEYFRAME_FRAMES 10        // Expected keyframe size, in average frames, until one is seen
+#define SIZER_MIN_FRAME_BUFFER (32 * 1024)
+#define SIZER_MAX_FRAME_BUFFER (1024 * 1024)
+#define SIZER_MIN_SEND_BUFFER (32 * 1024)
+#define SIZER_MAX_SEND_BUFFER (1024 * 1024)
+#define SIZER_SEND_BUFFER_MS 100        // Of the stream, if more than two of the largest frames
+
+// Forward error correction (RFC 5109 ULPFEC) for video
+#define VIDEO_FEC_ENABLED 0
+#define FEC_PAYLOAD_TYPE_OFFSET 20      // FEC payload type = media payload type + offset
+#define FEC_RED_PAYLOAD_TYPE_OFFSET 21  // RED (RFC 2198) payload type carrying the FEC = media payload type + offset
+#define FEC_GROUP_SIZE 8                // One parity packet per 8 media packets (12.5%)
+#define FEC_KEYFRAME_GROUP_SIZE 4       // Parameter sets and keyframes: one per 4 (25%)
+
+// SRTP (AES_CM_128_HMAC_SHA1_80) for both streams, keyed via SDES in the SDP
+#define SRTP_ENABLED 0
+
+// Shared-memory export of captured frames for local consumers (see shm_frame_ring.h)
+#define SHM_EXPORT_ENABLED 0
+#define SHM_VIDEO_NAME "/avs_rtsp_video"
+#define SHM_AUDIO_NAME "/avs_rtsp_audio"
+#define SHM_VIDEO_SLOTS 32
+#define SHM_VIDEO_SLOT_BYTES (512 * 1024)  // Larger access units are skipped, not truncated
+#define SHM_AUDIO_SLOTS 256
+#define SHM_CAPTURE_INTERVAL_MS 10  // How often capture is read for export while no RTSP stream reads it
+
+// Egress admission control: a new client gets 453 Not Enough Bandwidth once one
+// more stream at the measured bitrate would exceed the budget
+#define NET_EGRESS_BUDGET_BPS 20000000  // Leave headroom for UDP/IP overhead
+#define NET_CLIENT_MAX_BITRATE 3000000  // Per-client cap, video plus audio
+#define NET_CLIENT_BURST_MS 500         // Token bucket depth for the cap
+#define NET_BUDGET_SAMPLE_MS 1000
+
+#define METRICS_LOG_INTERVAL_SEC 10
+
+// Event loop: epoll instead of live555's select() scheduler, which is capped at
+// FD_SETSIZE sockets and scans all of them every iteration
+#define SCHEDULER_USE_EPOLL 1
+#define SCHEDULER_MAX_EVENTS 256        // Ready sockets handled per loop iteration
+
+// Simulation (--simulate=<seconds>): a replayed video file and a synthetic tone
+// streamed to 127.0.0.1 on a virtual clock, with no devices or clients involved
+#define SIMULATION_CLIENT_PORT 5004     // RTP/RTCP port pairs from here, one per track
+#define SIMULATION_RANDOM_SEED 1        // SSRCs and sequence number starts repeat across runs
+
+// A/V sync self-check in simulation runs: the video carries a marker SEI and the
+// synthetic audio a beep at the same capture instants, and a loopback receiver
+// measures how far apart they play out
+#define AV_SYNC_CHECK_ENABLED 1
+#define AV_SYNC_MARKER_INTERVAL_MS 2000
+#define AV_SYNC_BEEP_MS 100
+#define AV_SYNC_MAX_AUDIO_LEAD_MS 45    // ITU-R BT.1359 detectability thresholds
+#define AV_SYNC_MAX_AUDIO_LAG_MS 125
+
+// Trace events (trace.h), built with -DENABLE_TRACING=ON; SIGUSR2 dumps them
+#define TRACE_BUFFER_EVENTS 16384       // Per thread, about 400 KB
+#define TRACE_DUMP_PATH "/tmp/avs_rtsp_trace.json"
+
+// Thread placement (thread_placement.h). CPU lists use taskset syntax ("2",
+// "2-3", "0,2"); empty lets the thread run anywhere. SCHED_FIFO priorities 1-99
+// need CAP_SYS_NICE or RLIMIT_RTPRIO; 0 keeps SCHED_OTHER.
+#define THREAD_EVENT_LOOP_CPUS ""
+#define THREAD_EVENT_LOOP_FIFO_PRIORITY 0
+#define THREAD_RECOVERY_CPUS ""         // Best kept off the event loop's CPUs
+#define THREAD_RECOVERY_FIFO_PRIORITY 0
+#define THREAD_AUX_CPUS ""
+#define THREAD_LOCK_MEMORY 0            // mlockall(); locks every thread stack too
+#define EVENT_LOOP_PROBE_MS 10          // Scheduling lateness sample period
+#define VIDEO_JITTER_WINDOW_FRAMES 300  // Frames per dequeue interval jitter sample
 
 #endif // CONSTANTS_H
\ No newline at end of file
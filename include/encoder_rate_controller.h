@@ -0,0 +1,37 @@
+#ifndef ENCODER_RATE_CONTROLLER_H
+#define ENCODER_RATE_CONTROLLER_H
+
+#include <chrono>
+#include <cstddef>
+#include "v4l2_capture.h"
+
+// Adapts the encoder's GOP length and bitrate to scene activity, judged from the
+// frames it produces: in a static scene P-frames shrink to a small fraction of a
+// keyframe, in a busy one they approach it, whatever the bitrate. Static scenes get
+// a longer GOP (never beyond VIDEO_MAX_GOP_SIZE, which bounds how long a new viewer
+// waits for an IDR) and a lower bitrate; activity tightens both again at once.
+// Runs on the event loop thread only.
+class encoderRateController {
+public:
+    explicit encoderRateController(v4l2Capture* capture);
+
+    // Called by the framed source for every frame the encoder delivers
+    void frameEncoded(size_t bytes, bool keyFrame);
+
+    // Upper bound on the bitrate from the bandwidth budget; takes effect at once
+    void setBitrateCeiling(unsigned bitsPerSecond);
+
+private:
+    void update();
+
+    v4l2Capture* capture;
+    double keyframe_bytes;     // Running averages
+    double frame_bytes;
+    unsigned gop_size;
+    unsigned bitrate;
+    unsigned wanted_bitrate;   // Before the ceiling
+    unsigned bitrate_ceiling;
+    std::chrono::steady_clock::time_point last_change;
+};
+
+#endif // ENCODER_RATE_CONTROLLER_H
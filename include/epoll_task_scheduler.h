@@ -0,0 +1,65 @@
+#ifndef EPOLL_TASK_SCHEDULER_H
+#define EPOLL_TASK_SCHEDULER_H
+
+#include <BasicUsageEnvironment.hh>
+#include <sys/epoll.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+// Drop-in replacement for BasicTaskScheduler built on epoll instead of select().
+// Each step costs O(ready sockets) rather than O(registered sockets), and there
+// is no FD_SETSIZE limit on socket numbers. Delayed tasks still live in the
+// inherited DelayQueue; a timerfd wakes epoll_wait for the next one with
+// microsecond resolution. Event triggers wake the loop through an eventfd, so
+// other threads don't wait for the next timeout.
+//
+// Readiness is level-triggered: live555 handlers read one packet or one
+// request per call and expect to be called again while data is pending.
+class epollTaskScheduler : public BasicTaskScheduler0 {
+public:
+    // Returns NULL if the kernel objects can't be created
+    static epollTaskScheduler* createNew(unsigned maxEventsPerStep = 256);
+    virtual ~epollTaskScheduler();
+
+    virtual EventTriggerId createEventTrigger(TaskFunc* eventHandlerProc);
+    virtual void deleteEventTrigger(EventTriggerId eventTriggerId);
+    virtual void triggerEvent(EventTriggerId eventTriggerId, void* clientData = NULL);
+
+protected:
+    epollTaskScheduler(int epollFd, int timerFd, int wakeFd, unsigned maxEventsPerStep);
+
+    virtual void SingleStep(unsigned maxDelayTime);
+    virtual void setBackgroundHandling(int socketNum, int conditionSet, BackgroundHandlerProc* handlerProc,
+                                       void* clientData);
+    virtual void moveSocketHandling(int oldSocketNum, int newSocketNum);
+
+private:
+    struct socketHandler {
+        int conditionSet;
+        BackgroundHandlerProc* handlerProc;
+        void* clientData;
+    };
+
+    void armTimer(int64_t delayMicros);
+    void handleTriggers();
+    void publishMetrics();
+
+    int fEpollFd;
+    int fTimerFd;
+    int fWakeFd;
+    std::vector<struct epoll_event> fEvents;
+    std::vector<socketHandler> fSocketHandlers;  // Indexed by socket number
+    unsigned fSocketCount;
+
+    std::atomic<EventTriggerId> fPendingTriggers;
+    EventTriggerId fUsedTriggers;
+    TaskFunc* fTriggerHandlers[32];
+    void* volatile fTriggerClientData[32];
+
+    uint64_t fSteps;
+    uint64_t fReadyEvents;
+    std::chrono::steady_clock::time_point fLastPublish;
+};
+
+#endif // EPOLL_TASK_SCHEDULER_H
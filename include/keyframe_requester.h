@@ -0,0 +1,34 @@
+#ifndef KEYFRAME_REQUESTER_H
+#define KEYFRAME_REQUESTER_H
+
+#include <UsageEnvironment.hh>
+#include <chrono>
+#include "v4l2_capture.h"
+
+// Funnels keyframe requests from every client (RTCP PLI/FIR) and from the
+// framed source into the encoder. Requests that arrive within minIntervalMs
+// of the last keyframe are coalesced into a single deferred request, so many
+// lossy viewers can't turn the stream into all-IDR.
+// Runs on the event loop thread only.
+class keyFrameRequester {
+public:
+    keyFrameRequester(UsageEnvironment& env, v4l2Capture* capture, unsigned minIntervalMs);
+    ~keyFrameRequester();
+
+    void request(const char* reason);
+
+    // Called by the framed source whenever an IDR goes out, requested or not
+    void keyFrameSent();
+
+private:
+    static void deferredRequest(void* clientData);
+    void forceKeyFrame(const char* reason);
+
+    UsageEnvironment& env;
+    v4l2Capture* capture;
+    std::chrono::milliseconds min_interval;
+    std::chrono::steady_clock::time_point last_keyframe_time;
+    TaskToken deferred_task;
+};
+
+#endif // KEYFRAME_REQUESTER_H
@@ -0,0 +1,22 @@
+#ifndef LATENCY_PROFILE_H
+#define LATENCY_PROFILE_H
+
+// Buffering depth and packetization, selectable at startup with
+// --latency-profile=<name>. Trades end-to-end latency against robustness:
+// shallow queues and short audio packets react faster but overrun sooner,
+// longer packets cost fewer packets (and losses) per second.
+struct latencyProfile {
+    const char* name;
+    unsigned videoBufferCount;    // V4L2 capture queue depth
+    bool videoDrainToNewest;      // Skip stale queued frames instead of sending them late
+    unsigned audioPeriodMs;       // ALSA period, also the audio RTP packet duration (ptime)
+    unsigned audioBufferPeriods;  // ALSA ring buffer size in periods (overrun headroom)
+};
+
+// nullptr if there is no profile by that name
+const latencyProfile* findLatencyProfile(const char* name);
+
+// Logs the profile and exports its buffering figures as metrics
+void reportLatencyProfile(const latencyProfile& profile);
+
+#endif // LATENCY_PROFILE_H
@@ -0,0 +1,34 @@
+#ifndef MEDIA_CLOCK_H
+#define MEDIA_CLOCK_H
+
+#include <chrono>
+#include <cstdint>
+#include <sys/time.h>
+
+// The clock the media pipeline runs on. Normally that is just the system clocks.
+// In simulation mode it is a virtual clock that moves only when
+// virtualTaskScheduler jumps to the next delayed task or when something sleeps.
+// That way hours of media play out in seconds, with the same timing every run.
+// Code whose timing affects the stream reads time through these functions.
+// CPU cost measurements and log timestamps keep using the real clocks.
+
+// Switch to the virtual clock. Call once at startup, before anything reads the clock.
+void enableVirtualClock();
+bool isVirtualClock();
+
+// Moves the virtual clock forward, never back, to the given mediaClockMicros() value
+void advanceVirtualClock(int64_t monotonicMicros);
+
+// CLOCK_MONOTONIC, in microseconds
+int64_t mediaClockMicros();
+
+// The same instant, for code that does its arithmetic in std::chrono
+std::chrono::steady_clock::time_point mediaClockNow();
+
+// Wall-clock time, as gettimeofday() would report it
+void mediaClockWallTime(struct timeval& time);
+
+// usleep(); on the virtual clock the time passes at once
+void mediaClockSleep(int64_t micros);
+
+#endif // MEDIA_CLOCK_H
@@ -0,0 +1,18 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+
+// Process-wide named metrics. Gauges hold the last value set, counters accumulate.
+// All functions are thread-safe so capture and network threads can report freely.
+void setMetricGauge(const std::string& name, double value);
+void incrementMetricCounter(const std::string& name, double delta = 1.0);
+double getMetric(const std::string& name);
+
+// Sample process CPU usage since the previous call into "process.cpu_percent"
+void updateProcessMetrics();
+
+// Write every metric as a single log line ("name=value ...")
+void logMetrics();
+
+#endif // METRICS_H
@@ -0,0 +1,113 @@
+#ifndef NAL_UNIT_H
+#define NAL_UNIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum VideoCodec {
+    VIDEO_CODEC_H264,
+    VIDEO_CODEC_HEVC
+};
+
+// Codec-independent view of the NAL unit types the server cares about
+enum NalKind {
+    NAL_KIND_VPS,
+    NAL_KIND_SPS,
+    NAL_KIND_PPS,
+    NAL_KIND_KEYFRAME,  // IDR (H.264) or IRAP picture (HEVC)
+    NAL_KIND_SLICE,     // Any other picture data
+    NAL_KIND_OTHER      // SEI, AUD, ...
+};
+
+inline unsigned nalUnitType(VideoCodec codec, uint8_t header) {
+    return codec == VIDEO_CODEC_HEVC ? (header >> 1) & 0x3F : header & 0x1F;
+}
+
+inline NalKind nalKind(VideoCodec codec, uint8_t header) {
+    unsigned type = nalUnitType(codec, header);
+    if (codec == VIDEO_CODEC_HEVC) {
+        if (type == 32) return NAL_KIND_VPS;
+        if (type == 33) return NAL_KIND_SPS;
+        if (type == 34) return NAL_KIND_PPS;
+        if (type >= 16 && type <= 21) return NAL_KIND_KEYFRAME;  // BLA, IDR, CRA
+        if (type <= 9) return NAL_KIND_SLICE;
+        return NAL_KIND_OTHER;
+    }
+    if (type == 7) return NAL_KIND_SPS;
+    if (type == 8) return NAL_KIND_PPS;
+    if (type == 5) return NAL_KIND_KEYFRAME;
+    if (type >= 1 && type <= 4) return NAL_KIND_SLICE;
+    return NAL_KIND_OTHER;
+}
+
+inline bool isKeyFrameNal(VideoCodec codec, uint8_t header) {
+    return nalKind(codec, header) == NAL_KIND_KEYFRAME;
+}
+
+// Pictures no other picture predicts from, so they can be dropped without
+// corrupting the rest of the GOP: nal_ref_idc == 0 (H.264) or a sub-layer
+// non-reference type (HEVC)
+inline bool isDisposableNal(VideoCodec codec, uint8_t header) {
+    if (nalKind(codec, header) != NAL_KIND_SLICE) return false;
+    if (codec == VIDEO_CODEC_HEVC) {
+        unsigned type = nalUnitType(codec, header);
+        return type <= 14 && (type % 2) == 0;
+    }
+    return ((header >> 5) & 0x03) == 0;
+}
+
+// Header of the NAL unit an RTP payload carries, looking through fragmentation
+// units at the fragmented one and aggregation packets at the first one
+// (RFC 6184 / RFC 7798). False if the payload is too short to tell.
+inline bool rtpPayloadNalHeader(VideoCodec codec, const uint8_t* payload, size_t size, uint8_t& header) {
+    if (size < 3) return false;
+    unsigned type = nalUnitType(codec, payload[0]);
+    if (codec == VIDEO_CODEC_HEVC) {
+        if (type == 48) {                                               // AP: 2-byte size, then the NAL unit
+            if (size < 5) return false;
+            header = payload[4];
+        } else if (type == 49) {                                        // FU: F and layer bits from the payload header
+            header = (payload[0] & 0x81) | ((payload[2] & 0x3F) << 1);
+        } else {
+            header = payload[0];
+        }
+        return true;
+    }
+    if (type == 24) {                                                   // STAP-A
+        if (size < 4) return false;
+        header = payload[3];
+    } else if (type == 28) {                                            // FU-A: NRI from the indicator
+        header = (payload[0] & 0xE0) | (payload[1] & 0x1F);
+    } else {
+        header = payload[0];
+    }
+    return true;
+}
+
+// Length of the Annex-B start code at data[offset], or 0 if there is none
+inline size_t startCodeLength(const uint8_t* data, size_t size, size_t offset) {
+    if (offset + 3 <= size && data[offset] == 0x00 && data[offset + 1] == 0x00) {
+        if (data[offset + 2] == 0x01) return 3;
+        if (offset + 4 <= size && data[offset + 2] == 0x00 && data[offset + 3] == 0x01) return 4;
+    }
+    return 0;
+}
+
+// Strip emulation prevention bytes (00 00 03) to get the raw RBSP
+inline std::vector<uint8_t> nalToRbsp(const uint8_t* nal, size_t size) {
+    std::vector<uint8_t> rbsp;
+    rbsp.reserve(size);
+    unsigned zeros = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (zeros >= 2 && nal[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nal[i] == 0x00 ? zeros + 1 : 0;
+        rbsp.push_back(nal[i]);
+    }
+    return rbsp;
+}
+
+#endif // NAL_UNIT_H
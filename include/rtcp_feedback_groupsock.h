@@ -0,0 +1,50 @@
+#ifndef RTCP_FEEDBACK_GROUPSOCK_H
+#define RTCP_FEEDBACK_GROUPSOCK_H
+
+#include <Groupsock.hh>
+#include "srtp_context.h"
+
+// RTCP groupsock that picks generic NACKs and payload-specific feedback
+// (RFC 4585 / RFC 5104) out of incoming compound packets before RTCPInstance sees them. live555's
+// RTCPInstance only handles SR/RR/SDES/BYE/APP, and keeps their report blocks to
+// itself, so those are passed on from here too.
+// Feedback makes the server send, so it is only taken from a client's own RTCP
+// address and port (one of this groupsock's destinations), and one packet asks
+// for at most RTX_MAX_PACKETS_PER_RTCP retransmissions.
+// With an SRTP master key, outgoing RTCP is sent as SRTCP and incoming SRTCP
+// is authenticated and decrypted before anyone else reads it.
+// Only UDP transport passes through here; RTP-over-RTSP (TCP) RTCP does not.
+class rtcpFeedbackGroupsock : public Groupsock {
+public:
+    enum FeedbackType {
+        FEEDBACK_NACK, // One lost packet, reported once per sequence number
+        FEEDBACK_PLI,  // Picture Loss Indication
+        FEEDBACK_FIR,  // Full Intra Request
+        FEEDBACK_RECEIVER_REPORT  // A report block of an SR or RR
+    };
+    // mediaSsrc is the stream the feedback is about. seq is the lost packet for
+    // FEEDBACK_NACK, the highest one received for FEEDBACK_RECEIVER_REPORT, and
+    // otherwise 0. sessionId is the client's, as in addDestination().
+    typedef void (feedbackHandler)(void* clientData, FeedbackType type, u_int32_t mediaSsrc, u_int16_t seq,
+                                   unsigned sessionId);
+
+    // srtpMasterKey (key || salt) may be NULL
+    rtcpFeedbackGroupsock(UsageEnvironment& env, struct sockaddr_storage const& groupAddr, Port port,
+                          feedbackHandler* handler, void* clientData,
+                          const unsigned char* srtpMasterKey = NULL);
+    virtual ~rtcpFeedbackGroupsock();
+
+    virtual Boolean output(UsageEnvironment& env, unsigned char* buffer, unsigned bufferSize);
+    virtual Boolean handleRead(unsigned char* buffer, unsigned bufferMaxSize, unsigned& bytesRead,
+                               struct sockaddr_storage& fromAddressAndPort);
+
+private:
+    void parseFeedback(unsigned char const* packet, unsigned size, unsigned sessionId);
+
+    feedbackHandler* fHandler;
+    void* fClientData;
+    srtpContext* fSrtp;
+    unsigned char fSrtcpPacket[1500 + SRTCP_TRAILER_LENGTH];
+};
+
+#endif // RTCP_FEEDBACK_GROUPSOCK_H
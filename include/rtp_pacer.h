@@ -0,0 +1,62 @@
+#ifndef RTP_PACER_H
+#define RTP_PACER_H
+
+#include <UsageEnvironment.hh>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "rtp_packet_history.h"
+
+// Spreads each frame's RTP packets over a fraction of the frame interval instead
+// of letting them leave back-to-back, so an IDR doesn't overrun shallow switch
+// and Wi-Fi queues. Packets belong to a frame by RTP timestamp. Once a frame is
+// complete (marker bit), everything queued must be out within the pacing window
+// that began with its first packet, and the timer releases packets evenly over
+// what is left of it. The frame interval is taken from the timestamps, so it
+// follows frame rate changes.
+// Packets are copied into fixed slots; queueing never allocates.
+// Runs on the event loop thread only.
+class rtpPacer {
+public:
+    typedef void (sendFunc)(void* clientData, const unsigned char* packet, unsigned size);
+
+    rtpPacer(UsageEnvironment& env, unsigned clockRate, unsigned capacity, sendFunc* send, void* clientData);
+    ~rtpPacer();
+
+    void enqueue(const unsigned char* packet, unsigned size);
+
+private:
+    static const unsigned SLOT_SIZE = RTP_FEC_MAX_PACKET_SIZE;  // Media or FEC packet
+
+    static void sendTask(void* clientData);
+    void sendDue();
+    void sendOldest();
+    void startFrame(uint32_t timestamp, std::chrono::steady_clock::time_point now);
+
+    UsageEnvironment& env;
+    unsigned clock_rate;
+    sendFunc* send;
+    void* client_data;
+
+    std::vector<unsigned char> slots;
+    std::vector<unsigned> sizes;
+    std::vector<std::chrono::steady_clock::time_point> queued_at;
+    unsigned capacity;
+    unsigned head;
+    unsigned count;
+    TaskToken send_task;
+
+    bool have_timestamp;
+    uint32_t frame_timestamp;
+    bool frame_complete;       // Marker seen; release what is queued
+    double frame_interval_us;  // Smoothed
+    std::chrono::steady_clock::time_point deadline;  // Queue must be empty by then
+
+    // Per-frame statistics, published when the next frame starts
+    unsigned frame_packets;
+    unsigned frame_bytes;
+    unsigned max_burst;     // Most packets released by one timer tick
+    int64_t max_delay_us;   // Longest a packet waited
+};
+
+#endif // RTP_PACER_H
@@ -0,0 +1,33 @@
+#ifndef RTP_PACKET_HISTORY_H
+#define RTP_PACKET_HISTORY_H
+
+#include <cstdint>
+#include <vector>
+
+#define RTP_HISTORY_MAX_PACKET_SIZE 1500
+// A FEC packet protecting the largest media packets: RTP, RED block, FEC and level 0 headers
+#define RTP_FEC_MAX_PACKET_SIZE (27 + RTP_HISTORY_MAX_PACKET_SIZE)
+
+// Fixed-size ring of recently sent RTP packets, indexed by sequence number.
+// All slots are allocated up front so recording a packet never allocates.
+class rtpPacketHistory {
+public:
+    explicit rtpPacketHistory(unsigned capacity);  // Rounded up to a power of two
+
+    void store(const unsigned char* packet, unsigned size);
+
+    // Returns nullptr if the packet was never sent or has been overwritten
+    const unsigned char* find(uint16_t seq, unsigned& size) const;
+
+private:
+    struct slot {
+        uint16_t seq;
+        unsigned size;  // 0 while unused
+        unsigned char data[RTP_HISTORY_MAX_PACKET_SIZE];
+    };
+
+    std::vector<slot> slots;
+    unsigned index_mask;
+};
+
+#endif // RTP_PACKET_HISTORY_H
@@ -0,0 +1,18 @@
+#ifndef RTP_PAYLOAD_TYPE_H
+#define RTP_PAYLOAD_TYPE_H
+
+// RTX and FEC take the media payload type plus a configured offset. The result
+// has to stay a dynamic payload type (96-127, RFC 3551): wrapped into 0-34 it
+// would collide with static types a receiver already knows.
+static const unsigned RTP_DYNAMIC_PAYLOAD_TYPE_FIRST = 96;
+static const unsigned RTP_DYNAMIC_PAYLOAD_TYPE_LAST = 127;
+
+// False, leaving payloadType alone, if the offset leaves the dynamic range
+inline bool offsetPayloadType(unsigned mediaPayloadType, unsigned offset, unsigned& payloadType) {
+    unsigned result = mediaPayloadType + offset;
+    if (result < RTP_DYNAMIC_PAYLOAD_TYPE_FIRST || result > RTP_DYNAMIC_PAYLOAD_TYPE_LAST) return false;
+    payloadType = result;
+    return true;
+}
+
+#endif // RTP_PAYLOAD_TYPE_H
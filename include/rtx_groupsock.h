@@ -0,0 +1,135 @@
+#ifndef RTX_GROUPSOCK_H
+#define RTX_GROUPSOCK_H
+
+#include <Groupsock.hh>
+#include "rtp_packet_history.h"
+#include "ulpfec_encoder.h"
+#include "srtp_context.h"
+#include "rtp_pacer.h"
+#include "abs_capture_time.h"
+#include "nal_unit.h"
+#include <map>
+#include <vector>
+
+// RTP groupsock that remembers what it sent and can resend it as RTX
+// (RFC 4588, SSRC-multiplexed on the same port). With reuseFirstSource
+// every client is fed from one groupsock, so the history is shared rather
+// than kept per viewer. Optionally also sends ULPFEC for what goes out, and
+// SRTP-protects everything on the wire (the history stays in the clear).
+// Video can be held back for one client at a time: a client whose receiver
+// reports fall behind what was sent to it stops getting frames it can do
+// without, or everything up to the next keyframe, while the others get all of it.
+class rtxGroupsock : public Groupsock {
+public:
+    // Takes ownership of fec, which may be NULL. srtpMasterKey (key || salt) may be NULL.
+    rtxGroupsock(UsageEnvironment& env, struct sockaddr_storage const& groupAddr, Port port,
+                 unsigned historyPackets, ulpfecEncoder* fec = NULL,
+                 const unsigned char* srtpMasterKey = NULL);
+    virtual ~rtxGroupsock();
+
+    virtual Boolean output(UsageEnvironment& env, unsigned char* buffer, unsigned bufferSize);
+
+    // Resends seq to the RTP address and port of the client with sessionId,
+    // provided it is already a destination and mediaSsrc is the sink's
+    void retransmit(u_int16_t seq, u_int32_t mediaSsrc, unsigned sessionId);
+
+    // Spread each frame's packets out in time (see rtp_pacer.h). Retransmissions
+    // aren't paced; they answer a loss that has already happened.
+    void enablePacing(unsigned clockRate);
+
+    // Returns the CLOCK_MONOTONIC capture time, in microseconds, of the frame
+    // being sent, or a negative value if unknown
+    typedef int64_t (captureTimeFunc)(void* clientData);
+
+    // Add the abs-capture-time extension to the first packet of each frame
+    // (RTP timestamp). History, FEC and the pacer see the extended packet.
+    void enableAbsCaptureTime(unsigned char extensionId, captureTimeFunc* captureTime, void* clientData);
+
+    // Decide per client, from its receiver reports, whether to send it every
+    // packet, only those of frames other frames predict from, or nothing up to the
+    // next keyframe (VIDEO_DROP_LAG_MS / VIDEO_SKIP_LAG_MS behind). Only clients
+    // this groupsock sends to over UDP are covered; RTP-over-RTSP is not.
+    void enableClientBackpressure(VideoCodec codec);
+    // A report block from the client with sessionId. Returns true when the client
+    // has just started skipping to the next keyframe, which the caller should ask
+    // the encoder for.
+    bool receiverReport(u_int32_t mediaSsrc, u_int16_t highestSeq, unsigned sessionId);
+
+    // The sink's SSRC, once created: NACKs must name it, and the SDP groups it with the FEC's
+    void setMediaSsrc(u_int32_t ssrc);
+    // False before setMediaSsrc()
+    bool rtxSsrcGroup(u_int32_t& mediaSsrc, u_int32_t& rtxSsrc) const;
+    // False without FEC or before setMediaSsrc()
+    bool fecSsrcGroup(u_int32_t& mediaSsrc, u_int32_t& fecSsrc) const;
+
+private:
+    Boolean sendPacket(UsageEnvironment& env, const unsigned char* packet, unsigned size);
+    Boolean sendOrQueue(UsageEnvironment& env, const unsigned char* packet, unsigned size);
+    static void sendPaced(void* clientData, const unsigned char* packet, unsigned size);
+    Boolean sendToClients(UsageEnvironment& env, const unsigned char* packet, unsigned size,
+                          const unsigned char* wire, unsigned wireSize);
+    void pruneClients();
+
+    enum clientPolicy {
+        SEND_ALL,
+        DROP_DISPOSABLE,   // Pictures nothing predicts from are withheld
+        SKIP_TO_KEYFRAME   // Everything is withheld up to the next keyframe or parameter sets
+    };
+    struct clientState {
+        clientPolicy policy;
+        bool haveSent;
+        u_int16_t lastSentSeq;
+        bool haveBaseline;
+        int64_t baselineUs;    // Smallest backlog reported: the delay of the reports themselves
+        bool resumed;          // Reports from before resumeSeq still describe the skipped backlog
+        u_int16_t resumeSeq;
+        std::vector<bool> withheld;  // By sequence number, like fSent: never sent, so never retransmitted
+    };
+    struct sendRecord {
+        bool valid;
+        u_int16_t seq;
+        int64_t sentUs;  // mediaClockMicros()
+    };
+
+    rtpPacketHistory fHistory;
+    unsigned fHistoryPackets;
+    bool fClientBackpressure;
+    VideoCodec fCodec;
+    std::vector<sendRecord> fSent;  // Media packets by sequence number, a power of two of them
+    std::map<unsigned, clientState> fClients;  // By session ID
+    ulpfecEncoder* fFec;
+    srtpContext* fSrtp;
+    rtpPacer* fPacer;
+    captureTimeFunc* fCaptureTime;
+    void* fCaptureTimeClientData;
+    unsigned char fAbsCaptureTimeId;
+    bool fHaveLastTimestamp;
+    u_int32_t fLastTimestamp;  // Of the last packet that carried the extension
+    u_int32_t fRtxSsrc;
+    u_int16_t fRtxSeq;
+    bool fHaveMediaSsrc;
+    u_int32_t fMediaSsrc;
+    unsigned char fRtxPacket[RTP_HISTORY_MAX_PACKET_SIZE + 2 + SRTP_AUTH_TAG_LENGTH];  // + original sequence number
+    unsigned char fExtendedPacket[RTP_HISTORY_MAX_PACKET_SIZE];
+    unsigned char fSrtpPacket[RTP_FEC_MAX_PACKET_SIZE + SRTP_AUTH_TAG_LENGTH];  // Big enough for FEC too
+};
+
+// Advertise RTX for the (single) payload type of an SDP media section:
+// adds the RTX payload type to the m= line and appends the rtcp-fb nack,
+// rtpmap and fmtp lines, plus PLI/FIR feedback if keyFrameFeedback is set.
+// Returns a new[] string.
+char* addRtxToSdpLines(char const* sdpLines, unsigned clockRate, bool keyFrameFeedback);
+
+// Same for the ULPFEC stream: the RED and ULPFEC payload types on the m= line,
+// their rtpmaps, and the RED fmtp naming ULPFEC as what it carries
+char* addFecToSdpLines(char const* sdpLines, unsigned clockRate);
+
+// Groups a live stream's media and RTX SSRCs as FID (RFC 4588 section 8.1),
+// unless addRtxToSdpLines() couldn't offer RTX. Returns a new[] string.
+char* addRtxSsrcGroupToSdpLines(char const* sdpLines, u_int32_t mediaSsrc, u_int32_t rtxSsrc);
+
+// Groups a live stream's media and FEC SSRCs as FEC-FR (RFC 5956), so receivers
+// know which stream the FEC repairs. Returns a new[] string.
+char* addFecSsrcGroupToSdpLines(char const* sdpLines, u_int32_t mediaSsrc, u_int32_t fecSsrc);
+
+#endif // RTX_GROUPSOCK_H
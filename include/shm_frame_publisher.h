@@ -0,0 +1,29 @@
+#ifndef SHM_FRAME_PUBLISHER_H
+#define SHM_FRAME_PUBLISHER_H
+
+#include <string>
+#include <sys/time.h>
+#include "shm_frame_ring.h"
+
+// Writer side of a shared-memory frame ring (see shm_frame_ring.h). Captured
+// frames are copied in once; every local reader then maps them directly.
+class shmFramePublisher {
+public:
+    shmFramePublisher(const char* name, shmMediaType mediaType, uint32_t slotCount, uint32_t slotSize,
+                      uint32_t sampleRate = 0, uint32_t channels = 0);
+    ~shmFramePublisher();
+
+    bool isOpen() const { return ring != nullptr; }
+
+    // Frames larger than a slot are dropped (and counted) rather than truncated
+    void publish(const void* data, size_t size, uint32_t captureSequence, int64_t timestampUs, uint32_t flags);
+
+private:
+    std::string shm_name;
+    void* ring;
+    size_t ring_size;
+    std::string published_metric;
+    std::string oversized_metric;
+};
+
+#endif // SHM_FRAME_PUBLISHER_H
@@ -0,0 +1,203 @@
+#ifndef SHM_FRAME_RING_H
+#define SHM_FRAME_RING_H
+
+// Layout of the shared-memory frame rings the server publishes captured media
+// into, plus a reader for local consumers. Self-contained on purpose: analytics
+// processes only need this header (and -lrt on older glibc).
+//
+// One writer (the server), any number of readers. Readers map the ring
+// read-only and never block the writer or each other: every slot is guarded
+// by a sequence counter that is odd while the slot is being written, so a
+// reader detects a torn or overwritten slot and skips it rather than waiting.
+//
+//   shmFrameReader reader;
+//   reader.open("/avs_rtsp_video");
+//   shmFrameView frame;
+//   while (running) {
+//       if (!reader.peek(frame)) { usleep(5000); continue; }
+//       analyze(frame.data, frame.size);      // zero copy, straight from the ring
+//       if (!reader.stillValid(frame)) { ... } // writer lapped us mid-read; discard results
+//       reader.advance();
+//   }
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_FRAME_RING_MAGIC 0x41565352u  // "AVSR"
+#define SHM_FRAME_RING_VERSION 1u
+
+enum shmMediaType : uint32_t {
+    SHM_MEDIA_H264 = 0,  // Annex B access units, start codes included
+    SHM_MEDIA_HEVC = 1,
+    SHM_MEDIA_PCM_S16BE = 2  // Interleaved big-endian periods, as captured
+};
+
+enum shmFrameFlags : uint32_t {
+    SHM_FRAME_KEYFRAME = 1u << 0
+};
+
+struct shmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mediaType;     // shmMediaType
+    uint32_t slotCount;
+    uint32_t slotSize;      // Payload bytes per slot
+    uint32_t sampleRate;    // PCM only
+    uint32_t channels;      // PCM only
+    uint32_t reserved;
+    std::atomic<uint32_t> published;  // Frames written so far (wraps)
+};
+
+struct shmSlotHeader {
+    std::atomic<uint32_t> seq;  // Odd while the writer is inside this slot
+    uint32_t frameNumber;       // Value of "published" when this frame was written
+    uint32_t captureSequence;   // V4L2 buffer sequence / ALSA period counter
+    uint32_t flags;             // shmFrameFlags
+    uint32_t size;
+    uint32_t reserved;
+    int64_t timestampUs;        // CLOCK_MONOTONIC capture time
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "atomics must be plain words in shared memory");
+static_assert(sizeof(shmRingHeader) <= 64, "ring header must fit its cache line");
+
+inline size_t shmSlotStride(uint32_t slotSize) {
+    return (sizeof(shmSlotHeader) + slotSize + 63) & ~size_t(63);
+}
+
+inline size_t shmRingBytes(uint32_t slotCount, uint32_t slotSize) {
+    return 64 + size_t(slotCount) * shmSlotStride(slotSize);
+}
+
+inline shmSlotHeader* shmSlot(void* ring, uint32_t index) {
+    const shmRingHeader* header = static_cast<const shmRingHeader*>(ring);
+    return reinterpret_cast<shmSlotHeader*>(static_cast<uint8_t*>(ring) + 64 +
+                                            size_t(index % header->slotCount) * shmSlotStride(header->slotSize));
+}
+
+inline uint8_t* shmSlotPayload(shmSlotHeader* slot) {
+    return reinterpret_cast<uint8_t*>(slot) + sizeof(shmSlotHeader);
+}
+
+struct shmFrameView {
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t frameNumber;
+    uint32_t captureSequence;
+    uint32_t flags;
+    int64_t timestampUs;
+    uint32_t seq;  // Slot sequence the view was taken at
+};
+
+class shmFrameReader {
+public:
+    shmFrameReader() : ring(nullptr), ringSize(0), next(0), lost(0) {}
+    ~shmFrameReader() { close(); }
+
+    // Starts at the newest frame
+    bool open(const char* name) {
+        close();
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(shmRingHeader)) {
+            ::close(fd);
+            return false;
+        }
+        ringSize = st.st_size;
+        ring = mmap(nullptr, ringSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (ring == MAP_FAILED) {
+            ring = nullptr;
+            return false;
+        }
+        const shmRingHeader* h = header();
+        if (h->magic != SHM_FRAME_RING_MAGIC || h->version != SHM_FRAME_RING_VERSION || h->slotCount == 0 ||
+            shmRingBytes(h->slotCount, h->slotSize) > ringSize) {
+            close();
+            return false;
+        }
+        uint32_t published = h->published.load(std::memory_order_acquire);
+        next = published == 0 ? 0 : published - 1;
+        return true;
+    }
+
+    void close() {
+        if (ring != nullptr) munmap(ring, ringSize);
+        ring = nullptr;
+    }
+
+    const shmRingHeader* header() const { return static_cast<const shmRingHeader*>(ring); }
+
+    // Frames the writer overwrote before we got to them
+    uint64_t lostFrames() const { return lost; }
+
+    // Looks at the next unread frame without copying. False if there is none yet.
+    bool peek(shmFrameView& view) {
+        for (;;) {
+            uint32_t published = header()->published.load(std::memory_order_acquire);
+            if ((int32_t)(published - next) <= 0) return false;
+            if (published - next > header()->slotCount) {
+                // Lapped: jump to the oldest frame still in the ring
+                lost += published - next - header()->slotCount;
+                next = published - header()->slotCount;
+            }
+
+            const shmSlotHeader* slot = shmSlot(ring, next);
+            uint32_t seq = slot->seq.load(std::memory_order_acquire);
+            if ((seq & 1) == 0 && slot->frameNumber == next) {
+                view.data = shmSlotPayload(const_cast<shmSlotHeader*>(slot));
+                view.size = slot->size;
+                view.frameNumber = slot->frameNumber;
+                view.captureSequence = slot->captureSequence;
+                view.flags = slot->flags;
+                view.timestampUs = slot->timestampUs;
+                view.seq = seq;
+                if (stillValid(view)) return true;
+            }
+            // Being rewritten right now: that frame is gone
+            ++lost;
+            ++next;
+        }
+    }
+
+    // True if the slot behind a view hasn't been touched since peek()
+    bool stillValid(const shmFrameView& view) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const shmSlotHeader* slot = shmSlot(ring, view.frameNumber);
+        return slot->seq.load(std::memory_order_relaxed) == view.seq;
+    }
+
+    void advance() { ++next; }
+
+    // Copying alternative to peek/stillValid/advance
+    bool read(uint8_t* out, uint32_t capacity, shmFrameView& view) {
+        while (peek(view)) {
+            uint32_t size = view.size < capacity ? view.size : capacity;
+            memcpy(out, view.data, size);
+            bool valid = stillValid(view);
+            advance();
+            if (valid) {
+                view.data = out;
+                view.size = size;
+                return true;
+            }
+            ++lost;
+        }
+        return false;
+    }
+
+private:
+    void* ring;
+    size_t ringSize;
+    uint32_t next;
+    uint64_t lost;
+};
+
+#endif // SHM_FRAME_RING_H
@@ -0,0 +1,21 @@
+#ifndef SPS_PPS_CACHE_H
+#define SPS_PPS_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "nal_unit.h"
+
+// On-disk cache of the last known parameter sets per device and encoder
+// configuration, so DESCRIBE can be answered before the encoder has produced
+// its first keyframe.
+// The VPS is only present for HEVC and left empty for H.264.
+std::string spsPpsCacheKey(const std::string& device, VideoCodec codec, unsigned width, unsigned height,
+                           unsigned frameRateNumerator, unsigned frameRateDenominator);
+std::string spsPpsCachePath(const std::string& key);
+bool loadSpsPpsCache(const std::string& key, std::vector<uint8_t>& vps,
+                     std::vector<uint8_t>& sps, std::vector<uint8_t>& pps);
+bool saveSpsPpsCache(const std::string& key, const uint8_t* vps, unsigned vpsSize,
+                     const uint8_t* sps, unsigned spsSize, const uint8_t* pps, unsigned ppsSize);
+
+#endif // SPS_PPS_CACHE_H
@@ -0,0 +1,82 @@
+#ifndef SRTP_CONTEXT_H
+#define SRTP_CONTEXT_H
+
+#include <cstdint>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef struct evp_mac_ctx_st srtpMacCtx;
+#else
+typedef struct hmac_ctx_st srtpMacCtx;
+#endif
+
+#define SRTP_MASTER_KEY_LENGTH 16
+#define SRTP_MASTER_SALT_LENGTH 14
+#define SRTP_AUTH_TAG_LENGTH 10
+#define SRTCP_TRAILER_LENGTH (4 + SRTP_AUTH_TAG_LENGTH)  // E flag + SRTCP index, then the tag
+
+// SRTP/SRTCP sender side for AES_CM_128_HMAC_SHA1_80 (RFC 3711), keyed from a
+// single master key and salt. Cipher and MAC contexts are set up once and
+// re-keyed per packet with the IV only, so OpenSSL's AES-NI / ARMv8 code is
+// used without allocating anything per packet.
+// One context per RTP or RTCP groupsock: rollover counters are per stream.
+class srtpContext {
+public:
+    // masterKeyAndSalt: SRTP_MASTER_KEY_LENGTH key bytes followed by SRTP_MASTER_SALT_LENGTH salt bytes
+    explicit srtpContext(const unsigned char* masterKeyAndSalt);
+    ~srtpContext();
+
+    bool isValid() const { return valid; }
+
+    // In place. The buffer needs SRTP_AUTH_TAG_LENGTH bytes of room past size.
+    bool protectRtp(unsigned char* packet, unsigned& size);
+
+    // In place. The buffer needs SRTCP_TRAILER_LENGTH bytes of room past size.
+    bool protectRtcp(unsigned char* packet, unsigned& size);
+
+    // In place; false if the packet is too short or fails authentication
+    bool unprotectRtcp(unsigned char* packet, unsigned& size);
+
+private:
+    struct sessionKeys {
+        unsigned char cipherKey[16];
+        unsigned char salt[14];
+        unsigned char authKey[20];
+    };
+
+    struct streamState {
+        uint32_t ssrc;
+        uint32_t roc;  // Rollover counter
+        uint16_t lastSeq;
+        bool used;
+    };
+
+    bool deriveKeys(const unsigned char* masterKey, const unsigned char* masterSalt,
+                    unsigned char firstLabel, sessionKeys& keys);
+    bool crypt(EVP_CIPHER_CTX* cipher, const sessionKeys& keys, uint32_t ssrc, uint64_t index,
+               unsigned char* data, unsigned size);
+    bool computeTag(srtpMacCtx* mac, const unsigned char* data, unsigned size,
+                    const unsigned char* trailer, unsigned trailerSize, unsigned char* tag);
+    uint32_t rolloverCounter(uint32_t ssrc, uint16_t seq);
+
+    EVP_CIPHER_CTX* rtp_cipher;
+    EVP_CIPHER_CTX* rtcp_cipher;
+    srtpMacCtx* rtp_mac;
+    srtpMacCtx* rtcp_mac;
+    sessionKeys rtp_keys;
+    sessionKeys rtcp_keys;
+    streamState streams[4];  // Media, RTX and FEC share one groupsock
+    uint32_t srtcp_index;
+    bool valid;
+};
+
+// Fills masterKeyAndSalt with a fresh random master key and salt
+bool generateSrtpMasterKey(unsigned char* masterKeyAndSalt);
+
+// Switches an SDP media section to RTP/SAVP and appends the SDES key
+// (RFC 4568): "a=crypto:1 AES_CM_128_HMAC_SHA1_80 inline:<key||salt>".
+// Returns a new[] string.
+char* addSrtpToSdpLines(char const* sdpLines, const unsigned char* masterKeyAndSalt);
+
+#endif // SRTP_CONTEXT_H
@@ -0,0 +1,65 @@
+#ifndef STREAM_SIZER_H
+#define STREAM_SIZER_H
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+// Sizes live555's buffers for one stream from the frames it actually sends,
+// instead of from fixed guesses:
+//  - the frame buffer (OutPacketBuffer::maxSize, shared by all streams) holds
+//    the largest recent frame with headroom; a source truncates anything bigger
+//  - the bitrate estimate handed to live555 (RTCP bandwidth, initial SO_SNDBUF)
+//    is the measured rate including IP/UDP/RTP overhead
+//  - the send buffer holds the largest frame twice over, or SIZER_SEND_BUFFER_MS
+//    of the stream, whichever is more
+// Buffers grow as soon as a bigger frame shows up, but only shrink after
+// SIZER_SHRINK_WINDOWS windows of smaller frames, and the estimates only move
+// when they change by more than SIZER_HYSTERESIS.
+// live555 reads OutPacketBuffer::maxSize when a sink is created, so a new frame
+// buffer size takes effect at the next stream start; the send buffer and the
+// estimates change right away.
+// Runs on the event loop thread only.
+class streamSizer {
+public:
+    // nominalPeakFrameBytes is the largest frame expected before any is seen
+    streamSizer(const std::string& name, unsigned nominalBitsPerSecond, unsigned nominalPeakFrameBytes,
+                unsigned maxPayloadBytes, unsigned packetOverheadBytes);
+    ~streamSizer();
+
+    // Every frame the source delivers, at its full size even if it was truncated
+    void addFrame(unsigned bytes, bool truncated);
+
+    unsigned frameBufferSize() const { return frame_buffer_size; }
+    unsigned estimatedKbps() const { return est_kbps; }
+    unsigned sendBufferSize() const { return send_buffer_size; }
+
+    // Called whenever one of the sizes above changes
+    void setChangeListener(std::function<void()> listener) { change_listener = listener; }
+
+private:
+    unsigned wireBytes(unsigned bytes) const;
+    void closeWindow(std::chrono::steady_clock::time_point now);
+    void update();
+    static void updateOutPacketBufferSize();
+
+    std::string name;
+    unsigned max_payload;
+    unsigned packet_overhead;
+
+    unsigned peak;            // Largest frame the buffers are sized for
+    unsigned quiet_peak;      // Largest frame since the windows got quiet
+    unsigned quiet_windows;   // Consecutive windows well below peak
+    double bitrate;           // Wire bits per second: nominal until measured
+
+    std::chrono::steady_clock::time_point window_start;
+    unsigned window_peak;
+    double window_wire_bytes;
+
+    unsigned frame_buffer_size;
+    unsigned est_kbps;
+    unsigned send_buffer_size;
+    std::function<void()> change_listener;
+};
+
+#endif // STREAM_SIZER_H
@@ -0,0 +1,33 @@
+#ifndef THREAD_PLACEMENT_H
+#define THREAD_PLACEMENT_H
+
+// Where the server's threads run. On a shared SoC, other workloads can preempt
+// the event loop long enough for the ALSA buffer to overrun. The event loop
+// does all capture reads as well as the RTP sends. Each thread role can be
+// pinned to a CPU set and run under SCHED_FIFO, as configured by the THREAD_*
+// settings in constants.h. Whether it helps shows in the event_loop.lateness_*,
+// video.dequeue_interval_stddev_us and audio.overruns metrics, with the
+// settings on and off.
+enum ThreadRole {
+    THREAD_ROLE_EVENT_LOOP,  // live555 loop: capture reads, packetization, RTP sends
+    THREAD_ROLE_RECOVERY,    // Capture watchdog reopening a device
+    THREAD_ROLE_AUX          // Startup helpers, trace dump
+};
+
+// Applies the role's placement to the calling thread and names threads other
+// than the main one. A role without CPUs or a priority keeps the placement the
+// process was started with (taskset, chrt), even in a thread created by a placed
+// one. Failures (no CAP_SYS_NICE, CPUs not online) are logged and otherwise
+// ignored: the thread just runs unplaced.
+void placeCurrentThread(ThreadRole role);
+
+// What placeCurrentThread() applies for a role: cpus is a taskset-style list
+// such as "0,2-3", fifoPriority 0 means no SCHED_FIFO, and "" and 0 mean the
+// startup placement. False if any part failed; bench/ uses it directly.
+bool applyThreadPlacement(const char* name, const char* cpus, int fifoPriority);
+
+// mlockall() if THREAD_LOCK_MEMORY, so page faults can't stall the real-time
+// threads. Call once at startup.
+void lockProcessMemory();
+
+#endif // THREAD_PLACEMENT_H
@@ -0,0 +1,48 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+
+// Scoped trace events that show where the time goes on the hot paths: device
+// waits, ALSA reads, stream setup, RTP sends. They are compiled in only with
+// -DENABLE_TRACING=ON (AVS_TRACING); otherwise TRACE_SCOPE compiles to nothing.
+// Each thread records into its own ring of the last TRACE_BUFFER_EVENTS events
+// without taking a lock. On SIGUSR2 all rings go to TRACE_DUMP_PATH as a Chrome
+// trace, which chrome://tracing and ui.perfetto.dev open as a timeline.
+//
+// Timestamps are CLOCK_MONOTONIC, even in simulation runs: this is about real
+// time spent.
+
+#ifdef AVS_TRACING
+
+class traceScope {
+public:
+    // name must outlive the process; a string literal
+    explicit traceScope(const char* name);
+    ~traceScope();
+
+private:
+    const char* name;
+    int64_t start_ns;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) traceScope TRACE_CONCAT(traceScope_, __LINE__)(name)
+
+// Dumps on SIGUSR2 from a thread of its own, so a stuck event loop can still be
+// traced. Call before any other thread starts; they must inherit SIGUSR2 blocked.
+void startTraceDumpOnSignal();
+
+// Writes every thread's events; false if the file can't be written
+bool writeTrace(const char* path);
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+
+inline void startTraceDumpOnSignal() {}
+
+#endif // AVS_TRACING
+
+#endif // TRACE_H
@@ -0,0 +1,54 @@
+#ifndef ULPFEC_ENCODER_H
+#define ULPFEC_ENCODER_H
+
+#include <cstdint>
+#include "nal_unit.h"
+#include "rtp_packet_history.h"
+
+// RFC 5109 ULPFEC over outgoing video RTP packets: one level-0 XOR parity
+// packet per group of media packets. A group closes when it reaches its size
+// limit or at the end of a frame (marker bit), so a single loss per group is
+// recoverable as soon as the frame is complete, without waiting for more media.
+// Groups containing parameter sets or keyframe slices use the smaller
+// keyFrameGroupSize, i.e. stronger protection.
+//
+// FEC packets go out on an SSRC of their own, each wrapped in RED (RFC 2198)
+// with the parity as its single, primary block: the RED payload type marks
+// them, the ULPFEC one is in the block header. The SDP ties the two SSRCs
+// together with a=ssrc-group:FEC-FR (addFecToSdpLines()).
+class ulpfecEncoder {
+public:
+    ulpfecEncoder(VideoCodec codec, unsigned groupSize, unsigned keyFrameGroupSize);
+
+    // Feeds one media packet as sent. Returns the FEC packet to send right
+    // after it when this packet closed a group, nullptr otherwise.
+    const unsigned char* addPacket(const unsigned char* packet, unsigned size, unsigned& fecSize);
+
+    uint32_t getSsrc() const { return fec_ssrc; }
+
+private:
+    bool isKeyFramePayload(const unsigned char* payload, unsigned size) const;
+    unsigned buildFecPacket(const unsigned char* lastPacket, unsigned redPayloadType, unsigned fecPayloadType);
+
+    VideoCodec codec;
+    unsigned group_size;
+    unsigned keyframe_group_size;
+    uint32_t fec_ssrc;
+    uint16_t fec_seq;
+
+    // Current group
+    unsigned group_count;
+    bool group_keyframe;
+    uint16_t sn_base;
+    uint16_t mask;
+    unsigned char header_recovery[2];  // P, X, CC, M and PT bits
+    uint32_t ts_recovery;
+    uint16_t length_recovery;
+    unsigned protection_length;
+    unsigned char parity[RTP_HISTORY_MAX_PACKET_SIZE];
+
+    double frame_encode_us;
+    unsigned char fec_packet[RTP_FEC_MAX_PACKET_SIZE];
+};
+
+#endif // ULPFEC_ENCODER_H
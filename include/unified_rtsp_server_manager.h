@@ -8,6 +8,12 @@
 // Include both capture headers
 #include "v4l2_capture.h"
 #include "alsa_capture.h"
+#include "bandwidth_budget.h"
+#include "admission_rtsp_server.h"
+#include "av_sync_monitor.h"
+#include <chrono>
+#include <utility>
+#include <vector>
 
 // Since we're combining both, we'll stay in global namespace for now
 class UnifiedRTSPServerManager {
@@ -26,12 +32,44 @@ public:
     void runEventLoop(volatile char* shouldExit);  // Changed parameter type
     void cleanup();
 
+    // Switches the video resolution and frame rate without dropping clients.
+    // Connected sessions pick the change up at the next IDR, new DESCRIBEs
+    // get the new parameter sets. Call from the event loop thread only.
+    bool reconfigureVideo(unsigned width, unsigned height, unsigned fpsNumerator, unsigned fpsDenominator);
+    // The same from "<width>x<height>@<fps>", as RTSP SET_PARAMETER video_format gives it
+    bool reconfigureVideo(const char* format);
+
+    // Plays the session to 127.0.0.1 without an RTSP client, one port pair per
+    // subsession from firstClientPort up. Simulation runs use this, since no
+    // real client can keep up with the virtual clock. A monitor, if given,
+    // receives the stream.
+    bool startLoopbackStream(unsigned short firstClientPort, avSyncMonitor* monitor = nullptr);
+    void stopLoopbackStream();
+
 private:
+    // Periodically writes the metrics table to the log
+    static void logMetricsTask(void* clientData);
+    // Measures how late the event loop gets to a due task: time lost to preemption
+    static void probeLatenessTask(void* clientData);
+    // Reads the captures for shared-memory export while no RTSP stream does
+    static void exportFramesTask(void* clientData);
+    static bool videoFormatRequested(void* clientData, char const* format);
+
     // Environment and server components
     UsageEnvironment* env_;
     int port_;
-    RTSPServer* rtspServer_;
+    admissionRTSPServer* rtspServer_;
+    bandwidthBudget* budget_;  // Outlives the server; client sessions release into it
     ServerMediaSession* sms_;
+    TaskToken metricsTask_;
+    TaskToken probeTask_;
+    TaskToken exportTask_;
+    std::vector<char> exportAudioBuffer_;
+    std::chrono::steady_clock::time_point probeDue_;
+    unsigned probeSamples_;
+    double probeLatenessSumUs_;
+    double probeLatenessMaxUs_;
+    std::vector<std::pair<ServerMediaSubsession*, void*>> loopbackStreams_;  // Subsession, stream token
 
     // Both captures
     v4l2Capture* videoCapture_;
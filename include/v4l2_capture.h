@@ -7,9 +7,16 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h> // for close()
+#include <poll.h>
 #include <cstdint>  // for uint8_t
 #include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "constants.h"
+#include "nal_unit.h"
+#include "shm_frame_publisher.h"
 
 struct Buffer {
     void *start;
@@ -21,17 +28,48 @@ struct FrameInfo {
     uint32_t sequence;
     size_t size;
     bool valid;
+    unsigned skippedFrames;     // Older frames drain gave back to get to this one
+    unsigned heldFrames;        // Newer ones it couldn't skip to without breaking references
 };
 
 class v4l2Capture {
 public:
-    v4l2Capture(const char* device);
+    // A regular file instead of a device node is replayed as an Annex-B elementary stream
+    v4l2Capture(const char* device, VideoCodec requestedCodec = VIDEO_CODEC_H264);
     ~v4l2Capture();
 
     bool initialize();
     bool startCapture();
     bool stopCapture();
     bool reset();
+    // Reopens a stalled device. Runs on the watchdog's thread; the device methods
+    // the event loop calls meanwhile wait for it, or give up where that would stall the loop.
+    bool recover();
+    void setBufferCount(unsigned count) { bufferCount = count; }  // Before initialize()
+    // Deliver the newest ready frame that still decodes, handing stale ones straight
+    // back to the driver: past frames nothing predicts from, or up to a queued keyframe
+    void setDrainToNewest(bool enable) { drainToNewest = enable; }
+    // Also publish every captured access unit to a shared-memory ring for local readers
+    bool enableFrameExport(const char* name, unsigned slots, unsigned slotBytes);
+    bool isExportingFrames() const { return framePublisher != nullptr; }
+    bool isStreaming() const { return replayMode || streaming; }
+    // Framed sources register while they read frames, so nothing else takes them
+    void addStreamReader() { ++streamReaders; }
+    void removeStreamReader() { --streamReaders; }
+    bool hasStreamReader() const { return streamReaders > 0; }
+    bool waitForFrame(int timeoutMs);
+    bool requestKeyFrame();
+    // Runtime encoder adjustments; kept across recover()
+    bool setBitrate(unsigned bitsPerSecond);
+    bool setGopSize(unsigned frames);
+    // Renegotiates resolution and frame rate while running. Streaming restarts with a
+    // keyframe carrying the new parameter sets, and getSpsPpsGeneration() moves on.
+    // A replayed file keeps its size but takes the new rate, and starts over.
+    bool reconfigure(unsigned newWidth, unsigned newHeight, unsigned fpsNumerator, unsigned fpsDenominator);
+    unsigned getWidth() const { return width; }
+    unsigned getHeight() const { return height; }
+    int64_t getFrameIntervalUs() const { return 1000000LL * frameRateNumerator / frameRateDenominator; }
+    uint32_t getFrameIntervalTicks() const { return 90000u * frameRateNumerator / frameRateDenominator; }  // 90 kHz RTP clock
     unsigned char* getFrame(size_t& length);
     unsigned char* getFrameWithoutStartCode(size_t& length);
     void releaseFrame();
@@ -40,11 +78,21 @@ public:
     void clearSpsPps();
     bool extractSpsPpsImmediate();
     bool hasSpsPps() const { return spsPpsExtracted; }
+    // Cached parameter sets are checked against the first keyframe the stream delivers
+    bool loadCachedSpsPps();
+    bool isSpsPpsFromCache() const { return spsPpsFromCache; }
+    // Bumped whenever the parameter sets change, so cached SDP can be refreshed
+    unsigned getSpsPpsGeneration() const { return spsPpsGeneration; }
+    uint8_t* getVPS() const { return vps; }
     uint8_t* getSPS() const { return sps; }
     uint8_t* getPPS() const { return pps; }
+    unsigned getVPSSize() const { return vpsSize; }
     unsigned getSPSSize() const { return spsSize; }
     unsigned getPPSSize() const { return ppsSize; }
-    
+
+    // Codec actually negotiated with the encoder (HEVC falls back to H.264)
+    VideoCodec getCodec() const { return codec; }
+    bool isReplay() const { return replayMode; }
 
     int getFd() const { return fd; }
     // Timing information
@@ -52,22 +100,77 @@ public:
     bool isFrameValid() const { return currentFrameInfo.valid; }
     uint32_t getSequence() const { return currentFrameInfo.sequence; }
     const timeval& getTimestamp() const { return currentFrameInfo.timestamp; }
+    int64_t getFrameAgeMicros() const;  // Time since the current frame was captured
 
 private:
+    std::recursive_mutex deviceMutex;  // Held by whichever thread is using fd and the buffers
     int fd;
     Buffer* buffers;
     unsigned int n_buffers;
+    unsigned int bufferCount;
+    bool drainToNewest;
+    bool streaming;
+    unsigned streamReaders;
     struct v4l2_buffer current_buf;
+    std::deque<struct v4l2_buffer> heldBuffers;  // Dequeued by drain but not yet delivered, oldest first
+    void drainToNewestFrame();
+    void classifyBuffer(const v4l2_buffer& buf, bool& keyFrame, bool& disposable) const;
+    void classifyFrame(const uint8_t* data, size_t size, bool& keyFrame, bool& disposable) const;
+    shmFramePublisher* framePublisher;
+    void exportFrame(const uint8_t* data, size_t size);
     bool initializeMmap();
+    void releaseMmap();
+    void applyFrameRate(const char* action);
+    bool negotiateFormat();
+    void applyEncoderControls(const char* action);
+    unsigned bitrate;
+    unsigned gopSize;
+    unsigned width;
+    unsigned height;
+    unsigned frameRateNumerator;
+    unsigned frameRateDenominator;
 
+    VideoCodec codec;
+    uint8_t* vps;
+    unsigned vpsSize;
     uint8_t* sps;
     uint8_t* pps;
     unsigned spsSize;
     unsigned ppsSize;
     bool spsPpsExtracted;
+    bool spsPpsFromCache;
+    bool spsPpsUnconfirmed;  // May not be the encoder's; checked against the next keyframe
+    unsigned spsPpsGeneration;
+    std::string devicePath;
+    std::vector<uint8_t> knownVps;
+    std::vector<uint8_t> knownSps;
+    std::vector<uint8_t> knownPps;
+    void noteSpsPpsExtracted();
+    void revalidateSpsPps(const uint8_t* frame, size_t frameSize);
+    unsigned scanParameterSets(const uint8_t* frame, size_t frameSize, bool replace);
+    bool haveParameterSets() const;
+
+    // File replay input (for testing without a camera)
+    bool replayMode;
+    std::vector<uint8_t> replayData;
+    std::vector<std::pair<size_t, size_t>> replayPictures;  // offset/size incl. start code
+    size_t replayIndex;
+    std::vector<uint8_t> replayFrame;
+    uint32_t replaySequence;
+    bool loadReplayFile(const char* path);
+    bool reconfigureReplay(unsigned newWidth, unsigned newHeight, unsigned fpsNumerator, unsigned fpsDenominator);
 
     FrameInfo currentFrameInfo;
     void updateFrameInfo(const v4l2_buffer& buf);
+
+    // Spread of the intervals between dequeues: how evenly the event loop gets
+    // to the frames, which preemption shows up in first
+    void recordDequeueInterval();
+    int64_t lastDequeueMicros;
+    unsigned jitterFrames;
+    double jitterSum;
+    double jitterSumSquares;
+    double jitterMax;
 };
 
 #endif // V4L2_CAPTURE_H
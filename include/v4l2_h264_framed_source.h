@@ -3,52 +3,100 @@
 
 #include <FramedSource.hh>
 #include "v4l2_capture.h"
+#include "capture_watchdog.h"
+#include "keyframe_requester.h"
+#include "encoder_rate_controller.h"
+#include "bandwidth_budget.h"
+#include "stream_sizer.h"
 #include "constants.h"
+#include <vector>
 
 struct InitialFrameData {
+    uint8_t* vps;  // HEVC only
     uint8_t* sps;
     uint8_t* pps;
     uint8_t* idr;
+    unsigned vpsSize;
     unsigned spsSize;
     unsigned ppsSize;
     unsigned idrSize;
     struct timeval initialTime;
+    unsigned generation;  // Capture's parameter set generation the copies belong to
     
-    InitialFrameData() : sps(nullptr), pps(nullptr), idr(nullptr),
-                        spsSize(0), ppsSize(0), idrSize(0) {}
+    InitialFrameData() : vps(nullptr), sps(nullptr), pps(nullptr), idr(nullptr),
+                        vpsSize(0), spsSize(0), ppsSize(0), idrSize(0), generation(0) {}
     
     ~InitialFrameData() {
+        delete[] vps;
         delete[] sps;
         delete[] pps;
         delete[] idr;
     }
 };
 
+// Delivers H.264 or HEVC NAL units, depending on the codec the capture negotiated
 class v4l2H264FramedSource : public FramedSource {
 public:
-    static v4l2H264FramedSource* createNew(UsageEnvironment& env, v4l2Capture* capture, InitialFrameData* initData);
+    // rateController may be null when the encoder settings are fixed, budget when there is no egress cap.
+    // sizer, if given, sees every IDR and frame.
+    static v4l2H264FramedSource* createNew(UsageEnvironment& env, v4l2Capture* capture, InitialFrameData* initData,
+                                           keyFrameRequester* keyFrames, encoderRateController* rateController,
+                                           bandwidthBudget* budget, streamSizer* sizer);
     
 protected:
-    v4l2H264FramedSource(UsageEnvironment& env, v4l2Capture* capture, InitialFrameData* initData);
+    v4l2H264FramedSource(UsageEnvironment& env, v4l2Capture* capture, InitialFrameData* initData,
+                         keyFrameRequester* keyFrames, encoderRateController* rateController,
+                         bandwidthBudget* budget, streamSizer* sizer);
     virtual ~v4l2H264FramedSource();
 
 private:
     virtual void doGetNextFrame();
+    static void retryGetNextFrame(void* clientData);
+    void bridgeStall();
+    bool shouldDropForLag(uint8_t nalHeader, bool isIdr);
+    bool shouldDropForRateCap(uint8_t nalHeader, size_t length, bool isIdr);
+    void skipFrame();
+    bool deferToCaptureTime();
+    unsigned frameDurationUs() const;
+    void refreshParameterSets();
+    void setPresentationTime();
+    void copyFrame(const unsigned char* frame, size_t length);
+    void checkAvSyncMarker();
+    void deliverAvSyncMarker();
+
     v4l2Capture* fCapture;
+    captureWatchdog fWatchdog;
+    keyFrameRequester* fKeyFrames;
+    encoderRateController* fRateController;
+    bandwidthBudget* fBudget;
+    streamSizer* fSizer;
+    tokenBucket fRateCap;  // Enforces the per-client allowance until the encoder has caught up
     InitialFrameData* fInitData;
-    uint32_t fCurTimestamp{0};  // Current RTP timestamp
-    static const uint32_t TIMESTAMP_INCREMENT = 90000/FRAME_RATE_DENOMINATOR;  // 90kHz/30fps
+    uint32_t fCurTimestamp{0};  // Current RTP timestamp; advances by the capture's frame interval
     struct timeval fInitialTime;  // Base time for all calculations
+    int64_t fClockBaseUs;         // Media clock time at which fClockBaseTimestamp is due
+    uint32_t fClockBaseTimestamp;
+    int64_t fLastFrameUs;         // Media clock time the last frame came from the capture
+    int64_t fBridgedFrames{0};    // Frame intervals the clock was moved on since then
     
     enum GopState {
+        SENDING_VPS,
         SENDING_SPS,
         SENDING_PPS,
         SENDING_IDR,
-        SENDING_FRAMES
+        SENDING_FRAMES,
+        SENDING_MARKED_FRAME  // The picture held back behind a sync marker
     };
-    GopState gopState{SENDING_SPS};
+    GopState gopState{SENDING_VPS};
 
     bool fFirstGOP{true}; 
+    bool fAwaitingKeyFrame{false};  // After a device reset or under backpressure, resume at the next IDR
+
+    // A/V sync markers (av_sync_marker.h)
+    int64_t fLastMarkerIndex{-1};
+    int64_t fPendingMarker{-1};      // Marker to send in front of the current picture
+    uint32_t fPendingMarkerLatenessUs{0};
+    std::vector<uint8_t> fMarkedFrame;
 
 };
 
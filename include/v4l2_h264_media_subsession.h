@@ -3,23 +3,54 @@
 
 #include <liveMedia.hh>
 #include "v4l2_capture.h"
+#include "v4l2_h264_framed_source.h"
+#include "keyframe_requester.h"
+#include "encoder_rate_controller.h"
+#include "rtcp_feedback_groupsock.h"
+#include "rtx_groupsock.h"
+#include "bandwidth_budget.h"
+#include "stream_sizer.h"
+#include <vector>
 
 class v4l2H264MediaSubsession: public OnDemandServerMediaSubsession {
 public:
-    static v4l2H264MediaSubsession* createNew(UsageEnvironment& env, v4l2Capture* capture, Boolean reuseFirstSource);
+    // budget may be null; otherwise the encoder is kept under its per-client allowance
+    static v4l2H264MediaSubsession* createNew(UsageEnvironment& env, v4l2Capture* capture, Boolean reuseFirstSource,
+                                              bandwidthBudget* budget = NULL);
 
 protected:
-    v4l2H264MediaSubsession(UsageEnvironment& env, v4l2Capture* capture, Boolean reuseFirstSource);
+    v4l2H264MediaSubsession(UsageEnvironment& env, v4l2Capture* capture, Boolean reuseFirstSource,
+                            bandwidthBudget* budget);
     virtual ~v4l2H264MediaSubsession();
 
     virtual FramedSource* createNewStreamSource(unsigned clientSessionId, unsigned& estBitrate);
     virtual RTPSink* createNewRTPSink(Groupsock* rtpGroupsock, unsigned char rtpPayloadTypeIfDynamic, FramedSource* inputSource);
     virtual void deleteStream(unsigned clientSessionId, void*& streamToken);
     virtual char const* getAuxSDPLine(RTPSink* rtpSink, FramedSource* inputSource);
+    virtual char const* sdpLines(int addressFamily);
+    virtual Groupsock* createGroupsock(struct sockaddr_storage const& addr, Port port);
 
 private:
+    // Takes ownership of initData
+    FramedSource* createFramer(InitialFrameData* initData);
+    char* buildHevcFmtp(unsigned char payloadType);
+    static void onRtcpFeedback(void* clientData, rtcpFeedbackGroupsock::FeedbackType type, u_int32_t mediaSsrc,
+                               u_int16_t seq, unsigned sessionId);
+    static int64_t captureTimeUs(void* clientData);
+
     v4l2Capture* fCapture;
+    keyFrameRequester fKeyFrameRequester;
+    encoderRateController fRateController;
+    bandwidthBudget* fBudget;
+    streamSizer fSizer;
+    rtxGroupsock* fRtpGroupsock;     // Live stream's, or NULL once its stream is deleted
+    rtxGroupsock* fNewRtpGroupsock;  // Created, waiting for its RTCP groupsock to open
+    unsigned char fSrtpMasterKey[SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH];
+    bool fSrtpEnabled;
     char* fAuxSDPLine;
+    unsigned fAuxSDPLineGeneration;  // SPS/PPS generation fAuxSDPLine was built from
+    bool fSdpHasSsrcGroups;          // fSDPLines groups the live stream's SSRC with its RTX and FEC's...
+    u_int32_t fSdpMediaSsrc;         // ...this one
     unsigned streamingSessionId;  
 };
 
@@ -0,0 +1,45 @@
+#ifndef VIRTUAL_TASK_SCHEDULER_H
+#define VIRTUAL_TASK_SCHEDULER_H
+
+#include <BasicUsageEnvironment.hh>
+#include <cstdint>
+#include <map>
+
+// Task scheduler for simulation runs. It keeps delayed tasks against the virtual
+// clock (media_clock.h) and never waits for one: once no socket is ready, the
+// clock jumps straight to the next task. Sockets are still real. They are
+// polled without blocking while tasks are pending, and only a simulation with
+// nothing scheduled waits for the network. Tasks due at the same instant run in
+// the order they were scheduled, so every run plays out the same way.
+//
+// live555's own pacing reads gettimeofday(), so sources must not ask the sink to
+// pace them (fDurationInMicroseconds = 0) and must schedule frames themselves.
+class virtualTaskScheduler : public BasicTaskScheduler {
+public:
+    // Also switches the process to the virtual clock
+    static virtualTaskScheduler* createNew();
+    virtual ~virtualTaskScheduler();
+
+    virtual TaskToken scheduleDelayedTask(int64_t microseconds, TaskFunc* proc, void* clientData);
+    virtual void unscheduleDelayedTask(TaskToken& prevTask);
+
+protected:
+    virtualTaskScheduler();
+
+    virtual void SingleStep(unsigned maxDelayTime);
+
+private:
+    struct delayedTask {
+        uintptr_t id;
+        TaskFunc* proc;
+        void* clientData;
+    };
+    typedef std::multimap<int64_t, delayedTask> taskQueue;  // By due time, then in scheduling order
+
+    taskQueue fTasks;
+    std::map<uintptr_t, taskQueue::iterator> fTasksById;
+    uintptr_t fNextTaskId;
+    uint64_t fTasksRun;
+};
+
+#endif // VIRTUAL_TASK_SCHEDULER_H
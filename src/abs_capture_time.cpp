@@ -0,0 +1,55 @@
+#include "abs_capture_time.h"
+#include "media_clock.h"
+#include <strDup.hh>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static const uint64_t NTP_UNIX_OFFSET_SECONDS = 2208988800ULL;  // 1900 to 1970
+
+uint64_t monotonicToNtp(int64_t monotonicMicros) {
+    struct timeval wallNow;
+    mediaClockWallTime(wallNow);
+
+    int64_t ageMicros = mediaClockMicros() - monotonicMicros;
+    int64_t wallMicros = (int64_t)wallNow.tv_sec * 1000000 + wallNow.tv_usec - ageMicros;
+
+    uint64_t seconds = wallMicros / 1000000 + NTP_UNIX_OFFSET_SECONDS;
+    uint64_t fraction = ((uint64_t)(wallMicros % 1000000) << 32) / 1000000;
+    return (seconds << 32) | fraction;
+}
+
+unsigned addAbsCaptureTime(const unsigned char* packet, unsigned size, unsigned char extensionId, uint64_t ntpTime,
+                           unsigned char* out, unsigned outSize) {
+    // 0xBEDE profile, one element of 8 bytes (ID | length - 1), padded to 12 bytes
+    const unsigned EXTENSION_SIZE = ABS_CAPTURE_TIME_EXTENSION_SIZE;
+    if (size < 12 || (packet[0] & 0x10) != 0) return 0;
+    unsigned headerSize = 12 + 4 * (packet[0] & 0x0F);
+    if (headerSize > size || size + EXTENSION_SIZE > outSize) return 0;
+
+    memcpy(out, packet, headerSize);
+    out[0] |= 0x10;
+
+    unsigned char* extension = out + headerSize;
+    extension[0] = 0xBE;
+    extension[1] = 0xDE;
+    extension[2] = 0;
+    extension[3] = 3;  // Words after this header
+    extension[4] = (extensionId << 4) | (8 - 1);
+    for (int i = 0; i < 8; ++i) {
+        extension[5 + i] = (unsigned char)(ntpTime >> (56 - 8 * i));
+    }
+    extension[13] = extension[14] = extension[15] = 0;  // Padding
+
+    memcpy(extension + EXTENSION_SIZE, packet + headerSize, size - headerSize);
+    return size + EXTENSION_SIZE;
+}
+
+char* addAbsCaptureTimeToSdpLines(char const* sdpLines, unsigned char extensionId) {
+    // Media-level attribute: anywhere after the m= line
+    char line[128];
+    snprintf(line, sizeof(line), "a=extmap:%u %s\r\n", extensionId, ABS_CAPTURE_TIME_URI);
+    std::string sdp(sdpLines);
+    sdp += line;
+    return strDup(sdp.c_str());
+}
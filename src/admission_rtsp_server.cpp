@@ -0,0 +1,93 @@
+#include "admission_rtsp_server.h"
+#include "constants.h"
+#include "logger.h"
+#include <cstring>
+#include <string>
+
+static char const* VIDEO_FORMAT_PARAMETER = "video_format:";
+
+admissionRTSPServer* admissionRTSPServer::createNew(UsageEnvironment& env, Port ourPort, bandwidthBudget* budget,
+                                                    UserAuthenticationDatabase* authDatabase,
+                                                    unsigned reclamationSeconds) {
+    int ourSocketIPv4 = setUpOurSocket(env, ourPort, AF_INET);
+    int ourSocketIPv6 = setUpOurSocket(env, ourPort, AF_INET6);
+    if (ourSocketIPv4 < 0 && ourSocketIPv6 < 0) return NULL;
+
+    return new admissionRTSPServer(env, ourSocketIPv4, ourSocketIPv6, ourPort, budget, authDatabase,
+                                   reclamationSeconds);
+}
+
+admissionRTSPServer::admissionRTSPServer(UsageEnvironment& env, int ourSocketIPv4, int ourSocketIPv6, Port ourPort,
+                                         bandwidthBudget* budget, UserAuthenticationDatabase* authDatabase,
+                                         unsigned reclamationSeconds)
+    : RTSPServer(env, ourSocketIPv4, ourSocketIPv6, ourPort, authDatabase, reclamationSeconds),
+      fBudget(budget), fVideoFormatHandler(NULL), fVideoFormatClientData(NULL) {
+}
+
+admissionRTSPServer::~admissionRTSPServer() {
+}
+
+void admissionRTSPServer::setVideoFormatHandler(videoFormatHandler* handler, void* clientData) {
+    fVideoFormatHandler = handler;
+    fVideoFormatClientData = clientData;
+}
+
+GenericMediaServer::ClientSession* admissionRTSPServer::createNewClientSession(u_int32_t sessionId) {
+    return new admissionClientSession(*this, sessionId);
+}
+
+admissionRTSPServer::admissionClientSession::admissionClientSession(admissionRTSPServer& ourServer,
+                                                                    u_int32_t sessionId)
+    : RTSPClientSession(ourServer, sessionId),
+      fServer(ourServer),
+      fBudget(ourServer.fBudget),
+      fAdmitted(false) {
+}
+
+admissionRTSPServer::admissionClientSession::~admissionClientSession() {
+    if (fAdmitted) {
+        fBudget->releaseClient();
+    }
+}
+
+void admissionRTSPServer::admissionClientSession::handleCmd_SETUP(RTSPClientConnection* ourClientConnection,
+                                                                  char const* urlPreSuffix, char const* urlSuffix,
+                                                                  char const* fullRequestStr) {
+    // Only a session's first SETUP brings a new viewer; the audio SETUP that
+    // follows the video one belongs to the same stream
+    if (!fAdmitted) {
+        if (!fBudget->admitClient()) {
+            setRTSPResponse(ourClientConnection, "453 Not Enough Bandwidth");
+            return;
+        }
+        fAdmitted = true;
+    }
+    RTSPClientSession::handleCmd_SETUP(ourClientConnection, urlPreSuffix, urlSuffix, fullRequestStr);
+}
+
+void admissionRTSPServer::admissionClientSession::handleCmd_SET_PARAMETER(RTSPClientConnection* ourClientConnection,
+                                                                          ServerMediaSubsession* subsession,
+                                                                          char const* fullRequestStr) {
+    // The parameters are in the body, one "name: value" per line
+    char const* body = strstr(fullRequestStr, "\r\n\r\n");
+    char const* parameter = body != NULL ? strstr(body, VIDEO_FORMAT_PARAMETER) : NULL;
+    if (parameter == NULL) {
+        RTSPClientSession::handleCmd_SET_PARAMETER(ourClientConnection, subsession, fullRequestStr);
+        return;
+    }
+    if (!VIDEO_RECONFIGURE_VIA_RTSP || fServer.fVideoFormatHandler == NULL) {
+        setRTSPResponse(ourClientConnection, "458 Parameter Is Read-Only");
+        return;
+    }
+
+    parameter += strlen(VIDEO_FORMAT_PARAMETER);
+    parameter += strspn(parameter, " \t");
+    std::string format(parameter, strcspn(parameter, "\r\n"));
+    logMessage("SET_PARAMETER video_format " + format + " from session " + std::to_string(fOurSessionId));
+    if (!(*fServer.fVideoFormatHandler)(fServer.fVideoFormatClientData, format.c_str())) {
+        // Malformed, or a format the device refused
+        setRTSPResponse(ourClientConnection, "451 Parameter Not Understood");
+        return;
+    }
+    setRTSPResponse(ourClientConnection, "200 OK");
+}
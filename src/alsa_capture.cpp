@@ -1,79 +1,206 @@
 #include "alsa_capture.h"
+#include "av_sync_marker.h"
 #include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include "trace.h"
 #include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <cmath>
 #include <chrono>
+#include <sstream>
 
 namespace alsa_rtsp {
 
-alsaCapture::alsaCapture(const char* device, unsigned int sampleRate, unsigned int channels, unsigned int bitDepth)
+static std::vector<std::string> splitList(const std::string& list, char separator) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, separator)) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+alsaCapture::alsaCapture(const char* device, unsigned int sampleRate, unsigned int channels, unsigned int bitDepth,
+                         unsigned int framesPerPeriod, unsigned int periodsInBuffer)
     // Member initializer list - initializes class members before constructor body
-    : pcm_device(device)                          // Initialize ALSA device name
+    : device_list(device)                         // Initialize ALSA device name(s)
     , sample_rate(sampleRate)                     // Initialize sampling rate
-    , num_channels(channels)                      // Initialize number of channels
-    , bit_depth(bitDepth)                         // Initialize bits per sample
-    , pcm_handle(nullptr)                         // Initialize PCM handle to null
-    , params(nullptr)                             // Initialize params to null
-    , frames(NUM_OF_FRAMES_PER_PERIOD)            // Initialize frames per period
-    , periods(NUM_OF_PERIODS_IN_BUFFER) {         // Initialize number of periods
+    , num_channels(channels)                      // Initialize number of output channels
+    , bit_depth(bitDepth)                         // Initialize bits per output sample
+    , frames(framesPerPeriod)                     // Initialize frames per period
+    , periods(periodsInBuffer)                    // Initialize number of periods
+    , needs_alignment(true)
+    , frame_publisher(nullptr)
+    , stream_readers(0)
+    , periods_read(0)
+    , period_timestamp_us(0)
+    , synthetic(device_list == AUDIO_SYNTHETIC_DEVICE)
+    , synthetic_start_us(0) {
     // Calculate total buffer size in bytes:
     // frames * channels * (bytes per sample) * number of periods
     buffer_size = frames * channels * (bitDepth / 8) * periods;
-    
-    // Resize the buffer to calculated size
-    buffer.resize(buffer_size);
 }
 
 alsaCapture::~alsaCapture() {
-    if (pcm_handle) {
-        snd_pcm_close(pcm_handle);
+    closeInputs();
+    delete frame_publisher;
+}
+
+bool alsaCapture::enableFrameExport(const char* name, unsigned slots) {
+    delete frame_publisher;
+    frame_publisher = new shmFramePublisher(name, SHM_MEDIA_PCM_S16BE, slots,
+                                            frames * num_channels * (bit_depth / 8), sample_rate, num_channels);
+    if (!frame_publisher->isOpen()) {
+        delete frame_publisher;
+        frame_publisher = nullptr;
+        return false;
     }
+    return true;
+}
+
+void alsaCapture::closeInputs() {
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (inputs[i].pcm_handle) {
+            snd_pcm_close(inputs[i].pcm_handle);
+        }
+        delete inputs[i].resampler;
+    }
+    inputs.clear();
 }
 
 bool alsaCapture::initialize() {
+    closeInputs();
+
+    if (synthetic) {
+        // Carry on where the tone left off, as a device would after a reopen
+        synthetic_start_us = mediaClockMicros() - int64_t(periods_read) * getPeriodDurationUs();
+        logMessage("Audio capture is a synthetic " + std::to_string(AUDIO_SYNTHETIC_TONE_HZ) + " Hz tone");
+        return true;
+    }
+
+    std::vector<std::string> devices = splitList(device_list, ',');
+    std::vector<std::string> gains = splitList(AUDIO_DEVICE_GAIN_DB, ',');
+    if (devices.empty()) {
+        std::cerr << "ERROR: No audio device configured" << std::endl;
+        return false;
+    }
+
+    inputs.resize(devices.size());
+    for (size_t i = 0; i < devices.size(); ++i) {
+        inputs[i].device = devices[i];
+        inputs[i].pcm_handle = nullptr;
+        inputs[i].resampler = nullptr;
+        inputs[i].metric_prefix = "audio.input" + std::to_string(i) + ".";
+        inputs[i].gain = i < gains.size() ? std::pow(10.0f, std::strtof(gains[i].c_str(), nullptr) / 20.0f) : 1.0f;
+        if (!openInput(inputs[i])) {
+            closeInputs();
+            return false;
+        }
+    }
+
+    if (!buildRoutes()) {
+        closeInputs();
+        return false;
+    }
+
+    // Linked streams start and stop together, so the inputs begin sample-aligned.
+    // Devices on different cards often can't be linked; alignInputs() covers those.
+    for (size_t i = 1; i < inputs.size(); ++i) {
+        if (snd_pcm_link(inputs[0].pcm_handle, inputs[i].pcm_handle) < 0) {
+            logMessage("Audio input " + inputs[i].device + " can't be linked to " + inputs[0].device +
+                       ", aligning after start");
+        }
+    }
+
+    unsigned int planes = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        planes += inputs[i].channels;
+    }
+    input_planes.assign(planes, std::vector<float>(frames));
+    output_planes.assign(num_channels, std::vector<float>(frames));
+    input_plane_ptrs.resize(planes);
+    output_plane_ptrs.resize(num_channels);
+    for (unsigned int p = 0; p < planes; ++p) input_plane_ptrs[p] = input_planes[p].data();
+    for (unsigned int c = 0; c < num_channels; ++c) output_plane_ptrs[c] = output_planes[c].data();
+
+    needs_alignment = true;
+    return true;
+}
+
+bool alsaCapture::openInput(alsaInput& input) {
     int pcm;
     int dir = 0;  // Force exact rate with dir = 0
+    snd_pcm_hw_params_t* params;
 
     // Open PCM device in blocking mode
-    if ((pcm = snd_pcm_open(&pcm_handle, pcm_device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
-        std::cerr << "ERROR: Can't open \"" << pcm_device << "\" PCM device. " << snd_strerror(pcm) << std::endl;
+    if ((pcm = snd_pcm_open(&input.pcm_handle, input.device.c_str(), SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+        std::cerr << "ERROR: Can't open \"" << input.device << "\" PCM device. " << snd_strerror(pcm) << std::endl;
+        input.pcm_handle = nullptr;
         return false;
     }
     
     // Configure for low latency
     snd_pcm_hw_params_alloca(&params);
-    snd_pcm_hw_params_any(pcm_handle, params);
+    snd_pcm_hw_params_any(input.pcm_handle, params);
 
-    // Add these lines for explicit configuration
-    if ((pcm = snd_pcm_hw_params_set_rate_resample(pcm_handle, params, 1)) < 0) {
+    // With the in-process resampler we want the device's own rate, not ALSA's conversion
+    if ((pcm = snd_pcm_hw_params_set_rate_resample(input.pcm_handle, params, AUDIO_RESAMPLER_ENABLED ? 0 : 1)) < 0) {
         std::cerr << "Cannot set resampling: " << snd_strerror(pcm) << std::endl;
         return false;
     }
 
     // Set hardware parameters with explicit error checking
-    if ((pcm = snd_pcm_hw_params_set_access(pcm_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+    if ((pcm = snd_pcm_hw_params_set_access(input.pcm_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
         std::cerr << "Error setting access: " << snd_strerror(pcm) << std::endl;
         return false;
     }
 
-    if ((pcm = snd_pcm_hw_params_set_format(pcm_handle, params, SND_PCM_FORMAT_S16_BE)) < 0) {
+    // Take the first native-endian format the device offers; each has its own conversion path
+    static const struct {
+        snd_pcm_format_t alsaFormat;
+        sampleFormat format;
+    } formats[] = {
+        { SND_PCM_FORMAT_S16, SAMPLE_FORMAT_S16 },
+        { SND_PCM_FORMAT_S24, SAMPLE_FORMAT_S24 },
+        { SND_PCM_FORMAT_S32, SAMPLE_FORMAT_S32 },
+    };
+    pcm = -EINVAL;
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]) && pcm < 0; ++i) {
+        if (snd_pcm_hw_params_test_format(input.pcm_handle, params, formats[i].alsaFormat) == 0) {
+            pcm = snd_pcm_hw_params_set_format(input.pcm_handle, params, formats[i].alsaFormat);
+            input.format = formats[i].format;
+        }
+    }
+    if (pcm < 0) {
         std::cerr << "Error setting format: " << snd_strerror(pcm) << std::endl;
         return false;
     }
     
-    if ((pcm = snd_pcm_hw_params_set_channels(pcm_handle, params, num_channels)) < 0) {
+    unsigned int channels = AUDIO_DEVICE_CHANNELS;
+    if ((pcm = snd_pcm_hw_params_set_channels_near(input.pcm_handle, params, &channels)) < 0) {
         std::cerr << "Error setting channels: " << snd_strerror(pcm) << std::endl;
         return false;
     }
+    input.channels = channels;
+    input.deinterleave = getDeinterleaver(input.format, channels);
+    if (input.deinterleave == nullptr) {
+        std::cerr << "ERROR: " << channels << " channels on \"" << input.device << "\" not supported" << std::endl;
+        return false;
+    }
     
     // Set sample rate with explicit checking
     unsigned int rateNear = sample_rate;
-    if ((pcm = snd_pcm_hw_params_set_rate_near(pcm_handle, params, &rateNear, 0)) < 0) {
+    if ((pcm = snd_pcm_hw_params_set_rate_near(input.pcm_handle, params, &rateNear, 0)) < 0) {
         std::cerr << "Error setting rate: " << snd_strerror(pcm) << std::endl;
         return false;
     }
     
-    if (rateNear != sample_rate) {
+    if (rateNear != sample_rate && !AUDIO_RESAMPLER_ENABLED) {
         std::cerr << "Warning: Rate " << sample_rate << " Hz not supported, using " 
                 << rateNear << " Hz instead" << std::endl;
         return false;
@@ -81,89 +208,144 @@ bool alsaCapture::initialize() {
 
     // After setting hardware parameters, verify what we got
     unsigned int actualRate;
-    snd_pcm_format_t actualFormat;
-    unsigned int actualChannels;
     snd_pcm_hw_params_get_rate(params, &actualRate, 0);
-    snd_pcm_hw_params_get_format(params, &actualFormat);
-    snd_pcm_hw_params_get_channels(params, &actualChannels);
 
     // Verify we got what we requested
-    if (actualRate != sample_rate) {
+    if (actualRate != rateNear) {
         std::cerr << "WARNING: Sample rate mismatch - requested " 
-                << sample_rate << " Hz, got " << actualRate << " Hz\n";
+                << rateNear << " Hz, got " << actualRate << " Hz\n";
         return false;
     }
+    input.rate = actualRate;
+    input.period_frames = std::max<snd_pcm_uframes_t>(1, frames * input.rate / sample_rate);
 
     // Set period size (in frames)
-    snd_pcm_uframes_t period_size = frames;
-    if ((pcm = snd_pcm_hw_params_set_period_size_near(pcm_handle, params, &period_size, &dir)) < 0) {
+    snd_pcm_uframes_t period_size = input.period_frames;
+    if ((pcm = snd_pcm_hw_params_set_period_size_near(input.pcm_handle, params, &period_size, &dir)) < 0) {
         std::cerr << "Error setting period size: " << snd_strerror(pcm) << std::endl;
         return false;
     }
 
     // Set buffer size (in frames)
-    snd_pcm_uframes_t buffer_size = frames * periods;
-    if ((pcm = snd_pcm_hw_params_set_buffer_size_near(pcm_handle, params, &buffer_size)) < 0) {
+    snd_pcm_uframes_t buffer_size = input.period_frames * periods;
+    if ((pcm = snd_pcm_hw_params_set_buffer_size_near(input.pcm_handle, params, &buffer_size)) < 0) {
         std::cerr << "Error setting buffer size: " << snd_strerror(pcm) << std::endl;
         return false;
     }
 
     // Apply hardware parameters
-    if ((pcm = snd_pcm_hw_params(pcm_handle, params)) < 0) {
+    if ((pcm = snd_pcm_hw_params(input.pcm_handle, params)) < 0) {
         std::cerr << "ERROR: Can't set hardware parameters. " << snd_strerror(pcm) << std::endl;
         return false;
     }
 
-    // logMessage("Successfully set hardware parameters.");
-
     // Configure software parameters for better buffer management and additional protection against underruns
     snd_pcm_sw_params_t *swparams;
     snd_pcm_sw_params_alloca(&swparams);
-    snd_pcm_sw_params_current(pcm_handle, swparams);
+    snd_pcm_sw_params_current(input.pcm_handle, swparams);
     
     // Start when we have one full period
-    snd_pcm_sw_params_set_start_threshold(pcm_handle, swparams, frames);
+    snd_pcm_sw_params_set_start_threshold(input.pcm_handle, swparams, input.period_frames);
 
     // Wake up when we have enough frames to process
-    snd_pcm_sw_params_set_avail_min(pcm_handle, swparams, frames);
+    snd_pcm_sw_params_set_avail_min(input.pcm_handle, swparams, input.period_frames);
     
-    if ((pcm = snd_pcm_sw_params(pcm_handle, swparams)) < 0) {
+    if ((pcm = snd_pcm_sw_params(input.pcm_handle, swparams)) < 0) {
         std::cerr << "ERROR: Can't set software parameters. " << snd_strerror(pcm) << std::endl;
         return false;
     }
 
-    // Get and print actual configuration
-    snd_pcm_uframes_t actual_buffer_size;
-    snd_pcm_uframes_t actual_period_size;
-    unsigned int actual_rate;
-    unsigned int period_time;
-    snd_pcm_get_params(pcm_handle, &actual_buffer_size, &actual_period_size);
-    snd_pcm_hw_params_get_rate(params, &actual_rate, &dir);
-    snd_pcm_hw_params_get_period_time(params, &period_time, &dir);
-
-    // std::cout << "========= ALSA Configuration =========\n"
-    //             << "Access: " << snd_pcm_access_name(SND_PCM_ACCESS_RW_INTERLEAVED) << "\n"
-    //             << "Format: " << snd_pcm_format_name(actualFormat) << "\n"
-    //             << "Sample Rate: " << actual_rate << " Hz\n"
-    //             << "Channels: " << num_channels << "\n"
-    //             << "Bit Depth: " << bit_depth << " bits\n"
-    //             << "======================================\n"
-    //             << "Buffer Size: " << actual_buffer_size * num_channels * (bit_depth/8) << " bytes"
-    //             << " (" << actual_buffer_size << " frames)\n"
-    //             << "Number of Periods in Buffer: " << (actual_buffer_size / actual_period_size) << " periods\n"
-    //             << "Number of Frames per Period: " << actual_period_size << " frames\n"                    
-    //             << "Bytes per Frame: " << num_channels * (bit_depth/8) << " bytes\n"
-    //             << "======================================\n";
+    // The resampler pulls a little more or less than a period as it tracks the clock
+    snd_pcm_uframes_t capacity = AUDIO_RESAMPLER_ENABLED ? 2 * input.period_frames + 512 : frames;
+    input.buffer.resize(capacity * input.channels * sampleFormatBytes(input.format));
+    logMessage("Audio input " + input.device + ": " + sampleFormatName(input.format) + ", " +
+               std::to_string(input.channels) + " channel(s), " + std::to_string(input.rate) + " Hz");
+
+    if (AUDIO_RESAMPLER_ENABLED) {
+        input.resampler = new polyphaseResampler(input.rate, sample_rate, input.channels);
+        input.native_planes.assign(input.channels, std::vector<float>(capacity));
+        input.native_plane_ptrs.resize(input.channels);
+        for (unsigned int c = 0; c < input.channels; ++c) {
+            input.native_plane_ptrs[c] = input.native_planes[c].data();
+        }
+        char quality[128];
+        snprintf(quality, sizeof(quality), "%u taps, %.4f dB passband ripple, %.1f dB alias rejection",
+                 input.resampler->getTaps(), input.resampler->passbandRippleDb(),
+                 input.resampler->stopbandAttenuationDb());
+        logMessage("Resampling " + input.device + " " + std::to_string(input.rate) + " -> " +
+                   std::to_string(sample_rate) + " Hz: " + quality);
+    }
     return true;
 }
 
-bool alsaCapture::startCapture() {
+bool alsaCapture::buildRoutes() {
+    // Input channels are numbered across devices: device 0's channels first, then device 1's...
+    std::vector<unsigned int> firstPlane;
+    unsigned int planes = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        firstPlane.push_back(planes);
+        planes += inputs[i].channels;
+    }
+
+    routes.clear();
+    std::vector<unsigned int> sources(num_channels, 0);
+    std::string map = AUDIO_CHANNEL_MAP;
+    if (map.empty()) {
+        // One input channel per output channel if they match up, otherwise spread them round-robin
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            for (unsigned int c = 0; c < inputs[i].channels; ++c) {
+                unsigned int plane = firstPlane[i] + c;
+                mixRoute route = { plane, plane % num_channels, inputs[i].gain };
+                routes.push_back(route);
+                ++sources[route.output_channel];
+            }
+        }
+    } else {
+        // "device.channel" sources per output channel, '+' to mix several: "0.0+1.0" or "0.0,1.0"
+        std::vector<std::string> outputs = splitList(map, ',');
+        if (outputs.size() != num_channels) {
+            logMessage("AUDIO_CHANNEL_MAP has " + std::to_string(outputs.size()) + " outputs, expected " +
+                       std::to_string(num_channels));
+            return false;
+        }
+        for (unsigned int out = 0; out < num_channels; ++out) {
+            std::vector<std::string> terms = splitList(outputs[out], '+');
+            for (size_t t = 0; t < terms.size(); ++t) {
+                unsigned int device, channel;
+                if (sscanf(terms[t].c_str(), "%u.%u", &device, &channel) != 2 || device >= inputs.size() ||
+                    channel >= inputs[device].channels) {
+                    logMessage("Invalid AUDIO_CHANNEL_MAP source \"" + terms[t] + "\"");
+                    return false;
+                }
+                mixRoute route = { firstPlane[device] + channel, out, inputs[device].gain };
+                routes.push_back(route);
+                ++sources[out];
+            }
+        }
+    }
+
+    // Downmixes average their sources so they can't clip any more than one source would
+    for (size_t r = 0; r < routes.size(); ++r) {
+        routes[r].gain /= sources[routes[r].output_channel];
+    }
+    return true;
+}
+
+void alsaCapture::setMixerControls(snd_pcm_t* handle) {
+    // The mixer belongs to the card the PCM device lives on
+    snd_pcm_info_t* info;
+    snd_pcm_info_alloca(&info);
+    if (snd_pcm_info(handle, info) < 0 || snd_pcm_info_get_card(info) < 0) {
+        return;
+    }
+    std::string card = "hw:" + std::to_string(snd_pcm_info_get_card(info));
+
     // Set capture volume to maximum
     snd_mixer_t *mixer;
     snd_mixer_elem_t *elem;
     
     if (snd_mixer_open(&mixer, 0) >= 0) {
-        if (snd_mixer_attach(mixer, "hw:2") >= 0) {
+        if (snd_mixer_attach(mixer, card.c_str()) >= 0) {
             snd_mixer_selem_id_t *sid;
             snd_mixer_selem_id_alloca(&sid);
             snd_mixer_selem_id_set_index(sid, 0);
@@ -180,7 +362,7 @@ bool alsaCapture::startCapture() {
     }
     // Turn off Auto Gain Control for consistent volume
     if (snd_mixer_open(&mixer, 0) >= 0) {
-        if (snd_mixer_attach(mixer, "hw:2") >= 0) {
+        if (snd_mixer_attach(mixer, card.c_str()) >= 0) {
             snd_mixer_selem_id_t *sid;
             snd_mixer_selem_id_alloca(&sid);
             snd_mixer_selem_id_set_index(sid, 0);
@@ -192,31 +374,37 @@ bool alsaCapture::startCapture() {
         }
         snd_mixer_close(mixer);
     }
+}
+
+bool alsaCapture::startCapture() {
+    std::lock_guard<std::recursive_mutex> lock(device_mutex);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        setMixerControls(inputs[i].pcm_handle);
+    }
 
     logMessage("Successfully start audio capture.");
     return true;
 }
 
 bool alsaCapture::stopCapture() {
-    snd_pcm_drain(pcm_handle);
+    std::lock_guard<std::recursive_mutex> lock(device_mutex);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        snd_pcm_drain(inputs[i].pcm_handle);
+    }
     logMessage("Successfully stop audio capture.");
     return true;
 }
 
 bool alsaCapture::reset() {
+    std::lock_guard<std::recursive_mutex> lock(device_mutex);
     logMessage("Attempting to reset capture device.");
 
-    // Stop capture and close handle
+    // Stop capture and close handles
     stopCapture();
-
-    if (pcm_handle) {
-        snd_pcm_close(pcm_handle);
-        pcm_handle = nullptr;
-        params = nullptr;  // params is invalidated when handle is closed
-    }
+    closeInputs();
 
     // Wait for device to settle
-    usleep(500000);  // 500ms delay
+    mediaClockSleep(500000);  // 500ms delay
 
     // Reinitialize with error checking
     int retries = 3;
@@ -230,7 +418,7 @@ bool alsaCapture::reset() {
         }
         
         logMessage("Initialization attempt failed, retrying...");
-        usleep(100000);  // 100ms between retries
+        mediaClockSleep(100000);  // 100ms between retries
     }
     
     if (!init_success) {
@@ -245,22 +433,137 @@ bool alsaCapture::reset() {
     }
     
     // Verify device state
-    snd_pcm_state_t state = snd_pcm_state(pcm_handle);
-    if (state != SND_PCM_STATE_RUNNING && state != SND_PCM_STATE_PREPARED) {
-        logMessage("Device in incorrect state after reset: " + std::to_string(state));
-        return false;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        snd_pcm_state_t state = snd_pcm_state(inputs[i].pcm_handle);
+        if (state != SND_PCM_STATE_RUNNING && state != SND_PCM_STATE_PREPARED) {
+            logMessage("Device " + inputs[i].device + " in incorrect state after reset: " + std::to_string(state));
+            return false;
+        }
     }
 
     logMessage("Successfully reset audio capture.");
     return true;
 }
 
-int alsaCapture::readFrames(char* outbuffer, int outFrames) {
+bool alsaCapture::recover() {
+    // Fast path used by the stall watchdog: restart the streams in place first and
+    // only reopen the devices (without reset()'s settle delay) if that fails
+    std::lock_guard<std::recursive_mutex> lock(device_mutex);
+    bool restarted = !inputs.empty();
+    for (size_t i = 0; i < inputs.size() && restarted; ++i) {
+        snd_pcm_drop(inputs[i].pcm_handle);
+        restarted = snd_pcm_prepare(inputs[i].pcm_handle) == 0;
+    }
+    if (restarted) {
+        startPreparedInputs();
+        needs_alignment = true;
+        logMessage("Successfully restarted audio capture in place.");
+        return true;
+    }
+
+    if (!initialize()) {
+        logMessage("Failed to reopen audio device during recovery.");
+        return false;
+    }
+    return startCapture();
+}
+
+void alsaCapture::startPreparedInputs() {
+    // Starting one linked stream starts the rest, so re-check each state
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (snd_pcm_state(inputs[i].pcm_handle) == SND_PCM_STATE_PREPARED) {
+            snd_pcm_start(inputs[i].pcm_handle);
+            needs_alignment = true;
+        }
+    }
+}
+
+bool alsaCapture::waitForData(int timeoutMs) {
+    TRACE_SCOPE("alsaCapture::waitForData");
+    std::lock_guard<std::recursive_mutex> lock(device_mutex);
+    if (synthetic) {
+        // Periods become available in real time, as from a device
+        int64_t waitUs = synthetic_start_us + int64_t(periods_read + 1) * getPeriodDurationUs() - mediaClockMicros();
+        if (waitUs > timeoutMs * 1000LL) {
+            mediaClockSleep(timeoutMs * 1000LL);
+            return false;
+        }
+        mediaClockSleep(waitUs);
+        return true;
+    }
+
+    if (inputs.empty() || !inputs[0].pcm_handle) return false;
+
+    // A freshly prepared stream doesn't produce poll events until it's started
+    startPreparedInputs();
+
+    // A period is ready once every input has one, so wait on each in turn
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        snd_pcm_t* handle = inputs[i].pcm_handle;
+        snd_pcm_sframes_t wanted = framesToRead(inputs[i]);
+        for (;;) {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+            // Errors (e.g. overrun) are reported as readable so readFrames() can recover them
+            if (avail < 0 || avail >= wanted) break;
+
+            int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (remaining <= 0) return false;
+
+            int count = snd_pcm_poll_descriptors_count(handle);
+            if (count <= 0) return false;
+            poll_fds.resize(count);
+            snd_pcm_poll_descriptors(handle, poll_fds.data(), count);
+
+            if (poll(poll_fds.data(), count, remaining) <= 0) {
+                return false;
+            }
+
+            unsigned short revents = 0;
+            snd_pcm_poll_descriptors_revents(handle, poll_fds.data(), count, &revents);
+            if (revents & POLLERR) break;
+        }
+    }
+    return true;
+}
+
+void alsaCapture::alignInputs(snd_pcm_sframes_t tolerance) {
+    // The input with the least audio waiting captured its latest sample last;
+    // skip the others forward to it. Separate cards drift apart slowly, so after the
+    // initial alignment a period of slack is allowed before a slip is forced.
+    std::vector<int64_t> delaysUs(inputs.size(), 0);
+    int64_t minDelayUs = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        snd_pcm_sframes_t delay;
+        if (snd_pcm_delay(inputs[i].pcm_handle, &delay) < 0) return;
+        delaysUs[i] = int64_t(delay) * 1000000 / inputs[i].rate;
+        if (i == 0 || delaysUs[i] < minDelayUs) minDelayUs = delaysUs[i];
+    }
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        snd_pcm_sframes_t excess = (delaysUs[i] - minDelayUs) * inputs[i].rate / 1000000;
+        if (excess > tolerance * (snd_pcm_sframes_t)inputs[i].rate / (snd_pcm_sframes_t)sample_rate) {
+            snd_pcm_forward(inputs[i].pcm_handle, excess);
+            if (tolerance > 0) {
+                incrementMetricCounter("audio.input_slips");
+            }
+        }
+    }
+}
+
+snd_pcm_uframes_t alsaCapture::framesToRead(const alsaInput& input) const {
+    if (input.resampler == nullptr) return frames;
+    snd_pcm_uframes_t needed = input.resampler->inputFramesNeeded(frames);
+    return std::min<snd_pcm_uframes_t>(needed, input.native_planes[0].size());
+}
+
+int alsaCapture::readInput(alsaInput& input, snd_pcm_uframes_t count) {
     static int overrun_count = 0;
     static auto last_overrun = std::chrono::steady_clock::now();
     
     // Check available frames and handle errors
-    snd_pcm_sframes_t avail = snd_pcm_avail(pcm_handle);
+    snd_pcm_sframes_t avail = snd_pcm_avail(input.pcm_handle);
     
     if (avail < 0) {
         // Handle overrun
@@ -268,42 +571,167 @@ int alsaCapture::readFrames(char* outbuffer, int outFrames) {
             auto now = std::chrono::steady_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_overrun);
             std::cerr << "Overrun #" << ++overrun_count 
+                      << " on " << input.device
                       << " occurred after " << duration.count() << "ms" 
                       << std::endl;
             last_overrun = now;
+            incrementMetricCounter("audio.overruns");
+            needs_alignment = true;
         }
         
         // Try to recover from error
-        if ((avail = snd_pcm_recover(pcm_handle, avail, 0)) < 0) {
+        if ((avail = snd_pcm_recover(input.pcm_handle, avail, 0)) < 0) {
             std::cerr << "Recovery failed: " << snd_strerror(avail) << std::endl;
             return avail;
         }
         // Re-check available frames after recovery
-        avail = snd_pcm_avail(pcm_handle);
+        avail = snd_pcm_avail(input.pcm_handle);
     }
 
     // Read the frames
-    int pcm = snd_pcm_readi(pcm_handle, buffer.data(), frames);
+    if (count == 0) return 0;
+    int pcm = snd_pcm_readi(input.pcm_handle, input.buffer.data(), count);
     if (pcm < 0) {
         std::cerr << "ERROR. Can't read: " << snd_strerror(pcm) << std::endl;
-        return pcm;
     }
+    return pcm;
+}
 
-    // Calculate bytes to copy based on actual frames read
-    size_t bytes_to_copy = pcm * num_channels * (bit_depth / 8);
-    // std::cout << "Frames read: " << pcm << ", Bytes to copy: " << bytes_to_copy << std::endl;
-    
-    if (bytes_to_copy > 0) {
-        // Verify output buffer size
-        size_t max_copy = outFrames * num_channels * (bit_depth / 8);
-        if (bytes_to_copy > max_copy) {
-            std::cerr << "WARNING: Truncating output, buffer too small" << std::endl;
-            bytes_to_copy = max_copy;
+bool alsaCapture::resampleInput(alsaInput& input, int frames_read, float* const* planes) {
+    auto started = std::chrono::steady_clock::now();
+    input.deinterleave(input.buffer.data(), frames_read, input.native_plane_ptrs.data());
+    input.resampler->push(input.native_plane_ptrs.data(), frames_read);
+
+    // The newest frame was captured as long ago as the audio still queued behind it
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(input.pcm_handle, &delay) == 0 && delay >= 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        input.resampler->trackClock(int64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000 -
+                                    int64_t(delay) * 1000000 / input.rate);
+        setMetricGauge(input.metric_prefix + "clock_ppm", input.resampler->getAdjustPpm());
+        setMetricGauge(input.metric_prefix + "clock_error_ms", input.resampler->getClockErrorMs());
+    }
+
+    bool pulled = input.resampler->pull(planes, frames);
+    setMetricGauge(input.metric_prefix + "resample_us", std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started).count());
+    return pulled;
+}
+
+int alsaCapture::readSyntheticFrames(char* outbuffer, int outFrames) {
+    int count = std::min<int>(frames, outFrames);
+    const double step = 2 * M_PI * AUDIO_SYNTHETIC_TONE_HZ / sample_rate;
+    const double amplitude = 0.1 * 32767;  // -20 dBFS
+
+    // A device only buffers so much; drop what would have been overwritten
+    int64_t backlogUs = mediaClockMicros() - synthetic_start_us - int64_t(periods_read + 1) * getPeriodDurationUs();
+    if (backlogUs > int64_t(periods) * getPeriodDurationUs()) {
+        periods_read += backlogUs / getPeriodDurationUs() - periods;
+        incrementMetricCounter("audio.overruns");
+    }
+    uint64_t sample = uint64_t(periods_read) * frames;
+
+    // Computed from the sample index, so every run produces the same samples. With
+    // sync markers on, the tone only sounds as a beep at each marker instant.
+    bool beeps = avSyncMarkersEnabled();
+    unsigned char* out = reinterpret_cast<unsigned char*>(outbuffer);
+    for (int i = 0; i < count; ++i, ++sample) {
+        int16_t value = 0;
+        if (!beeps || avSyncBeepActive(synthetic_start_us + int64_t(sample * 1000000 / sample_rate))) {
+            value = int16_t(std::lround(amplitude * std::sin(step * double(sample % sample_rate))));
+        }
+        for (unsigned int c = 0; c < num_channels; ++c) {
+            *out++ = uint16_t(value) >> 8;
+            *out++ = uint16_t(value) & 0xFF;
         }
-        memcpy(outbuffer, buffer.data(), bytes_to_copy);
     }
 
-    return pcm;
+    period_timestamp_us = synthetic_start_us + int64_t(periods_read) * getPeriodDurationUs();
+    if (frame_publisher != nullptr) {
+        frame_publisher->publish(outbuffer, count * num_channels * (bit_depth / 8), periods_read,
+                                 period_timestamp_us, 0);
+    }
+    ++periods_read;
+    return count;
+}
+
+int alsaCapture::readFrames(char* outbuffer, int outFrames) {
+    TRACE_SCOPE("alsaCapture::readFrames");
+    std::lock_guard<std::recursive_mutex> lock(device_mutex);
+    if (synthetic) {
+        return readSyntheticFrames(outbuffer, outFrames);
+    }
+
+    if (needs_alignment) {
+        if (inputs.size() > 1) {
+            alignInputs(0);
+        }
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (inputs[i].resampler) inputs[i].resampler->restartClock();
+        }
+        needs_alignment = false;
+    }
+
+    // One period from every input, unpacked to float planes; a short read on any
+    // of them shortens the period
+    int count = frames;
+    for (size_t i = 0, plane = 0; i < inputs.size(); plane += inputs[i].channels, ++i) {
+        alsaInput& input = inputs[i];
+        int pcm = readInput(input, framesToRead(input));
+        if (pcm < 0) {
+            return pcm;
+        }
+        if (input.resampler) {
+            if (!resampleInput(input, pcm, &input_plane_ptrs[plane])) count = 0;
+        } else {
+            input.deinterleave(input.buffer.data(), pcm, &input_plane_ptrs[plane]);
+            if (pcm < count) count = pcm;
+        }
+    }
+
+    // Resampled inputs are each locked to the monotonic clock; the rest can only be
+    // kept together by slipping
+    if (inputs.size() > 1 && !AUDIO_RESAMPLER_ENABLED) {
+        alignInputs(frames);
+    }
+
+    if (count > outFrames) {
+        std::cerr << "WARNING: Truncating output, buffer too small" << std::endl;
+        count = outFrames;
+    }
+    if (count <= 0) {
+        return count;
+    }
+
+    // Sum each route into its output channel
+    for (unsigned int c = 0; c < num_channels; ++c) {
+        std::fill(output_planes[c].begin(), output_planes[c].begin() + count, 0.0f);
+    }
+    for (size_t r = 0; r < routes.size(); ++r) {
+        mixWithGain(output_plane_ptrs[routes[r].output_channel], input_plane_ptrs[routes[r].input_plane],
+                    routes[r].gain, count);
+    }
+    interleaveToS16BE(output_plane_ptrs.data(), num_channels, count, outbuffer);
+
+    // Back-date to the period's first sample: what is still queued in the device
+    // and in the resampler, both at the device rate, plus what we just produced
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    snd_pcm_sframes_t delay = 0;
+    if (snd_pcm_delay(inputs[0].pcm_handle, &delay) < 0 || delay < 0) delay = 0;
+    double queuedInput = delay;
+    if (inputs[0].resampler) queuedInput += inputs[0].resampler->pendingInputFrames();
+    period_timestamp_us = int64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000 -
+                          int64_t(queuedInput * 1e6 / inputs[0].rate + count * 1e6 / sample_rate);
+
+    if (frame_publisher != nullptr) {
+        frame_publisher->publish(outbuffer, count * num_channels * (bit_depth / 8), periods_read,
+                                 period_timestamp_us, 0);
+    }
+    ++periods_read;
+
+    return count;
 }
 
 } // namespace alsa_rtsp
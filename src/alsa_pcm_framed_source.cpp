@@ -1,44 +1,135 @@
 #include "alsa_pcm_framed_source.h"
 #include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include "trace.h"
+#include <algorithm>
 
 namespace alsa_rtsp {
 
-alsaPcmFramedSource* alsaPcmFramedSource::createNew(UsageEnvironment& env, alsaCapture* capture) {
-    return new alsaPcmFramedSource(env, capture);
+alsaPcmFramedSource* alsaPcmFramedSource::createNew(UsageEnvironment& env, alsaCapture* capture, streamSizer* sizer) {
+    return new alsaPcmFramedSource(env, capture, sizer);
 }
 
-alsaPcmFramedSource::alsaPcmFramedSource(UsageEnvironment& env, alsaCapture* capture)
-    : FramedSource(env), fCapture(capture), fCurTimestamp(0) {  // Start at 1 second
+alsaPcmFramedSource::alsaPcmFramedSource(UsageEnvironment& env, alsaCapture* capture, streamSizer* sizer)
+    : FramedSource(env), fCapture(capture), fSizer(sizer), fCurTimestamp(0), fClockStartUs(mediaClockMicros()),
+      fWatchdog("audio_capture", AUDIO_STALL_TIMEOUT_MS, [capture]() { return capture->recover(); }),
+      fSilenceDetector(AUDIO_SILENCE_THRESHOLD_DBFS,
+                       AUDIO_SILENCE_HANGOVER_MS * 1000 / capture->getPeriodDurationUs()),
+      fLastPeriodUs(mediaClockMicros()), fBridgedPeriods(0), fCoveredUntilUs(0),
+      fPeriodDurationUs(capture->getPeriodDurationUs()),
+      fTimestampIncrement(capture->getPeriodDurationUs() * 9 / 100),
+      fPollTimeoutMs(2 * capture->getPeriodDurationUs() / 1000) {
+    fCapture->addStreamReader();
     fFrameSize = fCapture->getBufferSize();
     if (fFrameSize > (1024 * 1024 * 10)) { // 10MB limit
         handleClosure();
         return;
     }
     fBuffer = new char[fFrameSize];
-    gettimeofday(&fInitialTime, NULL);
+    mediaClockWallTime(fInitialTime);
     
 
-    // logMessage("Audio timing: " + std::to_string(TIMESTAMP_INCREMENT) + " ticks per packet");
+    // logMessage("Audio timing: " + std::to_string(fTimestampIncrement) + " ticks per packet");
 }
 
 alsaPcmFramedSource::~alsaPcmFramedSource() {
+    fCapture->removeStreamReader();
     delete[] fBuffer;
     logMessage("Successfully destroyed alsaPcmFramedSource.");
 }
 
 void alsaPcmFramedSource::doGetNextFrame() {
+    TRACE_SCOPE("alsaPcmFramedSource::doGetNextFrame");
     if (!isCurrentlyAwaitingData()) return;
 
-    // Read exactly 320 samples (one packet)
-    int frames = fCapture->readFrames(fBuffer, NUM_OF_FRAMES_PER_PERIOD);
+    // While the watchdog reopens the device, keep clients fed with silence in real time
+    if (fWatchdog.isRecovering()) {
+        nextTask() = envir().taskScheduler().scheduleDelayedTask(fPeriodDurationUs, deliverSilence, this);
+        return;
+    }
+
+    if (deferToCaptureTime()) {
+        return;
+    }
+
+    if (!fCapture->waitForData(fPollTimeoutMs)) {
+        // Already waited the poll timeout
+        bridgeStall(0);
+        return;
+    }
+
+    // Read exactly one period (one packet)
+    int frames = fCapture->readFrames(fBuffer, fCapture->getFramesPerPeriod());
     if (frames < 0) {
-        handleClosure();
+        bridgeStall(fPeriodDurationUs);
         return;
     }
+    fWatchdog.reportFrame();
+    fLastPeriodUs = mediaClockMicros();
 
-    // Calculate size in bytes (320 samples * channels * bytes_per_sample)
+    // Once the device catches up after a gap, what it held back for the time
+    // silence already covered would put audio behind video for good; drop it
+    int64_t captureUs = fCapture->getPeriodTimestampUs();
+    if (fBridgedPeriods > 0 && fCoveredUntilUs > 0 && captureUs + fPeriodDurationUs / 2 < fCoveredUntilUs) {
+        incrementMetricCounter("audio.dropped_periods");
+        nextTask() = envir().taskScheduler().scheduleDelayedTask(0, retryGetNextFrame, this);
+        return;
+    }
+    fBridgedPeriods = 0;
+    fCoveredUntilUs = captureUs + fPeriodDurationUs;
+
+    // Calculate size in bytes (samples * channels * bytes_per_sample)
     fFrameSize = frames * fCapture->getChannels() * (fCapture->getBitDepth() / 8);
-    
+
+    audioLevel level = measureAudioLevel(fBuffer, frames * fCapture->getChannels());
+    setMetricGauge("audio.rms_dbfs", level.rmsDbfs);
+    setMetricGauge("audio.peak_dbfs", level.peakDbfs);
+
+    if (AUDIO_DTX_ENABLED && !fSilenceDetector.update(level)) {
+        // Suppress this period but keep the clock running, so RTP timestamps
+        // stay continuous when speech resumes
+        fCurTimestamp += fTimestampIncrement;
+        incrementMetricCounter("audio.suppressed_periods");
+        nextTask() = envir().taskScheduler().scheduleDelayedTask(0, retryGetNextFrame, this);
+        return;
+    }
+    incrementMetricCounter("audio.sent_periods");
+
+    deliverPeriods(frames, 1);
+}
+
+void alsaPcmFramedSource::bridgeStall(unsigned retryDelayUs) {
+    // A period that is merely late goes out when it comes. Over AUDIO_GAP_TIMEOUT_MS
+    // it is a gap: silence stands in for the periods that passed, so the clock
+    // keeps running in step with video.
+    int64_t gapUs = mediaClockMicros() - fLastPeriodUs;
+    int64_t missedPeriods = gapUs / fPeriodDurationUs - fBridgedPeriods;
+    if (gapUs < AUDIO_GAP_TIMEOUT_MS * 1000LL || missedPeriods <= 0) {
+        nextTask() = envir().taskScheduler().scheduleDelayedTask(retryDelayUs, retryGetNextFrame, this);
+        return;
+    }
+    fWatchdog.reportStall();
+
+    // As many as fit in one packet; the rest go with the next poll
+    size_t periodBytes = fCapture->getFramesPerPeriod() * fCapture->getChannels() * (fCapture->getBitDepth() / 8);
+    int64_t fitting = std::max<int64_t>(1, std::min<size_t>(fCapture->getBufferSize(), fMaxSize) / periodBytes);
+    deliverPeriods(0, (unsigned)std::min(missedPeriods, fitting));
+}
+
+void alsaPcmFramedSource::deliverPeriods(int frames, unsigned periods) {
+    if (frames == 0) {
+        // Bridging a stall: send silence covering the given number of periods
+        frames = fCapture->getFramesPerPeriod() * periods;
+        fFrameSize = frames * fCapture->getChannels() * (fCapture->getBitDepth() / 8);
+        memset(fBuffer, 0, fFrameSize);
+        incrementMetricCounter("audio.silence_periods", periods);
+        fBridgedPeriods += periods;
+        if (fCoveredUntilUs > 0) {
+            fCoveredUntilUs += (int64_t)fPeriodDurationUs * periods;
+        }
+    }
+
     // Calculate presentation time from start
     unsigned long long elapsedMicros = (fCurTimestamp / 90) * 1000;  // Convert from 90kHz to microseconds
     fPresentationTime = fInitialTime;
@@ -49,9 +140,13 @@ void alsaPcmFramedSource::doGetNextFrame() {
         fPresentationTime.tv_usec %= 1000000;
     }
 
-    // Each packet is 20ms (320/16000 seconds)
-    fDurationInMicroseconds = 20000;
+    // Each packet is one period (20 ms in the balanced profile). live555 paces by
+    // gettimeofday(); under the virtual clock the source paces itself.
+    fDurationInMicroseconds = isVirtualClock() ? 0 : fPeriodDurationUs * periods;
 
+    if (fSizer != nullptr) {
+        fSizer->addFrame(fFrameSize, fFrameSize > fMaxSize);
+    }
     if (fFrameSize > fMaxSize) {
         fNumTruncatedBytes = fFrameSize - fMaxSize;
         fFrameSize = fMaxSize;
@@ -61,10 +156,33 @@ void alsaPcmFramedSource::doGetNextFrame() {
 
     memcpy(fTo, fBuffer, fFrameSize);
     
-    // Increment by 1800 ticks (90000/50 or 320 samples * (90000/16000))
-    fCurTimestamp += TIMESTAMP_INCREMENT;
+    // Increment by one period in 90 kHz ticks (1800 for 20 ms)
+    fCurTimestamp += fTimestampIncrement * periods;
 
     FramedSource::afterGetting(this);
 }
 
+bool alsaPcmFramedSource::deferToCaptureTime() {
+    // Under the virtual clock nothing blocks, so the period waits on the scheduler
+    // until the device would have captured all of it
+    if (!isVirtualClock()) return false;
+
+    int64_t waitUs = fClockStartUs + (int64_t)(fCurTimestamp * 100 / 9) + fPeriodDurationUs - mediaClockMicros();
+    if (waitUs <= 0) return false;
+    nextTask() = envir().taskScheduler().scheduleDelayedTask(waitUs, retryGetNextFrame, this);
+    return true;
+}
+
+void alsaPcmFramedSource::deliverSilence(void* clientData) {
+    alsaPcmFramedSource* source = static_cast<alsaPcmFramedSource*>(clientData);
+    source->nextTask() = NULL;
+    source->deliverPeriods(0, 1);
+}
+
+void alsaPcmFramedSource::retryGetNextFrame(void* clientData) {
+    alsaPcmFramedSource* source = static_cast<alsaPcmFramedSource*>(clientData);
+    source->nextTask() = NULL;
+    source->doGetNextFrame();
+}
+
 } // namespace alsa_rtsp
\ No newline at end of file
@@ -1,48 +1,175 @@
 #include "alsa_pcm_media_subsession.h"
 #include "alsa_pcm_framed_source.h"
 #include "logger.h"
+#include "trace.h"
+#include <GroupsockHelper.hh>
 
 namespace alsa_rtsp {
 
+// What the groupsock adds to each packet after the sink built it
+static const unsigned RTP_EXTENSION_BYTES = ABS_CAPTURE_TIME_ENABLED ? ABS_CAPTURE_TIME_EXTENSION_SIZE : 0;
+
 alsaPcmMediaSubsession* alsaPcmMediaSubsession::createNew(UsageEnvironment& env, alsaCapture* capture, Boolean reuseFirstSource) {
     return new alsaPcmMediaSubsession(env, capture, reuseFirstSource);
 }
 
 alsaPcmMediaSubsession::alsaPcmMediaSubsession(UsageEnvironment& env, alsaCapture* capture, Boolean reuseFirstSource)
-    : OnDemandServerMediaSubsession(env, reuseFirstSource), fCapture(capture) {}
+    : OnDemandServerMediaSubsession(env, reuseFirstSource), fCapture(capture),
+      // A stall is bridged with up to two periods of silence in one frame
+      fSizer("audio", capture->getSampleRate() * capture->getChannels() * capture->getBitDepth(),
+             2 * capture->getFramesPerPeriod() * capture->getChannels() * (capture->getBitDepth() / 8),
+             RTP_MAX_PACKET_SIZE - RTP_EXTENSION_BYTES - 12,
+             RTP_PACKET_OVERHEAD + RTP_EXTENSION_BYTES + (SRTP_ENABLED ? SRTP_AUTH_TAG_LENGTH : 0)),
+      fRtpGroupsock(NULL),
+      fNewRtpGroupsock(NULL),
+      fSdpHasSsrcGroup(false),
+      fSdpMediaSsrc(0) {
+    // One key for the subsession: with reuseFirstSource every client gets the same packets
+    fSrtpEnabled = SRTP_ENABLED && generateSrtpMasterKey(fSrtpMasterKey);
+    if (SRTP_ENABLED && !fSrtpEnabled) {
+        logMessage("Failed to generate SRTP key for audio; streaming without SRTP");
+    }
+
+    fSizer.setChangeListener([this]() {
+        if (fRtpGroupsock != NULL) {
+            setSendBufferTo(envir(), fRtpGroupsock->socketNum(), fSizer.sendBufferSize());
+        }
+    });
+}
 
 FramedSource* alsaPcmMediaSubsession::createNewStreamSource(unsigned clientSessionId, unsigned& estBitrate) {
-    estBitrate = fCapture->getSampleRate() * fCapture->getChannels() * fCapture->getBitDepth() / 1000;
-    return alsaPcmFramedSource::createNew(envir(), fCapture);
+    TRACE_SCOPE("alsaPcmMediaSubsession::createNewStreamSource");
+    // Includes the packet headers, which at 20 ms periods are a noticeable share
+    estBitrate = fSizer.estimatedKbps();
+    return alsaPcmFramedSource::createNew(envir(), fCapture, &fSizer);
 }
 
 RTPSink* alsaPcmMediaSubsession::createNewRTPSink(Groupsock* rtpGroupsock, unsigned char rtpPayloadTypeIfDynamic, FramedSource* inputSource) {
+    TRACE_SCOPE("alsaPcmMediaSubsession::createNewRTPSink");
     logMessage("Creating new RTP sink with payload type: 97");
-    return SimpleRTPSink::createNew(envir(), rtpGroupsock,
+    SimpleRTPSink* sink = SimpleRTPSink::createNew(envir(), rtpGroupsock,
                                    97, // payload type
                                    fCapture->getSampleRate(),
                                    "audio", "L16",
                                    fCapture->getChannels(),
                                    False, // Don't set "rtptime" timestamp
                                    True); // Set "marker" bit on last packet
+    if (ABS_CAPTURE_TIME_ENABLED) {
+        sink->setPacketSizes(1000, RTP_MAX_PACKET_SIZE - RTP_EXTENSION_BYTES);
+    }
+    // The live stream's sink, not the one the SDP is built with
+    if (fRtpGroupsock != NULL && rtpGroupsock == fRtpGroupsock) {
+        fRtpGroupsock->setMediaSsrc(sink->SSRC());
+    }
+    return sink;
 }
 
 void alsaPcmMediaSubsession::deleteStream(unsigned clientSessionId, void*& streamToken) {
+    TRACE_SCOPE("alsaPcmMediaSubsession::deleteStream");
     logMessage("Deleting audio stream for client session: 97");
+    RTPSink* sink = streamToken != NULL ? static_cast<StreamState*>(streamToken)->rtpSink() : NULL;
+    Groupsock* streamGroupsock = sink != NULL ? &sink->groupsockBeingUsed() : NULL;
     OnDemandServerMediaSubsession::deleteStream(clientSessionId, streamToken);
+    // The base class cleared the token if it deleted the stream, groupsocks included
+    if (streamToken == NULL && streamGroupsock == fRtpGroupsock) {
+        fRtpGroupsock = NULL;
+    }
     if (!fCapture->reset()) {
         envir() << "Failed to reset ALSA capture device. Attempting to continue without reset.\n";
     }
 }
 
+char const* alsaPcmMediaSubsession::sdpLines(int addressFamily) {
+    // Rebuilt when a stream started or ended and with it the RTX SSRC group
+    u_int32_t mediaSsrc = 0;
+    u_int32_t rtxSsrc = 0;
+    bool ssrcGroup = fRtpGroupsock != NULL && fRtpGroupsock->rtxSsrcGroup(mediaSsrc, rtxSsrc);
+    if (fSDPLines != NULL && (ssrcGroup != fSdpHasSsrcGroup || mediaSsrc != fSdpMediaSsrc)) {
+        delete[] fSDPLines;
+        fSDPLines = NULL;
+    }
+
+    bool fresh = fSDPLines == NULL;
+    char const* lines = OnDemandServerMediaSubsession::sdpLines(addressFamily);
+    if (fresh && lines != NULL) {
+        char* withRtx = addRtxToSdpLines(lines, fCapture->getSampleRate(), false);
+        delete[] fSDPLines;
+        fSDPLines = withRtx;
+
+        if (ssrcGroup) {
+            char* withGroup = addRtxSsrcGroupToSdpLines(fSDPLines, mediaSsrc, rtxSsrc);
+            delete[] fSDPLines;
+            fSDPLines = withGroup;
+        }
+        fSdpHasSsrcGroup = ssrcGroup;
+        fSdpMediaSsrc = mediaSsrc;
+
+        if (ABS_CAPTURE_TIME_ENABLED) {
+            char* withExtension = addAbsCaptureTimeToSdpLines(fSDPLines, RTP_EXT_ABS_CAPTURE_TIME_ID);
+            delete[] fSDPLines;
+            fSDPLines = withExtension;
+        }
+
+        if (fSrtpEnabled) {
+            char* withSrtp = addSrtpToSdpLines(fSDPLines, fSrtpMasterKey);
+            delete[] fSDPLines;
+            fSDPLines = withSrtp;
+        }
+    }
+    return fSDPLines;
+}
+
+Groupsock* alsaPcmMediaSubsession::createGroupsock(struct sockaddr_storage const& addr, Port port) {
+    // Port 0 is the throwaway groupsock the base class builds the SDP with;
+    // it must not replace the live stream's RTP groupsock
+    if (port.num() == 0) {
+        return OnDemandServerMediaSubsession::createGroupsock(addr, port);
+    }
+
+    // RTP goes out on the even port, RTCP comes back on the odd one
+    if (ntohs(port.num()) % 2 == 1) {
+        rtcpFeedbackGroupsock* rtcpGroupsock = new rtcpFeedbackGroupsock(envir(), addr, port, onRtcpFeedback, this,
+                                                                         fSrtpEnabled ? fSrtpMasterKey : NULL);
+        // The RTP groupsock was created right before; if this one failed, live555
+        // deletes both and retries on other ports
+        if (rtcpGroupsock->socketNum() >= 0 && fNewRtpGroupsock != NULL) {
+            fRtpGroupsock = fNewRtpGroupsock;
+        }
+        fNewRtpGroupsock = NULL;
+        return rtcpGroupsock;
+    }
+    rtxGroupsock* rtpGroupsock = new rtxGroupsock(envir(), addr, port, RTX_AUDIO_HISTORY_PACKETS, NULL,
+                                                  fSrtpEnabled ? fSrtpMasterKey : NULL);
+    if (ABS_CAPTURE_TIME_ENABLED) {
+        rtpGroupsock->enableAbsCaptureTime(RTP_EXT_ABS_CAPTURE_TIME_ID, captureTimeUs, this);
+    }
+    fNewRtpGroupsock = rtpGroupsock->socketNum() >= 0 ? rtpGroupsock : NULL;
+    return rtpGroupsock;
+}
+
+int64_t alsaPcmMediaSubsession::captureTimeUs(void* clientData) {
+    // Each packet is one period; a bridged silence packet reuses the last period's time
+    alsaPcmMediaSubsession* subsession = static_cast<alsaPcmMediaSubsession*>(clientData);
+    int64_t timestamp = subsession->fCapture->getPeriodTimestampUs();
+    return timestamp > 0 ? timestamp : -1;
+}
+
+void alsaPcmMediaSubsession::onRtcpFeedback(void* clientData, rtcpFeedbackGroupsock::FeedbackType type,
+                                            u_int32_t mediaSsrc, u_int16_t lostSeq, unsigned sessionId) {
+    alsaPcmMediaSubsession* subsession = static_cast<alsaPcmMediaSubsession*>(clientData);
+    if (type == rtcpFeedbackGroupsock::FEEDBACK_NACK && subsession->fRtpGroupsock != NULL) {
+        subsession->fRtpGroupsock->retransmit(lostSeq, mediaSsrc, sessionId);
+    }
+}
+
 char const* alsaPcmMediaSubsession::getAuxSDPLine(RTPSink* rtpSink, FramedSource* inputSource) {
     // Critical SDP configuration for PCM audio
     // Note: L16 (Linear 16-bit PCM) format must be exactly "L16/<sample-rate>/<channels>"
     const char* fmtpFmt = 
             "a=rtpmap:97 L16/%u/%u\r\n"             // payload type, sample rate, channels
             "a=fmtp:97 channels=%u;byte-order=big-endian\r\n"  // Added byte-order
-            "a=ptime:20\r\n"                        // 20ms packets for 16kHz
-            "a=maxptime:20\r\n"                     // max packet time
+            "a=ptime:%u\r\n"                        // Packet duration follows the ALSA period
+            "a=maxptime:%u\r\n"                     // max packet time
             "a=sendonly\r\n"                        // This is a capture-only stream
             "a=clock-domain:PTP=IEEE1588-2008\r\n"; // Add precise timing info
     // Ensure we have enough space for the formatted string
@@ -52,12 +179,15 @@ char const* alsaPcmMediaSubsession::getAuxSDPLine(RTPSink* rtpSink, FramedSource
     // Get parameters - ensure they're valid
     unsigned int sampleRate = fCapture->getSampleRate();
     unsigned int channels = fCapture->getChannels();
+    unsigned int ptimeMs = fCapture->getPeriodDurationUs() / 1000;
     
     // Format the SDP line with proper parameter order
     snprintf(fmtpLine, fmtpLineSize, fmtpFmt,
             sampleRate,    // Sample rate first
             channels,      // Number of channels second
-            channels);     // Channels again for fmtp line
+            channels,      // Channels again for fmtp line
+            ptimeMs,
+            ptimeMs);
 
     return fmtpLine;
 }
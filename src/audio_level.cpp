@@ -0,0 +1,115 @@
+#include "audio_level.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIO_LEVEL_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define AUDIO_LEVEL_SSE2 1
+#endif
+
+namespace alsa_rtsp {
+
+static const float SILENCE_FLOOR_DBFS = -96.0f;
+
+static float toDbfs(double amplitude) {
+    if (amplitude <= 0.0) return SILENCE_FLOOR_DBFS;
+    float db = static_cast<float>(20.0 * std::log10(amplitude / 32768.0));
+    return db < SILENCE_FLOOR_DBFS ? SILENCE_FLOOR_DBFS : db;
+}
+
+audioLevel measureAudioLevel(const char* samples, size_t numSamples) {
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(samples);
+    uint64_t sumSquares = 0;
+    int peak = 0;
+    size_t i = 0;
+
+#if defined(AUDIO_LEVEL_NEON)
+    uint64x2_t acc = vdupq_n_u64(0);
+    int16x8_t maxAbs = vdupq_n_s16(0);
+    for (; i + 8 <= numSamples; i += 8) {
+        // Swap bytes to get native-endian samples
+        int16x8_t v = vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(in + i * 2)));
+        int32x4_t lo = vmull_s16(vget_low_s16(v), vget_low_s16(v));
+        int32x4_t hi = vmull_s16(vget_high_s16(v), vget_high_s16(v));
+        acc = vpadalq_u32(acc, vreinterpretq_u32_s32(lo));
+        acc = vpadalq_u32(acc, vreinterpretq_u32_s32(hi));
+        maxAbs = vmaxq_s16(maxAbs, vqabsq_s16(v));
+    }
+    sumSquares = vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+    int16_t lanes[8];
+    vst1q_s16(lanes, maxAbs);
+    for (int l = 0; l < 8; ++l) {
+        if (lanes[l] > peak) peak = lanes[l];
+    }
+#elif defined(AUDIO_LEVEL_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    __m128i maxAbs = _mm_setzero_si128();
+    for (; i + 8 <= numSamples; i += 8) {
+        __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 2));
+        // Swap bytes to get native-endian samples
+        __m128i v = _mm_or_si128(_mm_slli_epi16(raw, 8), _mm_srli_epi16(raw, 8));
+        // Each 32-bit lane holds the sum of two squares, which fits unsigned
+        __m128i sq = _mm_madd_epi16(v, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+        maxAbs = _mm_max_epi16(maxAbs, _mm_max_epi16(v, _mm_subs_epi16(zero, v)));
+    }
+    uint64_t accLanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(accLanes), acc);
+    sumSquares = accLanes[0] + accLanes[1];
+    int16_t lanes[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), maxAbs);
+    for (int l = 0; l < 8; ++l) {
+        if (lanes[l] > peak) peak = lanes[l];
+    }
+#endif
+
+    // Scalar tail (or whole buffer without SIMD)
+    for (; i < numSamples; ++i) {
+        int sample = static_cast<int16_t>((in[i * 2] << 8) | in[i * 2 + 1]);
+        sumSquares += static_cast<uint64_t>(sample * sample);
+        int magnitude = std::abs(sample);
+        if (magnitude > peak) peak = magnitude;
+    }
+
+    audioLevel level;
+    if (numSamples == 0) {
+        level.rmsDbfs = SILENCE_FLOOR_DBFS;
+        level.peakDbfs = SILENCE_FLOOR_DBFS;
+        return level;
+    }
+    level.rmsDbfs = toDbfs(std::sqrt(static_cast<double>(sumSquares) / numSamples));
+    level.peakDbfs = toDbfs(peak);
+    return level;
+}
+
+silenceDetector::silenceDetector(float thresholdDbfs, unsigned hangoverPeriods)
+    : threshold_dbfs(thresholdDbfs)
+    , hangover_periods(hangoverPeriods)
+    , quiet_periods(0)
+    , silent(false) {
+}
+
+bool silenceDetector::update(const audioLevel& level) {
+    if (level.rmsDbfs >= threshold_dbfs) {
+        // Speech (or any activity) resumes transmission immediately
+        quiet_periods = 0;
+        silent = false;
+        return true;
+    }
+
+    if (quiet_periods < hangover_periods) {
+        ++quiet_periods;
+        return true;
+    }
+
+    silent = true;
+    return false;
+}
+
+} // namespace alsa_rtsp
@@ -0,0 +1,141 @@
+#include "audio_mix.h"
+#include <cstdint>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIO_MIX_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define AUDIO_MIX_SSE2 1
+#endif
+
+namespace alsa_rtsp {
+
+template <sampleFormat Format> struct sampleTraits;
+
+template <> struct sampleTraits<SAMPLE_FORMAT_S16> {
+    typedef int16_t stored;
+    static float decode(int16_t v) { return v * (1.0f / 32768.0f); }
+};
+
+template <> struct sampleTraits<SAMPLE_FORMAT_S24> {
+    typedef int32_t stored;
+    // Sign-extend from bit 23; the top byte of the container is padding
+    static float decode(int32_t v) { return (static_cast<int32_t>(static_cast<uint32_t>(v) << 8) >> 8) * (1.0f / 8388608.0f); }
+};
+
+template <> struct sampleTraits<SAMPLE_FORMAT_S32> {
+    typedef int32_t stored;
+    static float decode(int32_t v) { return v * (1.0f / 2147483648.0f); }
+};
+
+template <sampleFormat Format, unsigned Channels>
+static void deinterleave(const void* in, size_t frames, float* const* planes) {
+    typedef typename sampleTraits<Format>::stored stored;
+    const stored* samples = static_cast<const stored*>(in);
+    for (size_t f = 0; f < frames; ++f) {
+        for (unsigned c = 0; c < Channels; ++c) {
+            planes[c][f] = sampleTraits<Format>::decode(samples[f * Channels + c]);
+        }
+    }
+}
+
+template <sampleFormat Format>
+static deinterleaveFunc deinterleaverFor(unsigned channels) {
+    switch (channels) {
+    case 1: return &deinterleave<Format, 1>;
+    case 2: return &deinterleave<Format, 2>;
+    case 3: return &deinterleave<Format, 3>;
+    case 4: return &deinterleave<Format, 4>;
+    case 5: return &deinterleave<Format, 5>;
+    case 6: return &deinterleave<Format, 6>;
+    case 7: return &deinterleave<Format, 7>;
+    case 8: return &deinterleave<Format, 8>;
+    default: return nullptr;
+    }
+}
+
+size_t sampleFormatBytes(sampleFormat format) {
+    return format == SAMPLE_FORMAT_S16 ? 2 : 4;
+}
+
+const char* sampleFormatName(sampleFormat format) {
+    switch (format) {
+    case SAMPLE_FORMAT_S16: return "S16";
+    case SAMPLE_FORMAT_S24: return "S24";
+    case SAMPLE_FORMAT_S32: return "S32";
+    }
+    return "unknown";
+}
+
+deinterleaveFunc getDeinterleaver(sampleFormat format, unsigned channels) {
+    switch (format) {
+    case SAMPLE_FORMAT_S16: return deinterleaverFor<SAMPLE_FORMAT_S16>(channels);
+    case SAMPLE_FORMAT_S24: return deinterleaverFor<SAMPLE_FORMAT_S24>(channels);
+    case SAMPLE_FORMAT_S32: return deinterleaverFor<SAMPLE_FORMAT_S32>(channels);
+    }
+    return nullptr;
+}
+
+void mixWithGain(float* acc, const float* in, float gain, size_t count) {
+    size_t i = 0;
+#if defined(AUDIO_MIX_NEON)
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(acc + i, vmlaq_n_f32(vld1q_f32(acc + i), vld1q_f32(in + i), gain));
+    }
+#elif defined(AUDIO_MIX_SSE2)
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+    }
+#endif
+    for (; i < count; ++i) {
+        acc[i] += in[i] * gain;
+    }
+}
+
+static inline void storeS16BE(float v, char* out) {
+    float scaled = v * 32768.0f;
+    int32_t s = scaled >= 32767.0f ? 32767 : scaled <= -32768.0f ? -32768 : static_cast<int32_t>(scaled);
+    out[0] = static_cast<char>((s >> 8) & 0xff);
+    out[1] = static_cast<char>(s & 0xff);
+}
+
+void interleaveToS16BE(const float* const* planes, unsigned channels, size_t frames, char* out) {
+    size_t f = 0;
+    if (channels == 1) {
+        // The downmixed case: one plane straight to the wire format, eight samples at a time
+        const float* in = planes[0];
+#if defined(AUDIO_MIX_NEON)
+        const float32x4_t scale = vdupq_n_f32(32768.0f);
+        for (; f + 8 <= frames; f += 8) {
+            int32x4_t lo = vcvtq_s32_f32(vmulq_f32(vld1q_f32(in + f), scale));
+            int32x4_t hi = vcvtq_s32_f32(vmulq_f32(vld1q_f32(in + f + 4), scale));
+            int16x8_t s = vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi));
+            vst1q_u8(reinterpret_cast<uint8_t*>(out + f * 2), vrev16q_u8(vreinterpretq_u8_s16(s)));
+        }
+#elif defined(AUDIO_MIX_SSE2)
+        const __m128 scale = _mm_set1_ps(32768.0f);
+        for (; f + 8 <= frames; f += 8) {
+            // cvttps saturates out-of-range values to INT32_MIN; packs then clamps to 16 bits
+            __m128 a = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + f), scale), _mm_set1_ps(32767.0f));
+            __m128 b = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + f + 4), scale), _mm_set1_ps(32767.0f));
+            __m128i s = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+            s = _mm_or_si128(_mm_slli_epi16(s, 8), _mm_srli_epi16(s, 8));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + f * 2), s);
+        }
+#endif
+        for (; f < frames; ++f) {
+            storeS16BE(in[f], out + f * 2);
+        }
+        return;
+    }
+
+    for (; f < frames; ++f) {
+        for (unsigned c = 0; c < channels; ++c) {
+            storeS16BE(planes[c][f], out + (f * channels + c) * 2);
+        }
+    }
+}
+
+} // namespace alsa_rtsp
@@ -0,0 +1,212 @@
+#include "audio_resampler.h"
+#include "constants.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIO_RESAMPLER_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define AUDIO_RESAMPLER_SSE2 1
+#endif
+
+namespace alsa_rtsp {
+
+static const unsigned int RESAMPLER_PHASES = 128;
+static const double KAISER_BETA = 8.0;
+// Ratio steering: ppm per ms of error, and per ms of accumulated error per update
+static const double CLOCK_KP = 20.0;
+static const double CLOCK_KI = 0.2;
+static const double CLOCK_MAX_PPM = 2000.0;
+
+static double besselI0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// Both loads unaligned; taps is a multiple of 4
+static inline float dot(const float* a, const float* b, unsigned int count) {
+    unsigned int i = 0;
+    float sum = 0.0f;
+#if defined(AUDIO_RESAMPLER_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= count; i += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float lanes[4];
+    vst1q_f32(lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(AUDIO_RESAMPLER_SSE2)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < count; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+polyphaseResampler::polyphaseResampler(unsigned int inRate, unsigned int outRate, unsigned int channels)
+    : in_rate(inRate)
+    , out_rate(outRate)
+    , num_channels(channels)
+    , phases(RESAMPLER_PHASES)
+    , history(channels)
+    , buffered(0)
+    , position(0)
+    , nominal_step(double(inRate) / outRate)
+    , step(uint64_t(nominal_step * 4294967296.0))
+    , clock_started(false)
+    , clock_origin_us(0)
+    , pushed_frames(0)
+    , dropped_frames(0)
+    , produced_frames(0)
+    , clock_integral(0)
+    , adjust_ppm(0)
+    , clock_error_ms(0) {
+    // Downsampling narrows the passband to the output Nyquist, which takes
+    // proportionally more taps for the same transition width
+    double ratio = std::max(1.0, nominal_step);
+    taps = (unsigned int)std::ceil(AUDIO_RESAMPLER_TAPS * ratio / 4.0) * 4;
+    cutoff = float(0.5 / ratio * AUDIO_RESAMPLER_CUTOFF);
+
+    // Row k holds the filter delayed by k/phases of an input sample, each normalized to unity gain
+    coefficients.resize((phases + 1) * taps);
+    double center = taps / 2.0 - 1.0;
+    double halfLength = taps / 2.0;
+    for (unsigned int k = 0; k <= phases; ++k) {
+        float* row = &coefficients[k * taps];
+        double sum = 0.0;
+        for (unsigned int j = 0; j < taps; ++j) {
+            double u = double(k) / phases + center - j;
+            double x = 2.0 * cutoff * u;
+            double sinc = std::fabs(x) < 1e-12 ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+            double w = u / halfLength;
+            double window = std::fabs(w) >= 1.0 ? 0.0 : besselI0(KAISER_BETA * std::sqrt(1.0 - w * w)) / besselI0(KAISER_BETA);
+            row[j] = float(2.0 * cutoff * sinc * window);
+            sum += row[j];
+        }
+        for (unsigned int j = 0; j < taps; ++j) {
+            row[j] = float(row[j] / sum);
+        }
+    }
+}
+
+size_t polyphaseResampler::inputFramesNeeded(size_t outFrames) const {
+    if (outFrames == 0) return 0;
+    uint64_t last = position + (outFrames - 1) * step;
+    size_t required = size_t(last >> 32) + taps + 1;
+    return required > buffered ? required - buffered : 0;
+}
+
+void polyphaseResampler::push(const float* const* planes, size_t frames) {
+    for (unsigned int c = 0; c < num_channels; ++c) {
+        history[c].insert(history[c].begin() + buffered, planes[c], planes[c] + frames);
+        history[c].resize(buffered + frames);
+    }
+    buffered += frames;
+    pushed_frames += frames;
+}
+
+bool polyphaseResampler::pull(float* const* planes, size_t outFrames) {
+    if (inputFramesNeeded(outFrames) > 0) {
+        return false;
+    }
+
+    const float scale = 1.0f / 4294967296.0f;
+    for (unsigned int c = 0; c < num_channels; ++c) {
+        const float* in = history[c].data();
+        float* out = planes[c];
+        uint64_t pos = position;
+        for (size_t n = 0; n < outFrames; ++n, pos += step) {
+            size_t index = size_t(pos >> 32);
+            uint32_t fraction = uint32_t(pos);
+            // Blend the two nearest phases
+            uint64_t phasePos = uint64_t(fraction) * phases;
+            unsigned int phase = unsigned(phasePos >> 32);
+            float blend = float(uint32_t(phasePos)) * scale;
+            float a = dot(in + index, &coefficients[phase * taps], taps);
+            float b = dot(in + index, &coefficients[(phase + 1) * taps], taps);
+            out[n] = a + (b - a) * blend;
+        }
+    }
+    position += outFrames * step;
+    produced_frames += outFrames;
+
+    // Drop what no future output can reach
+    size_t consumed = size_t(position >> 32);
+    if (consumed > 0) {
+        for (unsigned int c = 0; c < num_channels; ++c) {
+            history[c].erase(history[c].begin(), history[c].begin() + consumed);
+        }
+        buffered -= consumed;
+        dropped_frames += consumed;
+        position -= uint64_t(consumed) << 32;
+    }
+    return true;
+}
+
+void polyphaseResampler::trackClock(int64_t newestInputUs) {
+    // Where output time says we are vs. when the input we've consumed up to was captured.
+    // Positive: output is running ahead of the monotonic clock, so take bigger input steps.
+    double consumed = dropped_frames + position / 4294967296.0;
+    double consumedAtUs = newestInputUs - (pushed_frames - consumed) * 1e6 / in_rate;
+    if (!clock_started) {
+        // Anchor so the error starts from zero
+        clock_origin_us = consumedAtUs - produced_frames * 1e6 / out_rate;
+        clock_started = true;
+    }
+    double consumedUs = consumedAtUs - clock_origin_us;
+    clock_error_ms = (produced_frames * 1e6 / out_rate - consumedUs) / 1000.0;
+
+    clock_integral += clock_error_ms;
+    // Keep the integral within what it would take to hold the ppm limit on its own
+    clock_integral = std::max(-CLOCK_MAX_PPM / CLOCK_KI, std::min(CLOCK_MAX_PPM / CLOCK_KI, clock_integral));
+    adjust_ppm = std::max(-CLOCK_MAX_PPM, std::min(CLOCK_MAX_PPM, CLOCK_KP * clock_error_ms + CLOCK_KI * clock_integral));
+    step = uint64_t(nominal_step * (1.0 + adjust_ppm * 1e-6) * 4294967296.0);
+}
+
+float polyphaseResampler::responseDb(float frequency) const {
+    // Frequency in cycles per input sample; the phases interleave into one long filter
+    double re = 0.0, im = 0.0;
+    for (unsigned int k = 0; k < phases; ++k) {
+        for (unsigned int j = 0; j < taps; ++j) {
+            double t = j - double(k) / phases;
+            re += coefficients[k * taps + j] * std::cos(2.0 * M_PI * frequency * t);
+            im -= coefficients[k * taps + j] * std::sin(2.0 * M_PI * frequency * t);
+        }
+    }
+    double magnitude = std::sqrt(re * re + im * im) / phases;
+    return float(20.0 * std::log10(std::max(magnitude, 1e-12)));
+}
+
+float polyphaseResampler::passbandRippleDb() const {
+    float worst = 0.0f;
+    for (int i = 0; i <= 16; ++i) {
+        worst = std::max(worst, std::fabs(responseDb(cutoff * 0.8f * i / 16)));
+    }
+    return worst;
+}
+
+float polyphaseResampler::stopbandAttenuationDb() const {
+    // Whatever lands above the lower Nyquist frequency folds back; from here on it lands in the passband
+    // (or, upsampling, where the first image of the passband starts)
+    float stopStart = std::min(1.0f, float(out_rate) / in_rate) - cutoff;
+    float worst = -1000.0f;
+    for (int i = 0; i <= 32; ++i) {
+        worst = std::max(worst, responseDb(stopStart + 0.5f * i / 32));
+    }
+    return -worst;
+}
+
+} // namespace alsa_rtsp
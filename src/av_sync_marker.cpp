@@ -0,0 +1,91 @@
+#include "av_sync_marker.h"
+#include "constants.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+// Identifies our SEI among any others; has no zero bytes, like the rest of the
+// payload, so no emulation prevention is needed
+static const uint8_t MARKER_UUID[16] = {
+    0x61, 0x76, 0x73, 0x2d, 0x73, 0x79, 0x6e, 0x63,
+    0x2d, 0x6d, 0x61, 0x72, 0x6b, 0x65, 0x72, 0x31
+};
+static const size_t MARKER_TEXT_SIZE = 16;  // Index and lateness as 8 hex digits each
+static const size_t MARKER_PAYLOAD_SIZE = sizeof(MARKER_UUID) + MARKER_TEXT_SIZE;
+static const uint8_t SEI_USER_DATA_UNREGISTERED = 5;
+static const unsigned H264_NAL_SEI = 6;
+static const unsigned HEVC_NAL_PREFIX_SEI = 39;
+
+static std::atomic<bool> markersEnabled(false);
+
+void enableAvSyncMarkers() {
+    markersEnabled = true;
+}
+
+bool avSyncMarkersEnabled() {
+    return markersEnabled;
+}
+
+int64_t avSyncMarkerIndex(int64_t captureMicros) {
+    return captureMicros / (AV_SYNC_MARKER_INTERVAL_MS * 1000LL);
+}
+
+int64_t avSyncMarkerTimeUs(int64_t index) {
+    return index * AV_SYNC_MARKER_INTERVAL_MS * 1000LL;
+}
+
+bool avSyncBeepActive(int64_t captureMicros) {
+    return captureMicros >= 0 &&
+           captureMicros - avSyncMarkerTimeUs(avSyncMarkerIndex(captureMicros)) < AV_SYNC_BEEP_MS * 1000LL;
+}
+
+static size_t headerSize(VideoCodec codec) {
+    return codec == VIDEO_CODEC_HEVC ? 2 : 1;
+}
+
+size_t buildAvSyncMarkerNal(VideoCodec codec, int64_t index, uint32_t latenessUs, uint8_t* out, size_t maxSize) {
+    size_t size = headerSize(codec) + 2 + MARKER_PAYLOAD_SIZE + 1;
+    if (size > maxSize) return 0;
+
+    uint8_t* p = out;
+    if (codec == VIDEO_CODEC_HEVC) {
+        *p++ = HEVC_NAL_PREFIX_SEI << 1;
+        *p++ = 0x01;  // nuh_temporal_id_plus1
+    } else {
+        *p++ = H264_NAL_SEI;
+    }
+    *p++ = SEI_USER_DATA_UNREGISTERED;
+    *p++ = MARKER_PAYLOAD_SIZE;
+    memcpy(p, MARKER_UUID, sizeof(MARKER_UUID));
+    p += sizeof(MARKER_UUID);
+
+    char text[MARKER_TEXT_SIZE + 1];
+    snprintf(text, sizeof(text), "%08x%08x", (uint32_t)index, latenessUs);
+    memcpy(p, text, MARKER_TEXT_SIZE);
+    p += MARKER_TEXT_SIZE;
+    *p++ = 0x80;  // rbsp_trailing_bits
+    return p - out;
+}
+
+bool parseAvSyncMarkerNal(VideoCodec codec, const uint8_t* nal, size_t size, int64_t& index, uint32_t& latenessUs) {
+    size_t header = headerSize(codec);
+    if (size < header + 2 + MARKER_PAYLOAD_SIZE) return false;
+    unsigned type = nalUnitType(codec, nal[0]);
+    if (type != (codec == VIDEO_CODEC_HEVC ? HEVC_NAL_PREFIX_SEI : H264_NAL_SEI)) return false;
+
+    const uint8_t* p = nal + header;
+    if (p[0] != SEI_USER_DATA_UNREGISTERED || p[1] != MARKER_PAYLOAD_SIZE) return false;
+    p += 2;
+    if (memcmp(p, MARKER_UUID, sizeof(MARKER_UUID)) != 0) return false;
+    p += sizeof(MARKER_UUID);
+
+    char text[MARKER_TEXT_SIZE + 1];
+    memcpy(text, p, MARKER_TEXT_SIZE);
+    text[MARKER_TEXT_SIZE] = '\0';
+    unsigned int markerIndex;
+    unsigned int lateness;
+    if (sscanf(text, "%8x%8x", &markerIndex, &lateness) != 2) return false;
+    index = markerIndex;
+    latenessUs = lateness;
+    return true;
+}
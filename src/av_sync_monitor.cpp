@@ -0,0 +1,242 @@
+#include "av_sync_monitor.h"
+#include "av_sync_marker.h"
+#include "constants.h"
+#include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const int BEEP_THRESHOLD = 1000;  // About -30 dBFS; the beep peaks at -20
+static const int RECEIVE_BUFFER_BYTES = 4 * 1024 * 1024;
+static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+static std::string formatMs(double ms) {
+    char text[32];
+    snprintf(text, sizeof(text), "%+.1f ms", ms);
+    return text;
+}
+
+avSyncMonitor::avSyncMonitor(UsageEnvironment& env)
+    : env(env) {
+}
+
+avSyncMonitor::~avSyncMonitor() {
+    for (track* t : tracks) {
+        env.taskScheduler().disableBackgroundHandling(t->socket);
+        close(t->socket);
+        delete t;
+    }
+}
+
+bool avSyncMonitor::addTrack(unsigned short port, RTPSink* sink) {
+    if (SRTP_ENABLED) {
+        logMessage("A/V sync check needs plain RTP; SRTP is on");
+        return false;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        logMessage("A/V sync check: socket failed: " + std::string(strerror(errno)));
+        return false;
+    }
+    // A keyframe arrives as a burst of packets between two event loop iterations
+    int receiveBuffer = RECEIVE_BUFFER_BYTES;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        logMessage("A/V sync check: cannot listen on port " + std::to_string(port) + ": " +
+                   std::string(strerror(errno)));
+        close(sock);
+        return false;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    track* t = new track();
+    t->monitor = this;
+    t->socket = sock;
+    t->sink = sink;
+    t->video = strcmp(sink->sdpMediaType(), "video") == 0;
+    t->codec = strcmp(sink->rtpPayloadFormatName(), "H265") == 0 ? VIDEO_CODEC_HEVC : VIDEO_CODEC_H264;
+    t->channels = std::max(sink->numChannels(), 1u);
+    t->frame_timestamp = 0;
+    t->frame_bytes = 0;
+    t->have_frame = false;
+    t->in_beep = false;
+    t->quiet_samples = 0;
+    t->packets = 0;
+    t->digest = FNV_OFFSET_BASIS;
+    tracks.push_back(t);
+
+    env.taskScheduler().setBackgroundHandling(sock, SOCKET_READABLE, incomingHandler, t);
+    return true;
+}
+
+void avSyncMonitor::incomingHandler(void* clientData, int mask) {
+    track* t = static_cast<track*>(clientData);
+    t->monitor->readPackets(*t);
+}
+
+void avSyncMonitor::readPackets(track& t) {
+    uint8_t packet[65536];
+    ssize_t received;
+    while ((received = recv(t.socket, packet, sizeof(packet), 0)) > 0) {
+        size_t size = received;
+        ++t.packets;
+        for (size_t i = 0; i < size; ++i) {
+            t.digest = (t.digest ^ packet[i]) * FNV_PRIME;
+        }
+        t.digest = (t.digest ^ size) * FNV_PRIME;  // Where one packet ends and the next begins
+        if (size < 12 || (packet[0] >> 6) != 2) continue;
+        if ((packet[1] & 0x7F) != t.sink->rtpPayloadType()) continue;  // RTX or FEC
+
+        // Skip CSRCs and header extensions (abs-capture-time), drop padding
+        size_t header = 12 + 4 * (packet[0] & 0x0F);
+        if ((packet[0] & 0x10) && header + 4 <= size) {
+            header += 4 + 4 * ((packet[header + 2] << 8) | packet[header + 3]);
+        }
+        if ((packet[0] & 0x20) && size > header) {
+            size -= std::min<size_t>(packet[size - 1], size - header);
+        }
+        if (header >= size) continue;
+
+        uint32_t timestamp = ((uint32_t)packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+        if (t.video) {
+            handleVideo(t, timestamp, packet + header, size - header);
+        } else {
+            handleAudio(t, timestamp, packet + header, size - header);
+        }
+    }
+}
+
+void avSyncMonitor::handleAudio(track& t, uint32_t timestamp, const uint8_t* payload, size_t size) {
+    // L16: big-endian samples, the channels interleaved. A frame too big for one
+    // packet is split over several with the same timestamp.
+    size_t sampleBytes = 2 * t.channels;
+    if (!t.have_frame || timestamp != t.frame_timestamp) {
+        // A gap in the timestamps means suppressed silence, so any beep has ended
+        uint32_t expected = t.frame_timestamp + t.frame_bytes / sampleBytes;
+        if (!t.have_frame || timestamp != expected) {
+            t.in_beep = false;
+        }
+        t.frame_timestamp = timestamp;
+        t.frame_bytes = 0;
+        t.have_frame = true;
+    }
+
+    unsigned rate = t.sink->rtpTimestampFrequency();
+    size_t firstSample = t.frame_bytes / sampleBytes;
+    for (size_t i = 0; i + sampleBytes <= size; i += sampleBytes) {
+        int value = (int16_t)((payload[i] << 8) | payload[i + 1]);
+        if (std::abs(value) > BEEP_THRESHOLD) {
+            if (!t.in_beep) {
+                int64_t sample = firstSample + i / sampleBytes;
+                audio_onsets.push_back(presentationTimeUs(t, timestamp) + sample * 1000000 / rate);
+                matchMarkers();
+            }
+            t.in_beep = true;
+            t.quiet_samples = 0;
+        } else if (t.in_beep && ++t.quiet_samples > rate / 100) {
+            t.in_beep = false;
+        }
+    }
+    t.frame_bytes += size;
+}
+
+void avSyncMonitor::handleVideo(track& t, uint32_t timestamp, const uint8_t* payload, size_t size) {
+    // The marker SEI is small enough to go as a single NAL unit packet
+    int64_t index;
+    uint32_t latenessUs;
+    if (!parseAvSyncMarkerNal(t.codec, payload, size, index, latenessUs)) return;
+
+    // Back from the picture to the marker instant it shows
+    video_markers.push_back(presentationTimeUs(t, timestamp) - latenessUs);
+    matchMarkers();
+}
+
+int64_t avSyncMonitor::presentationTimeUs(const track& t, uint32_t timestamp) const {
+    // What a sender report would say: the RTP timestamp the sink would give the
+    // current time. Packets are never far from now, so 32 bits don't wrap.
+    struct timeval now;
+    mediaClockWallTime(now);
+    int32_t ticks = (int32_t)(timestamp - t.sink->convertToRTPTimestamp(now));
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec + (int64_t)ticks * 1000000 / t.sink->rtpTimestampFrequency();
+}
+
+void avSyncMonitor::matchMarkers() {
+    const int64_t window = AV_SYNC_MARKER_INTERVAL_MS * 1000LL / 2;
+    while (!video_markers.empty() && !audio_onsets.empty()) {
+        int64_t video = video_markers.front();
+        int64_t audio = audio_onsets.front();
+        if (audio < video - window) {
+            // A beep without a marker, e.g. before the video stream started
+            audio_onsets.pop_front();
+            incrementMetricCounter("av_sync.unmatched_beeps");
+            continue;
+        }
+        if (audio > video + window) {
+            video_markers.pop_front();
+            incrementMetricCounter("av_sync.unmatched_markers");
+            continue;
+        }
+
+        double offsetMs = (audio - video) / 1000.0;
+        audio_onsets.pop_front();
+        video_markers.pop_front();
+        offsets_ms.push_back(offsetMs);
+        setMetricGauge("av_sync.offset_ms", offsetMs);
+        incrementMetricCounter("av_sync.markers");
+    }
+}
+
+bool avSyncMonitor::report() {
+    for (track* t : tracks) {
+        // Loopback packets are queued as soon as they are sent; take them all in
+        // so the digest covers the whole run, however the last reads fell
+        readPackets(*t);
+        char digest[17];
+        snprintf(digest, sizeof(digest), "%016llx", (unsigned long long)t->digest);
+        logMessage(std::string("A/V sync: received ") + (t->video ? "video" : "audio") + " " +
+                   std::to_string(t->packets) + " packets, digest " + digest);
+    }
+
+    if (offsets_ms.empty()) {
+        logMessage("A/V sync: FAIL, no markers received");
+        return false;
+    }
+
+    std::vector<double> sorted(offsets_ms);
+    std::sort(sorted.begin(), sorted.end());
+    double median = sorted[sorted.size() / 2];
+    double p5 = sorted[sorted.size() * 5 / 100];
+    double p95 = sorted[sorted.size() * 95 / 100];
+    bool pass = sorted.front() >= -AV_SYNC_MAX_AUDIO_LEAD_MS && sorted.back() <= AV_SYNC_MAX_AUDIO_LAG_MS;
+
+    logMessage("A/V sync over " + std::to_string(offsets_ms.size()) + " markers (audio minus video): min " +
+               formatMs(sorted.front()) + ", p5 " + formatMs(p5) + ", median " + formatMs(median) + ", p95 " +
+               formatMs(p95) + ", max " + formatMs(sorted.back()));
+    // Drift shows as a trend between the start and the end of the run
+    logMessage("A/V sync: first " + formatMs(offsets_ms.front()) + ", last " + formatMs(offsets_ms.back()));
+    std::string series;
+    for (double offset : offsets_ms) {
+        char text[32];
+        snprintf(text, sizeof(text), " %+.3f", offset);
+        series += text;
+    }
+    logMessage("A/V sync offsets (ms):" + series);
+    logMessage(std::string("A/V sync: ") + (pass ? "PASS" : "FAIL") + " (audio may lead by " +
+               std::to_string(AV_SYNC_MAX_AUDIO_LEAD_MS) + " ms and lag by " +
+               std::to_string(AV_SYNC_MAX_AUDIO_LAG_MS) + " ms)");
+    return pass;
+}
@@ -0,0 +1,110 @@
+#include "bandwidth_budget.h"
+#include "constants.h"
+#include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include <algorithm>
+#include <limits>
+#include <string>
+
+static const double BITRATE_SMOOTHING = 0.5;
+
+bandwidthBudget::bandwidthBudget(UsageEnvironment& env, unsigned budgetBitsPerSecond, unsigned clientCapBitsPerSecond,
+                                 unsigned videoBitsPerSecond, unsigned audioBitsPerSecond)
+    : env(env)
+    , budget(budgetBitsPerSecond)
+    , client_cap(clientCapBitsPerSecond)
+    , nominal_bitrate(videoBitsPerSecond + audioBitsPerSecond)
+    , audio_bitrate(audioBitsPerSecond)
+    , clients(0)
+    , allowance(std::min(clientCapBitsPerSecond, budgetBitsPerSecond))
+    , stream_bitrate(0)
+    , last_sent_bytes(getMetric("rtp.sent_bytes"))
+    , last_sample(mediaClockNow())
+    , sample_task(nullptr) {
+    setMetricGauge("net.egress_budget", budget);
+    setMetricGauge("net.client_allowance", allowance);
+    sample_task = env.taskScheduler().scheduleDelayedTask(NET_BUDGET_SAMPLE_MS * 1000LL, sampleTask, this);
+}
+
+bandwidthBudget::~bandwidthBudget() {
+    env.taskScheduler().unscheduleDelayedTask(sample_task);
+}
+
+bool bandwidthBudget::admitClient() {
+    // Existing viewers keep what they get now; the newcomer needs as much again
+    double perClient = clients > 0 && stream_bitrate > 0 ? stream_bitrate : nominal_bitrate;
+    perClient = std::min(perClient, (double)client_cap);
+    if ((clients + 1) * perClient > budget) {
+        logMessage("Rejecting client: " + std::to_string(clients + 1) + " streams at " +
+                   std::to_string(unsigned(perClient / 1000)) + " kbps exceed the " +
+                   std::to_string(budget / 1000) + " kbps egress budget");
+        incrementMetricCounter("net.rejected_clients");
+        return false;
+    }
+
+    ++clients;
+    setMetricGauge("net.clients", clients);
+    updateAllowance();
+    return true;
+}
+
+void bandwidthBudget::releaseClient() {
+    if (clients == 0) return;
+    --clients;
+    setMetricGauge("net.clients", clients);
+    updateAllowance();
+}
+
+void bandwidthBudget::sampleTask(void* clientData) {
+    bandwidthBudget* self = static_cast<bandwidthBudget*>(clientData);
+    self->sample();
+    self->sample_task = self->env.taskScheduler().scheduleDelayedTask(NET_BUDGET_SAMPLE_MS * 1000LL, sampleTask, self);
+}
+
+void bandwidthBudget::sample() {
+    // Each RTP packet is counted once, however many clients it goes to
+    auto now = mediaClockNow();
+    double elapsed = std::chrono::duration<double>(now - last_sample).count();
+    double sentBytes = getMetric("rtp.sent_bytes");
+    if (elapsed <= 0) return;
+
+    double bitrate = (sentBytes - last_sent_bytes) * 8 / elapsed;
+    stream_bitrate = stream_bitrate == 0 ? bitrate : stream_bitrate + BITRATE_SMOOTHING * (bitrate - stream_bitrate);
+    last_sent_bytes = sentBytes;
+    last_sample = now;
+
+    setMetricGauge("net.stream_bitrate", stream_bitrate);
+    setMetricGauge("net.egress_bitrate", stream_bitrate * clients);
+}
+
+void bandwidthBudget::updateAllowance() {
+    unsigned share = clients > 0 ? budget / clients : budget;
+    unsigned updated = std::min(client_cap, share);
+    if (updated == allowance) return;
+
+    allowance = updated;
+    setMetricGauge("net.client_allowance", allowance);
+    if (allowance_listener) {
+        allowance_listener(allowance);
+    }
+}
+
+tokenBucket::tokenBucket()
+    : tokens(std::numeric_limits<double>::max())  // Starts full; clamped on first use
+    , last_refill(mediaClockNow()) {
+}
+
+bool tokenBucket::consume(size_t bytes, unsigned bitsPerSecond, unsigned burstMs, bool force) {
+    auto now = mediaClockNow();
+    double elapsed = std::chrono::duration<double>(now - last_refill).count();
+    last_refill = now;
+
+    double bytesPerSecond = bitsPerSecond / 8.0;
+    tokens = std::min(tokens + elapsed * bytesPerSecond, bytesPerSecond * burstMs / 1000.0);
+    if (!force && tokens < bytes) {
+        return false;
+    }
+    tokens -= bytes;
+    return true;
+}
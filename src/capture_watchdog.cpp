@@ -0,0 +1,73 @@
+#include "capture_watchdog.h"
+#include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include "thread_placement.h"
+
+captureWatchdog::captureWatchdog(const std::string& name, unsigned stallTimeoutMs, std::function<bool()> recoverFn)
+    : watchdog_name(name)
+    , stall_timeout(stallTimeoutMs)
+    , recover_fn(recoverFn)
+    , recovering(false)
+    , stalled(false)
+    , last_frame_time(mediaClockNow())
+    , recovery_count(0)
+    , total_recovery_ms(0.0) {
+}
+
+captureWatchdog::~captureWatchdog() {
+    if (recovery_thread.joinable()) {
+        recovery_thread.join();
+    }
+}
+
+void captureWatchdog::reportFrame() {
+    auto now = mediaClockNow();
+    last_frame_time = now;
+    if (!stalled) return;
+
+    stalled = false;
+    double recoveryMs = std::chrono::duration<double, std::milli>(now - stall_start_time).count();
+    ++recovery_count;
+    total_recovery_ms += recoveryMs;
+
+    setMetricGauge(watchdog_name + ".last_recovery_ms", recoveryMs);
+    setMetricGauge(watchdog_name + ".mean_recovery_ms", total_recovery_ms / recovery_count);
+    incrementMetricCounter(watchdog_name + ".recoveries");
+    logMessage(watchdog_name + " recovered after " + std::to_string(static_cast<int>(recoveryMs)) + " ms.");
+}
+
+void captureWatchdog::reportStall() {
+    auto now = mediaClockNow();
+    if (!stalled) {
+        stalled = true;
+        stall_start_time = now;
+        incrementMetricCounter(watchdog_name + ".stalls");
+    }
+
+    // Give the device the stall timeout since the last frame (or the last recovery)
+    // before reopening it
+    if (!recovering.load() && now - last_frame_time >= stall_timeout) {
+        last_frame_time = now;
+        startRecovery();
+    }
+}
+
+void captureWatchdog::startRecovery() {
+    if (recovery_thread.joinable()) {
+        recovery_thread.join();
+    }
+    logMessage(watchdog_name + " stalled, recovering device in background.");
+    recovering.store(true);
+    recovery_thread = std::thread(&captureWatchdog::runRecovery, this);
+}
+
+void captureWatchdog::runRecovery() {
+    // Created by the event loop, whose placement it would otherwise inherit
+    placeCurrentThread(THREAD_ROLE_RECOVERY);
+    if (!recover_fn()) {
+        logMessage(watchdog_name + " recovery attempt failed, will retry.");
+        incrementMetricCounter(watchdog_name + ".failed_recoveries");
+    }
+    recovering.store(false);
+}
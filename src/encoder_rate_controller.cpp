@@ -0,0 +1,76 @@
+#include "encoder_rate_controller.h"
+#include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include <algorithm>
+
+static const double KEYFRAME_SMOOTHING = 0.5;
+static const double FRAME_SMOOTHING = 0.1;   // About a third of a second at 30 fps
+static const double MIN_CHANGE = 0.1;        // Ignore adjustments smaller than this fraction
+static const unsigned MIN_CEILING = 100000;  // Below this the encoder output is useless anyway
+
+encoderRateController::encoderRateController(v4l2Capture* capture)
+    : capture(capture)
+    , keyframe_bytes(0)
+    , frame_bytes(0)
+    , gop_size(GOP_SIZE)
+    , bitrate(VIDEO_BITRATE)
+    , wanted_bitrate(VIDEO_BITRATE)
+    , bitrate_ceiling(VIDEO_MAX_BITRATE > VIDEO_BITRATE ? VIDEO_MAX_BITRATE : VIDEO_BITRATE)
+    , last_change(mediaClockNow()) {
+}
+
+void encoderRateController::frameEncoded(size_t bytes, bool keyFrame) {
+    if (keyFrame) {
+        keyframe_bytes = keyframe_bytes == 0 ? bytes : keyframe_bytes + KEYFRAME_SMOOTHING * (bytes - keyframe_bytes);
+        return;
+    }
+    frame_bytes = frame_bytes == 0 ? bytes : frame_bytes + FRAME_SMOOTHING * (bytes - frame_bytes);
+    if (keyframe_bytes > 0) {
+        update();
+    }
+}
+
+void encoderRateController::update() {
+    double activity = frame_bytes / keyframe_bytes;
+    setMetricGauge("video.activity", activity);
+
+    double level = (activity - ADAPTIVE_STATIC_ACTIVITY) / (ADAPTIVE_BUSY_ACTIVITY - ADAPTIVE_STATIC_ACTIVITY);
+    level = std::max(0.0, std::min(1.0, level));
+    unsigned targetGop = VIDEO_MAX_GOP_SIZE - unsigned(level * (VIDEO_MAX_GOP_SIZE - GOP_SIZE));
+    wanted_bitrate = VIDEO_MIN_BITRATE + unsigned(level * (VIDEO_MAX_BITRATE - VIDEO_MIN_BITRATE));
+    unsigned targetBitrate = std::min(wanted_bitrate, bitrate_ceiling);
+
+    // Tightening can't wait: a scene that just got busy needs the bits and the IDRs now.
+    // Relaxing is held back so a brief lull doesn't flip the encoder back and forth.
+    bool tighten = targetGop < gop_size * (1.0 - MIN_CHANGE) || targetBitrate > bitrate * (1.0 + MIN_CHANGE);
+    bool relax = targetGop > gop_size * (1.0 + MIN_CHANGE) || targetBitrate < bitrate * (1.0 - MIN_CHANGE);
+    auto now = mediaClockNow();
+    if (!tighten && !(relax && now - last_change >= std::chrono::milliseconds(ADAPTIVE_RELAX_INTERVAL_MS))) {
+        return;
+    }
+
+    if (targetGop != gop_size && capture->setGopSize(targetGop)) {
+        gop_size = targetGop;
+    }
+    if (targetBitrate != bitrate && capture->setBitrate(targetBitrate)) {
+        bitrate = targetBitrate;
+    }
+    last_change = now;
+    setMetricGauge("video.gop_size", gop_size);
+    setMetricGauge("video.target_bitrate", bitrate);
+    incrementMetricCounter("video.encoder_adjustments");
+}
+
+void encoderRateController::setBitrateCeiling(unsigned bitsPerSecond) {
+    bitrate_ceiling = std::max(bitsPerSecond, MIN_CEILING);
+    setMetricGauge("video.bitrate_ceiling", bitrate_ceiling);
+
+    // Without adaptation wanted_bitrate stays at VIDEO_BITRATE
+    unsigned targetBitrate = std::min(wanted_bitrate, bitrate_ceiling);
+    if (targetBitrate != bitrate && capture->setBitrate(targetBitrate)) {
+        bitrate = targetBitrate;
+        setMetricGauge("video.target_bitrate", bitrate);
+        incrementMetricCounter("video.encoder_adjustments");
+    }
+}
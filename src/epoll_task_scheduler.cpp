@@ -0,0 +1,259 @@
+#include "epoll_task_scheduler.h"
+#include "logger.h"
+#include "metrics.h"
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+// Same cap as BasicTaskScheduler; an empty DelayQueue reports an "eternal" delay
+static const int64_t MAX_DELAY_SECONDS = 1000000;
+
+epollTaskScheduler* epollTaskScheduler::createNew(unsigned maxEventsPerStep) {
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd < 0 || timerFd < 0 || wakeFd < 0) {
+        logMessage("Failed to create epoll scheduler: " + std::string(strerror(errno)));
+        if (epollFd >= 0) close(epollFd);
+        if (timerFd >= 0) close(timerFd);
+        if (wakeFd >= 0) close(wakeFd);
+        return NULL;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = timerFd;
+    bool registered = epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event) == 0;
+    event.data.fd = wakeFd;
+    registered = registered && epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == 0;
+    if (!registered) {
+        logMessage("Failed to register scheduler timers with epoll: " + std::string(strerror(errno)));
+        close(epollFd);
+        close(timerFd);
+        close(wakeFd);
+        return NULL;
+    }
+
+    return new epollTaskScheduler(epollFd, timerFd, wakeFd, maxEventsPerStep > 0 ? maxEventsPerStep : 1);
+}
+
+epollTaskScheduler::epollTaskScheduler(int epollFd, int timerFd, int wakeFd, unsigned maxEventsPerStep)
+    : fEpollFd(epollFd),
+      fTimerFd(timerFd),
+      fWakeFd(wakeFd),
+      fEvents(maxEventsPerStep),
+      fSocketCount(0),
+      fPendingTriggers(0),
+      fUsedTriggers(0),
+      fSteps(0),
+      fReadyEvents(0),
+      fLastPublish(std::chrono::steady_clock::now()) {
+    for (unsigned i = 0; i < 32; ++i) {
+        fTriggerHandlers[i] = NULL;
+        fTriggerClientData[i] = NULL;
+    }
+}
+
+epollTaskScheduler::~epollTaskScheduler() {
+    close(fEpollFd);
+    close(fTimerFd);
+    close(fWakeFd);
+}
+
+void epollTaskScheduler::SingleStep(unsigned maxDelayTime) {
+    DelayInterval const& timeToDelay = fDelayQueue.timeToNextAlarm();
+    int64_t delayMicros = timeToDelay.seconds() >= MAX_DELAY_SECONDS
+        ? MAX_DELAY_SECONDS * 1000000LL
+        : (int64_t)timeToDelay.seconds() * 1000000LL + timeToDelay.useconds();
+    if (maxDelayTime > 0 && delayMicros > (int64_t)maxDelayTime) {
+        delayMicros = maxDelayTime;
+    }
+
+    // epoll_wait only has millisecond timeouts, so the timerfd does the waiting
+    int timeoutMs = -1;
+    if (delayMicros <= 0) {
+        timeoutMs = 0;
+    } else {
+        armTimer(delayMicros);
+    }
+
+    int count = epoll_wait(fEpollFd, fEvents.data(), (int)fEvents.size(), timeoutMs);
+    if (count < 0) {
+        if (errno != EINTR) {
+            logMessage("epoll_wait error: " + std::string(strerror(errno)));
+            internalError();
+        }
+        count = 0;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        int socketNum = fEvents[i].data.fd;
+        uint32_t events = fEvents[i].events;
+        if (socketNum == fTimerFd || socketNum == fWakeFd) {
+            // Both are counters that stay readable until drained; the alarm and
+            // the triggers are handled below either way
+            uint64_t drained;
+            ssize_t drainedSize = read(socketNum, &drained, sizeof(drained));
+            (void)drainedSize;
+            continue;
+        }
+
+        // An earlier handler in this batch may have removed or replaced this one
+        if (socketNum < 0 || (size_t)socketNum >= fSocketHandlers.size()) continue;
+        socketHandler handler = fSocketHandlers[socketNum];
+        if (handler.handlerProc == NULL) continue;
+
+        // Report errors and hangups the way select() does: as readable/writable
+        int resultConditionSet = 0;
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP)) resultConditionSet |= SOCKET_READABLE;
+        if (events & (EPOLLOUT | EPOLLERR)) resultConditionSet |= SOCKET_WRITABLE;
+        if (events & EPOLLPRI) resultConditionSet |= SOCKET_EXCEPTION;
+        resultConditionSet &= handler.conditionSet;
+        if (resultConditionSet == 0) continue;
+
+        fLastHandledSocketNum = socketNum;
+        (*handler.handlerProc)(handler.clientData, resultConditionSet);
+    }
+
+    // Triggered events after the socket handlers, as BasicTaskScheduler does
+    handleTriggers();
+
+    fDelayQueue.handleAlarm();
+
+    ++fSteps;
+    fReadyEvents += count;
+    publishMetrics();
+}
+
+void epollTaskScheduler::armTimer(int64_t delayMicros) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = delayMicros / 1000000;
+    spec.it_value.tv_nsec = (delayMicros % 1000000) * 1000;
+    timerfd_settime(fTimerFd, 0, &spec, NULL);
+}
+
+void epollTaskScheduler::setBackgroundHandling(int socketNum, int conditionSet, BackgroundHandlerProc* handlerProc,
+                                               void* clientData) {
+    if (socketNum < 0) return;
+    if ((size_t)socketNum >= fSocketHandlers.size()) {
+        socketHandler empty = {0, NULL, NULL};
+        fSocketHandlers.resize(socketNum + 1, empty);
+    }
+    socketHandler& handler = fSocketHandlers[socketNum];
+    bool wasRegistered = handler.handlerProc != NULL;
+
+    if (conditionSet == 0 || handlerProc == NULL) {
+        if (wasRegistered) {
+            // Fails harmlessly if the socket was already closed; closing removes it from epoll
+            epoll_ctl(fEpollFd, EPOLL_CTL_DEL, socketNum, NULL);
+            handler.conditionSet = 0;
+            handler.handlerProc = NULL;
+            handler.clientData = NULL;
+            --fSocketCount;
+        }
+        return;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    if (conditionSet & SOCKET_READABLE) event.events |= EPOLLIN;
+    if (conditionSet & SOCKET_WRITABLE) event.events |= EPOLLOUT;
+    if (conditionSet & SOCKET_EXCEPTION) event.events |= EPOLLPRI;
+    event.data.fd = socketNum;
+
+    // The socket may have been closed and its number reused without the handler
+    // being cleared, so fall back to the other operation when the first one fails
+    int result = epoll_ctl(fEpollFd, wasRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, socketNum, &event);
+    if (result < 0 && (errno == ENOENT || errno == EEXIST)) {
+        result = epoll_ctl(fEpollFd, errno == ENOENT ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, socketNum, &event);
+    }
+    if (result < 0) {
+        logMessage("Failed to watch socket " + std::to_string(socketNum) + " with epoll: " + std::string(strerror(errno)));
+        return;
+    }
+
+    if (!wasRegistered) ++fSocketCount;
+    handler.conditionSet = conditionSet;
+    handler.handlerProc = handlerProc;
+    handler.clientData = clientData;
+}
+
+void epollTaskScheduler::moveSocketHandling(int oldSocketNum, int newSocketNum) {
+    if (oldSocketNum < 0 || newSocketNum < 0 || (size_t)oldSocketNum >= fSocketHandlers.size()) return;
+    socketHandler handler = fSocketHandlers[oldSocketNum];
+    if (handler.handlerProc == NULL) return;
+
+    setBackgroundHandling(oldSocketNum, 0, NULL, NULL);
+    setBackgroundHandling(newSocketNum, handler.conditionSet, handler.handlerProc, handler.clientData);
+}
+
+EventTriggerId epollTaskScheduler::createEventTrigger(TaskFunc* eventHandlerProc) {
+    for (unsigned i = 0; i < 32; ++i) {
+        EventTriggerId mask = 1u << i;
+        if ((fUsedTriggers & mask) == 0) {
+            fUsedTriggers |= mask;
+            fTriggerHandlers[i] = eventHandlerProc;
+            fTriggerClientData[i] = NULL;
+            return mask;
+        }
+    }
+    return 0;  // All in use
+}
+
+void epollTaskScheduler::deleteEventTrigger(EventTriggerId eventTriggerId) {
+    fUsedTriggers &= ~eventTriggerId;
+    fPendingTriggers.fetch_and(~eventTriggerId);
+    for (unsigned i = 0; i < 32; ++i) {
+        if (eventTriggerId & (1u << i)) {
+            fTriggerHandlers[i] = NULL;
+            fTriggerClientData[i] = NULL;
+        }
+    }
+}
+
+void epollTaskScheduler::triggerEvent(EventTriggerId eventTriggerId, void* clientData) {
+    // May be called from any thread
+    for (unsigned i = 0; i < 32; ++i) {
+        if (eventTriggerId & (1u << i)) {
+            fTriggerClientData[i] = clientData;
+        }
+    }
+    fPendingTriggers.fetch_or(eventTriggerId);
+
+    // Can only fail when the counter is about to overflow, i.e. the loop has a wakeup pending anyway
+    uint64_t one = 1;
+    ssize_t written = write(fWakeFd, &one, sizeof(one));
+    (void)written;
+}
+
+void epollTaskScheduler::handleTriggers() {
+    EventTriggerId pending = fPendingTriggers.exchange(0);
+    for (unsigned i = 0; pending != 0 && i < 32; ++i) {
+        EventTriggerId mask = 1u << i;
+        if ((pending & mask) == 0) continue;
+        pending &= ~mask;
+        if (fTriggerHandlers[i] != NULL) {
+            (*fTriggerHandlers[i])(fTriggerClientData[i]);
+        }
+    }
+}
+
+void epollTaskScheduler::publishMetrics() {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - fLastPublish).count();
+    if (elapsed < 1.0) return;
+
+    // With many idle connections steps_per_sec should stay flat; each step wakes
+    // only for the sockets that actually had something to do
+    setMetricGauge("scheduler.sockets", fSocketCount);
+    setMetricGauge("scheduler.steps_per_sec", fSteps / elapsed);
+    setMetricGauge("scheduler.ready_per_step", fSteps > 0 ? (double)fReadyEvents / fSteps : 0.0);
+    fSteps = 0;
+    fReadyEvents = 0;
+    fLastPublish = now;
+}
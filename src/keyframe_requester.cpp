@@ -0,0 +1,58 @@
+#include "keyframe_requester.h"
+#include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+
+keyFrameRequester::keyFrameRequester(UsageEnvironment& env, v4l2Capture* capture, unsigned minIntervalMs)
+    : env(env)
+    , capture(capture)
+    , min_interval(minIntervalMs)
+    , last_keyframe_time(mediaClockNow() - min_interval)
+    , deferred_task(NULL) {
+}
+
+keyFrameRequester::~keyFrameRequester() {
+    env.taskScheduler().unscheduleDelayedTask(deferred_task);
+}
+
+void keyFrameRequester::request(const char* reason) {
+    incrementMetricCounter("video.keyframe_requests");
+
+    if (deferred_task != NULL) {
+        // Already have one queued; it will cover this request too
+        incrementMetricCounter("video.keyframe_requests_coalesced");
+        return;
+    }
+
+    auto sinceLast = mediaClockNow() - last_keyframe_time;
+    if (sinceLast >= min_interval) {
+        forceKeyFrame(reason);
+        return;
+    }
+
+    // Too soon after the last keyframe; ask once the interval has passed
+    int64_t delayUs = std::chrono::duration_cast<std::chrono::microseconds>(min_interval - sinceLast).count();
+    deferred_task = env.taskScheduler().scheduleDelayedTask(delayUs, deferredRequest, this);
+    incrementMetricCounter("video.keyframe_requests_coalesced");
+}
+
+void keyFrameRequester::keyFrameSent() {
+    last_keyframe_time = mediaClockNow();
+
+    // Any IDR repairs the loss that was waiting for one
+    env.taskScheduler().unscheduleDelayedTask(deferred_task);
+}
+
+void keyFrameRequester::deferredRequest(void* clientData) {
+    keyFrameRequester* requester = static_cast<keyFrameRequester*>(clientData);
+    requester->deferred_task = NULL;
+    requester->forceKeyFrame("deferred");
+}
+
+void keyFrameRequester::forceKeyFrame(const char* reason) {
+    last_keyframe_time = mediaClockNow();
+    if (capture->requestKeyFrame()) {
+        incrementMetricCounter("video.keyframes_forced");
+        logMessage("Forced keyframe (" + std::string(reason) + ")");
+    }
+}
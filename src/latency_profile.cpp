@@ -0,0 +1,40 @@
+#include "latency_profile.h"
+#include "constants.h"
+#include "logger.h"
+#include "metrics.h"
+#include <cstring>
+#include <string>
+
+static const latencyProfile PROFILES[] = {
+    // Two V4L2 buffers and a 40 ms ALSA ring: lowest delay, least slack for scheduling hiccups
+    { "ultra-low-latency", 2, true, 10, 4 },
+    // The long-standing defaults
+    { "balanced", VIDEO_BUFFER_COUNT, false,
+      NUM_OF_FRAMES_PER_PERIOD * 1000 / AUDIO_SAMPLE_RATE, NUM_OF_PERIODS_IN_BUFFER },
+    // Deeper video queue and 40 ms audio packets: half the audio packet rate to lose
+    { "lossy-network", 6, false, 40, 32 },
+};
+
+const latencyProfile* findLatencyProfile(const char* name) {
+    for (size_t i = 0; i < sizeof(PROFILES) / sizeof(PROFILES[0]); ++i) {
+        if (strcmp(PROFILES[i].name, name) == 0) {
+            return &PROFILES[i];
+        }
+    }
+    return nullptr;
+}
+
+void reportLatencyProfile(const latencyProfile& profile) {
+    unsigned frameIntervalMs = 1000 * FRAME_RATE_NUMERATOR / FRAME_RATE_DENOMINATOR;
+    unsigned videoQueueMs = profile.videoBufferCount * frameIntervalMs;
+    unsigned audioBufferMs = profile.audioPeriodMs * profile.audioBufferPeriods;
+
+    setMetricGauge("latency_profile.video_queue_ms", videoQueueMs);
+    setMetricGauge("latency_profile.audio_period_ms", profile.audioPeriodMs);
+    setMetricGauge("latency_profile.audio_buffer_ms", audioBufferMs);
+
+    logMessage("Latency profile \"" + std::string(profile.name) + "\": video queue " +
+               std::to_string(profile.videoBufferCount) + " buffers (up to " + std::to_string(videoQueueMs) +
+               " ms" + (profile.videoDrainToNewest ? ", drained to newest" : "") + "), audio packets " + std::to_string(profile.audioPeriodMs) + " ms, ALSA buffer " +
+               std::to_string(audioBufferMs) + " ms");
+}
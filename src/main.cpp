@@ -1,8 +1,21 @@
 #include <csignal>
 #include <iostream>
+#include <chrono>
+#include <future>
+#include <cstring>
+#include <cstdlib>
+#include <sys/resource.h>
 #include "unified_rtsp_server_manager.h"
 #include "constants.h"
 #include "logger.h"
+#include "metrics.h"
+#include "latency_profile.h"
+#include "epoll_task_scheduler.h"
+#include "thread_placement.h"
+#include "trace.h"
+#include "av_sync_marker.h"
+#include "av_sync_monitor.h"
+#include "virtual_task_scheduler.h"
 
 // Global flag for clean shutdown
 static char volatile shouldExit = 0;
@@ -12,35 +25,164 @@ static void sigintHandler(int sig) {
     shouldExit = 1;
 }
 
+static bool simulationFailed = false;
+
+// A reconfiguration partway through a simulation, as SET_PARAMETER would make it
+struct simulatedReconfigure {
+    UnifiedRTSPServerManager* serverManager;
+    const char* format;
+};
+
+static void simulatedReconfigureTask(void* clientData) {
+    simulatedReconfigure* reconfigure = static_cast<simulatedReconfigure*>(clientData);
+    if (!reconfigure->serverManager->reconfigureVideo(reconfigure->format)) {
+        simulationFailed = true;
+    }
+}
+
+// Ends a simulation once its virtual time is up
+static void simulationDoneTask(void* clientData) {
+    avSyncMonitor* monitor = static_cast<avSyncMonitor*>(clientData);
+    logMessage("Simulation finished");
+    if (monitor != nullptr && !monitor->report()) {
+        simulationFailed = true;
+    }
+    updateProcessMetrics();
+    logMetrics();
+    shouldExit = 1;
+}
+
 int main(int argc, char** argv) {
     // Set up signal handling
     signal(SIGINT, sigintHandler);
     signal(SIGTERM, sigintHandler);
+    startTraceDumpOnSignal();  // Before any other thread starts
+    lockProcessMemory();
+
+    // --simulate=<seconds> runs that much media on the virtual clock and exits;
+    // --video-device=<path> overrides VIDEO_DEVICE, e.g. with a file to replay;
+    // --video-codec=<h264|hevc> overrides VIDEO_CODEC, and is what a replayed file holds;
+    // --simulate-reconfigure=<seconds>:<W>x<H>@<fps> switches the video format that far into a simulation
+    double simulateSeconds = 0;
+    double reconfigureSeconds = 0;
+    const char* reconfigureFormat = nullptr;
+    const char* videoDevice = VIDEO_DEVICE;
+    const char* videoCodec = VIDEO_CODEC;
+    const char* simulateArg = "--simulate=";
+    const char* videoDeviceArg = "--video-device=";
+    const char* videoCodecArg = "--video-codec=";
+    const char* reconfigureArg = "--simulate-reconfigure=";
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], simulateArg, strlen(simulateArg)) == 0) {
+            simulateSeconds = atof(argv[i] + strlen(simulateArg));
+        } else if (strncmp(argv[i], videoDeviceArg, strlen(videoDeviceArg)) == 0) {
+            videoDevice = argv[i] + strlen(videoDeviceArg);
+        } else if (strncmp(argv[i], videoCodecArg, strlen(videoCodecArg)) == 0) {
+            videoCodec = argv[i] + strlen(videoCodecArg);
+        } else if (strncmp(argv[i], reconfigureArg, strlen(reconfigureArg)) == 0) {
+            reconfigureSeconds = atof(argv[i] + strlen(reconfigureArg));
+            reconfigureFormat = strchr(argv[i], ':');
+            if (reconfigureFormat != nullptr) {
+                ++reconfigureFormat;
+            }
+        }
+    }
+    bool simulate = simulateSeconds > 0;
+    if (strcmp(videoCodec, "h264") != 0 && strcmp(videoCodec, "hevc") != 0) {
+        logMessage("Unknown video codec \"" + std::string(videoCodec) + "\", using \"" VIDEO_CODEC "\"");
+        videoCodec = VIDEO_CODEC;
+    }
 
     // Create basic usage environment
-    TaskScheduler* scheduler = BasicTaskScheduler::createNew();
+    TaskScheduler* scheduler = nullptr;
+    if (simulate) {
+        scheduler = virtualTaskScheduler::createNew();
+        logMessage("Simulating " + std::to_string(simulateSeconds) + " s on a virtual clock");
+        if (AV_SYNC_CHECK_ENABLED) {
+            enableAvSyncMarkers();
+        }
+    } else if (SCHEDULER_USE_EPOLL) {
+        scheduler = epollTaskScheduler::createNew(SCHEDULER_MAX_EVENTS);
+        if (scheduler == nullptr) {
+            logMessage("Falling back to the select() scheduler");
+        }
+    }
+    if (scheduler == nullptr) {
+        scheduler = BasicTaskScheduler::createNew();
+    } else {
+        // Every client takes several sockets; the default soft limit of 1024 would be the new ceiling
+        struct rlimit files;
+        if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+            files.rlim_cur = files.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &files);
+        }
+    }
     UsageEnvironment* env = BasicUsageEnvironment::createNew(*scheduler);
 
+    // Pick the latency profile: --latency-profile=<name> or the compiled-in default
+    const char* profileName = LATENCY_PROFILE;
+    const char* profileArg = "--latency-profile=";
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], profileArg, strlen(profileArg)) == 0) {
+            profileName = argv[i] + strlen(profileArg);
+        }
+    }
+    const latencyProfile* profile = findLatencyProfile(profileName);
+    if (profile == nullptr) {
+        logMessage("Unknown latency profile \"" + std::string(profileName) + "\", using \"" LATENCY_PROFILE "\"");
+        profile = findLatencyProfile(LATENCY_PROFILE);
+    }
+    reportLatencyProfile(*profile);
+
     try {
-        // Initialize video capture
-        v4l2Capture* videoCapture = new v4l2Capture(VIDEO_DEVICE);
-        if (!videoCapture->initialize()) {
+        auto startupBegin = std::chrono::steady_clock::now();
+
+        // Create both captures so the devices can be initialized in parallel
+        v4l2Capture* videoCapture = new v4l2Capture(videoDevice,
+            strcmp(videoCodec, "hevc") == 0 ? VIDEO_CODEC_HEVC : VIDEO_CODEC_H264);
+        videoCapture->setBufferCount(profile->videoBufferCount);
+        videoCapture->setDrainToNewest(profile->videoDrainToNewest);
+        alsa_rtsp::alsaCapture* audioCapture = new alsa_rtsp::alsaCapture(
+            simulate ? AUDIO_SYNTHETIC_DEVICE : AUDIO_DEVICE,
+            AUDIO_SAMPLE_RATE,
+            AUDIO_CHANNELS,
+            AUDIO_BIT_DEPTH,
+            AUDIO_SAMPLE_RATE * profile->audioPeriodMs / 1000,
+            profile->audioBufferPeriods
+        );
+
+        if (simulate && !videoCapture->isReplay()) {
+            // A camera runs in real time; only a file can follow the virtual clock
+            logMessage("Simulation needs a video file to replay (--video-device=<file>)");
+            delete videoCapture;
+            delete audioCapture;
+            env->reclaim();
+            delete scheduler;
+            return -1;
+        }
+
+        // Cached SPS/PPS let video initialization skip the keyframe scan
+        videoCapture->loadCachedSpsPps();
+
+        std::future<bool> audioInitialized = std::async(std::launch::async,
+            [audioCapture]() {
+                placeCurrentThread(THREAD_ROLE_AUX);
+                return audioCapture->initialize();
+            });
+        bool videoInitialized = videoCapture->initialize();
+        bool audioInitializedOk = audioInitialized.get();
+
+        if (!videoInitialized) {
             logMessage("Failed to initialize video capture");
             delete videoCapture;
+            delete audioCapture;
             env->reclaim();
             delete scheduler;
             return -1;
         }
         logMessage("Successfully initialize video capture.");
 
-        // Initialize audio capture
-        alsa_rtsp::alsaCapture* audioCapture = new alsa_rtsp::alsaCapture(
-            AUDIO_DEVICE,
-            AUDIO_SAMPLE_RATE,
-            AUDIO_CHANNELS,
-            AUDIO_BIT_DEPTH
-        );
-        if (!audioCapture->initialize()) {
+        if (!audioInitializedOk) {
             logMessage("Failed to initialize audio capture");
             delete videoCapture;
             delete audioCapture;
@@ -50,6 +192,15 @@ int main(int argc, char** argv) {
         }
         logMessage("Successfully initialize audio capture.");
 
+        if (SHM_EXPORT_ENABLED) {
+            if (!videoCapture->enableFrameExport(SHM_VIDEO_NAME, SHM_VIDEO_SLOTS, SHM_VIDEO_SLOT_BYTES)) {
+                logMessage("Video frame export disabled");
+            }
+            if (!audioCapture->enableFrameExport(SHM_AUDIO_NAME, SHM_AUDIO_SLOTS)) {
+                logMessage("Audio frame export disabled");
+            }
+        }
+
         // Start captures
         if (!videoCapture->startCapture()) {
             logMessage("Failed to start video capture");
@@ -87,14 +238,40 @@ int main(int argc, char** argv) {
         }
 
         logMessage("Successfully initialize RTSP server.");
+
+        avSyncMonitor* syncMonitor = nullptr;
+        if (simulate) {
+            if (AV_SYNC_CHECK_ENABLED) {
+                syncMonitor = new avSyncMonitor(*env);
+            }
+            if (!serverManager->startLoopbackStream(SIMULATION_CLIENT_PORT, syncMonitor)) {
+                logMessage("Failed to start the simulated stream");
+                simulationFailed = true;
+                shouldExit = 1;
+            }
+            scheduler->scheduleDelayedTask((int64_t)(simulateSeconds * 1000000), simulationDoneTask, syncMonitor);
+        }
+        simulatedReconfigure reconfigure = {serverManager, reconfigureFormat};
+        if (simulate && reconfigureFormat != nullptr) {
+            scheduler->scheduleDelayedTask((int64_t)(reconfigureSeconds * 1000000), simulatedReconfigureTask,
+                                           &reconfigure);
+        }
+
+        double startupMs = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - startupBegin).count();
+        setMetricGauge("startup_ms", startupMs);
+        logMessage("Startup completed in " + std::to_string(static_cast<int>(startupMs)) + " ms" +
+                   (videoCapture->isSpsPpsFromCache() ? " (SPS/PPS from cache)." : "."));
         logMessage("Use Ctrl-C to exit.");
         logMessage("===========================================================");
 
-        // Run the event loop
+        // Run the event loop; placed only now so the startup threads don't inherit it
+        placeCurrentThread(THREAD_ROLE_EVENT_LOOP);
         serverManager->runEventLoop(&shouldExit);
 
         // Cleanup
         serverManager->cleanup();
+        delete syncMonitor;
         videoCapture->stopCapture();
         audioCapture->stopCapture();
         delete serverManager;
@@ -111,5 +288,5 @@ int main(int argc, char** argv) {
     delete scheduler;
 
     logMessage("Successfully shutdown server.");
-    return 0;
+    return simulationFailed ? 1 : 0;
 }
@@ -0,0 +1,57 @@
+#include "media_clock.h"
+#include <atomic>
+#include <ctime>
+#include <unistd.h>
+
+// Virtual runs start at fixed times, so their timestamps don't depend on when they ran
+static const int64_t VIRTUAL_MONOTONIC_START_US = 1000LL * 1000000;   // Some uptime, so nothing goes negative
+static const int64_t VIRTUAL_WALL_START_US = 1700000000LL * 1000000;  // 2023-11-14 22:13:20 UTC
+
+static std::atomic<bool> virtualClock(false);
+static std::atomic<int64_t> virtualMicros(VIRTUAL_MONOTONIC_START_US);
+
+void enableVirtualClock() {
+    virtualClock = true;
+}
+
+bool isVirtualClock() {
+    return virtualClock;
+}
+
+void advanceVirtualClock(int64_t monotonicMicros) {
+    int64_t current = virtualMicros.load();
+    while (monotonicMicros > current && !virtualMicros.compare_exchange_weak(current, monotonicMicros)) {
+    }
+}
+
+int64_t mediaClockMicros() {
+    if (virtualClock) return virtualMicros;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+std::chrono::steady_clock::time_point mediaClockNow() {
+    if (!virtualClock) return std::chrono::steady_clock::now();
+    return std::chrono::steady_clock::time_point(std::chrono::microseconds(virtualMicros.load()));
+}
+
+void mediaClockWallTime(struct timeval& time) {
+    if (!virtualClock) {
+        gettimeofday(&time, NULL);
+        return;
+    }
+    int64_t wallMicros = VIRTUAL_WALL_START_US + virtualMicros - VIRTUAL_MONOTONIC_START_US;
+    time.tv_sec = wallMicros / 1000000;
+    time.tv_usec = wallMicros % 1000000;
+}
+
+void mediaClockSleep(int64_t micros) {
+    if (micros <= 0) return;
+    if (virtualClock) {
+        virtualMicros += micros;
+        return;
+    }
+    usleep(micros);
+}
@@ -0,0 +1,69 @@
+#include "metrics.h"
+#include "logger.h"
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <chrono>
+#include <sys/resource.h>
+
+namespace {
+
+std::mutex& metricsMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::map<std::string, double>& metricsTable() {
+    static std::map<std::string, double> table;
+    return table;
+}
+
+} // namespace
+
+void setMetricGauge(const std::string& name, double value) {
+    std::lock_guard<std::mutex> lock(metricsMutex());
+    metricsTable()[name] = value;
+}
+
+void incrementMetricCounter(const std::string& name, double delta) {
+    std::lock_guard<std::mutex> lock(metricsMutex());
+    metricsTable()[name] += delta;
+}
+
+double getMetric(const std::string& name) {
+    std::lock_guard<std::mutex> lock(metricsMutex());
+    std::map<std::string, double>::const_iterator it = metricsTable().find(name);
+    return it != metricsTable().end() ? it->second : 0.0;
+}
+
+void updateProcessMetrics() {
+    static std::chrono::steady_clock::time_point lastWall = std::chrono::steady_clock::now();
+    static double lastCpuSec = 0.0;
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return;
+    double cpuSec = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double wallSec = std::chrono::duration<double>(now - lastWall).count();
+    if (wallSec > 0.0) {
+        setMetricGauge("process.cpu_percent", 100.0 * (cpuSec - lastCpuSec) / wallSec);
+    }
+    lastWall = now;
+    lastCpuSec = cpuSec;
+}
+
+void logMetrics() {
+    std::ostringstream line;
+    {
+        std::lock_guard<std::mutex> lock(metricsMutex());
+        if (metricsTable().empty()) return;
+        line << "Metrics:";
+        for (std::map<std::string, double>::const_iterator it = metricsTable().begin();
+             it != metricsTable().end(); ++it) {
+            line << " " << it->first << "=" << it->second;
+        }
+    }
+    logMessage(line.str());
+}
@@ -0,0 +1,113 @@
+#include "rtcp_feedback_groupsock.h"
+#include "constants.h"
+#include "metrics.h"
+#include <cstring>
+
+// RTCP packet types and feedback message types we care about
+static const unsigned char RTCP_PT_SR = 200;
+static const unsigned char RTCP_PT_RR = 201;
+static const unsigned char RTCP_PT_RTPFB = 205;
+static const unsigned char RTCP_PT_PSFB = 206;
+static const unsigned char RTPFB_FMT_NACK = 1;
+static const unsigned char PSFB_FMT_PLI = 1;
+static const unsigned char PSFB_FMT_FIR = 4;
+
+rtcpFeedbackGroupsock::rtcpFeedbackGroupsock(UsageEnvironment& env, struct sockaddr_storage const& groupAddr,
+                                             Port port, feedbackHandler* handler, void* clientData,
+                                             const unsigned char* srtpMasterKey)
+    : Groupsock(env, groupAddr, port, 255),
+      fHandler(handler), fClientData(clientData),
+      fSrtp(srtpMasterKey != NULL ? new srtpContext(srtpMasterKey) : NULL) {
+}
+
+rtcpFeedbackGroupsock::~rtcpFeedbackGroupsock() {
+    delete fSrtp;
+}
+
+Boolean rtcpFeedbackGroupsock::output(UsageEnvironment& env, unsigned char* buffer, unsigned bufferSize) {
+    if (fSrtp == NULL) {
+        return Groupsock::output(env, buffer, bufferSize);
+    }
+
+    if (bufferSize > sizeof(fSrtcpPacket) - SRTCP_TRAILER_LENGTH) return False;
+    memcpy(fSrtcpPacket, buffer, bufferSize);
+    if (!fSrtp->protectRtcp(fSrtcpPacket, bufferSize)) {
+        incrementMetricCounter("srtp.failed_packets");
+        return False;
+    }
+    return Groupsock::output(env, fSrtcpPacket, bufferSize);
+}
+
+Boolean rtcpFeedbackGroupsock::handleRead(unsigned char* buffer, unsigned bufferMaxSize, unsigned& bytesRead,
+                                          struct sockaddr_storage& fromAddressAndPort) {
+    if (!Groupsock::handleRead(buffer, bufferMaxSize, bytesRead, fromAddressAndPort)) {
+        return False;
+    }
+    if (fSrtp != NULL && !fSrtp->unprotectRtcp(buffer, bytesRead)) {
+        // Unauthenticated; RTCPInstance must not see it either
+        incrementMetricCounter("srtp.rejected_rtcp");
+        return False;
+    }
+    // Anyone can send to this port; without SRTP the source address is all we have
+    destRecord* client = lookupDestRecordFromDestination(fromAddressAndPort);
+    if (client != NULL) {
+        parseFeedback(buffer, bytesRead, client->fSessionId);
+    } else {
+        incrementMetricCounter("rtcp.unknown_source_packets");
+    }
+    return True;
+}
+
+void rtcpFeedbackGroupsock::parseFeedback(unsigned char const* packet, unsigned size,
+                                          unsigned sessionId) {
+    // Walk the compound packet: each sub-packet is V=2|P|FMT, PT, length in 32-bit words - 1
+    unsigned offset = 0;
+    unsigned nacked = 0;
+    while (offset + 4 <= size) {
+        unsigned char const* header = packet + offset;
+        if ((header[0] >> 6) != 2) return;  // Not RTCP
+
+        unsigned char fmt = header[0] & 0x1F;
+        unsigned char pt = header[1];
+        unsigned length = (((unsigned)header[2] << 8) | header[3]) * 4 + 4;
+        if (offset + length > size) return;
+
+        if (fHandler == NULL || length < 12) {
+            // Nothing to report to, or too short for the sender and media SSRCs
+        } else if (pt == RTCP_PT_SR || pt == RTCP_PT_RR) {
+            // Report blocks follow the sender's SSRC, and an SR's sender info:
+            // SSRC, loss, extended highest sequence number, jitter, LSR, DLSR
+            unsigned block = pt == RTCP_PT_SR ? 28 : 8;
+            for (unsigned count = fmt; count > 0 && block + 24 <= length; --count, block += 24) {
+                unsigned char const* report = header + block;
+                u_int32_t mediaSsrc = (report[0] << 24) | (report[1] << 16) | (report[2] << 8) | report[3];
+                u_int16_t highestSeq = (report[10] << 8) | report[11];
+                (*fHandler)(fClientData, FEEDBACK_RECEIVER_REPORT, mediaSsrc, highestSeq, sessionId);
+            }
+        } else if (pt == RTCP_PT_RTPFB && fmt == RTPFB_FMT_NACK) {
+            u_int32_t mediaSsrc = (header[8] << 24) | (header[9] << 16) | (header[10] << 8) | header[11];
+            // FCI entries after the sender and media SSRCs: PID, then a bitmask
+            // of the 16 packets following it
+            for (unsigned fci = 12; fci + 4 <= length; fci += 4) {
+                u_int16_t pid = (header[fci] << 8) | header[fci + 1];
+                u_int16_t blp = (header[fci + 2] << 8) | header[fci + 3];
+                for (unsigned bit = 0; bit <= 16; ++bit) {
+                    if (bit > 0 && !(blp & (1 << (bit - 1)))) continue;
+                    if (nacked == RTX_MAX_PACKETS_PER_RTCP) {
+                        incrementMetricCounter("rtx.capped_requests");
+                        continue;
+                    }
+                    ++nacked;
+                    (*fHandler)(fClientData, FEEDBACK_NACK, mediaSsrc, (u_int16_t)(pid + bit), sessionId);
+                }
+            }
+        } else if (pt == RTCP_PT_PSFB && fmt == PSFB_FMT_PLI) {
+            u_int32_t mediaSsrc = (header[8] << 24) | (header[9] << 16) | (header[10] << 8) | header[11];
+            (*fHandler)(fClientData, FEEDBACK_PLI, mediaSsrc, 0, sessionId);
+        } else if (pt == RTCP_PT_PSFB && fmt == PSFB_FMT_FIR) {
+            // FIR names the media SSRC in each FCI entry; the header field is unused
+            (*fHandler)(fClientData, FEEDBACK_FIR, 0, 0, sessionId);
+        }
+        offset += length;
+    }
+}
@@ -0,0 +1,143 @@
+#include "rtp_pacer.h"
+#include "constants.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cstring>
+
+static const double INTERVAL_SMOOTHING = 0.1;
+
+rtpPacer::rtpPacer(UsageEnvironment& env, unsigned clockRate, unsigned capacity, sendFunc* send, void* clientData)
+    : env(env)
+    , clock_rate(clockRate)
+    , send(send)
+    , client_data(clientData)
+    , slots((size_t)capacity * SLOT_SIZE)
+    , sizes(capacity)
+    , queued_at(capacity)
+    , capacity(capacity)
+    , head(0)
+    , count(0)
+    , send_task(nullptr)
+    , have_timestamp(false)
+    , frame_timestamp(0)
+    , frame_complete(false)
+    , frame_interval_us(1000000.0 * FRAME_RATE_NUMERATOR / FRAME_RATE_DENOMINATOR)
+    , deadline(mediaClockNow())
+    , frame_packets(0)
+    , frame_bytes(0)
+    , max_burst(0)
+    , max_delay_us(0) {
+}
+
+rtpPacer::~rtpPacer() {
+    env.taskScheduler().unscheduleDelayedTask(send_task);
+}
+
+void rtpPacer::enqueue(const unsigned char* packet, unsigned size) {
+    auto now = mediaClockNow();
+    if (size >= 12) {
+        uint32_t timestamp = (packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+        if (!have_timestamp || timestamp != frame_timestamp) {
+            startFrame(timestamp, now);
+        }
+    }
+    ++frame_packets;
+    frame_bytes += size;
+
+    // Keep packet order: anything that can't be queued flushes the queue first
+    if (size > SLOT_SIZE || count == capacity) {
+        incrementMetricCounter("pacing.overflows");
+        while (count > 0) sendOldest();
+        if (size > SLOT_SIZE) {
+            send(client_data, packet, size);
+            return;
+        }
+    }
+
+    unsigned slot = (head + count) % capacity;
+    memcpy(&slots[(size_t)slot * SLOT_SIZE], packet, size);
+    sizes[slot] = size;
+    queued_at[slot] = now;
+    ++count;
+
+    // The sink hands over a frame's packets in consecutive zero-delay tasks, so
+    // the whole frame is known (marker bit) before the first one has to leave
+    if (size >= 2 && (packet[1] & 0x80)) {
+        frame_complete = true;
+    }
+    if (frame_complete && send_task == nullptr) {
+        send_task = env.taskScheduler().scheduleDelayedTask(0, sendTask, this);
+    }
+}
+
+void rtpPacer::startFrame(uint32_t timestamp, std::chrono::steady_clock::time_point now) {
+    // A frame that never got its marker is released along with this one
+    frame_complete = false;
+    if (count > 0 && send_task == nullptr) {
+        send_task = env.taskScheduler().scheduleDelayedTask(0, sendTask, this);
+    }
+
+    if (have_timestamp) {
+        // Publish the frame that just ended: how big its burst would have been
+        // unpaced, and what actually went out back-to-back
+        setMetricGauge("pacing.frame_packets", frame_packets);
+        setMetricGauge("pacing.frame_bytes", frame_bytes);
+        setMetricGauge("pacing.max_burst_packets", max_burst);
+        setMetricGauge("pacing.max_delay_us", max_delay_us);
+
+        uint32_t delta = timestamp - frame_timestamp;
+        double intervalUs = 1000000.0 * delta / clock_rate;
+        if (delta > 0 && intervalUs < 1000000.0) {
+            frame_interval_us += INTERVAL_SMOOTHING * (intervalUs - frame_interval_us);
+        }
+    }
+    have_timestamp = true;
+    frame_timestamp = timestamp;
+    frame_packets = 0;
+    frame_bytes = 0;
+    max_burst = 0;
+    max_delay_us = 0;
+
+    // Whatever is still queued shares the new window with this frame
+    deadline = now + std::chrono::microseconds((int64_t)(frame_interval_us * PACING_FRAME_FRACTION));
+}
+
+void rtpPacer::sendTask(void* clientData) {
+    rtpPacer* self = static_cast<rtpPacer*>(clientData);
+    self->send_task = nullptr;
+    self->sendDue();
+}
+
+void rtpPacer::sendDue() {
+    auto now = mediaClockNow();
+    int64_t remainingUs = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+
+    // Release the queue evenly over the rest of the window. Small frames needn't
+    // use all of it, and gaps shorter than the timer is worth waking up for are
+    // merged into one burst.
+    unsigned burst = count;
+    int64_t gapUs = 0;
+    if (remainingUs > 0 && count > 1) {
+        gapUs = std::min<int64_t>(remainingUs / count, PACING_MAX_GAP_US);
+        burst = gapUs >= PACING_MIN_GAP_US ? 1 : std::min<unsigned>(count, PACING_MIN_GAP_US / std::max<int64_t>(gapUs, 1));
+        gapUs = gapUs * burst;
+    }
+
+    max_burst = std::max(max_burst, burst);
+    for (unsigned i = 0; i < burst; ++i) {
+        int64_t delayUs = std::chrono::duration_cast<std::chrono::microseconds>(now - queued_at[head]).count();
+        max_delay_us = std::max(max_delay_us, delayUs);
+        sendOldest();
+    }
+
+    if (count > 0) {
+        send_task = env.taskScheduler().scheduleDelayedTask(gapUs, sendTask, this);
+    }
+}
+
+void rtpPacer::sendOldest() {
+    send(client_data, &slots[(size_t)head * SLOT_SIZE], sizes[head]);
+    head = (head + 1) % capacity;
+    --count;
+}
@@ -0,0 +1,36 @@
+#include "rtp_packet_history.h"
+#include <cstring>
+
+rtpPacketHistory::rtpPacketHistory(unsigned capacity) {
+    // A power of two divides 65536, so the slot index stays continuous across
+    // sequence number wrap-around
+    unsigned size = 1;
+    while (size < capacity && size < 65536) {
+        size <<= 1;
+    }
+    slots.resize(size);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        slots[i].seq = 0;
+        slots[i].size = 0;
+    }
+    index_mask = size - 1;
+}
+
+void rtpPacketHistory::store(const unsigned char* packet, unsigned size) {
+    if (size < 12 || size > RTP_HISTORY_MAX_PACKET_SIZE) return;
+
+    uint16_t seq = (packet[2] << 8) | packet[3];
+    slot& s = slots[seq & index_mask];
+    s.seq = seq;
+    s.size = size;
+    memcpy(s.data, packet, size);
+}
+
+const unsigned char* rtpPacketHistory::find(uint16_t seq, unsigned& size) const {
+    const slot& s = slots[seq & index_mask];
+    if (s.size == 0 || s.seq != seq) {
+        return nullptr;
+    }
+    size = s.size;
+    return s.data;
+}
@@ -0,0 +1,465 @@
+#include "rtx_groupsock.h"
+#include "constants.h"
+#include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include "rtp_payload_type.h"
+#include "trace.h"
+#include <GroupsockHelper.hh>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+// Header length including CSRCs and any header extension; false if the packet is shorter
+static bool rtpHeaderSize(const unsigned char* packet, unsigned size, unsigned& headerSize) {
+    if (size < 12) return false;
+    headerSize = 12 + 4 * (packet[0] & 0x0F);
+    if (packet[0] & 0x10) {
+        if (headerSize + 4 > size) return false;
+        headerSize += 4 + 4 * ((packet[headerSize + 2] << 8) | packet[headerSize + 3]);
+    }
+    return headerSize <= size;
+}
+
+rtxGroupsock::rtxGroupsock(UsageEnvironment& env, struct sockaddr_storage const& groupAddr, Port port,
+                           unsigned historyPackets, ulpfecEncoder* fec,
+                           const unsigned char* srtpMasterKey)
+    : Groupsock(env, groupAddr, port, 255),
+      fHistory(historyPackets),
+      fHistoryPackets(historyPackets),
+      fClientBackpressure(false),
+      fCodec(VIDEO_CODEC_H264),
+      fFec(fec),
+      fSrtp(srtpMasterKey != NULL ? new srtpContext(srtpMasterKey) : NULL),
+      fPacer(NULL),
+      fCaptureTime(NULL),
+      fCaptureTimeClientData(NULL),
+      fAbsCaptureTimeId(0),
+      fHaveLastTimestamp(false),
+      fLastTimestamp(0),
+      fRtxSsrc(our_random32()),
+      fRtxSeq((u_int16_t)our_random32()),
+      fHaveMediaSsrc(false),
+      fMediaSsrc(0) {
+}
+
+void rtxGroupsock::setMediaSsrc(u_int32_t ssrc) {
+    fMediaSsrc = ssrc;
+    fHaveMediaSsrc = true;
+}
+
+bool rtxGroupsock::rtxSsrcGroup(u_int32_t& mediaSsrc, u_int32_t& rtxSsrc) const {
+    if (!fHaveMediaSsrc) return false;
+    mediaSsrc = fMediaSsrc;
+    rtxSsrc = fRtxSsrc;
+    return true;
+}
+
+bool rtxGroupsock::fecSsrcGroup(u_int32_t& mediaSsrc, u_int32_t& fecSsrc) const {
+    if (fFec == nullptr || !fHaveMediaSsrc) return false;
+    mediaSsrc = fMediaSsrc;
+    fecSsrc = fFec->getSsrc();
+    return true;
+}
+
+rtxGroupsock::~rtxGroupsock() {
+    delete fPacer;
+    delete fFec;
+    delete fSrtp;
+}
+
+void rtxGroupsock::enablePacing(unsigned clockRate) {
+    if (fPacer == NULL) {
+        fPacer = new rtpPacer(env(), clockRate, PACING_QUEUE_PACKETS, sendPaced, this);
+    }
+}
+
+void rtxGroupsock::enableClientBackpressure(VideoCodec codec) {
+    unsigned capacity = 1;
+    while (capacity < fHistoryPackets) {
+        capacity *= 2;
+    }
+    sendRecord unused = {false, 0, 0};
+    fSent.assign(capacity, unused);
+    fCodec = codec;
+    fClientBackpressure = true;
+}
+
+void rtxGroupsock::enableAbsCaptureTime(unsigned char extensionId, captureTimeFunc* captureTime, void* clientData) {
+    fAbsCaptureTimeId = extensionId;
+    fCaptureTime = captureTime;
+    fCaptureTimeClientData = clientData;
+}
+
+Boolean rtxGroupsock::output(UsageEnvironment& env, unsigned char* buffer, unsigned bufferSize) {
+    // The sink sends a frame's first packet before the source moves on to the
+    // next frame, so the capture time still belongs to this one
+    if (fCaptureTime != NULL && bufferSize >= 12) {
+        u_int32_t timestamp = (buffer[4] << 24) | (buffer[5] << 16) | (buffer[6] << 8) | buffer[7];
+        if (!fHaveLastTimestamp || timestamp != fLastTimestamp) {
+            int64_t captureUs = fCaptureTime(fCaptureTimeClientData);
+            unsigned extendedSize = captureUs < 0 ? 0
+                : addAbsCaptureTime(buffer, bufferSize, fAbsCaptureTimeId, monotonicToNtp(captureUs),
+                                    fExtendedPacket, sizeof(fExtendedPacket));
+            if (extendedSize > 0) {
+                fHaveLastTimestamp = true;
+                fLastTimestamp = timestamp;
+                buffer = fExtendedPacket;
+                bufferSize = extendedSize;
+            }
+        }
+    }
+
+    fHistory.store(buffer, bufferSize);
+    Boolean result = sendOrQueue(env, buffer, bufferSize);
+
+    // FEC parity goes out right behind the packet that completes its group
+    if (fFec != nullptr) {
+        unsigned fecSize;
+        const unsigned char* fecPacket = fFec->addPacket(buffer, bufferSize, fecSize);
+        if (fecPacket != nullptr) {
+            sendOrQueue(env, fecPacket, fecSize);
+        }
+    }
+    return result;
+}
+
+Boolean rtxGroupsock::sendOrQueue(UsageEnvironment& env, const unsigned char* packet, unsigned size) {
+    if (fPacer == NULL) {
+        return sendPacket(env, packet, size);
+    }
+    // The sink can't act on a failed send anyway; it only counts the packet
+    fPacer->enqueue(packet, size);
+    return True;
+}
+
+void rtxGroupsock::sendPaced(void* clientData, const unsigned char* packet, unsigned size) {
+    rtxGroupsock* groupsock = static_cast<rtxGroupsock*>(clientData);
+    groupsock->sendPacket(groupsock->env(), packet, size);
+}
+
+Boolean rtxGroupsock::sendPacket(UsageEnvironment& env, const unsigned char* packet, unsigned size) {
+    TRACE_SCOPE("rtxGroupsock::sendPacket");
+    // Once per packet, not per destination: the bandwidth budget multiplies by the clients
+    incrementMetricCounter("rtp.sent_bytes", size);
+    const unsigned char* wire = packet;
+    unsigned wireSize = size;
+    if (fSrtp != NULL) {
+        // Protect a copy; the caller's buffer (and the history) stay in the clear.
+        // Never fall back to sending cleartext.
+        if (size > sizeof(fSrtpPacket) - SRTP_AUTH_TAG_LENGTH) return False;
+        memcpy(fSrtpPacket, packet, size);
+        if (!fSrtp->protectRtp(fSrtpPacket, wireSize)) {
+            incrementMetricCounter("srtp.failed_packets");
+            return False;
+        }
+        wire = fSrtpPacket;
+    }
+
+    // FEC and anything else but the media stream goes to everyone
+    bool media = size >= 12 && fHaveMediaSsrc &&
+                 ((u_int32_t)packet[8] << 24 | packet[9] << 16 | packet[10] << 8 | packet[11]) == fMediaSsrc;
+    if (fClientBackpressure && media) {
+        return sendToClients(env, packet, size, wire, wireSize);
+    }
+    return Groupsock::output(env, const_cast<unsigned char*>(wire), wireSize);
+}
+
+Boolean rtxGroupsock::sendToClients(UsageEnvironment& env, const unsigned char* packet, unsigned size,
+                                    const unsigned char* wire, unsigned wireSize) {
+    u_int16_t seq = (packet[2] << 8) | packet[3];
+    sendRecord& record = fSent[seq & (fSent.size() - 1)];
+    record.valid = true;
+    record.seq = seq;
+    record.sentUs = mediaClockMicros();
+
+    // What the packet carries decides who can do without it
+    unsigned headerSize;
+    uint8_t nalHeader = 0;
+    bool known = rtpHeaderSize(packet, size, headerSize) &&
+                 rtpPayloadNalHeader(fCodec, packet + headerSize, size - headerSize, nalHeader);
+    NalKind kind = known ? nalKind(fCodec, nalHeader) : NAL_KIND_OTHER;
+    bool resumes = kind != NAL_KIND_SLICE && kind != NAL_KIND_OTHER;
+    bool disposable = known && isDisposableNal(fCodec, nalHeader);
+
+    Boolean result = True;
+    for (destRecord* dest = fDests; dest != NULL; dest = dest->fNext) {
+        clientState& client = fClients[dest->fSessionId];
+        if (client.withheld.empty()) {
+            client.withheld.assign(fSent.size(), false);
+        }
+        if (client.policy == SKIP_TO_KEYFRAME && resumes) {
+            client.policy = SEND_ALL;
+            client.resumed = true;
+            client.resumeSeq = seq;
+        }
+        bool withhold = client.policy == SKIP_TO_KEYFRAME || (client.policy == DROP_DISPOSABLE && disposable);
+        client.withheld[seq & (fSent.size() - 1)] = withhold;
+        if (withhold) {
+            incrementMetricCounter("video.client_dropped_packets");
+            continue;
+        }
+        client.haveSent = true;
+        client.lastSentSeq = seq;
+        if (!writeSocket(env, socketNum(), dest->fGroupEId.groupAddress(), const_cast<unsigned char*>(wire),
+                         wireSize)) {
+            result = False;
+        }
+    }
+    return result;
+}
+
+bool rtxGroupsock::receiverReport(u_int32_t mediaSsrc, u_int16_t highestSeq, unsigned sessionId) {
+    if (!fClientBackpressure || !fHaveMediaSsrc || mediaSsrc != fMediaSsrc) return false;
+    pruneClients();
+    std::map<unsigned, clientState>::iterator found = fClients.find(sessionId);
+    if (found == fClients.end() || !found->second.haveSent) return false;
+    clientState& client = found->second;
+
+    if (client.resumed) {
+        if ((int16_t)(highestSeq - client.resumeSeq) < 0) return false;
+        client.resumed = false;
+    }
+    // Sequence numbers past what this client was sent are bogus
+    u_int16_t behind = client.lastSentSeq - highestSeq;
+    if (behind >= 0x8000) return false;
+
+    // How long before the last packet sent to it the reported one went out. The
+    // report's own delay (the round trip, roughly) is in there too; the smallest
+    // backlog seen stands for it.
+    const sendRecord& newest = fSent[client.lastSentSeq & (fSent.size() - 1)];
+    const sendRecord& reported = fSent[highestSeq & (fSent.size() - 1)];
+    if (!newest.valid || newest.seq != client.lastSentSeq) return false;
+    int64_t lagMs;
+    if (behind < fSent.size() && reported.valid && reported.seq == highestSeq) {
+        int64_t backlogUs = newest.sentUs - reported.sentUs;
+        if (!client.haveBaseline || backlogUs < client.baselineUs) {
+            client.baselineUs = backlogUs;
+            client.haveBaseline = true;
+        }
+        lagMs = (backlogUs - client.baselineUs) / 1000;
+    } else {
+        lagMs = VIDEO_SKIP_LAG_MS + 1;  // Further behind than the record goes
+    }
+    setMetricGauge("video.client_lag_ms", lagMs);
+
+    if (lagMs > VIDEO_SKIP_LAG_MS) {
+        if (client.policy == SKIP_TO_KEYFRAME) return false;
+        logMessage("Video client " + std::to_string(sessionId) + " " + std::to_string(lagMs) +
+                   " ms behind, skipping it to the next keyframe");
+        incrementMetricCounter("video.client_idr_skips");
+        client.policy = SKIP_TO_KEYFRAME;
+        return true;
+    }
+    // A skip only ends at a keyframe
+    if (client.policy != SKIP_TO_KEYFRAME) {
+        client.policy = lagMs > VIDEO_DROP_LAG_MS ? DROP_DISPOSABLE : SEND_ALL;
+    }
+    return false;
+}
+
+void rtxGroupsock::pruneClients() {
+    // Forget clients that are no longer destinations
+    for (std::map<unsigned, clientState>::iterator client = fClients.begin(); client != fClients.end();) {
+        destRecord* dest = fDests;
+        while (dest != NULL && dest->fSessionId != client->first) {
+            dest = dest->fNext;
+        }
+        if (dest == NULL) {
+            fClients.erase(client++);
+        } else {
+            ++client;
+        }
+    }
+}
+
+void rtxGroupsock::retransmit(u_int16_t seq, u_int32_t mediaSsrc, unsigned sessionId) {
+    if (!fHaveMediaSsrc || mediaSsrc != fMediaSsrc) {
+        incrementMetricCounter("rtx.foreign_ssrc_requests");
+        return;
+    }
+    // Only ever to where the stream already goes, never to where the NACK claims to be from
+    destRecord* client = fDests;
+    while (client != NULL && client->fSessionId != sessionId) {
+        client = client->fNext;
+    }
+    if (client == NULL) return;
+    if (fClientBackpressure) {
+        // Nothing it was deliberately not sent, and nothing while it skips to a keyframe
+        const clientState& state = fClients[sessionId];
+        unsigned index = seq & (fSent.size() - 1);
+        if (state.policy == SKIP_TO_KEYFRAME ||
+            (!state.withheld.empty() && state.withheld[index] && fSent[index].valid && fSent[index].seq == seq)) {
+            incrementMetricCounter("rtx.withheld_requests");
+            return;
+        }
+    }
+
+    unsigned size;
+    const unsigned char* packet = fHistory.find(seq, size);
+    if (packet == nullptr) {
+        incrementMetricCounter("rtx.unavailable_packets");
+        return;
+    }
+
+    unsigned headerSize;
+    if (!rtpHeaderSize(packet, size, headerSize)) return;
+    // Not advertised either (addRtxToSdpLines)
+    unsigned rtxPayloadType;
+    if (!offsetPayloadType(packet[1] & 0x7F, RTX_PAYLOAD_TYPE_OFFSET, rtxPayloadType)) return;
+
+    // Same header with the RTX payload type, sequence number and SSRC, then
+    // the original sequence number, then the original payload
+    memcpy(fRtxPacket, packet, headerSize);
+    fRtxPacket[1] = (packet[1] & 0x80) | rtxPayloadType;
+    fRtxPacket[2] = fRtxSeq >> 8;
+    fRtxPacket[3] = fRtxSeq & 0xFF;
+    fRtxPacket[8] = fRtxSsrc >> 24;
+    fRtxPacket[9] = (fRtxSsrc >> 16) & 0xFF;
+    fRtxPacket[10] = (fRtxSsrc >> 8) & 0xFF;
+    fRtxPacket[11] = fRtxSsrc & 0xFF;
+    fRtxPacket[headerSize] = packet[2];
+    fRtxPacket[headerSize + 1] = packet[3];
+    memcpy(fRtxPacket + headerSize + 2, packet + headerSize, size - headerSize);
+    ++fRtxSeq;
+
+    unsigned rtxSize = size + 2;
+    // Counted like sendPacket() does; the budget multiplies it by every client,
+    // so a loss burst for one errs on the safe side
+    incrementMetricCounter("rtp.sent_bytes", rtxSize);
+    if (fSrtp != NULL && !fSrtp->protectRtp(fRtxPacket, rtxSize)) {
+        incrementMetricCounter("srtp.failed_packets");
+        return;
+    }
+
+    if (writeSocket(env(), socketNum(), client->fGroupEId.groupAddress(), fRtxPacket, rtxSize)) {
+        incrementMetricCounter("rtx.retransmitted_packets");
+    }
+}
+
+// Finds the media payload type (the first format on the m= line) and the end of that line
+static bool findMediaPayloadType(const std::string& sdp, unsigned& payloadType, size_t& mLineEnd) {
+    // "m=<media> <port> RTP/AVP <pt> [<pt> ...]\r\n"
+    size_t mLine = sdp.find("m=");
+    if (mLine == std::string::npos) return false;
+    mLineEnd = sdp.find("\r\n", mLine);
+    size_t proto = sdp.find(" RTP/", mLine);
+    if (mLineEnd == std::string::npos || proto == std::string::npos || proto > mLineEnd) return false;
+    size_t ptStart = sdp.find(' ', proto + 1);
+    if (ptStart == std::string::npos || ptStart > mLineEnd) return false;
+    payloadType = atoi(sdp.c_str() + ptStart + 1);
+    return true;
+}
+
+char* addRtxToSdpLines(char const* sdpLines, unsigned clockRate, bool keyFrameFeedback) {
+    std::string sdp(sdpLines);
+
+    unsigned payloadType;
+    size_t mLineEnd;
+    if (!findMediaPayloadType(sdp, payloadType, mLineEnd)) {
+        return strDup(sdpLines);
+    }
+    char lines[256];
+    unsigned rtxPayloadType;
+    if (offsetPayloadType(payloadType, RTX_PAYLOAD_TYPE_OFFSET, rtxPayloadType)) {
+        sdp.insert(mLineEnd, " " + std::to_string(rtxPayloadType));
+        snprintf(lines, sizeof(lines),
+                 "a=rtcp-fb:%u nack\r\n"
+                 "a=rtpmap:%u rtx/%u\r\n"
+                 "a=fmtp:%u apt=%u;rtx-time=%u\r\n",
+                 payloadType,
+                 rtxPayloadType, clockRate,
+                 rtxPayloadType, payloadType, RTX_TIME_MS);
+        sdp += lines;
+    } else {
+        // NACKs would go unanswered: retransmit() drops them too
+        logMessage("RTX_PAYLOAD_TYPE_OFFSET takes payload type " + std::to_string(payloadType) +
+                   " out of 96-127; not offering retransmission");
+    }
+
+    if (keyFrameFeedback) {
+        snprintf(lines, sizeof(lines),
+                 "a=rtcp-fb:%u nack pli\r\n"
+                 "a=rtcp-fb:%u ccm fir\r\n",
+                 payloadType, payloadType);
+        sdp += lines;
+    }
+
+    return strDup(sdp.c_str());
+}
+
+char* addFecToSdpLines(char const* sdpLines, unsigned clockRate) {
+    std::string sdp(sdpLines);
+
+    unsigned payloadType;
+    size_t mLineEnd;
+    if (!findMediaPayloadType(sdp, payloadType, mLineEnd)) {
+        return strDup(sdpLines);
+    }
+    unsigned redPayloadType;
+    unsigned fecPayloadType;
+    if (!offsetPayloadType(payloadType, FEC_RED_PAYLOAD_TYPE_OFFSET, redPayloadType) ||
+        !offsetPayloadType(payloadType, FEC_PAYLOAD_TYPE_OFFSET, fecPayloadType)) {
+        logMessage("FEC_PAYLOAD_TYPE_OFFSET or FEC_RED_PAYLOAD_TYPE_OFFSET takes payload type " +
+                   std::to_string(payloadType) + " out of 96-127; not offering FEC");
+        return strDup(sdpLines);
+    }
+
+    sdp.insert(mLineEnd, " " + std::to_string(redPayloadType) + " " + std::to_string(fecPayloadType));
+
+    // The RED fmtp lists the payload types of its blocks: the ULPFEC one only
+    char lines[128];
+    snprintf(lines, sizeof(lines),
+             "a=rtpmap:%u red/%u\r\n"
+             "a=fmtp:%u %u\r\n"
+             "a=rtpmap:%u ulpfec/%u\r\n",
+             redPayloadType, clockRate,
+             redPayloadType, fecPayloadType,
+             fecPayloadType, clockRate);
+    sdp += lines;
+
+    return strDup(sdp.c_str());
+}
+
+// Appends the ssrc-group line, and an a=ssrc line for each SSRC the media
+// section doesn't declare yet (the media SSRC is in both the FID and FEC-FR groups)
+static char* addSsrcGroupToSdpLines(char const* sdpLines, char const* semantics, u_int32_t mediaSsrc,
+                                    u_int32_t otherSsrc) {
+    // RFC 5576 wants every grouped SSRC declared, with the CNAME RTCP reports;
+    // live555 uses the host name
+    char cname[100];
+    if (gethostname(cname, sizeof(cname)) != 0) {
+        cname[0] = '\0';
+    }
+    cname[sizeof(cname) - 1] = '\0';
+
+    std::string sdp(sdpLines);
+    char line[160];
+    snprintf(line, sizeof(line), "a=ssrc-group:%s %u %u\r\n", semantics, mediaSsrc, otherSsrc);
+    sdp += line;
+    u_int32_t ssrcs[2] = {mediaSsrc, otherSsrc};
+    for (u_int32_t ssrc : ssrcs) {
+        snprintf(line, sizeof(line), "a=ssrc:%u ", ssrc);
+        if (sdp.find(line) != std::string::npos) continue;
+        snprintf(line, sizeof(line), "a=ssrc:%u cname:%s\r\n", ssrc, cname);
+        sdp += line;
+    }
+    return strDup(sdp.c_str());
+}
+
+char* addRtxSsrcGroupToSdpLines(char const* sdpLines, u_int32_t mediaSsrc, u_int32_t rtxSsrc) {
+    unsigned payloadType;
+    size_t mLineEnd;
+    unsigned rtxPayloadType;
+    if (!findMediaPayloadType(sdpLines, payloadType, mLineEnd) ||
+        !offsetPayloadType(payloadType, RTX_PAYLOAD_TYPE_OFFSET, rtxPayloadType)) {
+        return strDup(sdpLines);
+    }
+    return addSsrcGroupToSdpLines(sdpLines, "FID", mediaSsrc, rtxSsrc);
+}
+
+char* addFecSsrcGroupToSdpLines(char const* sdpLines, u_int32_t mediaSsrc, u_int32_t fecSsrc) {
+    return addSsrcGroupToSdpLines(sdpLines, "FEC-FR", mediaSsrc, fecSsrc);
+}
@@ -0,0 +1,87 @@
+#include "shm_frame_publisher.h"
+#include "logger.h"
+#include "metrics.h"
+#include <cerrno>
+#include <new>
+
+shmFramePublisher::shmFramePublisher(const char* name, shmMediaType mediaType, uint32_t slotCount, uint32_t slotSize,
+                                     uint32_t sampleRate, uint32_t channels)
+    : shm_name(name)
+    , ring(nullptr)
+    , ring_size(shmRingBytes(slotCount, slotSize))
+    , published_metric(std::string("shm.") + (name[0] == '/' ? name + 1 : name) + ".published_frames")
+    , oversized_metric(std::string("shm.") + (name[0] == '/' ? name + 1 : name) + ".oversized_frames") {
+    // Start from a fresh object so old readers can't mistake stale data for ours
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        logMessage("shm_open " + shm_name + " failed: " + std::string(strerror(errno)));
+        return;
+    }
+    if (ftruncate(fd, ring_size) != 0) {
+        logMessage("ftruncate " + shm_name + " failed: " + std::string(strerror(errno)));
+        ::close(fd);
+        shm_unlink(name);
+        return;
+    }
+    void* mapped = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        logMessage("mmap " + shm_name + " failed: " + std::string(strerror(errno)));
+        shm_unlink(name);
+        return;
+    }
+
+    // ftruncate zero-fills, so every slot starts out even (idle) and empty
+    shmRingHeader* header = new (mapped) shmRingHeader();
+    header->mediaType = mediaType;
+    header->slotCount = slotCount;
+    header->slotSize = slotSize;
+    header->sampleRate = sampleRate;
+    header->channels = channels;
+    header->reserved = 0;
+    header->published.store(0, std::memory_order_relaxed);
+    header->version = SHM_FRAME_RING_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = SHM_FRAME_RING_MAGIC;  // Last, so readers never see a half-initialized ring
+
+    ring = mapped;
+    logMessage("Publishing frames to shared memory " + shm_name);
+}
+
+shmFramePublisher::~shmFramePublisher() {
+    if (ring != nullptr) {
+        munmap(ring, ring_size);
+        shm_unlink(shm_name.c_str());
+    }
+}
+
+void shmFramePublisher::publish(const void* data, size_t size, uint32_t captureSequence, int64_t timestampUs,
+                                uint32_t flags) {
+    if (ring == nullptr) return;
+
+    shmRingHeader* header = static_cast<shmRingHeader*>(ring);
+    if (size > header->slotSize) {
+        incrementMetricCounter(oversized_metric);
+        return;
+    }
+
+    uint32_t frameNumber = header->published.load(std::memory_order_relaxed);
+    shmSlotHeader* slot = shmSlot(ring, frameNumber);
+
+    // Odd sequence: readers treat the slot as being rewritten
+    uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->frameNumber = frameNumber;
+    slot->captureSequence = captureSequence;
+    slot->flags = flags;
+    slot->size = size;
+    slot->timestampUs = timestampUs;
+    memcpy(shmSlotPayload(slot), data, size);
+
+    slot->seq.store(seq + 2, std::memory_order_release);
+    header->published.store(frameNumber + 1, std::memory_order_release);
+    incrementMetricCounter(published_metric);
+}
@@ -0,0 +1,99 @@
+#include "sps_pps_cache.h"
+#include "constants.h"
+#include "logger.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+
+static std::string toHex(const uint8_t* data, unsigned size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(size * 2);
+    for (unsigned i = 0; i < size; ++i) {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 0x0F];
+    }
+    return hex;
+}
+
+static bool fromHex(const std::string& hex, std::vector<uint8_t>& out) {
+    if (hex.empty() || hex.size() % 2 != 0) return false;
+    out.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        unsigned value;
+        if (sscanf(hex.c_str() + i, "%2x", &value) != 1) return false;
+        out.push_back(static_cast<uint8_t>(value));
+    }
+    return true;
+}
+
+std::string spsPpsCachePath(const std::string& key) {
+    return std::string(SPS_PPS_CACHE_DIR) + "/" + key + ".params";
+}
+
+std::string spsPpsCacheKey(const std::string& device, VideoCodec codec, unsigned width, unsigned height,
+                           unsigned frameRateNumerator, unsigned frameRateDenominator) {
+    // Everything that changes the encoder's parameter sets is part of the key
+    std::string key = device;
+    for (size_t i = 0; i < key.size(); ++i) {
+        if (key[i] == '/') key[i] = '_';
+    }
+    char config[128];
+    snprintf(config, sizeof(config), "_%s_%ux%u_%u-%u_%d_gop%d",
+             codec == VIDEO_CODEC_HEVC ? "hevc" : "h264", width, height, frameRateNumerator, frameRateDenominator,
+             VIDEO_BITRATE, GOP_SIZE);
+    return key + config;
+}
+
+bool loadSpsPpsCache(const std::string& key, std::vector<uint8_t>& vps,
+                     std::vector<uint8_t>& sps, std::vector<uint8_t>& pps) {
+    std::ifstream file(spsPpsCachePath(key).c_str());
+    if (!file) return false;
+
+    std::string line;
+    bool haveSps = false;
+    bool havePps = false;
+    vps.clear();
+    while (std::getline(file, line)) {
+        if (line.compare(0, 4, "vps=") == 0) {
+            fromHex(line.substr(4), vps);
+        } else if (line.compare(0, 4, "sps=") == 0) {
+            haveSps = fromHex(line.substr(4), sps);
+        } else if (line.compare(0, 4, "pps=") == 0) {
+            havePps = fromHex(line.substr(4), pps);
+        }
+    }
+    return haveSps && havePps;
+}
+
+bool saveSpsPpsCache(const std::string& key, const uint8_t* vps, unsigned vpsSize,
+                     const uint8_t* sps, unsigned spsSize, const uint8_t* pps, unsigned ppsSize) {
+    if (mkdir(SPS_PPS_CACHE_DIR, 0755) == -1 && errno != EEXIST) {
+        logMessage("Cannot create SPS/PPS cache directory: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    // Write to a temporary file and rename, so a crash never leaves a torn cache
+    std::string path = spsPpsCachePath(key);
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream file(tmpPath.c_str(), std::ios::trunc);
+        if (!file) {
+            logMessage("Cannot write SPS/PPS cache " + tmpPath);
+            return false;
+        }
+        if (vpsSize > 0) {
+            file << "vps=" << toHex(vps, vpsSize) << "\n";
+        }
+        file << "sps=" << toHex(sps, spsSize) << "\n"
+             << "pps=" << toHex(pps, ppsSize) << "\n";
+        if (!file) return false;
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+        logMessage("Cannot store SPS/PPS cache: " + std::string(strerror(errno)));
+        return false;
+    }
+    return true;
+}
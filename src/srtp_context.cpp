@@ -0,0 +1,306 @@
+#include "srtp_context.h"
+#include "logger.h"
+#include <Base64.hh>
+#include <strDup.hh>
+#include <cstdio>
+#include <cstring>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <string>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+// Key derivation labels (RFC 3711, section 4.3.1); SRTCP uses these plus 3
+static const unsigned char LABEL_CIPHER_KEY = 0;
+static const unsigned char LABEL_AUTH_KEY = 1;
+static const unsigned char LABEL_SALT = 2;
+static const unsigned char SRTCP_LABEL_OFFSET = 3;
+
+static srtpMacCtx* newMac(const unsigned char* key, unsigned keySize) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC* hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    if (hmac == NULL) return NULL;
+    EVP_MAC_CTX* ctx = EVP_MAC_CTX_new(hmac);
+    EVP_MAC_free(hmac);  // The context keeps its own reference
+    if (ctx == NULL) return NULL;
+
+    char digest[] = "SHA1";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_end()
+    };
+    if (!EVP_MAC_init(ctx, key, keySize, params)) {
+        EVP_MAC_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+#else
+    HMAC_CTX* ctx = HMAC_CTX_new();
+    if (ctx == NULL) return NULL;
+    if (!HMAC_Init_ex(ctx, key, keySize, EVP_sha1(), NULL)) {
+        HMAC_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+#endif
+}
+
+static void freeMac(srtpMacCtx* ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC_CTX_free(ctx);
+#else
+    HMAC_CTX_free(ctx);
+#endif
+}
+
+srtpContext::srtpContext(const unsigned char* masterKeyAndSalt)
+    : rtp_cipher(EVP_CIPHER_CTX_new())
+    , rtcp_cipher(EVP_CIPHER_CTX_new())
+    , rtp_mac(NULL)
+    , rtcp_mac(NULL)
+    , srtcp_index(0)
+    , valid(false) {
+    memset(streams, 0, sizeof(streams));
+
+    const unsigned char* masterKey = masterKeyAndSalt;
+    const unsigned char* masterSalt = masterKeyAndSalt + SRTP_MASTER_KEY_LENGTH;
+    if (rtp_cipher == NULL || rtcp_cipher == NULL ||
+        !deriveKeys(masterKey, masterSalt, 0, rtp_keys) ||
+        !deriveKeys(masterKey, masterSalt, SRTCP_LABEL_OFFSET, rtcp_keys)) {
+        logMessage("Failed to derive SRTP session keys");
+        return;
+    }
+
+    // Expand the AES key schedules once; per packet only the IV changes
+    if (!EVP_EncryptInit_ex(rtp_cipher, EVP_aes_128_ctr(), NULL, rtp_keys.cipherKey, NULL) ||
+        !EVP_EncryptInit_ex(rtcp_cipher, EVP_aes_128_ctr(), NULL, rtcp_keys.cipherKey, NULL)) {
+        logMessage("Failed to set up SRTP cipher");
+        return;
+    }
+
+    rtp_mac = newMac(rtp_keys.authKey, sizeof(rtp_keys.authKey));
+    rtcp_mac = newMac(rtcp_keys.authKey, sizeof(rtcp_keys.authKey));
+    if (rtp_mac == NULL || rtcp_mac == NULL) {
+        logMessage("Failed to set up SRTP authentication");
+        return;
+    }
+
+    valid = true;
+}
+
+srtpContext::~srtpContext() {
+    EVP_CIPHER_CTX_free(rtp_cipher);
+    EVP_CIPHER_CTX_free(rtcp_cipher);
+    freeMac(rtp_mac);
+    freeMac(rtcp_mac);
+    OPENSSL_cleanse(&rtp_keys, sizeof(rtp_keys));
+    OPENSSL_cleanse(&rtcp_keys, sizeof(rtcp_keys));
+}
+
+bool srtpContext::deriveKeys(const unsigned char* masterKey, const unsigned char* masterSalt,
+                             unsigned char firstLabel, sessionKeys& keys) {
+    EVP_CIPHER_CTX* prf = EVP_CIPHER_CTX_new();
+    if (prf == NULL) return false;
+
+    // With a key derivation rate of 0, x = label << 48 XOR master salt, and
+    // the PRF is AES-CM keyed with the master key starting at x * 2^16
+    struct { unsigned char label; unsigned char* out; unsigned size; } outputs[] = {
+        { (unsigned char)(firstLabel + LABEL_CIPHER_KEY), keys.cipherKey, sizeof(keys.cipherKey) },
+        { (unsigned char)(firstLabel + LABEL_AUTH_KEY), keys.authKey, sizeof(keys.authKey) },
+        { (unsigned char)(firstLabel + LABEL_SALT), keys.salt, sizeof(keys.salt) }
+    };
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(outputs) / sizeof(outputs[0]) && ok; ++i) {
+        unsigned char iv[16] = {0};
+        memcpy(iv, masterSalt, SRTP_MASTER_SALT_LENGTH);
+        iv[7] ^= outputs[i].label;
+
+        int outLen;
+        memset(outputs[i].out, 0, outputs[i].size);
+        ok = EVP_EncryptInit_ex(prf, EVP_aes_128_ctr(), NULL, masterKey, iv) &&
+             EVP_EncryptUpdate(prf, outputs[i].out, &outLen, outputs[i].out, outputs[i].size);
+    }
+
+    EVP_CIPHER_CTX_free(prf);
+    return ok;
+}
+
+bool srtpContext::crypt(EVP_CIPHER_CTX* cipher, const sessionKeys& keys, uint32_t ssrc, uint64_t index,
+                        unsigned char* data, unsigned size) {
+    // IV = (salt * 2^16) XOR (SSRC * 2^64) XOR (index * 2^16)
+    unsigned char iv[16] = {0};
+    memcpy(iv, keys.salt, sizeof(keys.salt));
+    for (int i = 0; i < 4; ++i) {
+        iv[4 + i] ^= (ssrc >> (24 - 8 * i)) & 0xFF;
+    }
+    for (int i = 0; i < 6; ++i) {
+        iv[8 + i] ^= (index >> (40 - 8 * i)) & 0xFF;
+    }
+
+    int outLen;
+    return EVP_EncryptInit_ex(cipher, NULL, NULL, NULL, iv) &&
+           EVP_EncryptUpdate(cipher, data, &outLen, data, size);
+}
+
+bool srtpContext::computeTag(srtpMacCtx* mac, const unsigned char* data, unsigned size,
+                             const unsigned char* trailer, unsigned trailerSize, unsigned char* tag) {
+    unsigned char digest[20];
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    size_t digestLen;
+    // Re-initialising without a key keeps the one set up in the constructor
+    if (!EVP_MAC_init(mac, NULL, 0, NULL) ||
+        !EVP_MAC_update(mac, data, size) ||
+        (trailerSize > 0 && !EVP_MAC_update(mac, trailer, trailerSize)) ||
+        !EVP_MAC_final(mac, digest, &digestLen, sizeof(digest))) {
+        return false;
+    }
+#else
+    unsigned int digestLen;
+    if (!HMAC_Init_ex(mac, NULL, 0, NULL, NULL) ||
+        !HMAC_Update(mac, data, size) ||
+        (trailerSize > 0 && !HMAC_Update(mac, trailer, trailerSize)) ||
+        !HMAC_Final(mac, digest, &digestLen)) {
+        return false;
+    }
+#endif
+    memcpy(tag, digest, SRTP_AUTH_TAG_LENGTH);
+    return true;
+}
+
+uint32_t srtpContext::rolloverCounter(uint32_t ssrc, uint16_t seq) {
+    streamState* state = NULL;
+    for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); ++i) {
+        if (streams[i].used && streams[i].ssrc == ssrc) {
+            state = &streams[i];
+            break;
+        }
+        if (!streams[i].used && state == NULL) {
+            state = &streams[i];
+        }
+    }
+    if (state == NULL) {
+        state = &streams[0];  // More senders than expected; recycle a slot
+        state->used = false;
+    }
+
+    if (!state->used) {
+        state->used = true;
+        state->ssrc = ssrc;
+        state->roc = 0;
+        state->lastSeq = seq;
+        return 0;
+    }
+
+    // We're the sender, so sequence numbers only move forward
+    if ((int16_t)(seq - state->lastSeq) > 0) {
+        if (seq < state->lastSeq) {
+            ++state->roc;
+        }
+        state->lastSeq = seq;
+    }
+    return state->roc;
+}
+
+bool srtpContext::protectRtp(unsigned char* packet, unsigned& size) {
+    if (!valid || size < 12) return false;
+
+    unsigned headerSize = 12 + 4 * (packet[0] & 0x0F);
+    if (packet[0] & 0x10) {
+        if (headerSize + 4 > size) return false;
+        headerSize += 4 + 4 * ((packet[headerSize + 2] << 8) | packet[headerSize + 3]);
+    }
+    if (headerSize > size) return false;
+
+    uint16_t seq = (packet[2] << 8) | packet[3];
+    uint32_t ssrc = ((uint32_t)packet[8] << 24) | (packet[9] << 16) | (packet[10] << 8) | packet[11];
+    uint32_t roc = rolloverCounter(ssrc, seq);
+    uint64_t index = ((uint64_t)roc << 16) | seq;
+
+    if (!crypt(rtp_cipher, rtp_keys, ssrc, index, packet + headerSize, size - headerSize)) {
+        return false;
+    }
+
+    // The tag covers the packet followed by the rollover counter
+    unsigned char rocBytes[4] = {
+        (unsigned char)(roc >> 24), (unsigned char)(roc >> 16), (unsigned char)(roc >> 8), (unsigned char)roc
+    };
+    if (!computeTag(rtp_mac, packet, size, rocBytes, sizeof(rocBytes), packet + size)) {
+        return false;
+    }
+    size += SRTP_AUTH_TAG_LENGTH;
+    return true;
+}
+
+bool srtpContext::protectRtcp(unsigned char* packet, unsigned& size) {
+    if (!valid || size < 8) return false;
+
+    uint32_t ssrc = ((uint32_t)packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+    uint32_t index = srtcp_index;
+    srtcp_index = (srtcp_index + 1) & 0x7FFFFFFF;
+
+    // Everything after the first header and sender SSRC is encrypted
+    if (!crypt(rtcp_cipher, rtcp_keys, ssrc, index, packet + 8, size - 8)) {
+        return false;
+    }
+
+    unsigned char* trailer = packet + size;
+    trailer[0] = 0x80 | ((index >> 24) & 0x7F);  // E flag: encrypted
+    trailer[1] = (index >> 16) & 0xFF;
+    trailer[2] = (index >> 8) & 0xFF;
+    trailer[3] = index & 0xFF;
+    size += 4;
+
+    if (!computeTag(rtcp_mac, packet, size, NULL, 0, packet + size)) {
+        return false;
+    }
+    size += SRTP_AUTH_TAG_LENGTH;
+    return true;
+}
+
+bool srtpContext::unprotectRtcp(unsigned char* packet, unsigned& size) {
+    if (!valid || size < 8 + SRTCP_TRAILER_LENGTH) return false;
+
+    unsigned authenticatedSize = size - SRTP_AUTH_TAG_LENGTH;
+    unsigned char tag[SRTP_AUTH_TAG_LENGTH];
+    if (!computeTag(rtcp_mac, packet, authenticatedSize, NULL, 0, tag) ||
+        CRYPTO_memcmp(tag, packet + authenticatedSize, SRTP_AUTH_TAG_LENGTH) != 0) {
+        return false;
+    }
+
+    unsigned char* trailer = packet + authenticatedSize - 4;
+    bool encrypted = (trailer[0] & 0x80) != 0;
+    uint32_t index = ((uint32_t)(trailer[0] & 0x7F) << 24) | (trailer[1] << 16) | (trailer[2] << 8) | trailer[3];
+    uint32_t ssrc = ((uint32_t)packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+    size = authenticatedSize - 4;
+
+    if (encrypted && !crypt(rtcp_cipher, rtcp_keys, ssrc, index, packet + 8, size - 8)) {
+        return false;
+    }
+    return true;
+}
+
+bool generateSrtpMasterKey(unsigned char* masterKeyAndSalt) {
+    return RAND_bytes(masterKeyAndSalt, SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH) == 1;
+}
+
+char* addSrtpToSdpLines(char const* sdpLines, const unsigned char* masterKeyAndSalt) {
+    std::string sdp(sdpLines);
+
+    size_t profile = sdp.find(" RTP/AVP");
+    if (profile != std::string::npos) {
+        sdp.replace(profile, 8, " RTP/SAVP");
+    }
+
+    char* keyBase64 = base64Encode((char const*)masterKeyAndSalt,
+                                   SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH);
+    sdp += "a=crypto:1 AES_CM_128_HMAC_SHA1_80 inline:";
+    sdp += keyBase64;
+    sdp += "\r\n";
+    delete[] keyBase64;
+
+    return strDup(sdp.c_str());
+}
@@ -0,0 +1,142 @@
+#include "stream_sizer.h"
+#include "constants.h"
+#include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include <liveMedia.hh>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+static const unsigned FRAME_BUFFER_GRANULE = 4096;
+
+// Every live sizer, for the shared OutPacketBuffer::maxSize
+static std::vector<streamSizer*> sizers;
+
+// True when value moved more than the hysteresis band away from current
+static bool outsideHysteresis(double value, double current) {
+    return current == 0 || std::fabs(value - current) > SIZER_HYSTERESIS * current;
+}
+
+streamSizer::streamSizer(const std::string& name, unsigned nominalBitsPerSecond, unsigned nominalPeakFrameBytes,
+                         unsigned maxPayloadBytes, unsigned packetOverheadBytes)
+    : name(name)
+    , max_payload(maxPayloadBytes > 0 ? maxPayloadBytes : 1)
+    , packet_overhead(packetOverheadBytes)
+    , peak(nominalPeakFrameBytes)
+    , quiet_peak(0)
+    , quiet_windows(0)
+    , bitrate(0)
+    , window_start(mediaClockNow())
+    , window_peak(0)
+    , window_wire_bytes(0)
+    , frame_buffer_size(0)
+    , est_kbps(0)
+    , send_buffer_size(0) {
+    // The nominal rate is payload; add the headers of the packets it takes
+    bitrate = nominalBitsPerSecond * (double)wireBytes(max_payload) / max_payload;
+    sizers.push_back(this);
+    update();
+}
+
+streamSizer::~streamSizer() {
+    sizers.erase(std::remove(sizers.begin(), sizers.end(), this), sizers.end());
+    updateOutPacketBufferSize();
+}
+
+unsigned streamSizer::wireBytes(unsigned bytes) const {
+    unsigned packets = (bytes + max_payload - 1) / max_payload;
+    return bytes + std::max(packets, 1u) * packet_overhead;
+}
+
+void streamSizer::addFrame(unsigned bytes, bool truncated) {
+    auto now = mediaClockNow();
+    if (std::chrono::duration_cast<std::chrono::milliseconds>(now - window_start).count() >= SIZER_WINDOW_MS) {
+        closeWindow(now);
+    }
+
+    window_peak = std::max(window_peak, bytes);
+    window_wire_bytes += wireBytes(bytes);
+
+    if (truncated) {
+        incrementMetricCounter(name + ".truncated_frames");
+    }
+    if (bytes > peak) {
+        // Grow right away; the next stream start picks it up
+        peak = bytes;
+        update();
+    }
+}
+
+void streamSizer::closeWindow(std::chrono::steady_clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - window_start).count();
+    if (elapsed > 0) {
+        bitrate = window_wire_bytes * 8 / elapsed;
+    }
+
+    // Shrink only once frames have stayed well below the peak for a while, and
+    // then to the largest of them
+    if (window_peak < peak * (1 - SIZER_HYSTERESIS)) {
+        quiet_peak = std::max(quiet_peak, window_peak);
+        if (++quiet_windows >= SIZER_SHRINK_WINDOWS) {
+            peak = quiet_peak;
+            quiet_peak = 0;
+            quiet_windows = 0;
+        }
+    } else {
+        quiet_peak = 0;
+        quiet_windows = 0;
+    }
+
+    setMetricGauge(name + ".peak_frame_bytes", peak);
+    update();
+
+    window_start = now;
+    window_peak = 0;
+    window_wire_bytes = 0;
+}
+
+void streamSizer::update() {
+    bool changed = false;
+
+    unsigned frameBuffer = (unsigned)(peak * SIZER_HEADROOM);
+    frameBuffer = (frameBuffer + FRAME_BUFFER_GRANULE - 1) / FRAME_BUFFER_GRANULE * FRAME_BUFFER_GRANULE;
+    frameBuffer = std::max<unsigned>(SIZER_MIN_FRAME_BUFFER, std::min<unsigned>(frameBuffer, SIZER_MAX_FRAME_BUFFER));
+    if (frameBuffer != frame_buffer_size) {
+        frame_buffer_size = frameBuffer;
+        setMetricGauge(name + ".frame_buffer_bytes", frame_buffer_size);
+        updateOutPacketBufferSize();
+        changed = true;
+    }
+
+    unsigned kbps = (unsigned)std::ceil(bitrate / 1000);
+    if (kbps > 0 && outsideHysteresis(kbps, est_kbps)) {
+        est_kbps = kbps;
+        setMetricGauge(name + ".est_kbps", est_kbps);
+        changed = true;
+    }
+
+    double sendBuffer = std::max(2.0 * wireBytes(peak), bitrate / 8 * SIZER_SEND_BUFFER_MS / 1000);
+    sendBuffer = std::max<double>(SIZER_MIN_SEND_BUFFER, std::min<double>(sendBuffer, SIZER_MAX_SEND_BUFFER));
+    if (outsideHysteresis(sendBuffer, send_buffer_size)) {
+        send_buffer_size = (unsigned)sendBuffer;
+        setMetricGauge(name + ".send_buffer_bytes", send_buffer_size);
+        changed = true;
+    }
+
+    if (changed && change_listener) {
+        change_listener();
+    }
+}
+
+void streamSizer::updateOutPacketBufferSize() {
+    unsigned size = SIZER_MIN_FRAME_BUFFER;
+    for (streamSizer* sizer : sizers) {
+        size = std::max(size, sizer->frame_buffer_size);
+    }
+    if (size != OutPacketBuffer::maxSize) {
+        logMessage("Output packet buffer: " + std::to_string(OutPacketBuffer::maxSize) + " -> " +
+                   std::to_string(size) + " bytes");
+        OutPacketBuffer::maxSize = size;
+    }
+}
@@ -0,0 +1,156 @@
+#include "thread_placement.h"
+#include "constants.h"
+#include "logger.h"
+#include "metrics.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct rolePlacement {
+    const char* name;      // Thread name, at most 15 characters
+    const char* cpus;      // taskset-style list, "" for any
+    int fifoPriority;      // 0 for SCHED_OTHER
+};
+
+// What the process was started with (taskset, chrt, a cpuset), taken before main()
+// and before any thread was placed. Unconfigured roles keep this.
+struct startupPlacement {
+    cpu_set_t cpus;
+    bool haveCpus;
+    int policy;
+    struct sched_param param;
+
+    startupPlacement() {
+        haveCpus = pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+        if (pthread_getschedparam(pthread_self(), &policy, &param) != 0) {
+            policy = -1;
+        }
+    }
+};
+static const startupPlacement startup;
+
+static const rolePlacement placements[] = {
+    {"avs-loop", THREAD_EVENT_LOOP_CPUS, THREAD_EVENT_LOOP_FIFO_PRIORITY},
+    {"avs-recovery", THREAD_RECOVERY_CPUS, THREAD_RECOVERY_FIFO_PRIORITY},
+    {"avs-aux", THREAD_AUX_CPUS, 0},
+};
+
+// Parses "0,2-3" into set; false on a malformed list
+static bool parseCpuList(const char* list, cpu_set_t& set) {
+    CPU_ZERO(&set);
+    const char* p = list;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) return false;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return false;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, &set);
+        }
+        if (*end == ',') {
+            ++end;
+        } else if (*end != '\0') {
+            return false;
+        }
+        p = end;
+    }
+    return CPU_COUNT(&set) > 0;
+}
+
+bool applyThreadPlacement(const char* name, const char* cpus, int fifoPriority) {
+    // Threads inherit their creator's placement. An unconfigured part goes back to
+    // the startup placement, which leaves the main thread as the operator set it.
+    bool placed = true;
+    std::string description;
+    if (cpus[0] == '\0') {
+        if (startup.haveCpus) {
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(startup.cpus), &startup.cpus);
+            if (err != 0) {
+                logMessage(std::string("Cannot restore the startup CPUs of ") + name + ": " + strerror(err));
+                placed = false;
+            }
+        }
+    } else {
+        cpu_set_t set;
+        if (!parseCpuList(cpus, set)) {
+            logMessage(std::string("Ignoring malformed CPU list \"") + cpus + "\" for " + name);
+            placed = false;
+        } else {
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (err != 0) {
+                logMessage(std::string("Cannot pin ") + name + " to CPUs " + cpus + ": " + strerror(err));
+                placed = false;
+            } else {
+                description += std::string(" on CPUs ") + cpus;
+            }
+        }
+    }
+
+    if (fifoPriority == 0) {
+        if (startup.policy >= 0) {
+            int err = pthread_setschedparam(pthread_self(), startup.policy, &startup.param);
+            if (err != 0) {
+                logMessage(std::string("Cannot restore the startup scheduling of ") + name + ": " + strerror(err));
+                placed = false;
+            }
+        }
+    } else {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = fifoPriority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            // EPERM without CAP_SYS_NICE or an RLIMIT_RTPRIO allowance
+            logMessage(std::string("Cannot run ") + name + " as SCHED_FIFO " + std::to_string(fifoPriority) + ": " +
+                       strerror(err));
+            placed = false;
+        } else {
+            description += " at SCHED_FIFO " + std::to_string(fifoPriority);
+        }
+    }
+
+    if (!description.empty()) {
+        logMessage(std::string("Thread ") + name + description);
+    }
+    return placed;
+}
+
+void placeCurrentThread(ThreadRole role) {
+    const rolePlacement& placement = placements[role];
+
+    // Naming the main thread would rename the process
+    bool mainThread = syscall(SYS_gettid) == getpid();
+    if (!mainThread) {
+        pthread_setname_np(pthread_self(), placement.name);
+    }
+
+    // The main thread already runs as started; only a configured role changes it
+    if (mainThread && placement.cpus[0] == '\0' && placement.fifoPriority == 0) return;
+
+    if (!applyThreadPlacement(placement.name, placement.cpus, placement.fifoPriority)) {
+        incrementMetricCounter("thread.placement_failures");
+    }
+}
+
+void lockProcessMemory() {
+    if (!THREAD_LOCK_MEMORY) return;
+
+    // Future allocations too: sessions allocate buffers as clients come and go
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        logMessage("mlockall failed: " + std::string(strerror(errno)));
+        incrementMetricCounter("thread.placement_failures");
+        return;
+    }
+    logMessage("Process memory locked");
+}
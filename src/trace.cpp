@@ -0,0 +1,154 @@
+#include "trace.h"
+
+#ifdef AVS_TRACING
+
+#include "constants.h"
+#include "logger.h"
+#include "thread_placement.h"
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct traceEvent {
+    const char* name;
+    int64_t start_ns;
+    int64_t duration_ns;
+};
+
+// Written by its own thread only; the dump reads it concurrently
+struct threadBuffer {
+    pid_t tid;
+    std::atomic<uint64_t> head;  // Events written so far
+    traceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+// Buffers are never freed: the events of a finished thread are still worth dumping
+static std::mutex registryMutex;
+static std::vector<threadBuffer*> registry;
+
+static int64_t nowNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static threadBuffer* currentBuffer() {
+    static thread_local threadBuffer* buffer = nullptr;
+    if (buffer == nullptr) {
+        buffer = new threadBuffer();
+        buffer->tid = syscall(SYS_gettid);
+        buffer->head = 0;
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.push_back(buffer);
+    }
+    return buffer;
+}
+
+traceScope::traceScope(const char* name)
+    : name(name)
+    , start_ns(nowNs()) {
+}
+
+traceScope::~traceScope() {
+    threadBuffer* buffer = currentBuffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    traceEvent& event = buffer->events[head % TRACE_BUFFER_EVENTS];
+    event.name = name;
+    event.start_ns = start_ns;
+    event.duration_ns = nowNs() - start_ns;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+// Names can change after a thread starts, so read them at dump time
+static std::string threadName(pid_t tid) {
+    std::ifstream comm("/proc/self/task/" + std::to_string(tid) + "/comm");
+    std::string name;
+    if (!std::getline(comm, name) || name.empty()) {
+        name = "thread " + std::to_string(tid);
+    }
+    return name;
+}
+
+bool writeTrace(const char* path) {
+    std::vector<threadBuffer*> buffers;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        buffers = registry;
+    }
+
+    std::ofstream out(path);
+    if (!out) {
+        logMessage("Cannot write trace to " + std::string(path));
+        return false;
+    }
+
+    pid_t pid = getpid();
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":\"avs_rtsp_server\"}}";
+
+    uint64_t written = 0;
+    std::vector<traceEvent> events;
+    for (threadBuffer* buffer : buffers) {
+        uint64_t end = buffer->head.load(std::memory_order_acquire);
+        uint64_t begin = end > TRACE_BUFFER_EVENTS ? end - TRACE_BUFFER_EVENTS : 0;
+        events.clear();
+        for (uint64_t i = begin; i < end; ++i) {
+            events.push_back(buffer->events[i % TRACE_BUFFER_EVENTS]);
+        }
+        // Slots the thread reused while they were copied may be torn, and so may
+        // the one it is writing now, which holds event after - TRACE_BUFFER_EVENTS
+        uint64_t after = buffer->head.load(std::memory_order_acquire);
+        size_t skip = after + 1 > begin + TRACE_BUFFER_EVENTS
+            ? std::min<uint64_t>(after + 1 - begin - TRACE_BUFFER_EVENTS, events.size()) : 0;
+
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << buffer->tid
+            << ",\"args\":{\"name\":\"" << threadName(buffer->tid) << "\"}}";
+        char line[256];
+        for (size_t i = skip; i < events.size(); ++i) {
+            const traceEvent& event = events[i];
+            snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                     event.name, event.start_ns / 1000.0, event.duration_ns / 1000.0, (int)pid, (int)buffer->tid);
+            out << line;
+        }
+        written += events.size() - skip;
+    }
+    out << "\n]}\n";
+    out.close();
+
+    if (!out) {
+        logMessage("Failed writing trace to " + std::string(path));
+        return false;
+    }
+    logMessage("Wrote " + std::to_string(written) + " trace events from " + std::to_string(buffers.size()) +
+               " threads to " + std::string(path));
+    return true;
+}
+
+void startTraceDumpOnSignal() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    std::thread([signals]() {
+        placeCurrentThread(THREAD_ROLE_AUX);
+        for (;;) {
+            int received;
+            if (sigwait(&signals, &received) == 0) {
+                writeTrace(TRACE_DUMP_PATH);
+            }
+        }
+    }).detach();
+    logMessage("Tracing on; kill -USR2 " + std::to_string(getpid()) + " writes " TRACE_DUMP_PATH);
+}
+
+#endif // AVS_TRACING
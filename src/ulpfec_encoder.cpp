@@ -0,0 +1,155 @@
+#include "ulpfec_encoder.h"
+#include "constants.h"
+#include "metrics.h"
+#include "rtp_payload_type.h"
+#include <GroupsockHelper.hh>
+#include <chrono>
+#include <cstring>
+
+// ULPFEC with a 16-bit mask (L = 0) covers at most 16 media packets
+static const unsigned MAX_GROUP_SIZE = 16;
+
+ulpfecEncoder::ulpfecEncoder(VideoCodec codec, unsigned groupSize, unsigned keyFrameGroupSize)
+    : codec(codec)
+    , group_size(groupSize < 1 ? 1 : groupSize > MAX_GROUP_SIZE ? MAX_GROUP_SIZE : groupSize)
+    , keyframe_group_size(keyFrameGroupSize < 1 ? 1 : keyFrameGroupSize > MAX_GROUP_SIZE ? MAX_GROUP_SIZE : keyFrameGroupSize)
+    , fec_ssrc(our_random32())
+    , fec_seq((uint16_t)our_random32())
+    , group_count(0)
+    , group_keyframe(false)
+    , sn_base(0)
+    , mask(0)
+    , ts_recovery(0)
+    , length_recovery(0)
+    , protection_length(0)
+    , frame_encode_us(0.0) {
+    header_recovery[0] = header_recovery[1] = 0;
+}
+
+const unsigned char* ulpfecEncoder::addPacket(const unsigned char* packet, unsigned size, unsigned& fecSize) {
+    fecSize = 0;
+    if (size < 12 || size > RTP_HISTORY_MAX_PACKET_SIZE) return nullptr;
+    // Not advertised either (addFecToSdpLines)
+    unsigned redPayloadType;
+    unsigned fecPayloadType;
+    if (!offsetPayloadType(packet[1] & 0x7F, FEC_RED_PAYLOAD_TYPE_OFFSET, redPayloadType) ||
+        !offsetPayloadType(packet[1] & 0x7F, FEC_PAYLOAD_TYPE_OFFSET, fecPayloadType)) {
+        return nullptr;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    uint16_t seq = (packet[2] << 8) | packet[3];
+    if (group_count > 0 && (uint16_t)(seq - sn_base) >= MAX_GROUP_SIZE) {
+        group_count = 0;  // Sequence jumped; start over rather than send a bad mask
+    }
+    if (group_count == 0) {
+        sn_base = seq;
+        mask = 0;
+        group_keyframe = false;
+        header_recovery[0] = header_recovery[1] = 0;
+        ts_recovery = 0;
+        length_recovery = 0;
+        protection_length = 0;
+    }
+
+    // Everything after the fixed 12-byte header is protected as payload
+    const unsigned char* payload = packet + 12;
+    unsigned payloadSize = size - 12;
+
+    header_recovery[0] ^= packet[0];
+    header_recovery[1] ^= packet[1];
+    ts_recovery ^= ((uint32_t)packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+    length_recovery ^= payloadSize;
+
+    // Shorter packets are implicitly zero padded
+    if (payloadSize > protection_length) {
+        memset(parity + protection_length, 0, payloadSize - protection_length);
+        protection_length = payloadSize;
+    }
+    for (unsigned i = 0; i < payloadSize; ++i) {
+        parity[i] ^= payload[i];
+    }
+
+    mask |= 0x8000 >> (uint16_t)(seq - sn_base);
+    group_keyframe = group_keyframe || isKeyFramePayload(payload, payloadSize);
+    ++group_count;
+
+    bool endOfFrame = (packet[1] & 0x80) != 0;
+    unsigned limit = group_keyframe ? keyframe_group_size : group_size;
+    if (group_count >= limit || endOfFrame) {
+        fecSize = buildFecPacket(packet, redPayloadType, fecPayloadType);
+        group_count = 0;
+        incrementMetricCounter("fec.packets");
+    }
+
+    frame_encode_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    if (endOfFrame) {
+        setMetricGauge("fec.encode_us_per_frame", frame_encode_us);
+        frame_encode_us = 0.0;
+    }
+
+    return fecSize > 0 ? fec_packet : nullptr;
+}
+
+bool ulpfecEncoder::isKeyFramePayload(const unsigned char* payload, unsigned size) const {
+    if (size < 3) return false;
+
+    // Look through FU and aggregation packets at the NAL unit they carry
+    uint8_t header = payload[0];
+    unsigned type = nalUnitType(codec, header);
+    if (codec == VIDEO_CODEC_HEVC) {
+        if (type == 48) return true;                           // AP: parameter sets
+        if (type == 49) header = (payload[2] & 0x3F) << 1;     // FU
+    } else {
+        if (type == 24) return true;                           // STAP-A: parameter sets
+        if (type == 28) header = payload[1] & 0x1F;            // FU-A
+    }
+
+    NalKind kind = nalKind(codec, header);
+    return kind != NAL_KIND_SLICE && kind != NAL_KIND_OTHER;
+}
+
+unsigned ulpfecEncoder::buildFecPacket(const unsigned char* lastPacket, unsigned redPayloadType,
+                                       unsigned fecPayloadType) {
+    unsigned char* p = fec_packet;
+
+    // RTP header: RED payload type, own sequence number and SSRC; the timestamp
+    // is that of the media the packet was sent with
+    p[0] = 0x80;
+    p[1] = redPayloadType;
+    p[2] = fec_seq >> 8;
+    p[3] = fec_seq & 0xFF;
+    memcpy(p + 4, lastPacket + 4, 4);
+    p[8] = fec_ssrc >> 24;
+    p[9] = (fec_ssrc >> 16) & 0xFF;
+    p[10] = (fec_ssrc >> 8) & 0xFF;
+    p[11] = fec_ssrc & 0xFF;
+    ++fec_seq;
+
+    // RED header of the primary (last) block: F = 0, then its payload type
+    p[12] = fecPayloadType;
+    p += 13;
+
+    // FEC header: E = 0, L = 0, P/X/CC recovery; M/PT recovery; SN base;
+    // TS recovery; length recovery
+    p[0] = header_recovery[0] & 0x3F;
+    p[1] = header_recovery[1];
+    p[2] = sn_base >> 8;
+    p[3] = sn_base & 0xFF;
+    p[4] = ts_recovery >> 24;
+    p[5] = (ts_recovery >> 16) & 0xFF;
+    p[6] = (ts_recovery >> 8) & 0xFF;
+    p[7] = ts_recovery & 0xFF;
+    p[8] = length_recovery >> 8;
+    p[9] = length_recovery & 0xFF;
+
+    // Level 0 header: protection length, 16-bit mask
+    p[10] = protection_length >> 8;
+    p[11] = protection_length & 0xFF;
+    p[12] = mask >> 8;
+    p[13] = mask & 0xFF;
+
+    memcpy(p + 14, parity, protection_length);
+    return 27 + protection_length;
+}
@@ -1,13 +1,31 @@
 #include "unified_rtsp_server_manager.h"
 #include "v4l2_h264_media_subsession.h"
 #include "alsa_pcm_media_subsession.h"
+#include "admission_rtsp_server.h"
+#include "constants.h"
 #include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include <GroupsockHelper.hh>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstring>
+
+static const unsigned LOOPBACK_SESSION_ID = 1;
 
 UnifiedRTSPServerManager::UnifiedRTSPServerManager(UsageEnvironment* env, v4l2Capture* videoCapture, alsa_rtsp::alsaCapture* audioCapture, int port)
     : env_(env)
     , port_(port)
     , rtspServer_(nullptr)
+    , budget_(nullptr)
     , sms_(nullptr)
+    , metricsTask_(nullptr)
+    , probeTask_(nullptr)
+    , exportTask_(nullptr)
+    , probeSamples_(0)
+    , probeLatenessSumUs_(0)
+    , probeLatenessMaxUs_(0)
     , videoCapture_(videoCapture)
     , audioCapture_(audioCapture) {
 }
@@ -17,13 +35,23 @@ UnifiedRTSPServerManager::~UnifiedRTSPServerManager() {
 }
 
 bool UnifiedRTSPServerManager::initialize() {
+    // Every client gets the same stream: the video's bitrate plus uncompressed PCM
+    unsigned audioBitrate = audioCapture_
+        ? audioCapture_->getSampleRate() * audioCapture_->getChannels() * audioCapture_->getBitDepth()
+        : 0;
+    budget_ = new bandwidthBudget(*env_, NET_EGRESS_BUDGET_BPS, NET_CLIENT_MAX_BITRATE,
+                                  videoCapture_ ? VIDEO_BITRATE : 0, audioBitrate);
+
     // Create RTSP server
-    rtspServer_ = RTSPServer::createNew(*env_, port_, nullptr);
+    rtspServer_ = admissionRTSPServer::createNew(*env_, port_, budget_);
     if (rtspServer_ == nullptr) {
         logMessage("Failed to create RTSP server: " + std::string(env_->getResultMsg()));
         return false;
     }
     logMessage("Created RTSP server on port " + std::to_string(port_));
+    if (videoCapture_) {
+        rtspServer_->setVideoFormatHandler(videoFormatRequested, this);
+    }
 
     // Create a single session for both streams
     sms_ = ServerMediaSession::createNew(*env_,
@@ -35,7 +63,7 @@ bool UnifiedRTSPServerManager::initialize() {
     // Add video subsession
     if (videoCapture_) {
         v4l2H264MediaSubsession* videoSubsession = 
-            v4l2H264MediaSubsession::createNew(*env_, videoCapture_, True);
+            v4l2H264MediaSubsession::createNew(*env_, videoCapture_, True, budget_);
         if (videoSubsession == nullptr) {
             logMessage("Failed to create video subsession");
             return false;
@@ -64,9 +92,175 @@ bool UnifiedRTSPServerManager::initialize() {
     logMessage("Unified Stream URL: " + std::string(url));
     delete[] url;
 
+    metricsTask_ = env_->taskScheduler().scheduleDelayedTask(
+        METRICS_LOG_INTERVAL_SEC * 1000000LL, logMetricsTask, this);
+
+    // Real scheduling delays don't exist on the virtual clock
+    if (!isVirtualClock()) {
+        probeDue_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(EVENT_LOOP_PROBE_MS);
+        probeTask_ = env_->taskScheduler().scheduleDelayedTask(EVENT_LOOP_PROBE_MS * 1000LL, probeLatenessTask, this);
+    }
+
+    if ((videoCapture_ && videoCapture_->isExportingFrames()) || (audioCapture_ && audioCapture_->isExportingFrames())) {
+        if (audioCapture_) {
+            exportAudioBuffer_.resize(audioCapture_->getBufferSize());
+        }
+        exportTask_ = env_->taskScheduler().scheduleDelayedTask(0, exportFramesTask, this);
+    }
+
     return true;
 }
 
+bool UnifiedRTSPServerManager::reconfigureVideo(unsigned width, unsigned height, unsigned fpsNumerator,
+                                                unsigned fpsDenominator) {
+    unsigned generation = videoCapture_->getSpsPpsGeneration();
+    if (!videoCapture_->reconfigure(width, height, fpsNumerator, fpsDenominator)) {
+        logMessage("Video reconfiguration failed, still at " + std::to_string(videoCapture_->getWidth()) + "x" +
+                   std::to_string(videoCapture_->getHeight()));
+        return false;
+    }
+
+    // Build what new DESCRIBEs get now, rather than while the first one waits
+    char* sdp = sms_->generateSDPDescription(AF_INET);
+    delete[] sdp;
+    logMessage("Video reconfigured to " + std::to_string(width) + "x" + std::to_string(height) + " at " +
+               std::to_string(fpsDenominator) + "/" + std::to_string(fpsNumerator) + " fps, parameter set generation " +
+               std::to_string(generation) + " -> " + std::to_string(videoCapture_->getSpsPpsGeneration()));
+    return true;
+}
+
+bool UnifiedRTSPServerManager::reconfigureVideo(const char* format) {
+    unsigned width;
+    unsigned height;
+    unsigned fps;
+    char rest;
+    if (videoCapture_ == nullptr || sscanf(format, "%ux%u@%u%c", &width, &height, &fps, &rest) != 3) {
+        logMessage("Bad video format \"" + std::string(format) + "\", expected <width>x<height>@<fps>");
+        return false;
+    }
+    return reconfigureVideo(width, height, 1, fps);
+}
+
+bool UnifiedRTSPServerManager::videoFormatRequested(void* clientData, char const* format) {
+    return static_cast<UnifiedRTSPServerManager*>(clientData)->reconfigureVideo(format);
+}
+
+bool UnifiedRTSPServerManager::startLoopbackStream(unsigned short firstClientPort, avSyncMonitor* monitor) {
+    struct sockaddr_storage clientAddress;
+    memset(&clientAddress, 0, sizeof(clientAddress));
+    struct sockaddr_in* client4 = reinterpret_cast<struct sockaddr_in*>(&clientAddress);
+    client4->sin_family = AF_INET;
+    client4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // Same SSRCs and sequence numbers every run, so simulation captures compare.
+    // live555 seeds once, on its first host address lookup, which rtspURL()
+    // already did; the sinks created below draw from this seed.
+    if (isVirtualClock()) {
+        our_srandom(SIMULATION_RANDOM_SEED);
+    }
+
+    // What an RTSP SETUP and PLAY would do for each track
+    ServerMediaSubsessionIterator iter(*sms_);
+    unsigned short clientPort = firstClientPort;
+    while (ServerMediaSubsession* subsession = iter.next()) {
+        struct sockaddr_storage destinationAddress;
+        u_int8_t destinationTTL = 255;
+        Boolean isMulticast = False;
+        Port serverRTPPort(0);
+        Port serverRTCPPort(0);
+        void* streamToken = nullptr;
+        subsession->getStreamParameters(LOOPBACK_SESSION_ID, clientAddress, Port(clientPort), Port(clientPort + 1),
+                                        -1, 0, 0, NULL, destinationAddress, destinationTTL, isMulticast,
+                                        serverRTPPort, serverRTCPPort, streamToken);
+        if (streamToken == nullptr) {
+            logMessage("Failed to set up loopback stream for track " + std::string(subsession->trackId()));
+            stopLoopbackStream();
+            return false;
+        }
+        loopbackStreams_.push_back(std::make_pair(subsession, streamToken));
+
+        // Listening before the first packet goes out
+        if (monitor != nullptr &&
+            !monitor->addTrack(clientPort, static_cast<StreamState*>(streamToken)->rtpSink())) {
+            stopLoopbackStream();
+            return false;
+        }
+
+        unsigned short rtpSeqNum = 0;
+        unsigned rtpTimestamp = 0;
+        subsession->startStream(LOOPBACK_SESSION_ID, streamToken, NULL, NULL, rtpSeqNum, rtpTimestamp, NULL, NULL);
+        char ssrc[9];
+        snprintf(ssrc, sizeof(ssrc), "%08x", static_cast<StreamState*>(streamToken)->rtpSink()->SSRC());
+        logMessage("Loopback stream for track " + std::string(subsession->trackId()) + " to 127.0.0.1:" +
+                   std::to_string(clientPort) + ", SSRC " + ssrc + ", sequence from " + std::to_string(rtpSeqNum));
+        clientPort += 2;
+    }
+    return true;
+}
+
+void UnifiedRTSPServerManager::stopLoopbackStream() {
+    for (auto& stream : loopbackStreams_) {
+        stream.first->deleteStream(LOOPBACK_SESSION_ID, stream.second);
+    }
+    loopbackStreams_.clear();
+}
+
+void UnifiedRTSPServerManager::probeLatenessTask(void* clientData) {
+    UnifiedRTSPServerManager* manager = static_cast<UnifiedRTSPServerManager*>(clientData);
+    auto now = std::chrono::steady_clock::now();
+    double latenessUs = std::chrono::duration<double, std::micro>(now - manager->probeDue_).count();
+    if (latenessUs < 0) latenessUs = 0;
+    manager->probeSamples_++;
+    manager->probeLatenessSumUs_ += latenessUs;
+    manager->probeLatenessMaxUs_ = std::max(manager->probeLatenessMaxUs_, latenessUs);
+
+    manager->probeDue_ = now + std::chrono::milliseconds(EVENT_LOOP_PROBE_MS);
+    manager->probeTask_ = manager->env_->taskScheduler().scheduleDelayedTask(
+        EVENT_LOOP_PROBE_MS * 1000LL, probeLatenessTask, manager);
+}
+
+void UnifiedRTSPServerManager::exportFramesTask(void* clientData) {
+    UnifiedRTSPServerManager* manager = static_cast<UnifiedRTSPServerManager*>(clientData);
+
+    // Captures export whatever they deliver, so this only has to read them while
+    // no session does. Replays are paced by their RTSP stream alone.
+    v4l2Capture* video = manager->videoCapture_;
+    if (video && video->isExportingFrames() && !video->hasStreamReader() && !video->isReplay()) {
+        // Ending the last session stops capture
+        if (video->isStreaming() || video->startCapture()) {
+            size_t length;
+            while (video->waitForFrame(0) && video->getFrame(length) != nullptr) {
+                video->releaseFrame();
+            }
+        }
+    }
+
+    alsa_rtsp::alsaCapture* audio = manager->audioCapture_;
+    if (audio && audio->isExportingFrames() && !audio->hasStreamReader()) {
+        while (audio->waitForData(0) &&
+               audio->readFrames(manager->exportAudioBuffer_.data(), audio->getFramesPerPeriod()) > 0) {
+        }
+    }
+
+    manager->exportTask_ = manager->env_->taskScheduler().scheduleDelayedTask(
+        SHM_CAPTURE_INTERVAL_MS * 1000LL, exportFramesTask, manager);
+}
+
+void UnifiedRTSPServerManager::logMetricsTask(void* clientData) {
+    UnifiedRTSPServerManager* manager = static_cast<UnifiedRTSPServerManager*>(clientData);
+    if (manager->probeSamples_ > 0) {
+        setMetricGauge("event_loop.lateness_mean_us", manager->probeLatenessSumUs_ / manager->probeSamples_);
+        setMetricGauge("event_loop.lateness_max_us", manager->probeLatenessMaxUs_);
+        manager->probeSamples_ = 0;
+        manager->probeLatenessSumUs_ = 0;
+        manager->probeLatenessMaxUs_ = 0;
+    }
+    updateProcessMetrics();
+    logMetrics();
+    manager->metricsTask_ = manager->env_->taskScheduler().scheduleDelayedTask(
+        METRICS_LOG_INTERVAL_SEC * 1000000LL, logMetricsTask, manager);
+}
+
 void UnifiedRTSPServerManager::runEventLoop(volatile char* shouldExit) {
     logMessage("Starting unified RTSP server event loop");
     env_->taskScheduler().doEventLoop(const_cast<char*>(shouldExit));  // Safe cast here
@@ -74,9 +268,15 @@ void UnifiedRTSPServerManager::runEventLoop(volatile char* shouldExit) {
 
 void UnifiedRTSPServerManager::cleanup() {
     logMessage("Cleaning up unified RTSP server");
+    env_->taskScheduler().unscheduleDelayedTask(metricsTask_);
+    env_->taskScheduler().unscheduleDelayedTask(probeTask_);
+    env_->taskScheduler().unscheduleDelayedTask(exportTask_);
+    stopLoopbackStream();
     if (rtspServer_) {
         Medium::close(rtspServer_);
         rtspServer_ = nullptr;
     }
     sms_ = nullptr;  // Will be cleaned up by rtspServer_
+    delete budget_;
+    budget_ = nullptr;
 }
@@ -1,16 +1,61 @@
 #include "v4l2_capture.h"
 #include "logger.h"
+#include "media_clock.h"
+#include "sps_pps_cache.h"
+#include "metrics.h"
+#include "trace.h"
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <cmath>
+#include <sys/stat.h>
+#include <time.h>
 
-v4l2Capture::v4l2Capture(const char* device) 
+v4l2Capture::v4l2Capture(const char* device, VideoCodec requestedCodec) 
     : fd(-1)
     , buffers(nullptr)
     , n_buffers(0)
+    , bufferCount(VIDEO_BUFFER_COUNT)
+    , drainToNewest(false)
+    , streaming(false)
+    , streamReaders(0)
+    , framePublisher(nullptr)
+    , bitrate(VIDEO_BITRATE)
+    , gopSize(GOP_SIZE)
+    , width(VIDEO_WIDTH)
+    , height(VIDEO_HEIGHT)
+    , frameRateNumerator(FRAME_RATE_NUMERATOR)
+    , frameRateDenominator(FRAME_RATE_DENOMINATOR)
+    , codec(requestedCodec)
+    , vps(nullptr)
+    , vpsSize(0)
     , sps(nullptr)
     , pps(nullptr)
     , spsSize(0)
     , ppsSize(0)
-    , spsPpsExtracted(false) {
+    , spsPpsExtracted(false)
+    , spsPpsFromCache(false)
+    , spsPpsUnconfirmed(false)
+    , spsPpsGeneration(0)
+    , devicePath(device)
+    , replayMode(false)
+    , replayIndex(0)
+    , replaySequence(0)
+    , lastDequeueMicros(0)
+    , jitterFrames(0)
+    , jitterSum(0)
+    , jitterSumSquares(0)
+    , jitterMax(0) {
+    struct stat st;
+    if (stat(device, &st) == 0 && S_ISREG(st.st_mode)) {
+        replayMode = true;
+        if (!loadReplayFile(device)) {
+            replayMode = false;
+        }
+        return;
+    }
+
     fd = open(device, O_RDWR);
     if (fd == -1) {
         logMessage("Cannot open device " + std::string(device) + ": " + std::string(strerror(errno)));
@@ -29,12 +74,19 @@ v4l2Capture::~v4l2Capture() {
         }
         delete[] buffers;
     }
+    delete[] vps;
     delete[] sps;
     delete[] pps;
+    delete framePublisher;
     if (fd >= 0) close(fd);
 }
 
 bool v4l2Capture::initialize() {
+    if (replayMode) {
+        // Parameter sets were taken from the file when it was loaded
+        return spsPpsExtracted;
+    }
+
     struct v4l2_capability cap;
     if (ioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
         logMessage("VIDIOC_QUERYCAP error: " + std::string(strerror(errno)));
@@ -42,52 +94,18 @@ bool v4l2Capture::initialize() {
     }
 
     // Set the format
-    struct v4l2_format fmt = {0};
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width = VIDEO_WIDTH;
-    fmt.fmt.pix.height = VIDEO_HEIGHT;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
-    fmt.fmt.pix.field = V4L2_FIELD_ANY;
-
-    if (ioctl(fd, VIDIOC_S_FMT, &fmt) == -1) {
-        logMessage("VIDIOC_S_FMT error: " + std::string(strerror(errno)));
+    if (!negotiateFormat()) {
         return false;
     }
 
-    // Set H.264 related controls
-    struct v4l2_control control;
-    
-    // Set bitrate 
-    control.id = V4L2_CID_MPEG_VIDEO_BITRATE;
-    control.value = VIDEO_BITRATE;
-    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
-        logMessage("Failed to set bitrate: " + std::string(strerror(errno)));
-    }
-
-    // Set GOP size to 60 (2 seconds at 30 fps)
-    control.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
-    control.value = GOP_SIZE;
-    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
-        logMessage("Failed to set GOP size: " + std::string(strerror(errno)));
-    }
-
-    // Set H.264 profile to High
-    control.id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
-    control.value = V4L2_MPEG_VIDEO_H264_PROFILE_HIGH;
-    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
-        logMessage("Failed to set H.264 profile: " + std::string(strerror(errno)));
-    }
+    // Set codec related controls
+    applyEncoderControls("set");
 
     // Set the frame rate
-    struct v4l2_streamparm streamparm = {0};
-    streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    streamparm.parm.capture.timeperframe.numerator = FRAME_RATE_NUMERATOR;
-    streamparm.parm.capture.timeperframe.denominator = FRAME_RATE_DENOMINATOR;
-    if (ioctl(fd, VIDIOC_S_PARM, &streamparm) == -1) {
-        logMessage("Failed to set frame rate: " + std::string(strerror(errno)));
-    }
+    applyFrameRate("set");
 
     // Set rotation (if needed)
+    struct v4l2_control control;
     control.id = V4L2_CID_ROTATE;
     control.value = ROTATION_DEGREES;
     if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
@@ -100,6 +118,12 @@ bool v4l2Capture::initialize() {
         return false;
     }
 
+    // Parameter sets already known from the on-disk cache; they are re-validated
+    // against the first keyframe streamed instead of delaying startup
+    if (spsPpsExtracted) {
+        return true;
+    }
+
     // Start capture temporarily to get SPS/PPS
     if (!startCapture()) {
         logMessage("Failed to start capture for SPS/PPS extraction.");
@@ -124,9 +148,88 @@ bool v4l2Capture::initialize() {
     return true;
 }
 
+bool v4l2Capture::negotiateFormat() {
+    if (codec == VIDEO_CODEC_HEVC) {
+        // Only use HEVC if the encoder actually offers it
+        bool hevcSupported = false;
+        struct v4l2_fmtdesc desc = {0};
+        desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        for (desc.index = 0; ioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; ++desc.index) {
+            if (desc.pixelformat == V4L2_PIX_FMT_HEVC) {
+                hevcSupported = true;
+                break;
+            }
+        }
+        if (!hevcSupported) {
+            logMessage("Encoder does not support HEVC, falling back to H.264.");
+            codec = VIDEO_CODEC_H264;
+            if (spsPpsFromCache) {
+                clearSpsPps();  // Cached parameter sets were for HEVC
+                spsPpsFromCache = false;
+                spsPpsUnconfirmed = false;
+            }
+        }
+    }
+
+    struct v4l2_format fmt = {0};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = codec == VIDEO_CODEC_HEVC ? V4L2_PIX_FMT_HEVC : V4L2_PIX_FMT_H264;
+    fmt.fmt.pix.field = V4L2_FIELD_ANY;
+
+    if (ioctl(fd, VIDIOC_S_FMT, &fmt) == -1) {
+        logMessage("VIDIOC_S_FMT error: " + std::string(strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+void v4l2Capture::applyEncoderControls(const char* action) {
+    struct v4l2_control control;
+
+    // Set bitrate
+    control.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+    control.value = bitrate;
+    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
+        logMessage("Failed to " + std::string(action) + " bitrate: " + std::string(strerror(errno)));
+    }
+
+    if (codec == VIDEO_CODEC_HEVC) {
+        // Set GOP size
+        control.id = V4L2_CID_MPEG_VIDEO_GOP_SIZE;
+        control.value = gopSize;
+        if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
+            logMessage("Failed to " + std::string(action) + " GOP size: " + std::string(strerror(errno)));
+        }
+
+        // Set HEVC profile to Main
+        control.id = V4L2_CID_MPEG_VIDEO_HEVC_PROFILE;
+        control.value = V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN;
+        if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
+            logMessage("Failed to " + std::string(action) + " HEVC profile: " + std::string(strerror(errno)));
+        }
+        return;
+    }
+
+    // Set GOP size (1 second at 30 fps unless adapted)
+    control.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+    control.value = gopSize;
+    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
+        logMessage("Failed to " + std::string(action) + " GOP size: " + std::string(strerror(errno)));
+    }
+
+    // Set H.264 profile to High
+    control.id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
+    control.value = V4L2_MPEG_VIDEO_H264_PROFILE_HIGH;
+    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
+        logMessage("Failed to " + std::string(action) + " H.264 profile: " + std::string(strerror(errno)));
+    }
+}
+
 bool v4l2Capture::initializeMmap() {
     struct v4l2_requestbuffers req = {0};
-    req.count = VIDEO_BUFFER_COUNT;
+    req.count = bufferCount;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
 
@@ -160,6 +263,9 @@ bool v4l2Capture::initializeMmap() {
 }
 
 bool v4l2Capture::startCapture() {    
+    if (replayMode) return true;
+    std::lock_guard<std::recursive_mutex> lock(deviceMutex);
+
     for (unsigned int i = 0; i < n_buffers; ++i) {
         struct v4l2_buffer buf = {0};
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -177,12 +283,19 @@ bool v4l2Capture::startCapture() {
         logMessage("VIDIOC_STREAMON error: " + std::string(strerror(errno)));
         return false;
     }
+    streaming = true;
 
     logMessage("Successfully start video capture.");
     return true;
 }
 
 bool v4l2Capture::stopCapture() {
+    if (replayMode) return true;
+    std::lock_guard<std::recursive_mutex> lock(deviceMutex);
+
+    lastDequeueMicros = 0;  // The gap until the restart isn't jitter
+    streaming = false;
+    heldBuffers.clear();  // STREAMOFF takes every buffer back
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     
     // First stop streaming
@@ -207,9 +320,14 @@ bool v4l2Capture::stopCapture() {
 }
 
 bool v4l2Capture::reset() {    
+    if (replayMode) return true;
+    std::lock_guard<std::recursive_mutex> lock(deviceMutex);
+
     logMessage("Starting comprehensive device reset.");
 
     // 1. Stop streaming with proper error handling
+    streaming = false;
+    heldBuffers.clear();
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if (ioctl(fd, VIDIOC_STREAMOFF, &type) == -1) {
         logMessage("VIDIOC_STREAMOFF during reset: " + std::string(strerror(errno)));
@@ -228,7 +346,28 @@ bool v4l2Capture::reset() {
         }
     }
     
-    // 3. Unmap buffers with validation
+    // 3-4. Unmap and free the buffers
+    releaseMmap();
+
+    // 5. Re-initialize device parameters
+    applyEncoderControls("reset");
+
+    // 6. Reinitialize mmap
+    n_buffers = 0;
+    if (!initializeMmap()) {
+        logMessage("Failed to reinitialize mmap during reset");
+        return false;
+    }
+
+    // 7. Reset frame rate
+    applyFrameRate("reset");
+
+    logMessage("Successfully completed comprehensive device reset.");
+    return true;
+}
+
+void v4l2Capture::releaseMmap() {
+    // Unmap buffers with validation
     if (buffers) {
         for (unsigned int i = 0; i < n_buffers; ++i) {
             if (buffers[i].start != MAP_FAILED && buffers[i].start != nullptr) {
@@ -242,57 +381,211 @@ bool v4l2Capture::reset() {
         delete[] buffers;
         buffers = nullptr;
     }
-    
-    // 4. Reset buffer management
+    n_buffers = 0;
+
+    // Request zero buffers to free all; the format can only change after this
     struct v4l2_requestbuffers req = {0};
-    req.count = 0; // Request zero buffers to free all
+    req.count = 0;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
     if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
         logMessage("Failed to release buffers: " + std::string(strerror(errno)));
     }
+}
 
-    // 5. Re-initialize device parameters
-    struct v4l2_control control;
-    
-    // Reset bitrate
-    control.id = V4L2_CID_MPEG_VIDEO_BITRATE;
-    control.value = VIDEO_BITRATE;
-    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
-        logMessage("Failed to reset bitrate: " + std::string(strerror(errno)));
+void v4l2Capture::applyFrameRate(const char* action) {
+    struct v4l2_streamparm streamparm = {0};
+    streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    streamparm.parm.capture.timeperframe.numerator = frameRateNumerator;
+    streamparm.parm.capture.timeperframe.denominator = frameRateDenominator;
+    if (ioctl(fd, VIDIOC_S_PARM, &streamparm) == -1) {
+        logMessage("Failed to " + std::string(action) + " frame rate: " + std::string(strerror(errno)));
     }
+}
 
-    // Reset GOP size
-    control.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
-    control.value = GOP_SIZE;
-    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
-        logMessage("Failed to reset GOP size: " + std::string(strerror(errno)));
+bool v4l2Capture::reconfigure(unsigned newWidth, unsigned newHeight, unsigned fpsNumerator, unsigned fpsDenominator) {
+    if (newWidth == 0 || newHeight == 0 || fpsNumerator == 0 || fpsDenominator == 0) {
+        return false;
     }
+    if (replayMode) {
+        return reconfigureReplay(newWidth, newHeight, fpsNumerator, fpsDenominator);
+    }
+    std::lock_guard<std::recursive_mutex> lock(deviceMutex);
 
-    // Reset H.264 profile
-    control.id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
-    control.value = V4L2_MPEG_VIDEO_H264_PROFILE_HIGH;
-    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
-        logMessage("Failed to reset H.264 profile: " + std::string(strerror(errno)));
+    logMessage("Reconfiguring video to " + std::to_string(newWidth) + "x" + std::to_string(newHeight) + " at " +
+               std::to_string(fpsDenominator) + "/" + std::to_string(fpsNumerator) + " fps");
+    unsigned oldWidth = width;
+    unsigned oldHeight = height;
+    unsigned oldNumerator = frameRateNumerator;
+    unsigned oldDenominator = frameRateDenominator;
+
+    // The format is locked while buffers exist
+    stopCapture();
+    releaseMmap();
+
+    width = newWidth;
+    height = newHeight;
+    frameRateNumerator = fpsNumerator;
+    frameRateDenominator = fpsDenominator;
+    bool formatChanged = negotiateFormat();
+    if (!formatChanged) {
+        width = oldWidth;
+        height = oldHeight;
+        frameRateNumerator = oldNumerator;
+        frameRateDenominator = oldDenominator;
+        negotiateFormat();
     }
+    applyEncoderControls("reconfigure");
+    applyFrameRate("reconfigure");
 
-    // 6. Reinitialize mmap
-    n_buffers = 0;
-    if (!initializeMmap()) {
-        logMessage("Failed to reinitialize mmap during reset");
+    if (!initializeMmap() || !startCapture()) {
+        logMessage("Failed to restart video capture after reconfiguration.");
         return false;
     }
 
-    // 7. Reset frame rate
-    struct v4l2_streamparm streamparm = {0};
-    streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    streamparm.parm.capture.timeperframe.numerator = FRAME_RATE_NUMERATOR;
-    streamparm.parm.capture.timeperframe.denominator = FRAME_RATE_DENOMINATOR;
-    if (ioctl(fd, VIDIOC_S_PARM, &streamparm) == -1) {
-        logMessage("Failed to reset frame rate: " + std::string(strerror(errno)));
+    // Take the new parameter sets from the first keyframe: new DESCRIBEs get them
+    // via the generation bump, running sessions in-band at the next IDR. That
+    // keyframe was consumed here, so ask for another one for the clients.
+    if (formatChanged && !extractSpsPpsImmediate()) {
+        // The old resolution's sets must not be advertised any longer. Sessions
+        // hold back until an IDR, whose parameter sets getFrame() then takes.
+        logMessage("Failed to extract SPS/PPS after reconfiguration; taking them from the next keyframe.");
+        spsPpsUnconfirmed = true;
+        ++spsPpsGeneration;
     }
+    requestKeyFrame();
 
-    logMessage("Successfully completed comprehensive device reset.");
+    setMetricGauge("video.width", width);
+    setMetricGauge("video.height", height);
+    incrementMetricCounter("video.reconfigurations");
+    return formatChanged;
+}
+
+bool v4l2Capture::reconfigureReplay(unsigned newWidth, unsigned newHeight, unsigned fpsNumerator,
+                                    unsigned fpsDenominator) {
+    // The file was recorded at one size; its frame rate is only how fast it is read
+    if (newWidth != width || newHeight != height) {
+        logMessage("Replay input stays at " + std::to_string(width) + "x" + std::to_string(height) + ".");
+        return false;
+    }
+    logMessage("Reconfiguring replay to " + std::to_string(fpsDenominator) + "/" + std::to_string(fpsNumerator) +
+               " fps");
+    frameRateNumerator = fpsNumerator;
+    frameRateDenominator = fpsDenominator;
+
+    // Start over at the first keyframe, as an encoder restarts with one. That is
+    // a new coded video sequence even with the same parameter sets, so it gets a
+    // generation of its own and sessions take the sets in-band like after a device
+    // reconfiguration.
+    replayIndex = 0;
+    requestKeyFrame();
+    ++spsPpsGeneration;
+
+    incrementMetricCounter("video.reconfigurations");
+    return true;
+}
+
+bool v4l2Capture::recover() {
+    // Used by the stall watchdog: full reset, restart streaming and ask for an IDR
+    // so clients can resume decoding as soon as possible
+    std::lock_guard<std::recursive_mutex> lock(deviceMutex);
+    stopCapture();
+    if (!reset()) {
+        return false;
+    }
+    if (!startCapture()) {
+        return false;
+    }
+    requestKeyFrame();
+    return true;
+}
+
+bool v4l2Capture::waitForFrame(int timeoutMs) {
+    TRACE_SCOPE("v4l2Capture::waitForFrame");
+    if (replayMode) return true;  // Pacing comes from the frame durations
+    std::lock_guard<std::recursive_mutex> lock(deviceMutex);
+    if (!heldBuffers.empty()) return true;
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int ret = poll(&pfd, 1, timeoutMs);
+    if (ret == -1 && errno != EINTR) {
+        logMessage("poll error: " + std::string(strerror(errno)));
+    }
+    return ret > 0 && (pfd.revents & POLLIN);
+}
+
+int64_t v4l2Capture::getFrameAgeMicros() const {
+    if (!currentFrameInfo.valid) return 0;
+
+    // Buffer timestamps come from CLOCK_MONOTONIC
+    int64_t nowMicros = mediaClockMicros();
+    int64_t capturedMicros = (int64_t)currentFrameInfo.timestamp.tv_sec * 1000000 +
+                             currentFrameInfo.timestamp.tv_usec;
+    return nowMicros - capturedMicros;
+}
+
+bool v4l2Capture::requestKeyFrame() {
+    if (replayMode) {
+        // Skip ahead to the next keyframe in the file
+        for (size_t i = 0; i < replayPictures.size(); ++i) {
+            size_t index = (replayIndex + i) % replayPictures.size();
+            size_t offset = replayPictures[index].first;
+            size_t nalStart = offset + startCodeLength(replayData.data(), replayData.size(), offset);
+            if (isKeyFrameNal(codec, replayData[nalStart])) {
+                replayIndex = index;
+                break;
+            }
+        }
+        return true;
+    }
+
+    // Not worth stalling the loop for: a recovering device starts with a keyframe anyway
+    std::unique_lock<std::recursive_mutex> lock(deviceMutex, std::try_to_lock);
+    if (!lock.owns_lock()) return false;
+
+    struct v4l2_control control = {0};
+    control.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
+        logMessage("Failed to force keyframe: " + std::string(strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+bool v4l2Capture::setBitrate(unsigned bitsPerSecond) {
+    if (replayMode) return false;
+    // The rate controller tries again with its next frame
+    std::unique_lock<std::recursive_mutex> lock(deviceMutex, std::try_to_lock);
+    if (!lock.owns_lock()) return false;
+
+    struct v4l2_control control;
+    control.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+    control.value = bitsPerSecond;
+    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
+        logMessage("Failed to change bitrate: " + std::string(strerror(errno)));
+        return false;
+    }
+    bitrate = bitsPerSecond;
+    return true;
+}
+
+bool v4l2Capture::setGopSize(unsigned frames) {
+    if (replayMode) return false;
+    std::unique_lock<std::recursive_mutex> lock(deviceMutex, std::try_to_lock);
+    if (!lock.owns_lock()) return false;
+
+    struct v4l2_control control;
+    control.id = codec == VIDEO_CODEC_HEVC ? V4L2_CID_MPEG_VIDEO_GOP_SIZE : V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+    control.value = frames;
+    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
+        logMessage("Failed to change GOP size: " + std::string(strerror(errno)));
+        return false;
+    }
+    gopSize = frames;
     return true;
 }
 
@@ -301,14 +594,68 @@ void v4l2Capture::updateFrameInfo(const v4l2_buffer& buf) {
     currentFrameInfo.sequence = buf.sequence;
     currentFrameInfo.size = buf.bytesused;
     currentFrameInfo.valid = true;
+    currentFrameInfo.skippedFrames = 0;
+    currentFrameInfo.heldFrames = 0;
+}
+
+void v4l2Capture::recordDequeueInterval() {
+    int64_t nowMicros = mediaClockMicros();
+    if (lastDequeueMicros != 0) {
+        double interval = nowMicros - lastDequeueMicros;
+        jitterSum += interval;
+        jitterSumSquares += interval * interval;
+        jitterMax = std::max(jitterMax, interval);
+        if (++jitterFrames >= VIDEO_JITTER_WINDOW_FRAMES) {
+            double mean = jitterSum / jitterFrames;
+            double variance = std::max(0.0, jitterSumSquares / jitterFrames - mean * mean);
+            setMetricGauge("video.dequeue_interval_stddev_us", std::sqrt(variance));
+            setMetricGauge("video.dequeue_interval_max_us", jitterMax);
+            jitterFrames = 0;
+            jitterSum = 0;
+            jitterSumSquares = 0;
+            jitterMax = 0;
+        }
+    }
+    lastDequeueMicros = nowMicros;
 }
 
 unsigned char* v4l2Capture::getFrame(size_t& length) {
+    TRACE_SCOPE("v4l2Capture::getFrame");
+    if (replayMode) {
+        if (replayPictures.empty()) {
+            currentFrameInfo.valid = false;
+            return nullptr;
+        }
+
+        // Copy, since callers strip the start code in place; loop at end of file
+        const std::pair<size_t, size_t>& picture = replayPictures[replayIndex];
+        replayIndex = (replayIndex + 1) % replayPictures.size();
+        replayFrame.assign(replayData.begin() + picture.first,
+                           replayData.begin() + picture.first + picture.second);
+
+        int64_t nowMicros = mediaClockMicros();
+        currentFrameInfo.timestamp.tv_sec = nowMicros / 1000000;
+        currentFrameInfo.timestamp.tv_usec = nowMicros % 1000000;
+        currentFrameInfo.sequence = replaySequence++;
+        currentFrameInfo.size = replayFrame.size();
+        currentFrameInfo.valid = true;
+        currentFrameInfo.skippedFrames = 0;
+        currentFrameInfo.heldFrames = 0;
+
+        length = replayFrame.size();
+        exportFrame(replayFrame.data(), length);
+        return replayFrame.data();
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(deviceMutex);
     memset(&current_buf, 0, sizeof(current_buf));
     current_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     current_buf.memory = V4L2_MEMORY_MMAP;
 
-    if (ioctl(fd, VIDIOC_DQBUF, &current_buf) == -1) {
+    if (!heldBuffers.empty()) {
+        current_buf = heldBuffers.front();
+        heldBuffers.pop_front();
+    } else if (ioctl(fd, VIDIOC_DQBUF, &current_buf) == -1) {
         logMessage("VIDIOC_DQBUF error: " + std::string(strerror(errno)));
         currentFrameInfo.valid = false;
         return nullptr;
@@ -316,9 +663,41 @@ unsigned char* v4l2Capture::getFrame(size_t& length) {
 
     // Update frame info with timing data
     updateFrameInfo(current_buf);
+    recordDequeueInterval();
+
+    if (drainToNewest) {
+        drainToNewestFrame();
+    }
 
     length = current_buf.bytesused;
-    return static_cast<unsigned char*>(buffers[current_buf.index].start);
+    unsigned char* frame = static_cast<unsigned char*>(buffers[current_buf.index].start);
+    if (spsPpsUnconfirmed) {
+        revalidateSpsPps(frame, length);
+    }
+    exportFrame(frame, length);
+    return frame;
+}
+
+bool v4l2Capture::enableFrameExport(const char* name, unsigned slots, unsigned slotBytes) {
+    delete framePublisher;
+    framePublisher = new shmFramePublisher(name, codec == VIDEO_CODEC_HEVC ? SHM_MEDIA_HEVC : SHM_MEDIA_H264,
+                                           slots, slotBytes);
+    if (!framePublisher->isOpen()) {
+        delete framePublisher;
+        framePublisher = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void v4l2Capture::exportFrame(const uint8_t* data, size_t size) {
+    if (framePublisher == nullptr) return;
+
+    // Before callers get to strip the start code in place
+    bool keyFrame, disposable;
+    classifyFrame(data, size, keyFrame, disposable);
+    int64_t timestampUs = int64_t(currentFrameInfo.timestamp.tv_sec) * 1000000 + currentFrameInfo.timestamp.tv_usec;
+    framePublisher->publish(data, size, currentFrameInfo.sequence, timestampUs, keyFrame ? SHM_FRAME_KEYFRAME : 0);
 }
 
 unsigned char* v4l2Capture::getFrameWithoutStartCode(size_t& length) {
@@ -335,7 +714,90 @@ unsigned char* v4l2Capture::getFrameWithoutStartCode(size_t& length) {
     return frame;
 }
 
+void v4l2Capture::drainToNewestFrame() {
+    // current_buf, then what was held back last time, then whatever else the
+    // driver has ready now without blocking; oldest first
+    std::vector<struct v4l2_buffer> ready(1, current_buf);
+    ready.insert(ready.end(), heldBuffers.begin(), heldBuffers.end());
+    heldBuffers.clear();
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        struct v4l2_buffer next;
+        memset(&next, 0, sizeof(next));
+        next.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        next.memory = V4L2_MEMORY_MMAP;
+        if (ioctl(fd, VIDIOC_DQBUF, &next) == -1) {
+            break;
+        }
+        ready.push_back(next);
+        pfd.revents = 0;
+    }
+
+    // A frame can only be skipped if nothing predicts from it, or if a keyframe
+    // comes before the one delivered. So go to the newest queued keyframe, or
+    // past the run of disposable frames at the front, whichever is further.
+    size_t target = 0;
+    bool leadingDisposable = true;
+    for (size_t i = 0; i < ready.size(); ++i) {
+        bool keyFrame, disposable;
+        classifyBuffer(ready[i], keyFrame, disposable);
+        if (keyFrame || leadingDisposable) {
+            target = i;
+        }
+        leadingDisposable = leadingDisposable && disposable;
+    }
+
+    for (size_t i = 0; i < target; ++i) {
+        if (ioctl(fd, VIDIOC_QBUF, &ready[i]) == -1) {
+            logMessage("VIDIOC_QBUF error: " + std::string(strerror(errno)));
+        }
+    }
+    // The rest are delivered in order by the next getFrame() calls
+    current_buf = ready[target];
+    heldBuffers.assign(ready.begin() + target + 1, ready.end());
+
+    if (target > 0) {
+        updateFrameInfo(current_buf);
+        currentFrameInfo.skippedFrames = target;
+        incrementMetricCounter("video.drained_frames", target);
+    }
+    currentFrameInfo.heldFrames = heldBuffers.size();
+}
+
+void v4l2Capture::classifyBuffer(const v4l2_buffer& buf, bool& keyFrame, bool& disposable) const {
+    classifyFrame(static_cast<const uint8_t*>(buffers[buf.index].start), buf.bytesused, keyFrame, disposable);
+}
+
+void v4l2Capture::classifyFrame(const uint8_t* data, size_t size, bool& keyFrame, bool& disposable) const {
+    keyFrame = false;
+    disposable = false;
+
+    // The encoder prefixes keyframes with parameter sets, so look at every NAL unit
+    for (size_t offset = 0; offset + 3 < size; ++offset) {
+        size_t startCodeSize = startCodeLength(data, size, offset);
+        if (startCodeSize == 0 || offset + startCodeSize >= size) continue;
+
+        uint8_t header = data[offset + startCodeSize];
+        NalKind kind = nalKind(codec, header);
+        if (kind == NAL_KIND_KEYFRAME || kind == NAL_KIND_SPS || kind == NAL_KIND_VPS) {
+            keyFrame = true;
+            return;
+        }
+        if (kind == NAL_KIND_SLICE) {
+            disposable = isDisposableNal(codec, header);
+            return;
+        }
+        offset += startCodeSize;
+    }
+}
+
 void v4l2Capture::releaseFrame() {
+    if (replayMode) return;
+    std::lock_guard<std::recursive_mutex> lock(deviceMutex);
+
     if (ioctl(fd, VIDIOC_QBUF, &current_buf) == -1) {
         logMessage("VIDIOC_QBUF error: " + std::string(strerror(errno)));
         logMessage("Failed to queue buffer index: " + std::to_string(current_buf.index));
@@ -358,48 +820,14 @@ bool v4l2Capture::extractSpsPps() {
             continue;
         }
 
-        size_t offset = 0;
-        while (offset + 4 < frameSize) {
-            if (frame[offset] == 0 && frame[offset+1] == 0 && 
-                frame[offset+2] == 0 && frame[offset+3] == 1) {
-                offset += 4;
-                if (offset >= frameSize) break;
-
-                uint8_t nalType = frame[offset] & 0x1F;
-
-                size_t nextNalOffset = offset;
-                while (nextNalOffset + 4 < frameSize) {
-                    if (frame[nextNalOffset] == 0 && frame[nextNalOffset+1] == 0 && 
-                        frame[nextNalOffset+2] == 0 && frame[nextNalOffset+3] == 1) {
-                        break;
-                    }
-                    nextNalOffset++;
-                }
-
-                size_t nalUnitSize = nextNalOffset - offset;
-
-                if (nalType == 7 && sps == nullptr) {
-                    spsSize = nalUnitSize;
-                    sps = new uint8_t[spsSize];
-                    memcpy(sps, frame + offset, spsSize);
-                    // logMessage("Found SPS, size: " + std::to_string(spsSize));
-                } else if (nalType == 8 && pps == nullptr) {
-                    ppsSize = nalUnitSize;
-                    pps = new uint8_t[ppsSize];
-                    memcpy(pps, frame + offset, ppsSize);
-                    // logMessage("Found PPS, size: " + std::to_string(ppsSize));
-                }
-
-                offset = nextNalOffset;
-            } else {
-                offset++;
-            }
-        }
+        // Only fill in parameter sets we don't have yet
+        scanParameterSets(frame, frameSize, false);
 
         releaseFrame();
 
-        if (sps != nullptr && pps != nullptr) {
+        if (haveParameterSets()) {
             spsPpsExtracted = true;
+            noteSpsPpsExtracted();
             logMessage("Successfully extract SPS and PPS.");
             return true;
         }
@@ -410,10 +838,13 @@ bool v4l2Capture::extractSpsPps() {
 }
 
 void v4l2Capture::clearSpsPps() {
+    delete[] vps;
     delete[] sps;
     delete[] pps;
+    vps = nullptr;
     sps = nullptr;
     pps = nullptr;
+    vpsSize = 0;
     spsSize = 0;
     ppsSize = 0;
     spsPpsExtracted = false;
@@ -423,13 +854,25 @@ void v4l2Capture::clearSpsPps() {
 bool v4l2Capture::extractSpsPpsImmediate() {
     // logMessage("Starting SPS/PPS extraction...");
     const int MAX_IMMEDIATE_ATTEMPTS = 10; 
+
+    // Parameter sets must all come from the same keyframe
+    unsigned needed = (1u << NAL_KIND_SPS) | (1u << NAL_KIND_PPS);
+    if (codec == VIDEO_CODEC_HEVC) {
+        needed |= 1u << NAL_KIND_VPS;
+    }
+
+    if (replayMode) {
+        // The file's first parameter sets apply to the whole replay
+        unsigned found = scanParameterSets(replayData.data(), replayData.size(), true);
+        spsPpsExtracted = (found & needed) == needed;
+        if (spsPpsExtracted) {
+            noteSpsPpsExtracted();
+        }
+        return spsPpsExtracted;
+    }
     
     // Force keyframe request
-    struct v4l2_control control;
-    control.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
-    if (ioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
-        logMessage("Failed to force keyframe: " + std::string(strerror(errno)));
-    } else {
+    if (requestKeyFrame()) {
         logMessage("Successfully requested keyframe.");
     }
     
@@ -444,76 +887,14 @@ bool v4l2Capture::extractSpsPpsImmediate() {
             continue;
         }
 
-        // Debug log the first few bytes of the frame
-        std::string frameStart = "Frame starts with: ";
-        for (int j = 0; j < std::min(16, (int)frameSize); ++j) {
-            char hex[4];
-            snprintf(hex, sizeof(hex), "%02X ", frame[j]);
-            frameStart += hex;
-        }
-        // logMessage(frameStart);
-        
-        // Look for NAL units and process them
-        size_t offset = 0;
-        bool foundSPS = false;
-        bool foundPPS = false;
-        
-        while (offset + 4 < frameSize) {
-            // Look for NAL unit start code
-            if (frame[offset] == 0x00 && frame[offset+1] == 0x00 && 
-                ((frame[offset+2] == 0x00 && frame[offset+3] == 0x01) ||
-                 (frame[offset+2] == 0x01))) {
-                
-                // Calculate start code size
-                size_t startCodeSize = (frame[offset+2] == 0x00) ? 4 : 3;
-                size_t nalStart = offset + startCodeSize;
-                
-                if (nalStart >= frameSize) break;
-                
-                // Get NAL type
-                uint8_t nalType = frame[nalStart] & 0x1F;
-                // logMessage("Found NAL type: " + std::to_string(nalType));
-                
-                // Find next NAL unit or end of frame
-                size_t nextNalOffset = nalStart;
-                while (nextNalOffset + 3 < frameSize) {
-                    if (frame[nextNalOffset] == 0x00 && frame[nextNalOffset+1] == 0x00 && 
-                        (frame[nextNalOffset+2] == 0x01 || 
-                         (nextNalOffset + 3 < frameSize && frame[nextNalOffset+2] == 0x00 && 
-                          frame[nextNalOffset+3] == 0x01))) {
-                        break;
-                    }
-                    nextNalOffset++;
-                }
-                
-                size_t nalUnitSize = nextNalOffset - nalStart;
-                
-                if (nalType == 7 && !foundSPS) {  // SPS
-                    delete[] sps;  // Delete old SPS if exists
-                    spsSize = nalUnitSize;
-                    sps = new uint8_t[spsSize];
-                    memcpy(sps, frame + nalStart, spsSize);
-                    foundSPS = true;
-                    // logMessage("Found SPS, size: " + std::to_string(spsSize));
-                } else if (nalType == 8 && !foundPPS) {  // PPS
-                    delete[] pps;  // Delete old PPS if exists
-                    ppsSize = nalUnitSize;
-                    pps = new uint8_t[ppsSize];
-                    memcpy(pps, frame + nalStart, ppsSize);
-                    foundPPS = true;
-                    // logMessage("Found PPS, size: " + std::to_string(ppsSize));
-                }
-                
-                offset = nextNalOffset;
-            } else {
-                offset++;
-            }
-        }
+        // Look for parameter set NAL units, replacing any old ones
+        unsigned found = scanParameterSets(frame, frameSize, true);
         
         releaseFrame();
         
-        if (foundSPS && foundPPS) {
+        if ((found & needed) == needed) {
             spsPpsExtracted = true;
+            noteSpsPpsExtracted();
             logMessage("Successfully extracted SPS and PPS on attempt " + std::to_string(i + 1));
             return true;
         }
@@ -522,3 +903,184 @@ bool v4l2Capture::extractSpsPpsImmediate() {
     logMessage("Failed to extract SPS/PPS during immediate initialization");
     return false;
 }
+
+unsigned v4l2Capture::scanParameterSets(const uint8_t* frame, size_t frameSize, bool replace) {
+    unsigned found = 0;
+    size_t offset = 0;
+
+    while (offset + 4 < frameSize) {
+        // Look for NAL unit start code
+        size_t startCodeSize = startCodeLength(frame, frameSize, offset);
+        if (startCodeSize == 0) {
+            offset++;
+            continue;
+        }
+
+        size_t nalStart = offset + startCodeSize;
+        if (nalStart >= frameSize) break;
+
+        // Find next NAL unit or end of frame
+        size_t nextNalOffset = nalStart;
+        while (nextNalOffset < frameSize && startCodeLength(frame, frameSize, nextNalOffset) == 0) {
+            nextNalOffset++;
+        }
+        size_t nalUnitSize = nextNalOffset - nalStart;
+
+        NalKind kind = nalKind(codec, frame[nalStart]);
+        uint8_t** slot = nullptr;
+        unsigned* slotSize = nullptr;
+        if (kind == NAL_KIND_VPS) {
+            slot = &vps;
+            slotSize = &vpsSize;
+        } else if (kind == NAL_KIND_SPS) {
+            slot = &sps;
+            slotSize = &spsSize;
+        } else if (kind == NAL_KIND_PPS) {
+            slot = &pps;
+            slotSize = &ppsSize;
+        }
+
+        // Keep the first occurrence of each parameter set in this frame
+        if (slot != nullptr && !(found & (1u << kind)) && (replace || *slot == nullptr)) {
+            delete[] *slot;  // Delete old parameter set if exists
+            *slotSize = nalUnitSize;
+            *slot = new uint8_t[nalUnitSize];
+            memcpy(*slot, frame + nalStart, nalUnitSize);
+        }
+        if (slot != nullptr) {
+            found |= 1u << kind;
+        }
+
+        offset = nextNalOffset;
+    }
+
+    return found;
+}
+
+bool v4l2Capture::haveParameterSets() const {
+    return sps != nullptr && pps != nullptr && (codec != VIDEO_CODEC_HEVC || vps != nullptr);
+}
+
+bool v4l2Capture::loadReplayFile(const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        logMessage("Cannot open replay file " + std::string(path));
+        return false;
+    }
+    replayData.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    // Index every picture NAL unit; parameter sets are sent from the GOP state machine
+    const uint8_t* data = replayData.data();
+    size_t size = replayData.size();
+    size_t offset = 0;
+    while (offset < size) {
+        size_t startCodeSize = startCodeLength(data, size, offset);
+        if (startCodeSize == 0 || offset + startCodeSize >= size) {
+            offset++;
+            continue;
+        }
+
+        size_t next = offset + startCodeSize;
+        while (next < size && startCodeLength(data, size, next) == 0) {
+            next++;
+        }
+
+        NalKind kind = nalKind(codec, data[offset + startCodeSize]);
+        if (kind == NAL_KIND_KEYFRAME || kind == NAL_KIND_SLICE) {
+            replayPictures.push_back(std::make_pair(offset, next - offset));
+        }
+        offset = next;
+    }
+
+    if (replayPictures.empty()) {
+        logMessage("No pictures found in replay file " + std::string(path));
+        return false;
+    }
+
+    extractSpsPpsImmediate();
+    logMessage("Replaying " + std::to_string(replayPictures.size()) + " pictures from " + std::string(path));
+    return true;
+}
+
+bool v4l2Capture::loadCachedSpsPps() {
+    if (replayMode) {
+        return false;
+    }
+
+    std::vector<uint8_t> cachedVps;
+    std::vector<uint8_t> cachedSps;
+    std::vector<uint8_t> cachedPps;
+    if (!loadSpsPpsCache(spsPpsCacheKey(devicePath, codec, width, height, frameRateNumerator, frameRateDenominator),
+                         cachedVps, cachedSps, cachedPps)) {
+        return false;
+    }
+    if (codec == VIDEO_CODEC_HEVC && cachedVps.empty()) {
+        return false;
+    }
+
+    delete[] vps;
+    delete[] sps;
+    delete[] pps;
+    vpsSize = cachedVps.size();
+    spsSize = cachedSps.size();
+    ppsSize = cachedPps.size();
+    vps = vpsSize > 0 ? new uint8_t[vpsSize] : nullptr;
+    sps = new uint8_t[spsSize];
+    pps = new uint8_t[ppsSize];
+    if (vps != nullptr) {
+        memcpy(vps, cachedVps.data(), vpsSize);
+    }
+    memcpy(sps, cachedSps.data(), spsSize);
+    memcpy(pps, cachedPps.data(), ppsSize);
+    knownVps.swap(cachedVps);
+    knownSps.swap(cachedSps);
+    knownPps.swap(cachedPps);
+
+    spsPpsExtracted = true;
+    spsPpsFromCache = true;
+    spsPpsUnconfirmed = true;
+    ++spsPpsGeneration;
+    logMessage("Loaded SPS/PPS from cache.");
+    return true;
+}
+
+void v4l2Capture::revalidateSpsPps(const uint8_t* frame, size_t frameSize) {
+    // Keyframes come with the encoder's actual parameter sets; noteSpsPpsExtracted()
+    // updates the cache and the generation if they differ from the cached ones
+    bool keyFrame, disposable;
+    classifyFrame(frame, frameSize, keyFrame, disposable);
+    if (!keyFrame) return;
+
+    unsigned needed = (1u << NAL_KIND_SPS) | (1u << NAL_KIND_PPS);
+    if (codec == VIDEO_CODEC_HEVC) {
+        needed |= 1u << NAL_KIND_VPS;
+    }
+    if ((scanParameterSets(frame, frameSize, true) & needed) != needed) return;
+
+    unsigned generation = spsPpsGeneration;
+    noteSpsPpsExtracted();
+    logMessage(generation == spsPpsGeneration ? "SPS/PPS confirmed by the stream."
+                                              : "SPS/PPS were stale; updated from the stream.");
+}
+
+void v4l2Capture::noteSpsPpsExtracted() {
+    // Straight from the encoder
+    spsPpsFromCache = false;
+    spsPpsUnconfirmed = false;
+
+    if (knownVps.size() == vpsSize && knownSps.size() == spsSize && knownPps.size() == ppsSize &&
+        (vpsSize == 0 || memcmp(knownVps.data(), vps, vpsSize) == 0) &&
+        memcmp(knownSps.data(), sps, spsSize) == 0 &&
+        memcmp(knownPps.data(), pps, ppsSize) == 0) {
+        return;
+    }
+
+    knownVps.assign(vps, vps + vpsSize);
+    knownSps.assign(sps, sps + spsSize);
+    knownPps.assign(pps, pps + ppsSize);
+    ++spsPpsGeneration;
+    if (!replayMode) {
+        saveSpsPpsCache(spsPpsCacheKey(devicePath, codec, width, height, frameRateNumerator, frameRateDenominator),
+                        vps, vpsSize, sps, spsSize, pps, ppsSize);
+    }
+}
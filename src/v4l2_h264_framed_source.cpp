@@ -1,30 +1,76 @@
 #include "v4l2_h264_framed_source.h"
+#include "av_sync_marker.h"
 #include "logger.h"
+#include "media_clock.h"
+#include "metrics.h"
+#include "trace.h"
 
-v4l2H264FramedSource* v4l2H264FramedSource::createNew(UsageEnvironment& env, v4l2Capture* capture, InitialFrameData* initData) {
-    return new v4l2H264FramedSource(env, capture, initData);
+v4l2H264FramedSource* v4l2H264FramedSource::createNew(UsageEnvironment& env, v4l2Capture* capture, InitialFrameData* initData,
+                                                     keyFrameRequester* keyFrames,
+                                                     encoderRateController* rateController,
+                                                     bandwidthBudget* budget, streamSizer* sizer) {
+    return new v4l2H264FramedSource(env, capture, initData, keyFrames, rateController, budget, sizer);
 }
 
-v4l2H264FramedSource::v4l2H264FramedSource(UsageEnvironment& env, v4l2Capture* capture, InitialFrameData* initData)
+v4l2H264FramedSource::v4l2H264FramedSource(UsageEnvironment& env, v4l2Capture* capture, InitialFrameData* initData,
+                                           keyFrameRequester* keyFrames, encoderRateController* rateController,
+                                           bandwidthBudget* budget, streamSizer* sizer)
     : FramedSource(env), 
       fCapture(capture), 
+      fWatchdog("video_capture", VIDEO_STALL_TIMEOUT_MS, [capture]() { return capture->recover(); }),
+      fKeyFrames(keyFrames),
+      fRateController(rateController),
+      fBudget(budget),
+      fSizer(sizer),
       fInitData(initData),
       fCurTimestamp(0),
-      gopState(SENDING_SPS){ // Start in SENDING_SPS state immediately
+      fClockBaseUs(mediaClockMicros()),
+      fClockBaseTimestamp(0),
+      fLastFrameUs(mediaClockMicros()),
+      gopState(SENDING_VPS){ // Start sending parameter sets immediately
 
     // Initialize with the provided data
     fInitialTime = initData->initialTime;
+    fCapture->addStreamReader();
 }
 
 v4l2H264FramedSource::~v4l2H264FramedSource() {
+    fCapture->removeStreamReader();
     delete fInitData;  // Clean up initial frame data
     logMessage("Successfully destroyed v4l2H264FramedSource.");
 }
 
 void v4l2H264FramedSource::doGetNextFrame() {
+    TRACE_SCOPE("v4l2H264FramedSource::doGetNextFrame");
     if (!isCurrentlyAwaitingData()) return;
 
     switch (gopState) {
+        case SENDING_VPS: {
+            // Only HEVC has a VPS; H.264 goes straight to the SPS
+            if (fInitData->vps == nullptr) {
+                gopState = SENDING_SPS;
+                doGetNextFrame();
+                return;
+            }
+            if (fInitData->vpsSize <= fMaxSize) {
+                memcpy(fTo, fInitData->vps, fInitData->vpsSize);
+                fFrameSize = fInitData->vpsSize;
+                // Use GOP starting timestamp for VPS
+                unsigned long long elapsedMicros = (fCurTimestamp / 90) * 1000;
+                fPresentationTime = fInitialTime;
+                fPresentationTime.tv_sec += elapsedMicros / 1000000;
+                fPresentationTime.tv_usec += elapsedMicros % 1000000;
+                if (fPresentationTime.tv_usec >= 1000000) {
+                    fPresentationTime.tv_sec += fPresentationTime.tv_usec / 1000000;
+                    fPresentationTime.tv_usec %= 1000000;
+                }
+                fDurationInMicroseconds = 0;
+                gopState = SENDING_SPS;
+                FramedSource::afterGetting(this);
+            }
+            break;
+        }
+
         case SENDING_SPS: {
             if (fInitData->sps && fInitData->spsSize <= fMaxSize) {
                 memcpy(fTo, fInitData->sps, fInitData->spsSize);
@@ -66,9 +112,26 @@ void v4l2H264FramedSource::doGetNextFrame() {
         }
 
         case SENDING_IDR: {
-            if (fInitData->idr && fInitData->idrSize <= fMaxSize) {
-                memcpy(fTo, fInitData->idr, fInitData->idrSize);
-                fFrameSize = fInitData->idrSize;
+            if (fPendingMarker >= 0) {
+                // After the parameter sets, in front of the picture
+                deliverAvSyncMarker();
+                return;
+            }
+            if (fInitData->idr) {
+                // An IDR that doesn't fit is cut rather than left waiting forever;
+                // the sizer makes room for it from the next stream start
+                if (fInitData->idrSize <= fMaxSize) {
+                    fFrameSize = fInitData->idrSize;
+                    fNumTruncatedBytes = 0;
+                } else {
+                    fFrameSize = fMaxSize;
+                    fNumTruncatedBytes = fInitData->idrSize - fMaxSize;
+                    incrementMetricCounter("video.truncated_bytes", fNumTruncatedBytes);
+                }
+                memcpy(fTo, fInitData->idr, fFrameSize);
+                if (fSizer != nullptr) {
+                    fSizer->addFrame(fInitData->idrSize, fNumTruncatedBytes > 0);
+                }
                 // Use same timestamp as SPS/PPS
                 fPresentationTime = fInitialTime;
                 unsigned long long elapsedMicros = (fCurTimestamp / 90) * 1000;
@@ -78,70 +141,304 @@ void v4l2H264FramedSource::doGetNextFrame() {
                     fPresentationTime.tv_sec += fPresentationTime.tv_usec / 1000000;
                     fPresentationTime.tv_usec %= 1000000;
                 }
-                fDurationInMicroseconds = 33333;  // First frame duration
+                fDurationInMicroseconds = frameDurationUs();  // First frame duration
                 gopState = SENDING_FRAMES;
-                fCurTimestamp += TIMESTAMP_INCREMENT;  // Start incrementing from next frame
+                fCurTimestamp += fCapture->getFrameIntervalTicks();  // Start incrementing from next frame
                 delete[] fInitData->idr;  // Clear the stored IDR as we'll get new ones
                 fInitData->idr = nullptr;
                 fInitData->idrSize = 0;
+                fKeyFrames->keyFrameSent();
                 FramedSource::afterGetting(this);
             }
             break;
         }
         
         case SENDING_FRAMES: {
+            // Don't touch the device while the watchdog is reopening it
+            if (fWatchdog.isRecovering()) {
+                bridgeStall();
+                return;
+            }
+
+            if (deferToCaptureTime()) {
+                return;
+            }
+
+            if (!fCapture->waitForFrame(VIDEO_POLL_TIMEOUT_MS)) {
+                bridgeStall();
+                return;
+            }
+
             // Regular frame delivery
             size_t length;
             unsigned char* frame = fCapture->getFrameWithoutStartCode(length);
             
             if (frame == nullptr || !fCapture->isFrameValid()) {
-                handleClosure();
+                bridgeStall();
+                return;
+            }
+
+            fWatchdog.reportFrame();
+            fLastFrameUs = mediaClockMicros();
+            fBridgedFrames = 0;
+
+            // The drained frames were captured too; keep the clock in step with them and the audio
+            fCurTimestamp += fCapture->getCurrentFrameInfo().skippedFrames * fCapture->getFrameIntervalTicks();
+
+            bool isIdr = length > 0 && isKeyFrameNal(fCapture->getCodec(), frame[0]);
+            if (fRateController != nullptr && length > 0) {
+                // Every encoded frame counts, even ones we end up not sending. Keyframes may
+                // come with their parameter sets in front.
+                NalKind kind = nalKind(fCapture->getCodec(), frame[0]);
+                fRateController->frameEncoded(length, kind == NAL_KIND_KEYFRAME || kind == NAL_KIND_SPS ||
+                                                      kind == NAL_KIND_VPS);
+            }
+            if (fInitData->generation != fCapture->getSpsPpsGeneration() && !isIdr && !fAwaitingKeyFrame) {
+                // The capture was reconfigured; frames only decode after the new parameter sets
+                fAwaitingKeyFrame = true;
+                fKeyFrames->request("reconfigure");
+            }
+            if (fCapture->getCurrentFrameInfo().heldFrames > 0 && !isIdr) {
+                // Behind, and only a keyframe lets draining skip ahead without breaking
+                // references; the requester coalesces these
+                fKeyFrames->request("drain");
+            }
+            if (length > 0 && shouldDropForLag(frame[0], isIdr)) {
+                skipFrame();
+                return;
+            }
+            if (length > 0 && shouldDropForRateCap(frame[0], length, isIdr)) {
+                skipFrame();
+                return;
+            }
+            if (fAwaitingKeyFrame && !isIdr) {
+                // Frames before the next IDR can't be decoded
+                skipFrame();
                 return;
             }
+            fAwaitingKeyFrame = false;
+
+            if (avSyncMarkersEnabled()) {
+                checkAvSyncMarker();
+            }
 
             // Check for new IDR frame
-            if (length > 0 && (frame[0] & 0x1F) == 5) {
+            if (isIdr) {
                 // Store new IDR frame and prepare for new GOP sequence
+                if (fInitData->generation != fCapture->getSpsPpsGeneration()) {
+                    refreshParameterSets();
+                }
                 fInitData->idr = new uint8_t[length];
                 fInitData->idrSize = length;
                 memcpy(fInitData->idr, frame, length);
                 fCapture->releaseFrame();
 
                 // Start new GOP sequence
-                gopState = SENDING_SPS;
+                gopState = SENDING_VPS;
                 // Don't increment timestamp here as we want same timestamp for SPS/PPS/IDR
                 doGetNextFrame();
                 return;
             }
             
-            if (length <= fMaxSize) {
-                memcpy(fTo, frame, length);
-                fFrameSize = length;
-                fNumTruncatedBytes = 0;
-            } else {
-                memcpy(fTo, frame, fMaxSize);
-                fFrameSize = fMaxSize;
-                fNumTruncatedBytes = length - fMaxSize;
-            }
-
-            // Calculate presentation time for regular frames
-            unsigned long long elapsedMicros = (fCurTimestamp / 90) * 1000;
-            fPresentationTime = fInitialTime;
-            fPresentationTime.tv_sec += elapsedMicros / 1000000;
-            fPresentationTime.tv_usec += elapsedMicros % 1000000;
-            if (fPresentationTime.tv_usec >= 1000000) {
-                fPresentationTime.tv_sec += fPresentationTime.tv_usec / 1000000;
-                fPresentationTime.tv_usec %= 1000000;
+            if (fPendingMarker >= 0) {
+                // Hold the picture back; the marker goes first with the same timestamp
+                fMarkedFrame.assign(frame, frame + length);
+                fCapture->releaseFrame();
+                gopState = SENDING_MARKED_FRAME;
+                deliverAvSyncMarker();
+                return;
             }
-            
-            fDurationInMicroseconds = 33333;  // 30fps
-            fCurTimestamp += TIMESTAMP_INCREMENT;
 
+            copyFrame(frame, length);
             fCapture->releaseFrame();
             FramedSource::afterGetting(this);
             break;
         }
+
+        case SENDING_MARKED_FRAME: {
+            copyFrame(fMarkedFrame.data(), fMarkedFrame.size());
+            fMarkedFrame.clear();
+            gopState = SENDING_FRAMES;
+            FramedSource::afterGetting(this);
+            break;
+        }
+    }
+}
+
+void v4l2H264FramedSource::setPresentationTime() {
+    unsigned long long elapsedMicros = (fCurTimestamp / 90) * 1000;
+    fPresentationTime = fInitialTime;
+    fPresentationTime.tv_sec += elapsedMicros / 1000000;
+    fPresentationTime.tv_usec += elapsedMicros % 1000000;
+    if (fPresentationTime.tv_usec >= 1000000) {
+        fPresentationTime.tv_sec += fPresentationTime.tv_usec / 1000000;
+        fPresentationTime.tv_usec %= 1000000;
+    }
+}
+
+void v4l2H264FramedSource::copyFrame(const unsigned char* frame, size_t length) {
+    if (length <= fMaxSize) {
+        memcpy(fTo, frame, length);
+        fFrameSize = length;
+        fNumTruncatedBytes = 0;
+    } else {
+        memcpy(fTo, frame, fMaxSize);
+        fFrameSize = fMaxSize;
+        fNumTruncatedBytes = length - fMaxSize;
+        incrementMetricCounter("video.truncated_bytes", fNumTruncatedBytes);
+    }
+    if (fSizer != nullptr) {
+        fSizer->addFrame(length, fNumTruncatedBytes > 0);
+    }
+
+    setPresentationTime();
+    fDurationInMicroseconds = frameDurationUs();
+    fCurTimestamp += fCapture->getFrameIntervalTicks();
+}
+
+void v4l2H264FramedSource::checkAvSyncMarker() {
+    // The first picture captured at or after a marker instant is the flash frame
+    const timeval& captured = fCapture->getTimestamp();
+    int64_t capturedMicros = (int64_t)captured.tv_sec * 1000000 + captured.tv_usec;
+    int64_t index = avSyncMarkerIndex(capturedMicros);
+    if (fLastMarkerIndex >= 0 && index > fLastMarkerIndex) {
+        fPendingMarker = index;
+        fPendingMarkerLatenessUs = (uint32_t)(capturedMicros - avSyncMarkerTimeUs(index));
+    }
+    fLastMarkerIndex = index;
+}
+
+void v4l2H264FramedSource::deliverAvSyncMarker() {
+    fFrameSize = buildAvSyncMarkerNal(fCapture->getCodec(), fPendingMarker, fPendingMarkerLatenessUs, fTo, fMaxSize);
+    fNumTruncatedBytes = 0;
+    setPresentationTime();
+    fDurationInMicroseconds = 0;
+    fPendingMarker = -1;
+    incrementMetricCounter("av_sync.video_markers");
+    FramedSource::afterGetting(this);
+}
+
+void v4l2H264FramedSource::retryGetNextFrame(void* clientData) {
+    v4l2H264FramedSource* source = static_cast<v4l2H264FramedSource*>(clientData);
+    source->nextTask() = NULL;
+    source->doGetNextFrame();
+}
+
+void v4l2H264FramedSource::bridgeStall() {
+    // A frame that is merely late just takes the next timestamp when it comes.
+    // Over VIDEO_GAP_TIMEOUT_MS it is a gap: clients keep showing the last decoded
+    // picture, and the clock moves on over the frame slots that passed so video
+    // stays aligned with audio when it resumes.
+    int64_t gapUs = mediaClockMicros() - fLastFrameUs;
+    if (gapUs >= VIDEO_GAP_TIMEOUT_MS * 1000LL) {
+        fWatchdog.reportStall();
+        int64_t missedFrames = gapUs / fCapture->getFrameIntervalUs() - 1;
+        for (; fBridgedFrames < missedFrames; ++fBridgedFrames) {
+            fCurTimestamp += fCapture->getFrameIntervalTicks();
+        }
+        // The encoder's reference chain survives a gap, but not a device reset
+        if (fWatchdog.isRecovering()) {
+            fAwaitingKeyFrame = true;
+        }
+    }
+
+    nextTask() = envir().taskScheduler().scheduleDelayedTask(VIDEO_POLL_TIMEOUT_MS * 1000, retryGetNextFrame, this);
+}
+
+bool v4l2H264FramedSource::shouldDropForLag(uint8_t nalHeader, bool isIdr) {
+    // The sink asks for the next frame only once the previous one went out, so
+    // the age of the frame just dequeued is how far the send path is behind.
+    // That is the server's own, the same for every client; a client that can't
+    // keep up is held back on its own instead (rtxGroupsock::receiverReport()).
+    // IDRs are never dropped; they are what lets a lagging client catch up.
+    if (isIdr || fAwaitingKeyFrame) return false;
+
+    int64_t lagMs = fCapture->getFrameAgeMicros() / 1000;
+    setMetricGauge("video.lag_ms", lagMs);
+
+    if (lagMs > VIDEO_SKIP_LAG_MS) {
+        logMessage("Video send path " + std::to_string(lagMs) + " ms behind, skipping to next IDR");
+        incrementMetricCounter("video.idr_skips");
+        fAwaitingKeyFrame = true;
+        fKeyFrames->request("backpressure");
+        return true;
+    }
+
+    if (lagMs > VIDEO_DROP_LAG_MS && isDisposableNal(fCapture->getCodec(), nalHeader)) {
+        incrementMetricCounter("video.dropped_frames");
+        return true;
+    }
+    return false;
+}
+
+bool v4l2H264FramedSource::shouldDropForRateCap(uint8_t nalHeader, size_t length, bool isIdr) {
+    // Every client gets this stream, so the per-client allowance applies to it as
+    // a whole. IDRs always go out (possibly into debt); they end any skip.
+    if (fBudget == nullptr || fAwaitingKeyFrame) return false;
+    if (fRateCap.consume(length, fBudget->videoAllowance(), NET_CLIENT_BURST_MS, isIdr)) return false;
+
+    incrementMetricCounter("net.capped_frames");
+    if (!isDisposableNal(fCapture->getCodec(), nalHeader)) {
+        // Dropping a reference frame breaks the chain until the next IDR
+        fAwaitingKeyFrame = true;
+        fKeyFrames->request("rate_cap");
+    }
+    return true;
+}
+
+bool v4l2H264FramedSource::deferToCaptureTime() {
+    // Under the virtual clock nothing blocks, so the frame waits on the scheduler
+    // until the camera would have delivered it
+    if (!isVirtualClock()) return false;
+
+    // Unsigned difference, so the 32-bit timestamp may wrap; rebase well before
+    // it could, by a multiple of 9 ticks to keep the conversion exact
+    uint32_t ticks = fCurTimestamp - fClockBaseTimestamp;
+    if (ticks >= 0x40000000) {
+        uint32_t rebase = ticks - ticks % 9;
+        fClockBaseUs += (int64_t)rebase * 100 / 9;
+        fClockBaseTimestamp += rebase;
+        ticks -= rebase;
     }
+
+    int64_t waitUs = fClockBaseUs + (int64_t)ticks * 100 / 9 - mediaClockMicros();
+    if (waitUs <= 0) return false;
+    nextTask() = envir().taskScheduler().scheduleDelayedTask(waitUs, retryGetNextFrame, this);
+    return true;
+}
+
+unsigned v4l2H264FramedSource::frameDurationUs() const {
+    // live555 paces by gettimeofday(); under the virtual clock the source paces itself
+    return isVirtualClock() ? 0 : fCapture->getFrameIntervalUs();
 }
 
+void v4l2H264FramedSource::skipFrame() {
+    // Keep the clock running and fetch the next frame right away so queued
+    // frames drain faster than real time
+    fCapture->releaseFrame();
+    fCurTimestamp += fCapture->getFrameIntervalTicks();
+    nextTask() = envir().taskScheduler().scheduleDelayedTask(0, retryGetNextFrame, this);
+}
 
+void v4l2H264FramedSource::refreshParameterSets() {
+    // The GOP sequence resends these in front of every IDR, which is how
+    // connected clients learn about a new resolution
+    delete[] fInitData->vps;
+    delete[] fInitData->sps;
+    delete[] fInitData->pps;
+    fInitData->vps = nullptr;
+    fInitData->vpsSize = 0;
+    if (fCapture->getVPSSize() > 0) {
+        fInitData->vpsSize = fCapture->getVPSSize();
+        fInitData->vps = new uint8_t[fInitData->vpsSize];
+        memcpy(fInitData->vps, fCapture->getVPS(), fInitData->vpsSize);
+    }
+    fInitData->spsSize = fCapture->getSPSSize();
+    fInitData->ppsSize = fCapture->getPPSSize();
+    fInitData->sps = new uint8_t[fInitData->spsSize];
+    fInitData->pps = new uint8_t[fInitData->ppsSize];
+    memcpy(fInitData->sps, fCapture->getSPS(), fInitData->spsSize);
+    memcpy(fInitData->pps, fCapture->getPPS(), fInitData->ppsSize);
+    fInitData->generation = fCapture->getSpsPpsGeneration();
+    logMessage("Sending new parameter sets in-band at the next IDR.");
+}
@@ -1,53 +1,113 @@
 #include "v4l2_h264_media_subsession.h"
 #include "v4l2_h264_framed_source.h"
 #include "logger.h"
+#include "media_clock.h"
+#include "trace.h"
 #include <Base64.hh>
+#include <GroupsockHelper.hh>
 
-v4l2H264MediaSubsession* v4l2H264MediaSubsession::createNew(UsageEnvironment& env, v4l2Capture* capture, Boolean reuseFirstSource) {
-    return new v4l2H264MediaSubsession(env, capture, reuseFirstSource);
+// What the groupsock adds to each packet after the sink built it
+static const unsigned RTP_EXTENSION_BYTES = ABS_CAPTURE_TIME_ENABLED ? ABS_CAPTURE_TIME_EXTENSION_SIZE : 0;
+
+v4l2H264MediaSubsession* v4l2H264MediaSubsession::createNew(UsageEnvironment& env, v4l2Capture* capture, Boolean reuseFirstSource,
+                                                            bandwidthBudget* budget) {
+    return new v4l2H264MediaSubsession(env, capture, reuseFirstSource, budget);
 }
 
-v4l2H264MediaSubsession::v4l2H264MediaSubsession(UsageEnvironment& env, v4l2Capture* capture, Boolean reuseFirstSource)
+v4l2H264MediaSubsession::v4l2H264MediaSubsession(UsageEnvironment& env, v4l2Capture* capture, Boolean reuseFirstSource,
+                                                 bandwidthBudget* budget)
     : OnDemandServerMediaSubsession(env, reuseFirstSource), 
-      fCapture(capture), fAuxSDPLine(NULL) {
+      fCapture(capture), fKeyFrameRequester(env, capture, KEYFRAME_MIN_INTERVAL_MS),
+      fRateController(capture), fBudget(budget),
+      fSizer("video", VIDEO_BITRATE,
+             (unsigned)(1ULL * VIDEO_BITRATE / 8 * capture->getFrameIntervalUs() / 1000000 * SIZER_KEYFRAME_FRAMES),
+             RTP_MAX_PACKET_SIZE - RTP_EXTENSION_BYTES - 12,
+             RTP_PACKET_OVERHEAD + RTP_EXTENSION_BYTES + (SRTP_ENABLED ? SRTP_AUTH_TAG_LENGTH : 0)),
+      fRtpGroupsock(NULL), fNewRtpGroupsock(NULL),
+      fAuxSDPLine(NULL), fAuxSDPLineGeneration(0), fSdpHasSsrcGroups(false), fSdpMediaSsrc(0) {
+    // One key for the subsession: with reuseFirstSource every client gets the same packets
+    fSrtpEnabled = SRTP_ENABLED && generateSrtpMasterKey(fSrtpMasterKey);
+    if (SRTP_ENABLED && !fSrtpEnabled) {
+        logMessage("Failed to generate SRTP key for video; streaming without SRTP");
+    }
+
+    if (fBudget != NULL) {
+        fBudget->setAllowanceListener([this](unsigned) {
+            fRateController.setBitrateCeiling(fBudget->videoAllowance());
+        });
+    }
+
+    // live555 only ever grows the send buffer, from estBitrate at setup
+    fSizer.setChangeListener([this]() {
+        if (fRtpGroupsock != NULL) {
+            setSendBufferTo(envir(), fRtpGroupsock->socketNum(), fSizer.sendBufferSize());
+        }
+    });
 }
 
 v4l2H264MediaSubsession::~v4l2H264MediaSubsession() {
+    if (fBudget != NULL) {
+        fBudget->setAllowanceListener(nullptr);
+    }
     delete[] fAuxSDPLine;
 }
 
 FramedSource* v4l2H264MediaSubsession::createNewStreamSource(unsigned clientSessionId, unsigned& estBitrate) {
-    estBitrate = 1000;
+    TRACE_SCOPE("v4l2H264MediaSubsession::createNewStreamSource");
+    estBitrate = fSizer.estimatedKbps();
     logMessage("===========================================================");
     logMessage("Creating stream source for session: " + std::to_string(clientSessionId));
-    
-    // Force new SPS/PPS extraction for each session
+
+    if (clientSessionId == 0) {
+        // DESCRIBE: live555 builds the SDP from a source it never reads, and the
+        // SDP only needs the parameter sets. Cached ones will do; the stream's
+        // first keyframe confirms them, so the device is left alone here.
+        if (!fCapture->hasSpsPps() && !fCapture->extractSpsPps()) {
+            logMessage("No SPS/PPS to describe the stream with");
+            return nullptr;
+        }
+        InitialFrameData* initData = new InitialFrameData();
+        mediaClockWallTime(initData->initialTime);
+        initData->generation = fCapture->getSpsPpsGeneration();
+        return createFramer(initData);
+    }
+
+    // Restart so the encoder opens with a keyframe, and take the parameter sets
+    // it comes with; a change moves the generation on and rebuilds the SDP
     fCapture->stopCapture();
-    usleep(100000);  // 100ms delay
-    fCapture->clearSpsPps();
-    usleep(100000);  // 100ms delay
+    mediaClockSleep(100000);  // 100ms delay
     fCapture->reset();
-    usleep(100000);  // 100ms delay
+    mediaClockSleep(100000);  // 100ms delay
     fCapture->startCapture();
 
     if (!fCapture->extractSpsPpsImmediate()) {
-        logMessage("Immediate SPS/PPS/IDR extraction failed for session " + std::to_string(clientSessionId));
-        return nullptr;
+        if (!fCapture->hasSpsPps()) {
+            logMessage("Immediate SPS/PPS/IDR extraction failed for session " + std::to_string(clientSessionId));
+            return nullptr;
+        }
+        logMessage("SPS/PPS not re-extracted for session " + std::to_string(clientSessionId) +
+                   "; using the known ones");
     }
 
     // Prepare initial frame data with timestamps
     InitialFrameData* initData = new InitialFrameData();
 
     // Get initial timestamp before copying any frames
-    gettimeofday(&initData->initialTime, NULL);
+    mediaClockWallTime(initData->initialTime);
 
-    // Copy SPS/PPS
+    // Copy VPS (HEVC only) and SPS/PPS
+    if (fCapture->getVPSSize() > 0) {
+        initData->vpsSize = fCapture->getVPSSize();
+        initData->vps = new uint8_t[initData->vpsSize];
+        memcpy(initData->vps, fCapture->getVPS(), initData->vpsSize);
+    }
     initData->spsSize = fCapture->getSPSSize();
     initData->ppsSize = fCapture->getPPSSize();
     initData->sps = new uint8_t[initData->spsSize];
     initData->pps = new uint8_t[initData->ppsSize];
     memcpy(initData->sps, fCapture->getSPS(), initData->spsSize);
     memcpy(initData->pps, fCapture->getPPS(), initData->ppsSize);
+    initData->generation = fCapture->getSpsPpsGeneration();
     
     // Add retry logic for IDR frame acquisition
     const int MAX_IDR_ATTEMPTS = 10;
@@ -55,14 +115,12 @@ FramedSource* v4l2H264MediaSubsession::createNewStreamSource(unsigned clientSess
 
     for (int attempt = 0; attempt < MAX_IDR_ATTEMPTS; attempt++) {
         // Request a keyframe
-        struct v4l2_control control;
-        control.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
-        if (ioctl(fCapture->getFd(), VIDIOC_S_CTRL, &control) != -1) {
+        if (fCapture->requestKeyFrame()) {
             logMessage("Requested keyframe for IDR attempt " + std::to_string(attempt + 1));
         }
 
         // Wait for the camera to process the keyframe request
-        usleep(IDR_RETRY_DELAY_US);
+        mediaClockSleep(IDR_RETRY_DELAY_US);
 
         // Try to get multiple frames to find an IDR
         const int FRAMES_TO_CHECK = 5;
@@ -71,7 +129,7 @@ FramedSource* v4l2H264MediaSubsession::createNewStreamSource(unsigned clientSess
             unsigned char* frame = fCapture->getFrameWithoutStartCode(frameSize);
             
             if (frame && frameSize > 0) {
-                if ((frame[0] & 0x1F) == 5) {  // Found IDR frame
+                if (isKeyFrameNal(fCapture->getCodec(), frame[0])) {  // Found IDR frame
                     initData->idr = new uint8_t[frameSize];
                     initData->idrSize = frameSize;
                     memcpy(initData->idr, frame, frameSize);
@@ -79,21 +137,15 @@ FramedSource* v4l2H264MediaSubsession::createNewStreamSource(unsigned clientSess
                     
                     logMessage("Successfully acquired IDR frame on attempt " + std::to_string(attempt + 1) + ", frame check " + std::to_string(frame_check + 1));
                     
-                    // Create source with initial data
-                    v4l2H264FramedSource* source = v4l2H264FramedSource::createNew(
-                        envir(), fCapture, initData);
-                    
-                    if (source == nullptr) {
-                        delete initData;
+                    FramedSource* framer = createFramer(initData);
+                    if (framer == nullptr) {
                         logMessage("Failed to create source for session " + std::to_string(clientSessionId));
-                        return nullptr;
                     }
-                    
-                    return H264VideoStreamDiscreteFramer::createNew(envir(), source);
+                    return framer;
                 }
                 fCapture->releaseFrame();
             }
-            usleep(10000);  // 10ms delay between frame checks
+            mediaClockSleep(10000);  // 10ms delay between frame checks
         }
         
         logMessage("IDR frame not found in attempt " + std::to_string(attempt + 1) + ", retrying...");
@@ -106,7 +158,23 @@ FramedSource* v4l2H264MediaSubsession::createNewStreamSource(unsigned clientSess
     return nullptr;
 }
 
+FramedSource* v4l2H264MediaSubsession::createFramer(InitialFrameData* initData) {
+    v4l2H264FramedSource* source = v4l2H264FramedSource::createNew(
+        envir(), fCapture, initData, &fKeyFrameRequester,
+        VIDEO_ADAPTIVE_RATE_ENABLED ? &fRateController : nullptr, fBudget, &fSizer);
+    if (source == nullptr) {
+        delete initData;
+        return nullptr;
+    }
+
+    if (fCapture->getCodec() == VIDEO_CODEC_HEVC) {
+        return H265VideoStreamDiscreteFramer::createNew(envir(), source);
+    }
+    return H264VideoStreamDiscreteFramer::createNew(envir(), source);
+}
+
 RTPSink* v4l2H264MediaSubsession::createNewRTPSink(Groupsock* rtpGroupsock, unsigned char rtpPayloadTypeIfDynamic, FramedSource* inputSource) {
+    TRACE_SCOPE("v4l2H264MediaSubsession::createNewRTPSink");
     logMessage("Creating new RTP sink with payload type: " + std::to_string(rtpPayloadTypeIfDynamic));
     
     // Ensure we have SPS/PPS
@@ -117,12 +185,31 @@ RTPSink* v4l2H264MediaSubsession::createNewRTPSink(Groupsock* rtpGroupsock, unsi
         }
     }
 
-    return H264VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic,
-                                    fCapture->getSPS(), fCapture->getSPSSize(),
-                                    fCapture->getPPS(), fCapture->getPPSSize());
+    MultiFramedRTPSink* sink;
+    if (fCapture->getCodec() == VIDEO_CODEC_HEVC) {
+        sink = H265VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic,
+                                        fCapture->getVPS(), fCapture->getVPSSize(),
+                                        fCapture->getSPS(), fCapture->getSPSSize(),
+                                        fCapture->getPPS(), fCapture->getPPSSize());
+    } else {
+        sink = H264VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic,
+                                        fCapture->getSPS(), fCapture->getSPSSize(),
+                                        fCapture->getPPS(), fCapture->getPPSSize());
+    }
+
+    if (ABS_CAPTURE_TIME_ENABLED) {
+        // The groupsock adds the extension after packetization; keep it within the MTU
+        sink->setPacketSizes(1000, RTP_MAX_PACKET_SIZE - RTP_EXTENSION_BYTES);
+    }
+    // The live stream's sink, not the one the SDP is built with
+    if (fRtpGroupsock != NULL && rtpGroupsock == fRtpGroupsock) {
+        fRtpGroupsock->setMediaSsrc(sink->SSRC());
+    }
+    return sink;
 }
 
 void v4l2H264MediaSubsession::deleteStream(unsigned clientSessionId, void*& streamToken) {
+    TRACE_SCOPE("v4l2H264MediaSubsession::deleteStream");
     logMessage("Cleaning up session: " + std::to_string(clientSessionId));
 
     if (clientSessionId == streamingSessionId) {
@@ -141,11 +228,141 @@ void v4l2H264MediaSubsession::deleteStream(unsigned clientSessionId, void*& stre
     
     // usleep(50000); // 50ms delay
     
+    RTPSink* sink = streamToken != NULL ? static_cast<StreamState*>(streamToken)->rtpSink() : NULL;
+    Groupsock* streamGroupsock = sink != NULL ? &sink->groupsockBeingUsed() : NULL;
     OnDemandServerMediaSubsession::deleteStream(clientSessionId, streamToken);
+    // The base class cleared the token if it deleted the stream, groupsocks included
+    if (streamToken == NULL && streamGroupsock == fRtpGroupsock) {
+        fRtpGroupsock = NULL;
+    }
+}
+
+Groupsock* v4l2H264MediaSubsession::createGroupsock(struct sockaddr_storage const& addr, Port port) {
+    // Port 0 is the throwaway groupsock the base class builds the SDP with;
+    // it must not replace the live stream's RTP groupsock
+    if (port.num() == 0) {
+        return OnDemandServerMediaSubsession::createGroupsock(addr, port);
+    }
+
+    // RTP goes out on the even port, RTCP comes back on the odd one
+    if (ntohs(port.num()) % 2 == 1) {
+        rtcpFeedbackGroupsock* rtcpGroupsock = new rtcpFeedbackGroupsock(envir(), addr, port, onRtcpFeedback, this,
+                                                                         fSrtpEnabled ? fSrtpMasterKey : NULL);
+        // The RTP groupsock was created right before; if this one failed, live555
+        // deletes both and retries on other ports
+        if (rtcpGroupsock->socketNum() >= 0 && fNewRtpGroupsock != NULL) {
+            fRtpGroupsock = fNewRtpGroupsock;
+        }
+        fNewRtpGroupsock = NULL;
+        return rtcpGroupsock;
+    }
+    ulpfecEncoder* fec = VIDEO_FEC_ENABLED
+        ? new ulpfecEncoder(fCapture->getCodec(), FEC_GROUP_SIZE, FEC_KEYFRAME_GROUP_SIZE)
+        : NULL;
+    rtxGroupsock* rtpGroupsock = new rtxGroupsock(envir(), addr, port, RTX_VIDEO_HISTORY_PACKETS, fec,
+                                                  fSrtpEnabled ? fSrtpMasterKey : NULL);
+    if (VIDEO_PACING_ENABLED) {
+        rtpGroupsock->enablePacing(90000);
+    }
+    if (ABS_CAPTURE_TIME_ENABLED) {
+        rtpGroupsock->enableAbsCaptureTime(RTP_EXT_ABS_CAPTURE_TIME_ID, captureTimeUs, this);
+    }
+    rtpGroupsock->enableClientBackpressure(fCapture->getCodec());
+    fNewRtpGroupsock = rtpGroupsock->socketNum() >= 0 ? rtpGroupsock : NULL;
+    return rtpGroupsock;
+}
+
+int64_t v4l2H264MediaSubsession::captureTimeUs(void* clientData) {
+    // V4L2 stamps buffers with CLOCK_MONOTONIC when the driver filled them
+    v4l2H264MediaSubsession* subsession = static_cast<v4l2H264MediaSubsession*>(clientData);
+    const timeval& timestamp = subsession->fCapture->getTimestamp();
+    if (timestamp.tv_sec == 0 && timestamp.tv_usec == 0) return -1;
+    return (int64_t)timestamp.tv_sec * 1000000 + timestamp.tv_usec;
+}
+
+void v4l2H264MediaSubsession::onRtcpFeedback(void* clientData, rtcpFeedbackGroupsock::FeedbackType type,
+                                             u_int32_t mediaSsrc, u_int16_t seq, unsigned sessionId) {
+    v4l2H264MediaSubsession* subsession = static_cast<v4l2H264MediaSubsession*>(clientData);
+    if (type == rtcpFeedbackGroupsock::FEEDBACK_NACK) {
+        if (subsession->fRtpGroupsock != NULL) {
+            subsession->fRtpGroupsock->retransmit(seq, mediaSsrc, sessionId);
+        }
+        return;
+    }
+    if (type == rtcpFeedbackGroupsock::FEEDBACK_RECEIVER_REPORT) {
+        // The client's backlog; it waits for the keyframe on its own
+        if (subsession->fRtpGroupsock != NULL &&
+            subsession->fRtpGroupsock->receiverReport(mediaSsrc, seq, sessionId)) {
+            subsession->fKeyFrameRequester.request("backpressure");
+        }
+        return;
+    }
+    subsession->fKeyFrameRequester.request(type == rtcpFeedbackGroupsock::FEEDBACK_PLI ? "PLI" : "FIR");
+}
+
+char const* v4l2H264MediaSubsession::sdpLines(int addressFamily) {
+    // The base class builds the SDP once; rebuild it when the parameter sets
+    // changed, or when a stream started or ended and with it the SSRC groups
+    u_int32_t mediaSsrc = 0;
+    u_int32_t rtxSsrc = 0;
+    u_int32_t fecSsrc = 0;
+    bool ssrcGroups = fRtpGroupsock != NULL && fRtpGroupsock->rtxSsrcGroup(mediaSsrc, rtxSsrc);
+    bool fecGroup = ssrcGroups && fRtpGroupsock->fecSsrcGroup(mediaSsrc, fecSsrc);
+    if (fSDPLines != NULL && (fAuxSDPLineGeneration != fCapture->getSpsPpsGeneration() ||
+                              ssrcGroups != fSdpHasSsrcGroups || mediaSsrc != fSdpMediaSsrc)) {
+        delete[] fSDPLines;
+        fSDPLines = NULL;
+    }
+
+    bool fresh = fSDPLines == NULL;
+    char const* lines = OnDemandServerMediaSubsession::sdpLines(addressFamily);
+    if (fresh && lines != NULL) {
+        // Advertise the feedback we answer: NACK with RTX, PLI and FIR
+        char* withFeedback = addRtxToSdpLines(lines, 90000, true);
+        delete[] fSDPLines;
+        fSDPLines = withFeedback;
+
+        // Only known once the first client set up the shared stream
+        if (ssrcGroups) {
+            char* withGroup = addRtxSsrcGroupToSdpLines(fSDPLines, mediaSsrc, rtxSsrc);
+            delete[] fSDPLines;
+            fSDPLines = withGroup;
+        }
+
+        if (VIDEO_FEC_ENABLED) {
+            char* withFec = addFecToSdpLines(fSDPLines, 90000);
+            delete[] fSDPLines;
+            fSDPLines = withFec;
+
+            if (fecGroup) {
+                char* withGroup = addFecSsrcGroupToSdpLines(fSDPLines, mediaSsrc, fecSsrc);
+                delete[] fSDPLines;
+                fSDPLines = withGroup;
+            }
+        }
+        fSdpHasSsrcGroups = ssrcGroups;
+        fSdpMediaSsrc = mediaSsrc;
+
+        if (ABS_CAPTURE_TIME_ENABLED) {
+            char* withExtension = addAbsCaptureTimeToSdpLines(fSDPLines, RTP_EXT_ABS_CAPTURE_TIME_ID);
+            delete[] fSDPLines;
+            fSDPLines = withExtension;
+        }
+
+        if (fSrtpEnabled) {
+            char* withSrtp = addSrtpToSdpLines(fSDPLines, fSrtpMasterKey);
+            delete[] fSDPLines;
+            fSDPLines = withSrtp;
+        }
+        logMessage("Video SDP built from parameter set generation " + std::to_string(fAuxSDPLineGeneration));
+    }
+    return fSDPLines;
 }
 
 char const* v4l2H264MediaSubsession::getAuxSDPLine(RTPSink* rtpSink, FramedSource* inputSource) {
-    if (fAuxSDPLine != NULL) return fAuxSDPLine;
+    if (fAuxSDPLine != NULL && fAuxSDPLineGeneration == fCapture->getSpsPpsGeneration()) {
+        return fAuxSDPLine;
+    }
 
     if (!fCapture->hasSpsPps()) {
         if (!fCapture->extractSpsPps()) {
@@ -164,6 +381,18 @@ char const* v4l2H264MediaSubsession::getAuxSDPLine(RTPSink* rtpSink, FramedSourc
         return nullptr;
     }
 
+    if (fCapture->getCodec() == VIDEO_CODEC_HEVC) {
+        char* fmtp = buildHevcFmtp(rtpSink->rtpPayloadType());
+        if (fmtp == nullptr) {
+            envir() << "Invalid VPS. Cannot create aux SDP line.\n";
+            return nullptr;
+        }
+        delete[] fAuxSDPLine;
+        fAuxSDPLine = fmtp;
+        fAuxSDPLineGeneration = fCapture->getSpsPpsGeneration();
+        return fAuxSDPLine;
+    }
+
     char* spsBase64 = base64Encode((char*)sps, spsSize);
     char* ppsBase64 = base64Encode((char*)pps, ppsSize);
 
@@ -180,6 +409,50 @@ char const* v4l2H264MediaSubsession::getAuxSDPLine(RTPSink* rtpSink, FramedSourc
     delete[] spsBase64;
     delete[] ppsBase64;
 
+    delete[] fAuxSDPLine;
     fAuxSDPLine = fmtp;
+    fAuxSDPLineGeneration = fCapture->getSpsPpsGeneration();
     return fAuxSDPLine;
 }
+
+char* v4l2H264MediaSubsession::buildHevcFmtp(unsigned char payloadType) {
+    u_int8_t* vps = fCapture->getVPS();
+    unsigned vpsSize = fCapture->getVPSSize();
+    if (vps == nullptr || vpsSize == 0) {
+        return nullptr;
+    }
+
+    // profile_tier_level() sits at a fixed offset in the VPS (RFC 7798, section 7.1),
+    // but only after the emulation prevention bytes have been removed
+    std::vector<uint8_t> rbsp = nalToRbsp(vps, vpsSize);
+    if (rbsp.size() < 18) {
+        return nullptr;
+    }
+    unsigned profileSpace = rbsp[6] >> 6;
+    unsigned tierFlag = (rbsp[6] >> 5) & 0x01;
+    unsigned profileId = rbsp[6] & 0x1F;
+    unsigned levelId = rbsp[17];
+
+    char* vpsBase64 = base64Encode((char*)vps, vpsSize);
+    char* spsBase64 = base64Encode((char*)fCapture->getSPS(), fCapture->getSPSSize());
+    char* ppsBase64 = base64Encode((char*)fCapture->getPPS(), fCapture->getPPSSize());
+
+    char const* fmtpFmt =
+        "a=fmtp:%d profile-space=%u;profile-id=%u;tier-flag=%u;level-id=%u;"
+        "interop-constraints=%02X%02X%02X%02X%02X%02X;"
+        "sprop-vps=%s;sprop-sps=%s;sprop-pps=%s\r\n";
+    unsigned fmtpFmtSize = strlen(fmtpFmt)
+        + 3 + 1 + 2 + 1 + 3 + 12
+        + strlen(vpsBase64) + strlen(spsBase64) + strlen(ppsBase64);
+    char* fmtp = new char[fmtpFmtSize];
+    sprintf(fmtp, fmtpFmt,
+            payloadType,
+            profileSpace, profileId, tierFlag, levelId,
+            rbsp[11], rbsp[12], rbsp[13], rbsp[14], rbsp[15], rbsp[16],
+            vpsBase64, spsBase64, ppsBase64);
+
+    delete[] vpsBase64;
+    delete[] spsBase64;
+    delete[] ppsBase64;
+    return fmtp;
+}
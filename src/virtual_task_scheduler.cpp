@@ -0,0 +1,60 @@
+#include "virtual_task_scheduler.h"
+#include "media_clock.h"
+#include "metrics.h"
+
+virtualTaskScheduler* virtualTaskScheduler::createNew() {
+    enableVirtualClock();
+    return new virtualTaskScheduler();
+}
+
+// No scheduler tick: it would be a real-time task
+virtualTaskScheduler::virtualTaskScheduler()
+    : BasicTaskScheduler(0),
+      fNextTaskId(1),
+      fTasksRun(0) {
+}
+
+virtualTaskScheduler::~virtualTaskScheduler() {
+}
+
+TaskToken virtualTaskScheduler::scheduleDelayedTask(int64_t microseconds, TaskFunc* proc, void* clientData) {
+    if (microseconds < 0) microseconds = 0;
+
+    delayedTask task = {fNextTaskId++, proc, clientData};
+    taskQueue::iterator queued = fTasks.insert(std::make_pair(mediaClockMicros() + microseconds, task));
+    fTasksById[task.id] = queued;
+    return (TaskToken)task.id;
+}
+
+void virtualTaskScheduler::unscheduleDelayedTask(TaskToken& prevTask) {
+    std::map<uintptr_t, taskQueue::iterator>::iterator found = fTasksById.find((uintptr_t)prevTask);
+    if (found != fTasksById.end()) {
+        fTasks.erase(found->second);
+        fTasksById.erase(found);
+    }
+    prevTask = NULL;
+}
+
+void virtualTaskScheduler::SingleStep(unsigned maxDelayTime) {
+    if (fTasks.empty()) {
+        // Nothing to simulate; only the network can bring new work
+        BasicTaskScheduler::SingleStep(maxDelayTime);
+        return;
+    }
+
+    // Sockets and event triggers, without waiting
+    BasicTaskScheduler::SingleStep(1);
+    if (fTasks.empty()) return;  // A handler may have unscheduled the rest
+
+    taskQueue::iterator next = fTasks.begin();
+    advanceVirtualClock(next->first);
+    delayedTask task = next->second;
+    fTasksById.erase(task.id);
+    fTasks.erase(next);
+    (*task.proc)(task.clientData);
+
+    // Progress of long runs
+    if (++fTasksRun % 10000 == 0) {
+        setMetricGauge("scheduler.virtual_tasks", fTasksRun);
+    }
+}
@@ -0,0 +1,36 @@
+# Runs a short simulation twice and checks that both streamed the same: the
+# same SSRCs and sequence number starts (SIMULATION_RANDOM_SEED), the same RTP
+# packet for packet (the A/V sync monitor's digest of each track), and the same
+# A/V sync offset at every marker.
+#
+#   cmake -DSERVER=<avs_rtsp_server> -DSTREAM=<file.h264> -P compare_simulation_runs.cmake
+
+foreach(run 1 2)
+    execute_process(
+        COMMAND ${SERVER} --simulate=5 --video-device=${STREAM}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE output
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "Simulation run ${run} exited with ${result}:\n${output}")
+    endif()
+    string(REGEX MATCHALL "Loopback stream for track [^\n]*" streams_${run} "${output}")
+    if(NOT streams_${run})
+        message(FATAL_ERROR "Simulation run ${run} started no loopback stream:\n${output}")
+    endif()
+    string(REGEX MATCHALL "A/V sync: received [^\n]*" digests_${run} "${output}")
+    if(NOT digests_${run})
+        message(FATAL_ERROR "Simulation run ${run} logged no RTP digest:\n${output}")
+    endif()
+    string(REGEX MATCH "A/V sync offsets \\(ms\\):[^\n]*" offsets_${run} "${output}")
+    if(NOT offsets_${run})
+        message(FATAL_ERROR "Simulation run ${run} logged no A/V sync offsets:\n${output}")
+    endif()
+endforeach()
+
+foreach(what streams digests offsets)
+    if(NOT ${what}_1 STREQUAL ${what}_2)
+        message(FATAL_ERROR "Runs differ in ${what}:\n${${what}_1}\n${${what}_2}")
+    endif()
+    message(STATUS "Both runs: ${${what}_1}")
+endforeach()
@@ -0,0 +1,408 @@
+#!/usr/bin/env python3
+"""Writes test_stream.h264 and test_stream.h265, the replay inputs of the
+simulation tests.
+
+Two seconds of 16x16 video at 30 fps, one IDR per second: the IDR is a single
+PCM block, every other picture a P slice that skips it. H.264 is Baseline, HEVC
+Main with one 16x16 CTU per picture. Any decoder plays them, and they are
+small enough to check in. The server only ever replays them, so their content
+doesn't matter beyond being valid.
+
+    python3 tests/data/make_test_stream.py
+"""
+
+import os
+
+FRAMES = 60
+GOP = 30
+
+
+class BitWriter:
+    def __init__(self):
+        self.bits = []
+
+    def u(self, value, count):
+        self.bits.extend((value >> (count - 1 - i)) & 1 for i in range(count))
+
+    def ue(self, value):
+        value += 1
+        self.u(0, value.bit_length() - 1)
+        self.u(value, value.bit_length())
+
+    def se(self, value):
+        self.ue(2 * value - 1 if value > 0 else -2 * value)
+
+    def align_zero(self):
+        while len(self.bits) % 8:
+            self.bits.append(0)
+
+    def trailing(self):
+        self.bits.append(1)
+        self.align_zero()
+
+    def bytes(self):
+        return bytes(int("".join(map(str, self.bits[i:i + 8])), 2) for i in range(0, len(self.bits), 8))
+
+
+def nal(header, writer):
+    # Emulation prevention: no 00 00 0x (x <= 3) inside the NAL unit
+    out = bytearray(header)
+    zeros = 0
+    for byte in writer.bytes():
+        if zeros >= 2 and byte <= 3:
+            out.append(3)
+            zeros = 0
+        out.append(byte)
+        zeros = zeros + 1 if byte == 0 else 0
+    return b"\x00\x00\x00\x01" + bytes(out)
+
+
+def sps():
+    w = BitWriter()
+    w.u(66, 8)        # profile_idc: Baseline
+    w.u(0xC0, 8)      # constraint_set0/1
+    w.u(10, 8)        # level_idc 1.0
+    w.ue(0)           # seq_parameter_set_id
+    w.ue(0)           # log2_max_frame_num_minus4
+    w.ue(2)           # pic_order_cnt_type: output order is decode order
+    w.ue(1)           # max_num_ref_frames
+    w.u(0, 1)         # gaps_in_frame_num_value_allowed_flag
+    w.ue(0)           # pic_width_in_mbs_minus1
+    w.ue(0)           # pic_height_in_map_units_minus1
+    w.u(1, 1)         # frame_mbs_only_flag
+    w.u(1, 1)         # direct_8x8_inference_flag
+    w.u(0, 1)         # frame_cropping_flag
+    w.u(0, 1)         # vui_parameters_present_flag
+    w.trailing()
+    return nal(b"\x67", w)
+
+
+def pps():
+    w = BitWriter()
+    w.ue(0)           # pic_parameter_set_id
+    w.ue(0)           # seq_parameter_set_id
+    w.u(0, 1)         # entropy_coding_mode_flag: CAVLC
+    w.u(0, 1)         # bottom_field_pic_order_in_frame_present_flag
+    w.ue(0)           # num_slice_groups_minus1
+    w.ue(0)           # num_ref_idx_l0_default_active_minus1
+    w.ue(0)           # num_ref_idx_l1_default_active_minus1
+    w.u(0, 1)         # weighted_pred_flag
+    w.u(0, 2)         # weighted_bipred_idc
+    w.se(0)           # pic_init_qp_minus26
+    w.se(0)           # pic_init_qs_minus26
+    w.se(0)           # chroma_qp_index_offset
+    w.u(1, 1)         # deblocking_filter_control_present_flag
+    w.u(0, 1)         # constrained_intra_pred_flag
+    w.u(0, 1)         # redundant_pic_cnt_present_flag
+    w.trailing()
+    return nal(b"\x68", w)
+
+
+def idr(idr_pic_id, luma):
+    w = BitWriter()
+    w.ue(0)           # first_mb_in_slice
+    w.ue(7)           # slice_type: I, all slices
+    w.ue(0)           # pic_parameter_set_id
+    w.u(0, 4)         # frame_num
+    w.ue(idr_pic_id)
+    w.u(0, 1)         # no_output_of_prior_pics_flag
+    w.u(0, 1)         # long_term_reference_flag
+    w.se(0)           # slice_qp_delta
+    w.ue(1)           # disable_deblocking_filter_idc
+    w.ue(25)          # mb_type: I_PCM
+    w.align_zero()
+    for _ in range(256):
+        w.u(luma, 8)
+    for _ in range(128):
+        w.u(128, 8)   # Neutral chroma
+    w.trailing()
+    return nal(b"\x65", w)
+
+
+def p_skip(frame_num):
+    w = BitWriter()
+    w.ue(0)           # first_mb_in_slice
+    w.ue(5)           # slice_type: P, all slices
+    w.ue(0)           # pic_parameter_set_id
+    w.u(frame_num, 4)
+    w.u(0, 1)         # num_ref_idx_active_override_flag
+    w.u(0, 1)         # ref_pic_list_modification_flag_l0
+    w.u(0, 1)         # adaptive_ref_pic_marking_mode_flag
+    w.se(0)           # slice_qp_delta
+    w.ue(1)           # disable_deblocking_filter_idc
+    w.ue(1)           # mb_skip_run: the one macroblock
+    w.trailing()
+    return nal(b"\x41", w)
+
+
+# HEVC. NAL unit headers: type, layer 0, TemporalId 0
+HEVC_VPS = b"\x40\x01"
+HEVC_SPS = b"\x42\x01"
+HEVC_PPS = b"\x44\x01"
+HEVC_IDR_N_LP = b"\x28\x01"
+HEVC_TRAIL_R = b"\x02\x01"
+HEVC_LOG2_MAX_POC_LSB = 8
+HEVC_SLICE_QP = 26
+
+# Rows of the CABAC rangeTabLps table (H.265 Table 9-52) for the context
+# states the slices below start in, by pStateIdx
+RANGE_TAB_LPS = {
+    0: (128, 176, 208, 240),
+    15: (66, 80, 95, 110),
+    16: (62, 76, 90, 104),
+}
+
+
+class CabacWriter:
+    """H.265 9.3.4.3 arithmetic encoder over a BitWriter. Every context is coded
+    at most once per slice, so states never need to move on."""
+
+    def __init__(self, writer):
+        self.w = writer
+        self.start()
+
+    def start(self):
+        self.low = 0
+        self.range = 510
+        self.first_bit = True
+        self.outstanding = 0
+
+    @staticmethod
+    def context(init_value):
+        # 9.3.2.2: (pStateIdx, valMps) at the slice QP
+        m = (init_value >> 4) * 5 - 45
+        n = ((init_value & 15) << 3) - 16
+        state = min(max(((m * HEVC_SLICE_QP) >> 4) + n, 1), 126)
+        return (state - 64, 1) if state > 63 else (63 - state, 0)
+
+    def put_bit(self, bit):
+        if self.first_bit:
+            self.first_bit = False
+        else:
+            self.w.u(bit, 1)
+        for _ in range(self.outstanding):
+            self.w.u(1 - bit, 1)
+        self.outstanding = 0
+
+    def renormalize(self):
+        while self.range < 256:
+            if self.low < 256:
+                self.put_bit(0)
+            elif self.low >= 512:
+                self.low -= 512
+                self.put_bit(1)
+            else:
+                self.low -= 256
+                self.outstanding += 1
+            self.range <<= 1
+            self.low <<= 1
+
+    def decision(self, init_value, bin_value):
+        state, mps = self.context(init_value)
+        lps = RANGE_TAB_LPS[state][(self.range >> 6) & 3]
+        self.range -= lps
+        if bin_value != mps:
+            self.low += self.range
+            self.range = lps
+        self.renormalize()
+
+    def terminate(self, bin_value):
+        # A 1 ends the arithmetic code; its last bit written is a 1
+        self.range -= 2
+        if bin_value:
+            self.low += self.range
+            self.range = 2
+            self.renormalize()
+            self.put_bit((self.low >> 9) & 1)
+            self.w.u(((self.low >> 7) & 3) | 1, 2)
+        else:
+            self.renormalize()
+
+
+def hevc_profile_tier_level(w):
+    w.u(0, 2)         # general_profile_space
+    w.u(0, 1)         # general_tier_flag: Main
+    w.u(1, 5)         # general_profile_idc: Main
+    w.u(0x60000000, 32)  # general_profile_compatibility_flag[1..2]: Main, Main 10
+    w.u(1, 1)         # general_progressive_source_flag
+    w.u(0, 1)         # general_interlaced_source_flag
+    w.u(0, 1)         # general_non_packed_constraint_flag
+    w.u(1, 1)         # general_frame_only_constraint_flag
+    w.u(0, 44)        # general_reserved_zero_43bits, general_inbld_flag
+    w.u(30, 8)        # general_level_idc: 1
+
+
+def hevc_vps():
+    w = BitWriter()
+    w.u(0, 4)         # vps_video_parameter_set_id
+    w.u(1, 1)         # vps_base_layer_internal_flag
+    w.u(1, 1)         # vps_base_layer_available_flag
+    w.u(0, 6)         # vps_max_layers_minus1
+    w.u(0, 3)         # vps_max_sub_layers_minus1
+    w.u(1, 1)         # vps_temporal_id_nesting_flag
+    w.u(0xFFFF, 16)   # vps_reserved_0xffff_16bits
+    hevc_profile_tier_level(w)
+    w.u(0, 1)         # vps_sub_layer_ordering_info_present_flag
+    w.ue(1)           # vps_max_dec_pic_buffering_minus1: the picture and its reference
+    w.ue(0)           # vps_max_num_reorder_pics
+    w.ue(0)           # vps_max_latency_increase_plus1
+    w.u(0, 6)         # vps_max_layer_id
+    w.ue(0)           # vps_num_layer_sets_minus1
+    w.u(0, 1)         # vps_timing_info_present_flag
+    w.u(0, 1)         # vps_extension_flag
+    w.trailing()
+    return nal(HEVC_VPS, w)
+
+
+def hevc_sps():
+    w = BitWriter()
+    w.u(0, 4)         # sps_video_parameter_set_id
+    w.u(0, 3)         # sps_max_sub_layers_minus1
+    w.u(1, 1)         # sps_temporal_id_nesting_flag
+    hevc_profile_tier_level(w)
+    w.ue(0)           # sps_seq_parameter_set_id
+    w.ue(1)           # chroma_format_idc: 4:2:0
+    w.ue(16)          # pic_width_in_luma_samples
+    w.ue(16)          # pic_height_in_luma_samples
+    w.u(0, 1)         # conformance_window_flag
+    w.ue(0)           # bit_depth_luma_minus8
+    w.ue(0)           # bit_depth_chroma_minus8
+    w.ue(HEVC_LOG2_MAX_POC_LSB - 4)
+    w.u(0, 1)         # sps_sub_layer_ordering_info_present_flag
+    w.ue(1)           # sps_max_dec_pic_buffering_minus1
+    w.ue(0)           # sps_max_num_reorder_pics
+    w.ue(0)           # sps_max_latency_increase_plus1
+    w.ue(0)           # log2_min_luma_coding_block_size_minus3: 8x8
+    w.ue(1)           # log2_diff_max_min_luma_coding_block_size: 16x16 CTUs
+    w.ue(0)           # log2_min_luma_transform_block_size_minus2
+    w.ue(2)           # log2_diff_max_min_luma_transform_block_size
+    w.ue(0)           # max_transform_hierarchy_depth_inter
+    w.ue(0)           # max_transform_hierarchy_depth_intra
+    w.u(0, 1)         # scaling_list_enabled_flag
+    w.u(0, 1)         # amp_enabled_flag
+    w.u(0, 1)         # sample_adaptive_offset_enabled_flag
+    w.u(1, 1)         # pcm_enabled_flag
+    w.u(7, 4)         # pcm_sample_bit_depth_luma_minus1
+    w.u(7, 4)         # pcm_sample_bit_depth_chroma_minus1
+    w.ue(0)           # log2_min_pcm_luma_coding_block_size_minus3
+    w.ue(1)           # log2_diff_max_min_pcm_luma_coding_block_size: up to 16x16
+    w.u(1, 1)         # pcm_loop_filter_disabled_flag
+    w.ue(1)           # num_short_term_ref_pic_sets
+    w.ue(1)           # num_negative_pics: the previous picture...
+    w.ue(0)           # num_positive_pics
+    w.ue(0)           # delta_poc_s0_minus1
+    w.u(1, 1)         # used_by_curr_pic_s0_flag: ...is the reference
+    w.u(0, 1)         # long_term_ref_pics_present_flag
+    w.u(0, 1)         # sps_temporal_mvp_enabled_flag
+    w.u(0, 1)         # strong_intra_smoothing_enabled_flag
+    w.u(0, 1)         # vui_parameters_present_flag
+    w.u(0, 1)         # sps_extension_present_flag
+    w.trailing()
+    return nal(HEVC_SPS, w)
+
+
+def hevc_pps():
+    w = BitWriter()
+    w.ue(0)           # pps_pic_parameter_set_id
+    w.ue(0)           # pps_seq_parameter_set_id
+    w.u(0, 1)         # dependent_slice_segments_enabled_flag
+    w.u(0, 1)         # output_flag_present_flag
+    w.u(0, 3)         # num_extra_slice_header_bits
+    w.u(0, 1)         # sign_data_hiding_enabled_flag
+    w.u(0, 1)         # cabac_init_present_flag
+    w.ue(0)           # num_ref_idx_l0_default_active_minus1
+    w.ue(0)           # num_ref_idx_l1_default_active_minus1
+    w.se(HEVC_SLICE_QP - 26)  # init_qp_minus26
+    w.u(0, 1)         # constrained_intra_pred_flag
+    w.u(0, 1)         # transform_skip_enabled_flag
+    w.u(0, 1)         # cu_qp_delta_enabled_flag
+    w.se(0)           # pps_cb_qp_offset
+    w.se(0)           # pps_cr_qp_offset
+    w.u(0, 1)         # pps_slice_chroma_qp_offsets_present_flag
+    w.u(0, 1)         # weighted_pred_flag
+    w.u(0, 1)         # weighted_bipred_flag
+    w.u(0, 1)         # transquant_bypass_enabled_flag
+    w.u(0, 1)         # tiles_enabled_flag
+    w.u(0, 1)         # entropy_coding_sync_enabled_flag
+    w.u(0, 1)         # pps_loop_filter_across_slices_enabled_flag
+    w.u(1, 1)         # deblocking_filter_control_present_flag
+    w.u(0, 1)         # deblocking_filter_override_enabled_flag
+    w.u(1, 1)         # pps_deblocking_filter_disabled_flag
+    w.u(0, 1)         # pps_scaling_list_data_present_flag
+    w.u(0, 1)         # lists_modification_present_flag
+    w.ue(0)           # log2_parallel_merge_level_minus2
+    w.u(0, 1)         # slice_segment_header_extension_present_flag
+    w.u(0, 1)         # pps_extension_present_flag
+    w.trailing()
+    return nal(HEVC_PPS, w)
+
+
+def hevc_slice_header(w, idr, poc):
+    w.u(1, 1)         # first_slice_segment_in_pic_flag
+    if idr:
+        w.u(0, 1)     # no_output_of_prior_pics_flag
+    w.ue(0)           # slice_pic_parameter_set_id
+    w.ue(2 if idr else 1)  # slice_type: I or P
+    if not idr:
+        w.u(poc % (1 << HEVC_LOG2_MAX_POC_LSB), HEVC_LOG2_MAX_POC_LSB)  # slice_pic_order_cnt_lsb
+        w.u(1, 1)     # short_term_ref_pic_set_sps_flag: the only one
+        w.u(0, 1)     # num_ref_idx_active_override_flag
+        w.ue(4)       # five_minus_max_num_merge_cand: one candidate, so no merge_idx
+    w.se(0)           # slice_qp_delta
+    w.u(1, 1)         # byte_alignment()
+    w.align_zero()
+
+
+def hevc_idr(luma):
+    w = BitWriter()
+    hevc_slice_header(w, True, 0)
+    cabac = CabacWriter(w)
+    cabac.decision(139, 0)   # split_cu_flag (I slice)
+    cabac.terminate(1)       # pcm_flag
+    w.align_zero()           # pcm_alignment_zero_bit
+    for _ in range(256):
+        w.u(luma, 8)
+    for _ in range(128):
+        w.u(128, 8)          # Neutral chroma
+    cabac.start()            # The arithmetic coder starts over after PCM samples
+    cabac.terminate(1)       # end_of_slice_segment_flag; its last bit is the rbsp_stop_one_bit
+    w.align_zero()
+    return nal(HEVC_IDR_N_LP, w)
+
+
+def hevc_p_skip(poc):
+    w = BitWriter()
+    hevc_slice_header(w, False, poc)
+    cabac = CabacWriter(w)
+    cabac.decision(107, 0)   # split_cu_flag (P slice)
+    cabac.decision(197, 1)   # cu_skip_flag: zero motion from the previous picture
+    cabac.terminate(1)       # end_of_slice_segment_flag
+    w.align_zero()
+    return nal(HEVC_TRAIL_R, w)
+
+
+def write_stream(name, stream):
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), name)
+    with open(path, "wb") as out:
+        out.write(stream)
+    print("Wrote %d bytes to %s" % (len(stream), path))
+
+
+def main():
+    h264 = bytearray()
+    hevc = bytearray()
+    for frame in range(FRAMES):
+        index = frame % GOP
+        if index == 0:
+            gop = frame // GOP
+            h264 += sps() + pps() + idr(gop % 2, 64 + 128 * (gop % 2))
+            hevc += hevc_vps() + hevc_sps() + hevc_pps() + hevc_idr(64 + 128 * (gop % 2))
+        else:
+            h264 += p_skip(index % 16)
+            hevc += hevc_p_skip(index)
+    write_stream("test_stream.h264", h264)
+    write_stream("test_stream.h265", hevc)
+
+
+if __name__ == "__main__":
+    main()
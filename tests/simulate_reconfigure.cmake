@@ -0,0 +1,35 @@
+# Runs a simulation that switches the video format halfway through, as RTSP
+# SET_PARAMETER video_format would, and checks that the stream went on: A/V sync
+# held to the end, the parameter set generation and with it the SDP moved on,
+# and the running session sent the new parameter sets in-band.
+#
+#   cmake -DSERVER=<avs_rtsp_server> -DSTREAM=<file.h264> -P simulate_reconfigure.cmake
+
+execute_process(
+    COMMAND ${SERVER} --simulate=10 --simulate-reconfigure=5:640x480@60 --video-device=${STREAM}
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output
+    RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Simulation exited with ${result}:\n${output}")
+endif()
+
+if(NOT output MATCHES "Video reconfigured to [^\n]* parameter set generation ([0-9]+) -> ([0-9]+)")
+    message(FATAL_ERROR "No reconfiguration:\n${output}")
+endif()
+set(before ${CMAKE_MATCH_1})
+set(after ${CMAKE_MATCH_2})
+if(before EQUAL after)
+    message(FATAL_ERROR "Parameter set generation stayed at ${before}:\n${output}")
+endif()
+if(NOT output MATCHES "Video SDP built from parameter set generation ${after}\n")
+    message(FATAL_ERROR "SDP not rebuilt for generation ${after}:\n${output}")
+endif()
+
+# The session survived if it took the new parameter sets after the switch
+string(FIND "${output}" "Video reconfigured to" reconfigured)
+string(SUBSTRING "${output}" ${reconfigured} -1 afterwards)
+if(NOT afterwards MATCHES "Sending new parameter sets in-band at the next IDR")
+    message(FATAL_ERROR "The running session never took the new parameter sets:\n${output}")
+endif()
+message(STATUS "Reconfigured from parameter set generation ${before} to ${after}")
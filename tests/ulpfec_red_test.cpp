@@ -0,0 +1,176 @@
+// ULPFEC in RED (ulpfec_encoder.h) and its SDP (rtx_groupsock.h): the parity
+// packet's layout, recovery of a lost packet from it, and what the SDP offers,
+// SSRC groups included.
+// Exits non-zero on the first failed check.
+
+#include "constants.h"
+#include "rtx_groupsock.h"
+#include "ulpfec_encoder.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const unsigned MEDIA_PAYLOAD_TYPE = 96;
+
+#define CHECK(condition)                                                          \
+    do {                                                                          \
+        if (!(condition)) {                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return false;                                                         \
+        }                                                                         \
+    } while (0)
+
+static std::vector<unsigned char> mediaPacket(uint16_t seq, bool marker, unsigned payloadSize) {
+    std::vector<unsigned char> packet(12 + payloadSize);
+    packet[0] = 0x80;
+    packet[1] = (marker ? 0x80 : 0) | MEDIA_PAYLOAD_TYPE;
+    packet[2] = seq >> 8;
+    packet[3] = seq & 0xFF;
+    packet[4] = 0x12;  // Timestamp
+    packet[5] = 0x34;
+    packet[6] = 0x56;
+    packet[7] = 0x78;
+    packet[8] = 0xCA;  // SSRC
+    packet[9] = 0xFE;
+    packet[10] = 0xBA;
+    packet[11] = 0xBE;
+    packet[12] = 0x41;  // A P slice NAL header, so not a keyframe group
+    for (unsigned i = 1; i < payloadSize; ++i) {
+        packet[12 + i] = (unsigned char)(seq * 31 + i);
+    }
+    return packet;
+}
+
+// Rebuilds the one missing packet of the group from the others and the parity (RFC 5109 section 10)
+static std::vector<unsigned char> recover(const std::vector<std::vector<unsigned char>>& received,
+                                          const unsigned char* fec, uint16_t lostSeq) {
+    const unsigned char* fecHeader = fec + 13;
+    const unsigned char* level0 = fecHeader + 10;
+    unsigned protectionLength = (level0[0] << 8) | level0[1];
+    unsigned char header[2] = {fecHeader[0], fecHeader[1]};
+    unsigned char timestamp[4] = {fecHeader[4], fecHeader[5], fecHeader[6], fecHeader[7]};
+    unsigned length = (fecHeader[8] << 8) | fecHeader[9];
+    std::vector<unsigned char> payload(level0 + 4, level0 + 4 + protectionLength);
+
+    for (const std::vector<unsigned char>& packet : received) {
+        header[0] ^= packet[0];
+        header[1] ^= packet[1];
+        for (unsigned i = 0; i < 4; ++i) {
+            timestamp[i] ^= packet[4 + i];
+        }
+        length ^= packet.size() - 12;
+        for (unsigned i = 0; i + 12 < packet.size() && i < protectionLength; ++i) {
+            payload[i] ^= packet[12 + i];
+        }
+    }
+
+    std::vector<unsigned char> packet(12 + length);
+    packet[0] = 0x80 | (header[0] & 0x3F);
+    packet[1] = header[1];
+    packet[2] = lostSeq >> 8;
+    packet[3] = lostSeq & 0xFF;
+    memcpy(&packet[4], timestamp, 4);
+    memcpy(&packet[8], &received[0][8], 4);  // The media SSRC, from any packet of the stream
+    memcpy(&packet[12], payload.data(), std::min<size_t>(length, payload.size()));
+    return packet;
+}
+
+static bool testRedPacketRecoversLoss() {
+    ulpfecEncoder encoder(VIDEO_CODEC_H264, 8, 4);
+    std::vector<std::vector<unsigned char>> group;
+    const unsigned char* fec = nullptr;
+    unsigned fecSize = 0;
+    // A frame of four packets of different sizes; the marker closes the group
+    for (uint16_t i = 0; i < 4; ++i) {
+        group.push_back(mediaPacket(1000 + i, i == 3, 100 + 37 * i));
+        fec = encoder.addPacket(group.back().data(), group.back().size(), fecSize);
+        CHECK((fec != nullptr) == (i == 3));
+    }
+
+    unsigned redPayloadType = MEDIA_PAYLOAD_TYPE + FEC_RED_PAYLOAD_TYPE_OFFSET;
+    unsigned fecPayloadType = MEDIA_PAYLOAD_TYPE + FEC_PAYLOAD_TYPE_OFFSET;
+    CHECK(fecSize == 12 + 1 + 14 + group.back().size() - 12);
+    CHECK(fec[0] == 0x80);
+    CHECK(fec[1] == redPayloadType);
+    uint32_t ssrc = (fec[8] << 24) | (fec[9] << 16) | (fec[10] << 8) | fec[11];
+    CHECK(ssrc == encoder.getSsrc());
+    // A single primary block: F = 0 and the ULPFEC payload type
+    CHECK(fec[12] == fecPayloadType);
+    // SN base and a mask covering the four packets
+    CHECK(((fec[15] << 8) | fec[16]) == 1000);
+    CHECK(fec[25] == 0xF0 && fec[26] == 0x00);
+
+    for (unsigned lost = 0; lost < group.size(); ++lost) {
+        std::vector<std::vector<unsigned char>> received;
+        for (unsigned i = 0; i < group.size(); ++i) {
+            if (i != lost) received.push_back(group[i]);
+        }
+        CHECK(recover(received, fec, 1000 + lost) == group[lost]);
+    }
+    return true;
+}
+
+static bool testPayloadTypeOutOfRange() {
+    ulpfecEncoder encoder(VIDEO_CODEC_H264, 1, 1);
+    std::vector<unsigned char> packet = mediaPacket(1, true, 50);
+    packet[1] = 0x80 | 120;  // + the offsets leaves 96-127
+    unsigned fecSize;
+    CHECK(encoder.addPacket(packet.data(), packet.size(), fecSize) == nullptr);
+    return true;
+}
+
+static bool testSdp() {
+    const char* media = "m=video 0 RTP/AVP 96\r\nc=IN IP4 0.0.0.0\r\na=rtpmap:96 H264/90000\r\n";
+    char* withFec = addFecToSdpLines(media, 90000);
+    std::string sdp(withFec);
+    delete[] withFec;
+    char expected[128];
+    unsigned redPayloadType = MEDIA_PAYLOAD_TYPE + FEC_RED_PAYLOAD_TYPE_OFFSET;
+    unsigned fecPayloadType = MEDIA_PAYLOAD_TYPE + FEC_PAYLOAD_TYPE_OFFSET;
+    snprintf(expected, sizeof(expected), "m=video 0 RTP/AVP 96 %u %u\r\n", redPayloadType, fecPayloadType);
+    CHECK(sdp.find(expected) == 0);
+    snprintf(expected, sizeof(expected), "a=rtpmap:%u red/90000\r\na=fmtp:%u %u\r\na=rtpmap:%u ulpfec/90000\r\n",
+             redPayloadType, redPayloadType, fecPayloadType, fecPayloadType);
+    CHECK(sdp.find(expected) != std::string::npos);
+
+    char* withGroup = addFecSsrcGroupToSdpLines(sdp.c_str(), 0x11111111, 0x22222222);
+    sdp = withGroup;
+    delete[] withGroup;
+    CHECK(sdp.find("a=ssrc-group:FEC-FR 286331153 572662306\r\n") != std::string::npos);
+    CHECK(sdp.find("a=ssrc:286331153 cname:") != std::string::npos);
+    CHECK(sdp.find("a=ssrc:572662306 cname:") != std::string::npos);
+
+    // With RTX too, the media SSRC is in both groups but declared once
+    char* withRtx = addRtxToSdpLines(media, 90000, true);
+    char* withFid = addRtxSsrcGroupToSdpLines(withRtx, 0x11111111, 0x33333333);
+    char* withBoth = addFecSsrcGroupToSdpLines(withFid, 0x11111111, 0x22222222);
+    std::string grouped(withBoth);
+    delete[] withRtx;
+    delete[] withFid;
+    delete[] withBoth;
+    CHECK(grouped.find("a=ssrc-group:FID 286331153 858993459\r\n") != std::string::npos);
+    CHECK(grouped.find("a=ssrc-group:FEC-FR 286331153 572662306\r\n") != std::string::npos);
+    size_t mediaLine = grouped.find("a=ssrc:286331153 cname:");
+    CHECK(mediaLine != std::string::npos && grouped.find("a=ssrc:286331153 ", mediaLine + 1) == std::string::npos);
+    CHECK(grouped.find("a=ssrc:858993459 cname:") != std::string::npos);
+
+    // No FEC offered under a payload type it couldn't be sent with
+    const char* highMedia = "m=video 0 RTP/AVP 120\r\na=rtpmap:120 H264/90000\r\n";
+    char* unchanged = addFecToSdpLines(highMedia, 90000);
+    sdp = unchanged;
+    delete[] unchanged;
+    CHECK(sdp == highMedia);
+    char* noFid = addRtxSsrcGroupToSdpLines(highMedia, 0x11111111, 0x33333333);
+    sdp = noFid;
+    delete[] noFid;
+    CHECK(sdp == highMedia);
+    return true;
+}
+
+int main() {
+    bool passed = testRedPacketRecoversLoss() && testPayloadTypeOutOfRange() && testSdp();
+    printf("%s\n", passed ? "PASS" : "FAIL");
+    return passed ? 0 : 1;
+}